@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include "checksum.h"
+#include "log.h"
+
+/**
+ * Bytes of data CRC32C implementations are compared on, at every alignment and length up to this.
+ */
+#define CHECKSUM_KAT_COMPARE_LENGTH 300
+
+/**
+ * The implementations selected by g_checksum_init(), switched between to test each.
+ */
+extern uint32_t (*crc32c_implementation)(uint32_t crc, const unsigned char* data, size_t length);
+extern void (*sha256_blocks)(uint32_t* state, const unsigned char* data, size_t nblocks);
+
+/**
+ * The implementations compiled in.
+ */
+uint32_t crc32c_portable(uint32_t crc, const unsigned char* data, size_t length);
+void sha256_blocks_portable(uint32_t* state, const unsigned char* data, size_t nblocks);
+#if defined(__x86_64__)
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length);
+void sha256_blocks_shani(uint32_t* state, const unsigned char* data, size_t nblocks);
+#elif defined(__aarch64__)
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char* data, size_t length);
+#endif
+
+/**
+ * A CRC32C implementation to test.
+ */
+struct ChecksumKatCrc32c {
+    const char* name;
+    uint32_t (*implementation)(uint32_t crc, const unsigned char* data, size_t length);
+    int supported;
+};
+
+/**
+ * A SHA-256 implementation to test.
+ */
+struct ChecksumKatSha256 {
+    const char* name;
+    void (*blocks)(uint32_t* state, const unsigned char* data, size_t nblocks);
+    int supported;
+};
+
+/**
+ * CRC32C test vectors: RFC 3720 B.4 and the customary check value.
+ */
+struct ChecksumKatCrc32cVector {
+    const char* name;
+    unsigned char data[32];
+    size_t length;
+    uint32_t crc;
+} crc32c_vectors[] = {
+    { "check", "123456789", 9, 0xe3069283 },
+    { "zeros", { 0 }, 32, 0x8a9136aa },
+    { "ones", { [0 ... 31] = 0xff }, 32, 0x62a8ab43 },
+    { "incrementing", { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+                        26, 27, 28, 29, 30, 31 }, 32, 0x46dd794e },
+    { "decrementing", { 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+                        6, 5, 4, 3, 2, 1, 0 }, 32, 0x113fdb5c },
+};
+
+/**
+ * SHA-256 test vectors from FIPS 180-2, the message being repeated to make up the length.
+ */
+struct ChecksumKatSha256Vector {
+    const char* name;
+    const char* message;
+    size_t length;
+    const char* digest;
+} sha256_vectors[] = {
+    { "empty", "", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", "abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "two blocks", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56,
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "million a", "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+/**
+ * Continue a raw CRC32C a bit at a time, as the reference the implementations are compared with.
+ */
+uint32_t checksum_kat_crc32c_bitwise(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length-- > 0) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * Test a CRC32C implementation against the vectors, then against the reference at every alignment and length, fed in
+ * two pieces to cover continuing a CRC.
+ * @param test the implementation
+ * @return number of failures
+ */
+int checksum_kat_crc32c(const struct ChecksumKatCrc32c* test) {
+    unsigned char data[CHECKSUM_KAT_COMPARE_LENGTH + 8];
+    uint32_t crc, expected;
+    int nfailed = 0;
+
+    crc32c_implementation = test->implementation;
+
+    for (size_t v = 0; v < sizeof(crc32c_vectors) / sizeof(crc32c_vectors[0]); v++) {
+        crc = g_checksum_crc32c(0, crc32c_vectors[v].data, crc32c_vectors[v].length);
+        if (crc != crc32c_vectors[v].crc) {
+            printf("FAIL\tcrc32c\t%s\t%s\t%08x, expected %08x\n", test->name, crc32c_vectors[v].name, crc,
+                   crc32c_vectors[v].crc);
+            nfailed++;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char) (i * 131 + 7);
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 0; length <= CHECKSUM_KAT_COMPARE_LENGTH; length++) {
+            expected = ~checksum_kat_crc32c_bitwise(~0u, data + offset, length);
+            crc = g_checksum_crc32c(g_checksum_crc32c(0, data + offset, length / 3), data + offset + length / 3,
+                                    length - length / 3);
+            if (crc != expected) {
+                printf("FAIL\tcrc32c\t%s\toffset %zu length %zu\t%08x, expected %08x\n", test->name, offset, length,
+                       crc, expected);
+                nfailed++;
+            }
+        }
+    }
+
+    printf("%s\tcrc32c\t%s\n", nfailed == 0 ? "PASS" : "FAIL", test->name);
+    return nfailed;
+}
+
+/**
+ * Test a SHA-256 implementation against the vectors, fed in uneven pieces to cover partial blocks.
+ * @param test the implementation
+ * @return number of failures
+ */
+int checksum_kat_sha256(const struct ChecksumKatSha256* test) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    struct Sha256 sha256;
+    size_t message_length, done, piece;
+    int nfailed = 0;
+
+    sha256_blocks = test->blocks;
+
+    for (size_t v = 0; v < sizeof(sha256_vectors) / sizeof(sha256_vectors[0]); v++) {
+        message_length = strlen(sha256_vectors[v].message);
+
+        g_checksum_sha256_init(&sha256);
+        for (done = 0; done < sha256_vectors[v].length; done += piece) {
+            piece = message_length - done % (message_length > 0 ? message_length : 1);
+            if (piece > sha256_vectors[v].length - done) {
+                piece = sha256_vectors[v].length - done;
+            }
+            g_checksum_sha256_update(&sha256, sha256_vectors[v].message + done % message_length, piece);
+        }
+        g_checksum_sha256_final(&sha256, digest);
+
+        g_checksum_to_hex(digest, sizeof(digest), hex);
+        if (strcmp(hex, sha256_vectors[v].digest) != 0) {
+            printf("FAIL\tsha256\t%s\t%s\t%s, expected %s\n", test->name, sha256_vectors[v].name, hex,
+                   sha256_vectors[v].digest);
+            nfailed++;
+        }
+    }
+
+    printf("%s\tsha256\t%s\n", nfailed == 0 ? "PASS" : "FAIL", test->name);
+    return nfailed;
+}
+
+/**
+ * Known answer tests of every CRC32C and SHA-256 implementation compiled in, those the CPU does not support being
+ * skipped.  Prints a line per implementation, and exits non-zero if any failed.
+ *
+ * Usage: checksum_kat
+ */
+int main() {
+    struct ChecksumKatCrc32c crc32c_tests[] = {
+        { "slicing-by-8", &crc32c_portable, 1 },
+#if defined(__x86_64__)
+        { "sse4.2", &crc32c_sse42, __builtin_cpu_supports("sse4.2") },
+#elif defined(__aarch64__)
+        { "armv8", &crc32c_armv8, (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0 },
+#endif
+    };
+    struct ChecksumKatSha256 sha256_tests[] = {
+        { "portable", &sha256_blocks_portable, 1 },
+#if defined(__x86_64__)
+        { "sha-ni", &sha256_blocks_shani, 0 },
+#endif
+    };
+    int nfailed = 0;
+
+    g_log_level = LOG_LEVEL_ERROR;
+    g_checksum_init();
+
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+
+    sha256_tests[1].supported = __builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+                                (ebx & bit_SHA);
+#endif
+
+    for (size_t t = 0; t < sizeof(crc32c_tests) / sizeof(crc32c_tests[0]); t++) {
+        if (crc32c_tests[t].supported) {
+            nfailed += checksum_kat_crc32c(&crc32c_tests[t]);
+        } else {
+            printf("SKIP\tcrc32c\t%s\n", crc32c_tests[t].name);
+        }
+    }
+    for (size_t t = 0; t < sizeof(sha256_tests) / sizeof(sha256_tests[0]); t++) {
+        if (sha256_tests[t].supported) {
+            nfailed += checksum_kat_sha256(&sha256_tests[t]);
+        } else {
+            printf("SKIP\tsha256\t%s\n", sha256_tests[t].name);
+        }
+    }
+
+    return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,674 @@
+// For memmem and pipe2
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Evictions timed per configuration when not given.
+ */
+#define EVICTION_BENCH_ITERATIONS 5
+
+/**
+ * Most evictions timed per configuration.
+ */
+#define EVICTION_BENCH_MAX_ITERATIONS 101
+
+/**
+ * Milliseconds to wait for the child to start or report SIGTERM before giving up.
+ */
+#define EVICTION_BENCH_TIMEOUT_MS 30000
+
+/**
+ * Most bytes of a request's headers.
+ */
+#define EVICTION_BENCH_HEADERS_SIZE 8192
+
+/**
+ * Most files uploaded per eviction.
+ */
+#define EVICTION_BENCH_MAX_FILES 32
+
+/**
+ * Most arguments jetsam is launched with: its options, two per file, then the child's.
+ */
+#define EVICTION_BENCH_MAX_ARGS (2 * EVICTION_BENCH_MAX_FILES + 24)
+
+/**
+ * Files uploaded and their sizes, per configuration.
+ */
+struct EvictionBenchFiles {
+    int nfiles;
+    int file_kib;
+};
+
+/**
+ * Configurations benchmarked for each heap size.
+ */
+const struct EvictionBenchFiles eviction_bench_files[] = { { 1, 64 }, { 1, 16384 }, { 8, 1024 }, { 32, 256 } };
+
+/**
+ * Heap sizes in MiB benchmarked when none are given.
+ */
+const int default_heap_mib[] = { 16, 256 };
+
+/**
+ * Our environment, passed to jetsam.
+ */
+extern char** environ;
+
+/**
+ * What the receiver has been sent during an eviction.
+ */
+struct EvictionBenchReceiver {
+    /**
+     * Listening socket.
+     */
+    int fd;
+
+    /**
+     * Port listened on.
+     */
+    int port;
+
+    /**
+     * Guards what follows.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Benchmark files received in full.
+     */
+    int nfiles;
+
+    /**
+     * Body bytes of benchmark files received.
+     */
+    long long bytes;
+
+    /**
+     * When the last byte of a benchmark file was received, in nanoseconds.
+     */
+    long long last_byte_ns;
+};
+
+/**
+ * The receiver instance.
+ */
+struct EvictionBenchReceiver eviction_bench_receiver = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Set by SIGTERM in the synthetic child, with when it arrived.
+ */
+volatile sig_atomic_t eviction_bench_terminated;
+
+/**
+ * When SIGTERM arrived at the synthetic child, in nanoseconds.
+ */
+volatile long long eviction_bench_terminated_ns;
+
+/**
+ * Current time in nanoseconds, on the clock jetsam's trace spans use.
+ */
+long long eviction_bench_now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Exit with a message.
+ * @param message what went wrong
+ */
+void eviction_bench_fail(const char* message) {
+    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+    exit(1);
+}
+
+/**
+ * SIGTERM handler of the synthetic child.
+ * @param signum SIGTERM
+ */
+void eviction_bench_child_signal(int signum) {
+    (void) signum;
+    eviction_bench_terminated_ns = eviction_bench_now_ns();
+    eviction_bench_terminated = 1;
+}
+
+/**
+ * Run as jetsam's child: report being ready on stdout, wait for SIGTERM, then report when it arrived and exit.
+ * @return exit code
+ */
+int eviction_bench_child() {
+    struct sigaction action = { .sa_handler = &eviction_bench_child_signal };
+    sigset_t mask, previous;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &previous);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("ready\n");
+    fflush(stdout);
+    while (!eviction_bench_terminated) {
+        sigsuspend(&previous);
+    }
+
+    printf("%lld\n", eviction_bench_terminated_ns);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Read exactly a number of bytes from a connection, given some already buffered.
+ * @param fd the connection
+ * @param buffer buffered bytes, consumed first
+ * @param buffered number of bytes buffered, updated
+ * @param size number of bytes to read, or discard if destination is NULL
+ * @param destination receives the bytes, or NULL to discard them
+ * @return 1 if and only if all were read
+ */
+int eviction_bench_read(int fd, char* buffer, size_t* buffered, size_t size, char* destination) {
+    char discard[65536];
+    size_t taken;
+    ssize_t nread;
+
+    taken = *buffered < size ? *buffered : size;
+    if (destination != NULL) {
+        memcpy(destination, buffer, taken);
+        destination += taken;
+    }
+    memmove(buffer, buffer + taken, *buffered - taken);
+    *buffered -= taken;
+    size -= taken;
+
+    while (size > 0) {
+        nread = read(fd, destination != NULL ? destination : discard,
+                     destination != NULL || size < sizeof(discard) ? size : sizeof(discard));
+        if (nread <= 0) {
+            return 0;
+        }
+        size -= (size_t) nread;
+        if (destination != NULL) {
+            destination += nread;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Read a line, CRLF terminated, from a connection, given some already buffered.
+ * @param fd the connection
+ * @param buffer buffered bytes, EVICTION_BENCH_HEADERS_SIZE of them at most, the line being consumed
+ * @param buffered number of bytes buffered, updated
+ * @param line receives the line, null terminated without its CRLF
+ * @return 1 if and only if a line was read
+ */
+int eviction_bench_read_line(int fd, char* buffer, size_t* buffered, char* line) {
+    char* end;
+    ssize_t nread;
+
+    while ((end = memmem(buffer, *buffered, "\r\n", 2)) == NULL) {
+        if (*buffered == EVICTION_BENCH_HEADERS_SIZE) {
+            return 0;
+        }
+        nread = read(fd, buffer + *buffered, EVICTION_BENCH_HEADERS_SIZE - *buffered);
+        if (nread <= 0) {
+            return 0;
+        }
+        *buffered += (size_t) nread;
+    }
+
+    memcpy(line, buffer, (size_t) (end - buffer));
+    line[end - buffer] = '\0';
+    return eviction_bench_read(fd, buffer, buffered, (size_t) (end - buffer) + 2, NULL);
+}
+
+/**
+ * Serve requests on a connection until closed, counting the bodies of PUTs of benchmark files.
+ * @param arg the connection's descriptor
+ * @return NULL
+ */
+void* eviction_bench_connection(void* arg) {
+    const char* ok = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    const char* proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+    char buffer[EVICTION_BENCH_HEADERS_SIZE];
+    char line[EVICTION_BENCH_HEADERS_SIZE + 1];
+    char path[EVICTION_BENCH_HEADERS_SIZE + 1];
+    int fd = (int) (long) arg;
+    size_t buffered = 0, chunk;
+    long long length;
+    int chunked, benchmarked;
+
+    while (eviction_bench_read_line(fd, buffer, &buffered, line)) {
+        if (sscanf(line, "%*s %s", path) != 1) {
+            break;
+        }
+        benchmarked = strstr(path, "/file-") != NULL;
+        length = 0;
+        chunked = 0;
+
+        while (eviction_bench_read_line(fd, buffer, &buffered, line) && line[0] != '\0') {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                length = atoll(line + 15);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked") != NULL) {
+                chunked = 1;
+            } else if (strncasecmp(line, "Expect:", 7) == 0 && strstr(line, "100") != NULL) {
+                send(fd, proceed, strlen(proceed), MSG_NOSIGNAL);
+            }
+        }
+
+        if (!chunked && !eviction_bench_read(fd, buffer, &buffered, (size_t) length, NULL)) {
+            break;
+        }
+        while (chunked && eviction_bench_read_line(fd, buffer, &buffered, line)) {
+            chunk = strtoul(line, NULL, 16);
+            if (chunk == 0) {
+                // Trailers, up to an empty line
+                while (eviction_bench_read_line(fd, buffer, &buffered, line) && line[0] != '\0') {
+                    continue;
+                }
+                break;
+            }
+            length += (long long) chunk;
+            if (!eviction_bench_read(fd, buffer, &buffered, chunk + 2, NULL)) {
+                break;
+            }
+        }
+
+        if (benchmarked) {
+            pthread_mutex_lock(&eviction_bench_receiver.lock);
+            eviction_bench_receiver.nfiles++;
+            eviction_bench_receiver.bytes += length;
+            eviction_bench_receiver.last_byte_ns = eviction_bench_now_ns();
+            pthread_mutex_unlock(&eviction_bench_receiver.lock);
+        }
+        if (send(fd, ok, strlen(ok), MSG_NOSIGNAL) == -1) {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Accept connections to the receiver, serving each on its own thread.
+ * @param arg unused
+ * @return NULL
+ */
+void* eviction_bench_accept(void* arg) {
+    pthread_t thread;
+    long fd;
+
+    (void) arg;
+
+    while ((fd = accept(eviction_bench_receiver.fd, NULL, NULL)) != -1) {
+        if (pthread_create(&thread, NULL, &eviction_bench_connection, (void*) fd) != 0) {
+            close((int) fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the receiver listening on an ephemeral loopback port.
+ */
+void eviction_bench_receive() {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t address_length = sizeof(address);
+    pthread_t thread;
+
+    eviction_bench_receiver.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (eviction_bench_receiver.fd == -1 ||
+            bind(eviction_bench_receiver.fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+            listen(eviction_bench_receiver.fd, 64) != 0 ||
+            getsockname(eviction_bench_receiver.fd, (struct sockaddr*) &address, &address_length) != 0) {
+        eviction_bench_fail("could not listen");
+    }
+    eviction_bench_receiver.port = ntohs(address.sin_port);
+
+    if (pthread_create(&thread, NULL, &eviction_bench_accept, NULL) != 0) {
+        eviction_bench_fail("could not start receiver");
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Read a line jetsam's child reports on the pipe.
+ * @param fd the pipe
+ * @param line receives the line, null terminated without its newline
+ * @param size bytes of room in line
+ * @return 1 if and only if a line was read in time
+ */
+int eviction_bench_child_line(int fd, char* line, size_t size) {
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    size_t used = 0;
+
+    while (used < size - 1) {
+        if (poll(&pollfd, 1, EVICTION_BENCH_TIMEOUT_MS) != 1 || read(fd, line + used, 1) != 1) {
+            return 0;
+        }
+        if (line[used] == '\n') {
+            break;
+        }
+        used++;
+    }
+
+    line[used] = '\0';
+    return 1;
+}
+
+/**
+ * Find a span in jetsam's trace.
+ * @param trace the trace text
+ * @param name the span's name
+ * @param start_us receives when it started
+ * @param duration_us receives how long it lasted
+ * @return 1 if and only if found
+ */
+int eviction_bench_span(const char* trace, const char* name, long long* start_us, long long* duration_us) {
+    char needle[64];
+    const char* span;
+
+    snprintf(needle, sizeof(needle), "\"name\":\"%s\"", name);
+    span = strstr(trace, needle);
+    if (span == NULL || (span = strstr(span, "\"ts\":")) == NULL ||
+            sscanf(span, "\"ts\":%lld,\"dur\":%lld", start_us, duration_us) != 2) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Read jetsam's trace.
+ * @param path the trace file
+ * @return the trace, null terminated, to free, or NULL
+ */
+char* eviction_bench_trace(const char* path) {
+    struct stat trace_stat;
+    char* trace;
+    FILE* file;
+
+    file = fopen(path, "r");
+    if (file == NULL || fstat(fileno(file), &trace_stat) != 0) {
+        return NULL;
+    }
+
+    trace = calloc(1, (size_t) trace_stat.st_size + 1);
+    if (trace != NULL && fread(trace, 1, (size_t) trace_stat.st_size, file) != (size_t) trace_stat.st_size) {
+        free(trace);
+        trace = NULL;
+    }
+    fclose(file);
+
+    return trace;
+}
+
+/**
+ * Time one eviction: launch jetsam with a synthetic child, send it SIGTERM once the child runs and wait for it to
+ * upload the files to the receiver and exit.
+ * @param jetsam path of jetsam
+ * @param directory directory of the files and trace
+ * @param nfiles number of files, named file-N in the directory
+ * @param heap_mib jetsam's heap size
+ * @param results receives microseconds from SIGTERM to the child receiving it, to jetsam reaping the child, spent
+ *        quiescing and to the last byte arriving at the receiver
+ */
+void eviction_bench_evict(const char* jetsam, const char* directory, int nfiles, int heap_mib, double results[4]) {
+    char files[EVICTION_BENCH_MAX_FILES][PATH_MAX];
+    char self[PATH_MAX], trace_path[PATH_MAX], url[64], heap[32], line[64];
+    char* argv[EVICTION_BENCH_MAX_ARGS];
+    posix_spawn_file_actions_t actions;
+    long long terminated_ns, sent_ns, start_us, duration_us;
+    int pipe_fds[2];
+    int argc = 0, error_code, stat;
+    char* trace;
+    pid_t pid;
+    ssize_t length;
+
+    length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length == -1) {
+        eviction_bench_fail("could not find ourselves");
+    }
+    self[length] = '\0';
+    snprintf(trace_path, sizeof(trace_path), "%s/trace.json", directory);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bench", eviction_bench_receiver.port);
+    snprintf(heap, sizeof(heap), "%d", heap_mib * 1024 * 1024);
+
+    argv[argc++] = (char*) jetsam;
+    argv[argc++] = "-s";
+    argv[argc++] = heap;
+    argv[argc++] = "-q";
+    argv[argc++] = "1";
+    argv[argc++] = "-Q";
+    argv[argc++] = "20";
+    argv[argc++] = "-m";
+    argv[argc++] = "PUT";
+    argv[argc++] = "-u";
+    argv[argc++] = url;
+    argv[argc++] = "-J";
+    argv[argc++] = trace_path;
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(files[f], sizeof(files[f]), "%s/file-%d", directory, f);
+        argv[argc++] = "-f";
+        argv[argc++] = files[f];
+    }
+    // PROGRAM, then its arguments from its own argv[0]
+    argv[argc++] = "--";
+    argv[argc++] = self;
+    argv[argc++] = self;
+    argv[argc++] = "--child";
+    argv[argc] = NULL;
+
+    pthread_mutex_lock(&eviction_bench_receiver.lock);
+    eviction_bench_receiver.nfiles = 0;
+    eviction_bench_receiver.bytes = 0;
+    eviction_bench_receiver.last_byte_ns = 0;
+    pthread_mutex_unlock(&eviction_bench_receiver.lock);
+
+    // The child reports on jetsam's stdout, which it inherits; jetsam's own log is discarded
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        eviction_bench_fail("could not create pipe");
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    error_code = posix_spawn(&pid, jetsam, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+    if (error_code != 0) {
+        errno = error_code;
+        eviction_bench_fail("could not launch jetsam");
+    }
+
+    if (!eviction_bench_child_line(pipe_fds[0], line, sizeof(line)) || strcmp(line, "ready") != 0) {
+        kill(pid, SIGKILL);
+        eviction_bench_fail("child did not start");
+    }
+
+    sent_ns = eviction_bench_now_ns();
+    kill(pid, SIGTERM);
+    if (!eviction_bench_child_line(pipe_fds[0], line, sizeof(line))) {
+        kill(pid, SIGKILL);
+        eviction_bench_fail("child did not report SIGTERM");
+    }
+    terminated_ns = atoll(line);
+    waitpid(pid, &stat, 0);
+    close(pipe_fds[0]);
+
+    pthread_mutex_lock(&eviction_bench_receiver.lock);
+    if (eviction_bench_receiver.nfiles != nfiles) {
+        fprintf(stderr, "only %d of %d files received\n", eviction_bench_receiver.nfiles, nfiles);
+        exit(1);
+    }
+    results[3] = (eviction_bench_receiver.last_byte_ns - sent_ns) / 1e3;
+    pthread_mutex_unlock(&eviction_bench_receiver.lock);
+    results[0] = (terminated_ns - sent_ns) / 1e3;
+
+    trace = eviction_bench_trace(trace_path);
+    if (trace == NULL || !eviction_bench_span(trace, "run", &start_us, &duration_us)) {
+        eviction_bench_fail("could not read jetsam's trace");
+    }
+    results[1] = start_us + duration_us - sent_ns / 1e3;
+    results[2] = eviction_bench_span(trace, "quiesce", &start_us, &duration_us) ? (double) duration_us : 0;
+    free(trace);
+}
+
+/**
+ * Median of samples, sorting them.
+ * @param samples the samples
+ * @param nsamples number of samples
+ * @return the median
+ */
+double eviction_bench_median(double* samples, int nsamples) {
+    double swap;
+
+    for (int i = 1; i < nsamples; i++) {
+        for (int j = i; j > 0 && samples[j - 1] > samples[j]; j--) {
+            swap = samples[j];
+            samples[j] = samples[j - 1];
+            samples[j - 1] = swap;
+        }
+    }
+
+    return samples[nsamples / 2];
+}
+
+/**
+ * Write files of a size for jetsam to upload.
+ * @param directory directory to write them in
+ * @param nfiles number of files, named file-N
+ * @param file_kib size of each in KiB
+ */
+void eviction_bench_write_files(const char* directory, int nfiles, int file_kib) {
+    char path[PATH_MAX];
+    char block[1024];
+    FILE* file;
+
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(path, sizeof(path), "%s/file-%d", directory, f);
+        file = fopen(path, "w");
+        if (file == NULL) {
+            eviction_bench_fail("could not write file");
+        }
+        for (int k = 0; k < file_kib; k++) {
+            memset(block, 'a' + (f + k) % 26, sizeof(block));
+            fwrite(block, 1, sizeof(block), file);
+        }
+        fclose(file);
+    }
+}
+
+/**
+ * Remove the files and trace written for a configuration.
+ * @param directory their directory
+ * @param nfiles number of files
+ */
+void eviction_bench_remove_files(const char* directory, int nfiles) {
+    char path[PATH_MAX];
+
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(path, sizeof(path), "%s/file-%d", directory, f);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/trace.json", directory);
+    unlink(path);
+}
+
+/**
+ * Benchmark how quickly jetsam gets files off after SIGTERM, for each configuration of files and each heap size in MiB
+ * given as an argument.  A local receiver takes the uploads.  Prints one tab separated line of medians per
+ * configuration: microseconds from SIGTERM until the child received it, until jetsam reaped the child (from jetsam's
+ * trace), spent quiescing and until the last byte arrived at the receiver.
+ *
+ * Usage: eviction_bench [-j JETSAM] [-n ITERATIONS] [HEAP_MIB ...]
+ */
+int main(int argc, char* argv[]) {
+    double samples[4][EVICTION_BENCH_MAX_ITERATIONS];
+    double results[4];
+    char directory[] = "/tmp/eviction_bench.XXXXXX";
+    const char* jetsam = EVICTION_BENCH_JETSAM;
+    int iterations = EVICTION_BENCH_ITERATIONS;
+    int nconfigurations = (int) (sizeof(eviction_bench_files) / sizeof(eviction_bench_files[0]));
+    int nheaps, heap_mib, opt;
+
+    if (argc == 2 && strcmp(argv[1], "--child") == 0) {
+        return eviction_bench_child();
+    }
+
+    while ((opt = getopt(argc, argv, "j:n:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jetsam = optarg;
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j JETSAM] [-n ITERATIONS] [HEAP_MIB ...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations < 1 || iterations > EVICTION_BENCH_MAX_ITERATIONS) {
+        fprintf(stderr, "ITERATIONS must be 1 to %d\n", EVICTION_BENCH_MAX_ITERATIONS);
+        return 1;
+    }
+    nheaps = optind < argc ? argc - optind : (int) (sizeof(default_heap_mib) / sizeof(default_heap_mib[0]));
+
+    if (mkdtemp(directory) == NULL) {
+        eviction_bench_fail("could not create directory");
+    }
+    eviction_bench_receive();
+
+    printf("files\tfile_kib\theap_mib\tsignal_us\treap_us\tquiesce_us\tlast_byte_us\n");
+
+    for (int c = 0; c < nconfigurations; c++) {
+        eviction_bench_write_files(directory, eviction_bench_files[c].nfiles, eviction_bench_files[c].file_kib);
+
+        for (int h = 0; h < nheaps; h++) {
+            heap_mib = optind < argc ? atoi(argv[optind + h]) : default_heap_mib[h];
+
+            for (int i = 0; i < iterations; i++) {
+                eviction_bench_evict(jetsam, directory, eviction_bench_files[c].nfiles, heap_mib, results);
+                for (int r = 0; r < 4; r++) {
+                    samples[r][i] = results[r];
+                }
+            }
+
+            printf("%d\t%d\t%d", eviction_bench_files[c].nfiles, eviction_bench_files[c].file_kib, heap_mib);
+            for (int r = 0; r < 4; r++) {
+                printf("\t%.1f", eviction_bench_median(samples[r], iterations));
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+
+        eviction_bench_remove_files(directory, eviction_bench_files[c].nfiles);
+    }
+
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Launches timed per method and heap size.
+ */
+#define LAUNCH_BENCH_ITERATIONS 50
+
+/**
+ * Program launched, which exits immediately.
+ */
+#define LAUNCH_BENCH_PROGRAM "/bin/true"
+
+/**
+ * Heap sizes in MiB benchmarked when none are given.
+ */
+const int default_heap_mib[] = { 0, 16, 64, 256, 1024 };
+
+/**
+ * Our environment, passed to launched programs.
+ */
+extern char** environ;
+
+/**
+ * Current time in microseconds.
+ */
+double launch_bench_now_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/**
+ * Launch the program with fork() and execv(), as jetsam used to, and wait for it.
+ * @return microseconds from starting to launch until the child was reaped
+ */
+double launch_bench_fork() {
+    char* argv[] = { LAUNCH_BENCH_PROGRAM, NULL };
+    double start = launch_bench_now_us();
+    int stat;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid == -1) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    waitpid(pid, &stat, 0);
+    return launch_bench_now_us() - start;
+}
+
+/**
+ * Launch the program with posix_spawn(), as jetsam does, and wait for it.
+ * @return microseconds from starting to launch until the child was reaped
+ */
+double launch_bench_spawn() {
+    char* argv[] = { LAUNCH_BENCH_PROGRAM, NULL };
+    double start = launch_bench_now_us();
+    int error_code, stat;
+    pid_t pid;
+
+    error_code = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+    if (error_code != 0) {
+        fprintf(stderr, "posix_spawn failed: %s\n", strerror(error_code));
+        exit(1);
+    }
+
+    waitpid(pid, &stat, 0);
+    return launch_bench_now_us() - start;
+}
+
+/**
+ * Median of launch latencies.
+ * @param launch launch method
+ * @return median microseconds over LAUNCH_BENCH_ITERATIONS launches
+ */
+double launch_bench_median(double (*launch)()) {
+    double samples[LAUNCH_BENCH_ITERATIONS];
+    double swap;
+
+    for (int i = 0; i < LAUNCH_BENCH_ITERATIONS; i++) {
+        samples[i] = launch();
+    }
+
+    for (int i = 1; i < LAUNCH_BENCH_ITERATIONS; i++) {
+        for (int j = i; j > 0 && samples[j - 1] > samples[j]; j--) {
+            swap = samples[j];
+            samples[j] = samples[j - 1];
+            samples[j - 1] = swap;
+        }
+    }
+
+    return samples[LAUNCH_BENCH_ITERATIONS / 2];
+}
+
+/**
+ * Benchmark launching a child with fork() and with posix_spawn() while holding a locked heap like jetsam's, for each
+ * heap size in MiB given as an argument.  Prints one tab separated line per heap size.
+ */
+int main(int argc, char* argv[]) {
+    int nheaps = argc > 1 ? argc - 1 : (int) (sizeof(default_heap_mib) / sizeof(default_heap_mib[0]));
+    size_t size;
+    char* heap;
+
+    printf("heap_mib\tfork_us\tspawn_us\n");
+
+    for (int i = 0; i < nheaps; i++) {
+        size = (size_t) (argc > 1 ? atoi(argv[i + 1]) : default_heap_mib[i]) * 1024 * 1024;
+        heap = NULL;
+
+        if (size > 0) {
+            heap = malloc(size);
+            if (heap == NULL || mlock(heap, size) != 0) {
+                fprintf(stderr, "could not allocate and lock %zu bytes: %s\n", size, strerror(errno));
+                return 1;
+            }
+            memset(heap, 1, size);
+        }
+
+        printf("%zu\t%.1f\t%.1f\n", size / 1024 / 1024, launch_bench_median(&launch_bench_fork),
+               launch_bench_median(&launch_bench_spawn));
+        fflush(stdout);
+
+        if (heap != NULL) {
+            munlock(heap, size);
+            free(heap);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,436 @@
+// For memmem
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Most bytes of a request's headers.
+ */
+#define MOCK_SERVER_HEADERS_SIZE 8192
+
+/**
+ * Most body bytes read at once, and paced at once under a bandwidth cap.
+ */
+#define MOCK_SERVER_READ_SIZE 16384
+
+/**
+ * What befalls a request.
+ */
+enum MockServerFate {
+    MOCK_SERVER_OK = 0,
+    MOCK_SERVER_RESET,
+    MOCK_SERVER_PARTIAL,
+    MOCK_SERVER_SERVER_ERROR,
+    MOCK_SERVER_CLIENT_ERROR
+};
+
+/**
+ * Mock server configuration and counters.
+ */
+struct MockServer {
+    /**
+     * Listening socket.
+     */
+    int fd;
+
+    /**
+     * Milliseconds before responding to each request.
+     */
+    int latency_ms;
+
+    /**
+     * Body bytes read per second across all connections, or 0 for no cap.
+     */
+    long bandwidth;
+
+    /**
+     * Percentages of requests whose connection is reset halfway through the body, closed halfway through the body,
+     * answered 503 and answered 400, in that order.
+     */
+    int percent[MOCK_SERVER_CLIENT_ERROR + 1];
+
+    /**
+     * Guards seed and next_read_ns.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Seed of the fates of requests.
+     */
+    unsigned int seed;
+
+    /**
+     * When the bandwidth cap next lets body bytes be read, in nanoseconds.
+     */
+    long long next_read_ns;
+
+    /**
+     * Requests received.
+     */
+    atomic_long requests;
+
+    /**
+     * Requests by fate.
+     */
+    atomic_long fates[MOCK_SERVER_CLIENT_ERROR + 1];
+
+    /**
+     * Body bytes read.
+     */
+    atomic_llong bytes;
+};
+
+/**
+ * The mock server instance.
+ */
+struct MockServer mock_server = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .seed = 1 };
+
+/**
+ * Current time in nanoseconds.
+ */
+long long mock_server_now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Sleep for a number of nanoseconds.
+ * @param ns nanoseconds
+ */
+void mock_server_sleep_ns(long long ns) {
+    struct timespec duration = { ns / 1000000000LL, ns % 1000000000LL };
+
+    while (ns > 0 && nanosleep(&duration, &duration) == -1 && errno == EINTR) {
+        continue;
+    }
+}
+
+/**
+ * Wait until the bandwidth cap lets a number of body bytes be read.
+ * @param size number of bytes
+ */
+void mock_server_pace(size_t size) {
+    long long now_ns = mock_server_now_ns();
+    long long slot_ns;
+
+    if (mock_server.bandwidth <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mock_server.lock);
+    slot_ns = mock_server.next_read_ns > now_ns ? mock_server.next_read_ns : now_ns;
+    mock_server.next_read_ns = slot_ns + (long long) size * 1000000000LL / mock_server.bandwidth;
+    pthread_mutex_unlock(&mock_server.lock);
+
+    mock_server_sleep_ns(slot_ns - now_ns);
+}
+
+/**
+ * Decide what befalls a request.
+ * @return a MockServerFate
+ */
+int mock_server_fate() {
+    int roll, fate;
+
+    pthread_mutex_lock(&mock_server.lock);
+    roll = rand_r(&mock_server.seed) % 100;
+    pthread_mutex_unlock(&mock_server.lock);
+
+    for (fate = MOCK_SERVER_RESET; fate <= MOCK_SERVER_CLIENT_ERROR; fate++) {
+        if (roll < mock_server.percent[fate]) {
+            return fate;
+        }
+        roll -= mock_server.percent[fate];
+    }
+
+    return MOCK_SERVER_OK;
+}
+
+/**
+ * Read body bytes from a connection, given some already buffered, pacing them under the bandwidth cap.
+ * @param fd the connection
+ * @param buffer buffered bytes, consumed first
+ * @param buffered number of bytes buffered, updated
+ * @param size number of bytes to read and discard
+ * @return 1 if and only if all were read
+ */
+int mock_server_read(int fd, char* buffer, size_t* buffered, size_t size) {
+    char discard[MOCK_SERVER_READ_SIZE];
+    size_t taken;
+    ssize_t nread;
+
+    taken = *buffered < size ? *buffered : size;
+    memmove(buffer, buffer + taken, *buffered - taken);
+    *buffered -= taken;
+    size -= taken;
+
+    while (size > 0) {
+        mock_server_pace(size < sizeof(discard) ? size : sizeof(discard));
+        nread = read(fd, discard, size < sizeof(discard) ? size : sizeof(discard));
+        if (nread <= 0) {
+            return 0;
+        }
+        size -= (size_t) nread;
+        atomic_fetch_add(&mock_server.bytes, nread);
+    }
+
+    return 1;
+}
+
+/**
+ * Read a line, CRLF terminated, from a connection, given some already buffered.
+ * @param fd the connection
+ * @param buffer buffered bytes, MOCK_SERVER_HEADERS_SIZE of them at most, the line being consumed
+ * @param buffered number of bytes buffered, updated
+ * @param line receives the line, null terminated without its CRLF
+ * @return 1 if and only if a line was read
+ */
+int mock_server_read_line(int fd, char* buffer, size_t* buffered, char* line) {
+    size_t length;
+    char* end;
+    ssize_t nread;
+
+    while ((end = memmem(buffer, *buffered, "\r\n", 2)) == NULL) {
+        if (*buffered == MOCK_SERVER_HEADERS_SIZE) {
+            return 0;
+        }
+        nread = read(fd, buffer + *buffered, MOCK_SERVER_HEADERS_SIZE - *buffered);
+        if (nread <= 0) {
+            return 0;
+        }
+        *buffered += (size_t) nread;
+    }
+
+    length = (size_t) (end - buffer);
+    memcpy(line, buffer, length);
+    line[length] = '\0';
+    memmove(buffer, buffer + length + 2, *buffered - length - 2);
+    *buffered -= length + 2;
+    return 1;
+}
+
+/**
+ * Read a request's body, whether of a known length or chunked, stopping early if asked to.
+ * @param fd the connection
+ * @param buffer buffered bytes
+ * @param buffered number of bytes buffered, updated
+ * @param line room for a line
+ * @param length length of the body, if not chunked
+ * @param chunked whether the body is chunked
+ * @param cut whether to stop halfway through a body of known length, or after the first chunk
+ * @return 1 if and only if read as far as asked
+ */
+int mock_server_read_body(int fd, char* buffer, size_t* buffered, char* line, long long length, int chunked, int cut) {
+    size_t chunk;
+
+    if (!chunked) {
+        return mock_server_read(fd, buffer, buffered, (size_t) (cut ? length / 2 : length));
+    }
+
+    while (mock_server_read_line(fd, buffer, buffered, line)) {
+        chunk = strtoul(line, NULL, 16);
+        if (chunk == 0) {
+            // Trailers, up to an empty line
+            while (mock_server_read_line(fd, buffer, buffered, line)) {
+                if (line[0] == '\0') {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+        if (!mock_server_read(fd, buffer, buffered, chunk + 2)) {
+            return 0;
+        }
+        if (cut) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Serve requests on a connection until closed, applying faults.
+ * @param arg the connection's descriptor
+ * @return NULL
+ */
+void* mock_server_connection(void* arg) {
+    const char* responses[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", NULL, NULL,
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n",
+        "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n"
+    };
+    const char* proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    char buffer[MOCK_SERVER_HEADERS_SIZE];
+    char line[MOCK_SERVER_HEADERS_SIZE + 1];
+    int fd = (int) (long) arg;
+    size_t buffered = 0;
+    long long length;
+    int chunked, fate;
+
+    while (mock_server_read_line(fd, buffer, &buffered, line)) {
+        atomic_fetch_add(&mock_server.requests, 1);
+        fate = mock_server_fate();
+        atomic_fetch_add(&mock_server.fates[fate], 1);
+        length = 0;
+        chunked = 0;
+
+        while (mock_server_read_line(fd, buffer, &buffered, line) && line[0] != '\0') {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                length = atoll(line + 15);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked") != NULL) {
+                chunked = 1;
+            } else if (strncasecmp(line, "Expect:", 7) == 0 && strstr(line, "100") != NULL) {
+                send(fd, proceed, strlen(proceed), MSG_NOSIGNAL);
+            }
+        }
+
+        if (!mock_server_read_body(fd, buffer, &buffered, line, length, chunked,
+                                   fate == MOCK_SERVER_RESET || fate == MOCK_SERVER_PARTIAL)) {
+            break;
+        }
+        if (fate == MOCK_SERVER_RESET) {
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+            break;
+        }
+        if (fate == MOCK_SERVER_PARTIAL) {
+            shutdown(fd, SHUT_RDWR);
+            break;
+        }
+
+        mock_server_sleep_ns(mock_server.latency_ms * 1000000LL);
+        if (send(fd, responses[fate], strlen(responses[fate]), MSG_NOSIGNAL) == -1) {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Accept connections, serving each on its own thread.
+ * @param arg unused
+ * @return NULL
+ */
+void* mock_server_accept(void* arg) {
+    pthread_t thread;
+    long fd;
+
+    (void) arg;
+
+    while ((fd = accept(mock_server.fd, NULL, NULL)) != -1) {
+        if (pthread_create(&thread, NULL, &mock_server_connection, (void*) fd) != 0) {
+            close((int) fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/**
+ * Stand in for a collector: take PUTs on a loopback port and discard them, with latency, a bandwidth cap, connection
+ * resets, partial reads, 5xx and 4xx responses as configured.  Prints the port once listening, and on SIGTERM or SIGINT
+ * a tab separated header and line of counts before exiting.
+ *
+ * Usage: mock_server [-p PORT] [-l LATENCY_MS] [-b BYTES_PER_SEC] [-R RESET_PERCENT] [-P PARTIAL_PERCENT]
+ *        [-5 SERVER_ERROR_PERCENT] [-4 CLIENT_ERROR_PERCENT] [-s SEED]
+ */
+int main(int argc, char* argv[]) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t address_length = sizeof(address);
+    pthread_t thread;
+    sigset_t signals;
+    int opt, signum, total = 0;
+
+    while ((opt = getopt(argc, argv, "p:l:b:R:P:5:4:s:")) != -1) {
+        switch (opt) {
+            case 'p':
+                address.sin_port = htons((uint16_t) atoi(optarg));
+                break;
+            case 'l':
+                mock_server.latency_ms = atoi(optarg);
+                break;
+            case 'b':
+                mock_server.bandwidth = atol(optarg);
+                break;
+            case 'R':
+                mock_server.percent[MOCK_SERVER_RESET] = atoi(optarg);
+                break;
+            case 'P':
+                mock_server.percent[MOCK_SERVER_PARTIAL] = atoi(optarg);
+                break;
+            case '5':
+                mock_server.percent[MOCK_SERVER_SERVER_ERROR] = atoi(optarg);
+                break;
+            case '4':
+                mock_server.percent[MOCK_SERVER_CLIENT_ERROR] = atoi(optarg);
+                break;
+            case 's':
+                mock_server.seed = (unsigned int) atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p PORT] [-l LATENCY_MS] [-b BYTES_PER_SEC] [-R RESET_PERCENT] "
+                                "[-P PARTIAL_PERCENT] [-5 SERVER_ERROR_PERCENT] [-4 CLIENT_ERROR_PERCENT] [-s SEED]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    for (int f = MOCK_SERVER_RESET; f <= MOCK_SERVER_CLIENT_ERROR; f++) {
+        total += mock_server.percent[f];
+    }
+    if (total > 100) {
+        fprintf(stderr, "Fault percentages add up to more than 100\n");
+        return 1;
+    }
+
+    // Signals are taken here, not by the threads serving connections
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    mock_server.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mock_server.fd == -1 || setsockopt(mock_server.fd, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 }, sizeof(int)) != 0 ||
+            bind(mock_server.fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+            listen(mock_server.fd, 64) != 0 ||
+            getsockname(mock_server.fd, (struct sockaddr*) &address, &address_length) != 0) {
+        fprintf(stderr, "Could not listen: %s\n", strerror(errno));
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, &mock_server_accept, NULL) != 0) {
+        fprintf(stderr, "Could not start accepting\n");
+        return 1;
+    }
+
+    printf("%d\n", ntohs(address.sin_port));
+    fflush(stdout);
+
+    sigwait(&signals, &signum);
+
+    printf("requests\tok\tresets\tpartials\tserver_errors\tclient_errors\tbytes\n");
+    printf("%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%lld\n", atomic_load(&mock_server.requests),
+           atomic_load(&mock_server.fates[MOCK_SERVER_OK]), atomic_load(&mock_server.fates[MOCK_SERVER_RESET]),
+           atomic_load(&mock_server.fates[MOCK_SERVER_PARTIAL]), atomic_load(&mock_server.fates[MOCK_SERVER_SERVER_ERROR]),
+           atomic_load(&mock_server.fates[MOCK_SERVER_CLIENT_ERROR]), atomic_load(&mock_server.bytes));
+    fflush(stdout);
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+// For pipe2
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Restarts soaked when not given.
+ */
+#define RESTART_SOAK_RESTARTS 12
+
+/**
+ * Restarts the heap is compared after, against the soak.
+ */
+#define RESTART_SOAK_BASELINE_RESTARTS 1
+
+/**
+ * KiB of the file uploaded by every run.
+ */
+#define RESTART_SOAK_FILE_KIB 200
+
+/**
+ * Heap jetsam is given, small enough that a few runs' uploads left allocated exhaust it.
+ */
+#define RESTART_SOAK_HEAP_SIZE "2097152"
+
+/**
+ * Most bytes of heap jetsam may end up using beyond the baseline, however many runs it uploaded.
+ */
+#define RESTART_SOAK_SLACK_BYTES 4096
+
+/**
+ * Milliseconds to wait for the mock server to report before giving up.
+ */
+#define RESTART_SOAK_TIMEOUT_MS 60000
+
+/**
+ * Our environment, passed to launched processes.
+ */
+extern char** environ;
+
+/**
+ * Exit with a message.
+ * @param message what went wrong
+ */
+void restart_soak_fail(const char* message) {
+    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+    exit(1);
+}
+
+/**
+ * Launch a process, its stdout connected to a pipe if asked.
+ * @param argv its arguments, the first being its path
+ * @param pid receives its process ID
+ * @param report whether to connect its stdout to a pipe rather than discard it
+ * @return read end of the pipe, or -1 if not reporting
+ */
+int restart_soak_launch(char* argv[], pid_t* pid, int report) {
+    posix_spawn_file_actions_t actions;
+    int pipe_fds[2] = { -1, -1 };
+    int error_code;
+
+    if (report && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        restart_soak_fail("could not create pipe");
+    }
+    posix_spawn_file_actions_init(&actions);
+    if (report) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    error_code = posix_spawn(pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (report) {
+        close(pipe_fds[1]);
+    }
+    if (error_code != 0) {
+        errno = error_code;
+        restart_soak_fail("could not launch");
+    }
+
+    return pipe_fds[0];
+}
+
+/**
+ * Read a line a launched process reports.
+ * @param fd the pipe
+ * @param line receives the line, null terminated without its newline
+ * @param size bytes of room in line
+ * @return 1 if and only if a line was read in time
+ */
+int restart_soak_line(int fd, char* line, size_t size) {
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    size_t used = 0;
+
+    while (used < size - 1) {
+        if (poll(&pollfd, 1, RESTART_SOAK_TIMEOUT_MS) != 1 || read(fd, line + used, 1) != 1) {
+            return 0;
+        }
+        if (line[used] == '\n') {
+            break;
+        }
+        used++;
+    }
+
+    line[used] = '\0';
+    return 1;
+}
+
+/**
+ * Find a metric's value in a metrics file.
+ * @param path the metrics file
+ * @param name the metric's name, unlabelled
+ * @return its value, or -1 if not found
+ */
+long long restart_soak_metric(const char* path, const char* name) {
+    char line[512];
+    long long value = -1;
+    size_t length = strlen(name);
+    FILE* file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, name, length) == 0 && line[length] == ' ') {
+            value = atoll(line + length + 1);
+            break;
+        }
+    }
+    fclose(file);
+
+    return value;
+}
+
+/**
+ * Run jetsam over a child failing every time until it gives up restarting it, each run uploading the file.
+ * @param jetsam path of jetsam
+ * @param url URL to upload to
+ * @param directory directory of the file and metrics
+ * @param nrestarts restarts before giving up
+ * @return bytes of heap used when jetsam exited, from its metrics
+ */
+long long restart_soak_run(const char* jetsam, const char* url, const char* directory, int nrestarts) {
+    char file[PATH_MAX], metrics_path[PATH_MAX], restarts[16];
+    char* argv[] = { (char*) jetsam, "-m", "PUT", "-u", (char*) url, "-f", file, "-q", "0", "-s",
+                     RESTART_SOAK_HEAP_SIZE, "-R", restarts, "-b", "1", "-X", metrics_path, "-v", "error", "--",
+                     "/bin/false", "false", NULL };
+    long long heap_used;
+    pid_t pid;
+    int status;
+
+    snprintf(file, sizeof(file), "%s/file", directory);
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.prom", directory);
+    snprintf(restarts, sizeof(restarts), "%d", nrestarts);
+
+    restart_soak_launch(argv, &pid, 0);
+    if (waitpid(pid, &status, 0) != pid) {
+        restart_soak_fail("could not wait for jetsam");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 1) {
+        fprintf(stderr, "jetsam exited with status %d, not from the child failing\n", status);
+        exit(1);
+    }
+
+    heap_used = restart_soak_metric(metrics_path, "salvage_heap_used_bytes");
+    unlink(metrics_path);
+    if (heap_used == -1) {
+        fprintf(stderr, "jetsam wrote no heap metrics\n");
+        exit(1);
+    }
+
+    return heap_used;
+}
+
+/**
+ * Check jetsam's heap stays flat over restarts: run it over a failing child restarted once, then many times, uploading
+ * a file to the mock server every run, and compare the heap used when it exits.  Prints a tab separated line of
+ * `restarts` and `heap_used_bytes` per run, and exits non-zero if the heap grew with the restarts.
+ *
+ * Usage: restart_soak [-j JETSAM] [-m MOCK_SERVER] [-n RESTARTS]
+ */
+int main(int argc, char* argv[]) {
+    char directory[] = "/tmp/restart_soak.XXXXXX";
+    char path[PATH_MAX], url[64], line[256];
+    char block[1024];
+    char* mock_argv[2];
+    char* end;
+    const char* jetsam = RESTART_SOAK_JETSAM;
+    const char* mock = RESTART_SOAK_MOCK_SERVER;
+    long long baseline, soaked;
+    long port;
+    int nrestarts = RESTART_SOAK_RESTARTS;
+    int opt, mock_fd;
+    pid_t mock_pid;
+    FILE* file;
+
+    while ((opt = getopt(argc, argv, "j:m:n:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jetsam = optarg;
+                break;
+            case 'm':
+                mock = optarg;
+                break;
+            case 'n':
+                nrestarts = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j JETSAM] [-m MOCK_SERVER] [-n RESTARTS]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nrestarts <= RESTART_SOAK_BASELINE_RESTARTS) {
+        fprintf(stderr, "RESTARTS must be more than %d\n", RESTART_SOAK_BASELINE_RESTARTS);
+        return 1;
+    }
+
+    if (mkdtemp(directory) == NULL) {
+        restart_soak_fail("could not create directory");
+    }
+    snprintf(path, sizeof(path), "%s/file", directory);
+    file = fopen(path, "w");
+    if (file == NULL) {
+        restart_soak_fail("could not write file");
+    }
+    for (int k = 0; k < RESTART_SOAK_FILE_KIB; k++) {
+        memset(block, 'a' + k % 26, sizeof(block));
+        fwrite(block, 1, sizeof(block), file);
+    }
+    fclose(file);
+
+    mock_argv[0] = (char*) mock;
+    mock_argv[1] = NULL;
+    mock_fd = restart_soak_launch(mock_argv, &mock_pid, 1);
+    port = restart_soak_line(mock_fd, line, sizeof(line)) ? strtol(line, &end, 10) : 0;
+    if (port < 1 || port > 65535 || *end != '\0') {
+        kill(mock_pid, SIGKILL);
+        restart_soak_fail("mock server reported no port");
+    }
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/soak", (int) port);
+
+    printf("restarts\theap_used_bytes\n");
+    baseline = restart_soak_run(jetsam, url, directory, RESTART_SOAK_BASELINE_RESTARTS);
+    printf("%d\t%lld\n", RESTART_SOAK_BASELINE_RESTARTS, baseline);
+    soaked = restart_soak_run(jetsam, url, directory, nrestarts);
+    printf("%d\t%lld\n", nrestarts, soaked);
+    fflush(stdout);
+
+    kill(mock_pid, SIGTERM);
+    waitpid(mock_pid, NULL, 0);
+    close(mock_fd);
+    unlink(path);
+    rmdir(directory);
+
+    if (soaked - baseline > RESTART_SOAK_SLACK_BYTES) {
+        fprintf(stderr, "Heap grew by %lld bytes over %d more restarts\n", soaked - baseline,
+                nrestarts - RESTART_SOAK_BASELINE_RESTARTS);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,363 @@
+// For pipe2
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "init.h"
+
+/**
+ * Files uploaded per scenario when not given.
+ */
+#define UPLOAD_BENCH_FILES 8
+
+/**
+ * Most files uploaded per scenario.
+ */
+#define UPLOAD_BENCH_MAX_FILES 64
+
+/**
+ * KiB per file when not given.
+ */
+#define UPLOAD_BENCH_FILE_KIB 4096
+
+/**
+ * Milliseconds to wait for the mock server or an upload to report before giving up.
+ */
+#define UPLOAD_BENCH_TIMEOUT_MS 600000
+
+/**
+ * Most arguments a process is launched with: the options, two per file, then the program.
+ */
+#define UPLOAD_BENCH_MAX_ARGS (2 * UPLOAD_BENCH_MAX_FILES + 24)
+
+/**
+ * A scenario: the faults the mock server injects.
+ */
+struct UploadBenchScenario {
+    /**
+     * Name of the scenario.
+     */
+    const char* name;
+
+    /**
+     * Mock server options, NULL terminated.
+     */
+    const char* options[5];
+};
+
+/**
+ * Scenarios benchmarked, in order.
+ */
+const struct UploadBenchScenario upload_bench_scenarios[] = {
+    { "clean", { NULL } },
+    { "latency", { "-l", "50", NULL } },
+    { "bandwidth", { "-b", "33554432", NULL } },
+    { "resets", { "-R", "10", NULL } },
+    { "partial", { "-P", "10", NULL } },
+    { "5xx", { "-5", "20", NULL } },
+    { "4xx", { "-4", "5", NULL } },
+    { "mixed", { "-R", "5", "-5", "10", NULL } }
+};
+
+/**
+ * Our environment, passed to launched processes.
+ */
+extern char** environ;
+
+/**
+ * Current time in microseconds.
+ */
+long long upload_bench_now_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/**
+ * Exit with a message.
+ * @param message what went wrong
+ */
+void upload_bench_fail(const char* message) {
+    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+    exit(1);
+}
+
+/**
+ * Run as an upload: initialize as flotsam and jetsam do from the arguments, upload the files, and report how many were
+ * uploaded and how long it took on stdout.
+ * @param argc number of arguments, the first standing in for the program name
+ * @param argv the arguments
+ * @return exit code
+ */
+int upload_bench_upload(int argc, char* argv[]) {
+    long long started_us;
+    int nuploaded;
+
+    g_init(argc, argv);
+
+    started_us = upload_bench_now_us();
+    nuploaded = g_http_upload_files();
+    printf("%d\t%lld\n", nuploaded, upload_bench_now_us() - started_us);
+    fflush(stdout);
+
+    g_destroy();
+    return 0;
+}
+
+/**
+ * Launch a process reporting on a pipe.
+ * @param argv its arguments, the first being its path
+ * @param pid receives its process ID
+ * @return read end of the pipe its stdout is connected to
+ */
+int upload_bench_launch(char* argv[], pid_t* pid) {
+    posix_spawn_file_actions_t actions;
+    int pipe_fds[2];
+    int error_code;
+
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        upload_bench_fail("could not create pipe");
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    error_code = posix_spawn(pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+    if (error_code != 0) {
+        errno = error_code;
+        upload_bench_fail("could not launch");
+    }
+
+    return pipe_fds[0];
+}
+
+/**
+ * Read a line a launched process reports.
+ * @param fd the pipe
+ * @param line receives the line, null terminated without its newline
+ * @param size bytes of room in line
+ * @return 1 if and only if a line was read in time
+ */
+int upload_bench_line(int fd, char* line, size_t size) {
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    size_t used = 0;
+
+    while (used < size - 1) {
+        if (poll(&pollfd, 1, UPLOAD_BENCH_TIMEOUT_MS) != 1 || read(fd, line + used, 1) != 1) {
+            return 0;
+        }
+        if (line[used] == '\n') {
+            break;
+        }
+        used++;
+    }
+
+    line[used] = '\0';
+    return 1;
+}
+
+/**
+ * Find a metric's value in a metrics file.
+ * @param path the metrics file
+ * @param name the metric's name, unlabelled
+ * @return its value, or -1 if not found
+ */
+long long upload_bench_metric(const char* path, const char* name) {
+    char line[512];
+    long long value = -1;
+    size_t length = strlen(name);
+    FILE* file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, name, length) == 0 && line[length] == ' ') {
+            value = atoll(line + length + 1);
+            break;
+        }
+    }
+    fclose(file);
+
+    return value;
+}
+
+/**
+ * Run a scenario: start the mock server with its faults, upload the files to it from a separate process, and print
+ * a line of results.
+ * @param scenario the scenario
+ * @param mock path of the mock server
+ * @param directory directory of the files and metrics
+ * @param nfiles number of files, named file-N in the directory
+ * @param file_kib size of each file in KiB
+ */
+void upload_bench_scenario(const struct UploadBenchScenario* scenario, const char* mock, const char* directory,
+                           int nfiles, int file_kib) {
+    char files[UPLOAD_BENCH_MAX_FILES][PATH_MAX];
+    char self[PATH_MAX], metrics_path[PATH_MAX], url[64], line[256];
+    char* argv[UPLOAD_BENCH_MAX_ARGS];
+    char* end;
+    long long elapsed_us, retries, heap_used, requests, ok;
+    long port;
+    int mock_fd, upload_fd, argc = 0, nuploaded;
+    pid_t mock_pid, upload_pid;
+    ssize_t length;
+    double seconds;
+
+    argv[argc++] = (char*) mock;
+    for (int o = 0; scenario->options[o] != NULL; o++) {
+        argv[argc++] = (char*) scenario->options[o];
+    }
+    argv[argc] = NULL;
+    mock_fd = upload_bench_launch(argv, &mock_pid);
+    if (!upload_bench_line(mock_fd, line, sizeof(line))) {
+        kill(mock_pid, SIGKILL);
+        upload_bench_fail("mock server did not start");
+    }
+    port = strtol(line, &end, 10);
+    if (end == line || *end != '\0' || port < 1 || port > 65535) {
+        kill(mock_pid, SIGKILL);
+        upload_bench_fail("mock server reported no port");
+    }
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bench", (int) port);
+
+    length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length == -1) {
+        upload_bench_fail("could not find ourselves");
+    }
+    self[length] = '\0';
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.prom", directory);
+
+    argc = 0;
+    argv[argc++] = self;
+    argv[argc++] = "--upload";
+    argv[argc++] = "-m";
+    argv[argc++] = "PUT";
+    argv[argc++] = "-u";
+    argv[argc++] = url;
+    argv[argc++] = "-X";
+    argv[argc++] = metrics_path;
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(files[f], sizeof(files[f]), "%s/file-%d", directory, f);
+        argv[argc++] = "-f";
+        argv[argc++] = files[f];
+    }
+    // Required by the options, never run
+    argv[argc++] = "--";
+    argv[argc++] = "/bin/true";
+    argv[argc++] = "true";
+    argv[argc] = NULL;
+    upload_fd = upload_bench_launch(argv, &upload_pid);
+    if (!upload_bench_line(upload_fd, line, sizeof(line)) || sscanf(line, "%d\t%lld", &nuploaded, &elapsed_us) != 2) {
+        kill(upload_pid, SIGKILL);
+        kill(mock_pid, SIGKILL);
+        upload_bench_fail("upload did not finish");
+    }
+    waitpid(upload_pid, NULL, 0);
+    close(upload_fd);
+
+    // The counts follow a header line
+    kill(mock_pid, SIGTERM);
+    if (!upload_bench_line(mock_fd, line, sizeof(line)) || !upload_bench_line(mock_fd, line, sizeof(line)) ||
+            sscanf(line, "%lld\t%lld", &requests, &ok) != 2) {
+        upload_bench_fail("mock server did not report");
+    }
+    waitpid(mock_pid, NULL, 0);
+    close(mock_fd);
+
+    retries = upload_bench_metric(metrics_path, "salvage_upload_retries_total");
+    heap_used = upload_bench_metric(metrics_path, "salvage_heap_used_bytes");
+    unlink(metrics_path);
+
+    seconds = elapsed_us / 1e6;
+    printf("%s\t%d\t%d\t%d\t%.3f\t%.1f\t%lld\t%lld\t%lld\t%lld\n", scenario->name, nfiles, file_kib, nuploaded, seconds,
+           seconds > 0 ? (double) nuploaded * file_kib / 1024 / seconds : 0, retries, heap_used / 1024, requests,
+           requests - ok);
+    fflush(stdout);
+}
+
+/**
+ * Benchmark the upload engine against the mock server under each fault scenario, uploading the same files in each.
+ * Prints one tab separated line per scenario: files uploaded, seconds, MiB/s of files uploaded, retries and heap used
+ * as the upload's metrics report them, and requests the mock server received and failed.
+ *
+ * Usage: upload_bench [-m MOCK_SERVER] [-n FILES] [-k FILE_KIB]
+ */
+int main(int argc, char* argv[]) {
+    char directory[] = "/tmp/upload_bench.XXXXXX";
+    char path[PATH_MAX];
+    char block[1024];
+    const char* mock = UPLOAD_BENCH_MOCK_SERVER;
+    int nfiles = UPLOAD_BENCH_FILES, file_kib = UPLOAD_BENCH_FILE_KIB;
+    int nscenarios = (int) (sizeof(upload_bench_scenarios) / sizeof(upload_bench_scenarios[0]));
+    int opt;
+    FILE* file;
+
+    if (argc > 1 && strcmp(argv[1], "--upload") == 0) {
+        return upload_bench_upload(argc - 1, argv + 1);
+    }
+
+    while ((opt = getopt(argc, argv, "m:n:k:")) != -1) {
+        switch (opt) {
+            case 'm':
+                mock = optarg;
+                break;
+            case 'n':
+                nfiles = atoi(optarg);
+                break;
+            case 'k':
+                file_kib = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m MOCK_SERVER] [-n FILES] [-k FILE_KIB]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nfiles < 1 || nfiles > UPLOAD_BENCH_MAX_FILES || file_kib < 1) {
+        fprintf(stderr, "FILES must be 1 to %d and FILE_KIB positive\n", UPLOAD_BENCH_MAX_FILES);
+        return 1;
+    }
+
+    if (mkdtemp(directory) == NULL) {
+        upload_bench_fail("could not create directory");
+    }
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(path, sizeof(path), "%s/file-%d", directory, f);
+        file = fopen(path, "w");
+        if (file == NULL) {
+            upload_bench_fail("could not write file");
+        }
+        for (int k = 0; k < file_kib; k++) {
+            memset(block, 'a' + (f + k) % 26, sizeof(block));
+            fwrite(block, 1, sizeof(block), file);
+        }
+        fclose(file);
+    }
+
+    printf("scenario\tfiles\tfile_kib\tuploaded\tseconds\tmib_per_s\tretries\theap_used_kib\trequests\tfailed\n");
+    for (int s = 0; s < nscenarios; s++) {
+        upload_bench_scenario(&upload_bench_scenarios[s], mock, directory, nfiles, file_kib);
+    }
+
+    for (int f = 0; f < nfiles; f++) {
+        snprintf(path, sizeof(path), "%s/file-%d", directory, f);
+        unlink(path);
+    }
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,394 @@
+// For tee() and splice()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "heap.h"
+#include "log.h"
+#include "opts.h"
+
+/**
+ * Most bytes passed through at once, the default capacity of a pipe.
+ */
+#define CAPTURE_TEE_SIZE (64 * 1024)
+
+/**
+ * Capture state of one of the child's output streams.
+ */
+struct CaptureStream {
+    /**
+     * Name the kept output is uploaded as.
+     */
+    const char* name;
+
+    /**
+     * Our file descriptor output is passed through to, and the child's it is connected to.
+     */
+    int target;
+
+    /**
+     * Pipe the child writes to, or -1s if not capturing.
+     */
+    int pipe[2];
+
+    /**
+     * Pipe output is duplicated into with tee(), to be read into the ring buffer.
+     */
+    int tee[2];
+
+    /**
+     * Whether output is passed through with splice(), rather than written from the ring buffer.
+     */
+    int spliced;
+
+    /**
+     * Whether output is still passed through, rather than only kept.
+     */
+    int forwarding;
+
+    /**
+     * Ring buffer keeping the last of the output, allocated from the heap.
+     */
+    char* ring;
+
+    /**
+     * Ring buffer the next run keeps output in when restarting, or NULL.
+     */
+    char* spare;
+
+    /**
+     * Total bytes of output kept, the ring buffer position being this modulo its size.
+     */
+    size_t head;
+};
+
+/**
+ * Capture state of the child's stdout and stderr.
+ */
+struct Capture {
+    /**
+     * stdout and stderr.
+     */
+    struct CaptureStream streams[CAPTURE_STREAMS];
+};
+
+/**
+ * The capture instance.
+ */
+struct Capture g_capture_instance = {
+    .streams = {
+        { .name = "stdout", .target = STDOUT_FILENO, .pipe = { -1, -1 }, .tee = { -1, -1 } },
+        { .name = "stderr", .target = STDERR_FILENO, .pipe = { -1, -1 }, .tee = { -1, -1 } }
+    }
+};
+
+/**
+ * Pointer to the capture instance.
+ */
+struct Capture* g_capture = &g_capture_instance;
+
+/**
+ * Read output into the ring buffer, as far as the end of the ring buffer.
+ * @param stream the stream
+ * @param fd file descriptor to read from
+ * @param max most bytes to read
+ * @return bytes read, 0 at end of file, or -1 on error as per read()
+ */
+ssize_t capture_ring_fill(struct CaptureStream* stream, int fd, size_t max) {
+    size_t position = stream->head % g_opts->output_size;
+    size_t space = g_opts->output_size - position;
+    ssize_t nread;
+
+    nread = read(fd, stream->ring + position, space < max ? space : max);
+    if (nread > 0) {
+        stream->head += nread;
+    }
+
+    return nread;
+}
+
+/**
+ * Stop passing a stream through after failing to, keeping its output only.
+ * @param stream the stream
+ * @param reason why passing it through failed
+ */
+void capture_forward_failed(struct CaptureStream* stream, const char* reason) {
+    ERRORV("Could not pass %s through, only keeping it: %s", stream->name, reason);
+    stream->forwarding = 0;
+}
+
+/**
+ * Write output from the ring buffer to our stream.
+ * @param stream the stream
+ * @param start position of the output in the stream
+ * @param length bytes of output, no more than the ring buffer holds
+ */
+void capture_ring_write(struct CaptureStream* stream, size_t start, size_t length) {
+    size_t position, piece;
+    ssize_t nwritten;
+
+    while (length > 0 && stream->forwarding) {
+        position = start % g_opts->output_size;
+        piece = g_opts->output_size - position < length ? g_opts->output_size - position : length;
+
+        nwritten = write(stream->target, stream->ring + position, piece);
+        if (nwritten > 0) {
+            start += nwritten;
+            length -= nwritten;
+        } else if (nwritten == -1 && errno != EINTR) {
+            capture_forward_failed(stream, strerror(errno));
+        }
+    }
+}
+
+/**
+ * Consume output from the pipe that is already in the ring buffer, by reading it over itself.
+ * @param stream the stream
+ * @param start position of the output in the stream
+ * @param end position after the output in the stream
+ */
+void capture_consume(struct CaptureStream* stream, size_t start, size_t end) {
+    size_t head = stream->head;
+    ssize_t nread;
+
+    stream->head = start;
+    while (stream->head < end) {
+        nread = capture_ring_fill(stream, stream->pipe[0], end - stream->head);
+        if (nread <= 0 && errno != EINTR) {
+            ERRORV("Could not consume %s: %s", stream->name, nread == 0 ? "unexpected end" : strerror(errno));
+            break;
+        }
+    }
+    stream->head = head;
+}
+
+/**
+ * Duplicate output waiting on the pipe into the ring buffer with tee(), leaving it on the pipe to pass through.
+ * @param stream the stream
+ * @return bytes duplicated, 0 once the pipe is closed, or -1 on error as per tee()
+ */
+ssize_t capture_tee(struct CaptureStream* stream) {
+    size_t max = g_opts->output_size < CAPTURE_TEE_SIZE ? g_opts->output_size : CAPTURE_TEE_SIZE;
+    ssize_t nteed, nread;
+    size_t ncopied = 0;
+
+    nteed = tee(stream->pipe[0], stream->tee[1], max, SPLICE_F_NONBLOCK);
+
+    while (nteed > 0 && ncopied < (size_t) nteed) {
+        nread = capture_ring_fill(stream, stream->tee[0], nteed - ncopied);
+        if (nread > 0) {
+            ncopied += nread;
+        } else if (errno != EINTR) {
+            ERRORV("Could not keep %s: %s", stream->name, nread == 0 ? "unexpected end" : strerror(errno));
+            break;
+        }
+    }
+
+    return nteed;
+}
+
+/**
+ * Move duplicated output from the pipe to our stream with splice(), so the kernel passes it through without copying
+ * it to us.
+ * @param stream the stream
+ * @param start position of the output in the stream
+ * @param length bytes of output
+ */
+void capture_splice(struct CaptureStream* stream, size_t start, size_t length) {
+    size_t nmoved = 0;
+    ssize_t nspliced;
+
+    while (nmoved < length && stream->forwarding) {
+        nspliced = splice(stream->pipe[0], NULL, stream->target, NULL, length - nmoved, SPLICE_F_MOVE);
+        if (nspliced > 0) {
+            nmoved += nspliced;
+        } else if (nspliced == -1 && errno == EINVAL && nmoved == 0) {
+            // Terminals, among others, cannot be spliced to, so pass output through from the ring buffer instead
+            DEBUGV("%s cannot be spliced, copying instead", stream->name);
+            stream->spliced = 0;
+            capture_ring_write(stream, start, length);
+            break;
+        } else if (nspliced == 0 || errno != EINTR) {
+            capture_forward_failed(stream, nspliced == 0 ? "unexpected end" : strerror(errno));
+        }
+    }
+
+    if (nmoved < length) {
+        capture_consume(stream, start + nmoved, start + length);
+    }
+}
+
+void g_capture_init() {
+    struct CaptureStream* stream;
+
+    TRACE("g_capture_init()");
+
+    if (g_opts->output_size == 0) {
+        return;
+    }
+
+    for (int s = 0; s < CAPTURE_STREAMS; s++) {
+        stream = &g_capture->streams[s];
+
+        if (stream->ring == NULL) {
+            stream->ring = g_heap_allocate(g_opts->output_size);
+            stream->spare = g_opts->max_restarts > 0 ? g_heap_allocate(g_opts->output_size) : NULL;
+            if (stream->ring == NULL || (g_opts->max_restarts > 0 && stream->spare == NULL)) {
+                FATALV(FATAL_ERROR_CAPTURE_INIT, "Could not allocate %d bytes for %s", g_opts->output_size,
+                       stream->name);
+            }
+        }
+
+        // The child's end must block as it would writing to our stream, only our end is non-blocking
+        if (pipe2(stream->pipe, O_CLOEXEC) != 0 || pipe2(stream->tee, O_CLOEXEC) != 0 ||
+                fcntl(stream->pipe[0], F_SETFL, O_NONBLOCK) != 0) {
+            FATALV(FATAL_ERROR_CAPTURE_INIT, "Could not create pipes for %s: %s", stream->name, strerror(errno));
+        }
+
+        stream->spliced = 1;
+        stream->forwarding = 1;
+        stream->head = 0;
+    }
+
+    INFOV("Keeping the last %d bytes of stdout and stderr", g_opts->output_size);
+}
+
+int g_capture_spawn_actions(posix_spawn_file_actions_t* file_actions) {
+    int error_code;
+
+    for (int s = 0; s < CAPTURE_STREAMS; s++) {
+        if (g_capture->streams[s].pipe[1] == -1) {
+            continue;
+        }
+
+        error_code = posix_spawn_file_actions_adddup2(file_actions, g_capture->streams[s].pipe[1],
+                                                      g_capture->streams[s].target);
+        if (error_code != 0) {
+            return error_code;
+        }
+    }
+
+    return 0;
+}
+
+void g_capture_spawned() {
+    for (int s = 0; s < CAPTURE_STREAMS; s++) {
+        if (g_capture->streams[s].pipe[1] != -1 && close(g_capture->streams[s].pipe[1]) != 0) {
+            ERRORV("Could not close %s pipe: %s", g_capture->streams[s].name, strerror(errno));
+        }
+        g_capture->streams[s].pipe[1] = -1;
+    }
+}
+
+int g_capture_fd(int stream) {
+    return g_capture->streams[stream].pipe[0];
+}
+
+int g_capture_drain(int s) {
+    struct CaptureStream* stream = &g_capture->streams[s];
+    ssize_t nread;
+    size_t start;
+
+    if (stream->pipe[0] == -1) {
+        return 0;
+    }
+
+    for (;;) {
+        start = stream->head;
+
+        if (stream->spliced) {
+            nread = capture_tee(stream);
+        } else {
+            nread = capture_ring_fill(stream, stream->pipe[0], g_opts->output_size);
+        }
+
+        if (nread == 0) {
+            DEBUGV("%s closed", stream->name);
+            return 0;
+        }
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && errno == EAGAIN) {
+            return 1;
+        }
+        if (nread == -1) {
+            ERRORV("Could not read %s: %s", stream->name, strerror(errno));
+            return 0;
+        }
+
+        if (stream->spliced) {
+            capture_splice(stream, start, nread);
+        } else {
+            capture_ring_write(stream, start, nread);
+        }
+    }
+}
+
+void g_capture_finish() {
+    struct CaptureStream* stream;
+
+    TRACE("g_capture_finish()");
+
+    for (int s = 0; s < CAPTURE_STREAMS; s++) {
+        stream = &g_capture->streams[s];
+        if (stream->pipe[0] == -1) {
+            continue;
+        }
+
+        // Descendants of the child may still hold the pipe open, so only what is already waiting is drained
+        g_capture_drain(s);
+
+        if (close(stream->pipe[0]) != 0 || close(stream->tee[0]) != 0 || close(stream->tee[1]) != 0) {
+            ERRORV("Could not close %s pipes: %s", stream->name, strerror(errno));
+        }
+        stream->pipe[0] = -1;
+        stream->tee[0] = -1;
+        stream->tee[1] = -1;
+
+        INFOV("Kept %zu of %zu bytes of %s", stream->head < (size_t) g_opts->output_size ? stream->head :
+              (size_t) g_opts->output_size, stream->head, stream->name);
+    }
+}
+
+int g_capture_files(struct VirtualFile* files) {
+    struct CaptureStream* stream;
+    size_t size = g_opts->output_size;
+    size_t kept, position;
+    char* ring;
+    int nfiles = 0;
+
+    TRACEV("g_capture_files(%p)", files);
+
+    for (int s = 0; s < CAPTURE_STREAMS; s++) {
+        stream = &g_capture->streams[s];
+        if (stream->ring == NULL) {
+            continue;
+        }
+
+        // The oldest output kept may be part way round the ring buffer, in which case it wraps to the start
+        kept = stream->head < size ? stream->head : size;
+        position = (stream->head - kept) % size;
+
+        files[nfiles].name = stream->name;
+        files[nfiles].data[0] = stream->ring + position;
+        files[nfiles].length[0] = size - position < kept ? size - position : kept;
+        files[nfiles].data[1] = stream->ring;
+        files[nfiles].length[1] = kept - files[nfiles].length[0];
+        files[nfiles].data[2] = stream->ring;
+        files[nfiles].length[2] = 0;
+        nfiles++;
+
+        if (stream->spare != NULL) {
+            ring = stream->ring;
+            stream->ring = stream->spare;
+            stream->spare = ring;
+        }
+    }
+
+    return nfiles;
+}
@@ -0,0 +1,59 @@
+#ifndef JETSAM_CAPTURE_H
+#define JETSAM_CAPTURE_H
+
+#include <spawn.h>
+
+#include "http.h"
+
+/**
+ * Number of streams captured, stdout and stderr.
+ */
+#define CAPTURE_STREAMS 2
+
+/**
+ * Initialize capturing the child's stdout and stderr, if configured in the CLI options: a pipe for each, and a ring
+ * buffer in the heap keeping the last of each, allocated on the first run only.  When restarting, a spare ring buffer
+ * is allocated for each too.
+ */
+void g_capture_init();
+
+/**
+ * Add file actions connecting the child's stdout and stderr to the capture pipes.
+ * @param file_actions file actions the child is spawned with
+ * @return 0 on success, otherwise an error number
+ */
+int g_capture_spawn_actions(posix_spawn_file_actions_t* file_actions);
+
+/**
+ * Close our copies of the pipe ends the child writes to, once it has been spawned.
+ */
+void g_capture_spawned();
+
+/**
+ * File descriptor to watch for output from a stream.
+ * @param stream 0 for stdout, 1 for stderr
+ * @return the file descriptor, or -1 if not capturing
+ */
+int g_capture_fd(int stream);
+
+/**
+ * Pass output waiting on a stream through to ours, keeping a copy.  Never blocks waiting for output.
+ * @param stream 0 for stdout, 1 for stderr
+ * @return 1 if the stream may have more output, 0 once it is closed
+ */
+int g_capture_drain(int stream);
+
+/**
+ * Drain what is left of both streams and stop capturing.
+ */
+void g_capture_finish();
+
+/**
+ * Hand the output kept of both streams over to be uploaded, as files named stdout and stderr.  When restarting, the
+ * next run keeps its output in the spare ring buffers, so this run's stay untouched while they upload.
+ * @param files receives up to CAPTURE_STREAMS files
+ * @return number of files
+ */
+int g_capture_files(struct VirtualFile* files);
+
+#endif //JETSAM_CAPTURE_H
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include "checksum.h"
+#include "log.h"
+
+/**
+ * CRC32C polynomial, bit reversed.
+ */
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+/**
+ * Slicing-by-8 lookup tables for the portable CRC32C.
+ */
+uint32_t crc32c_table[8][256];
+
+/**
+ * SHA-256 round constants.
+ */
+const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * SHA-256 initial hash value.
+ */
+const uint32_t sha256_initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Hash whole blocks into the SHA-256 state, portable implementation.
+ * @param state intermediate hash value
+ * @param data blocks to hash
+ * @param nblocks number of SHA256_BLOCK_LENGTH byte blocks
+ */
+void sha256_blocks_portable(uint32_t* state, const unsigned char* data, size_t nblocks) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+
+    for (; nblocks > 0; nblocks--, data += SHA256_BLOCK_LENGTH) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t) data[i * 4] << 24) | ((uint32_t) data[i * 4 + 1] << 16) |
+                   ((uint32_t) data[i * 4 + 2] << 8) | (uint32_t) data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            w[i] = w[i - 16] + w[i - 7] +
+                   (SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                   (SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        }
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                 sha256_k[i] + w[i];
+            t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+/**
+ * Continue a raw (not pre or post inverted) CRC32C, portable slicing-by-8 implementation.
+ */
+uint32_t crc32c_portable(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t word;
+
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+
+    while (length >= 8) {
+        memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length > 0) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Continue a raw CRC32C using the SSE4.2 CRC32 instruction.
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t crc64, word;
+
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    crc64 = crc;
+    while (length >= 8) {
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    return crc;
+}
+
+/**
+ * Hash whole blocks into the SHA-256 state using the SHA extensions.
+ */
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(uint32_t* state, const unsigned char* data, size_t nblocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, message, tmp;
+    __m128i w[4];
+
+    // Rearrange from ABCD EFGH into the ABEF CDGH layout the instructions use
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; nblocks > 0; nblocks--, data += SHA256_BLOCK_LENGTH) {
+        abef = state0;
+        cdgh = state1;
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + i * 16)), byte_swap);
+            } else {
+                tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+            }
+
+            message = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*) &sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*) &state[0], state0);
+    _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+#elif defined(__aarch64__)
+/**
+ * Continue a raw CRC32C using the ARMv8 CRC32 instructions.
+ */
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t word;
+
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+
+    while (length >= 8) {
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+
+    while (length > 0) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+
+    return crc;
+}
+#endif
+
+/**
+ * CRC32C implementation selected by g_checksum_init.
+ */
+uint32_t (*crc32c_implementation)(uint32_t crc, const unsigned char* data, size_t length) = &crc32c_portable;
+
+/**
+ * SHA-256 block implementation selected by g_checksum_init.
+ */
+void (*sha256_blocks)(uint32_t* state, const unsigned char* data, size_t nblocks) = &sha256_blocks_portable;
+
+void g_checksum_init() {
+    uint32_t crc;
+
+    TRACE("g_checksum_init()");
+
+    for (int i = 0; i < 256; i++) {
+        crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            crc32c_table[slice][i] = crc32c_table[0][crc32c_table[slice - 1][i] & 0xff] ^
+                                     (crc32c_table[slice - 1][i] >> 8);
+        }
+    }
+
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_implementation = &crc32c_sse42;
+        INFO("Using SSE4.2 CRC32C");
+    }
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+        sha256_blocks = &sha256_blocks_shani;
+        INFO("Using SHA extensions for SHA-256");
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_implementation = &crc32c_armv8;
+        INFO("Using ARMv8 CRC32C");
+    }
+#endif
+}
+
+uint32_t g_checksum_crc32c(uint32_t crc, const void* data, size_t length) {
+    return ~crc32c_implementation(~crc, data, length);
+}
+
+void g_checksum_start(struct Checksum* checksum, int algorithms) {
+    checksum->algorithms = algorithms;
+    checksum->crc32c = 0;
+    if (algorithms & CHECKSUM_SHA256) {
+        g_checksum_sha256_init(&checksum->sha256);
+    }
+}
+
+void g_checksum_update(struct Checksum* checksum, const void* data, size_t length) {
+    if (checksum->algorithms & CHECKSUM_CRC32C) {
+        checksum->crc32c = g_checksum_crc32c(checksum->crc32c, data, length);
+    }
+    if (checksum->algorithms & CHECKSUM_SHA256) {
+        g_checksum_sha256_update(&checksum->sha256, data, length);
+    }
+}
+
+void g_checksum_finish(struct Checksum* checksum) {
+    if (checksum->algorithms & CHECKSUM_SHA256) {
+        g_checksum_sha256_final(&checksum->sha256, checksum->sha256_digest);
+    }
+}
+
+void g_checksum_header(const struct Checksum* checksum, int algorithm, char* line, size_t size) {
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    switch (algorithm) {
+        case CHECKSUM_CRC32C:
+            snprintf(line, size, "X-Checksum-CRC32C: %08x", checksum->crc32c);
+            break;
+        case CHECKSUM_SHA256:
+            g_checksum_to_hex(checksum->sha256_digest, SHA256_DIGEST_LENGTH, hex);
+            snprintf(line, size, "X-Checksum-SHA256: %s", hex);
+            break;
+        default:
+            line[0] = '\0';
+    }
+}
+
+void g_checksum_sha256_init(struct Sha256* sha256) {
+    memcpy(sha256->state, sha256_initial_state, sizeof(sha256->state));
+    sha256->length = 0;
+    sha256->nblock = 0;
+}
+
+void g_checksum_sha256_update(struct Sha256* sha256, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    size_t ncopy;
+
+    sha256->length += length;
+
+    if (sha256->nblock > 0) {
+        ncopy = SHA256_BLOCK_LENGTH - sha256->nblock;
+        if (ncopy > length) {
+            ncopy = length;
+        }
+        memcpy(sha256->block + sha256->nblock, bytes, ncopy);
+        sha256->nblock += ncopy;
+        bytes += ncopy;
+        length -= ncopy;
+
+        if (sha256->nblock < SHA256_BLOCK_LENGTH) {
+            return;
+        }
+        sha256_blocks(sha256->state, sha256->block, 1);
+        sha256->nblock = 0;
+    }
+
+    if (length >= SHA256_BLOCK_LENGTH) {
+        sha256_blocks(sha256->state, bytes, length / SHA256_BLOCK_LENGTH);
+        bytes += length & ~(size_t) (SHA256_BLOCK_LENGTH - 1);
+        length &= SHA256_BLOCK_LENGTH - 1;
+    }
+
+    memcpy(sha256->block, bytes, length);
+    sha256->nblock = length;
+}
+
+void g_checksum_sha256_final(struct Sha256* sha256, unsigned char* digest) {
+    uint64_t bits = sha256->length * 8;
+
+    sha256->block[sha256->nblock++] = 0x80;
+    if (sha256->nblock > SHA256_BLOCK_LENGTH - 8) {
+        memset(sha256->block + sha256->nblock, 0, SHA256_BLOCK_LENGTH - sha256->nblock);
+        sha256_blocks(sha256->state, sha256->block, 1);
+        sha256->nblock = 0;
+    }
+    memset(sha256->block + sha256->nblock, 0, SHA256_BLOCK_LENGTH - 8 - sha256->nblock);
+    for (int i = 0; i < 8; i++) {
+        sha256->block[SHA256_BLOCK_LENGTH - 1 - i] = (unsigned char) (bits >> (i * 8));
+    }
+    sha256_blocks(sha256->state, sha256->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char) (sha256->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (sha256->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (sha256->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) sha256->state[i];
+    }
+}
+
+void g_checksum_to_hex(const unsigned char* data, size_t length, char* hex) {
+    const char* digits = "0123456789abcdef";
+
+    for (size_t i = 0; i < length; i++) {
+        hex[i * 2] = digits[data[i] >> 4];
+        hex[i * 2 + 1] = digits[data[i] & 0x0f];
+    }
+    hex[length * 2] = '\0';
+}
+
+/**
+ * Value of a single hexadecimal digit.
+ * @return 0-15, or -1 if not a hexadecimal digit
+ */
+int checksum_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int g_checksum_from_hex(const char* hex, size_t length, unsigned char* data) {
+    int high, low;
+
+    for (size_t i = 0; i < length; i++) {
+        high = checksum_hex_digit(hex[i * 2]);
+        low = checksum_hex_digit(hex[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return -1;
+        }
+        data[i] = (unsigned char) ((high << 4) | low);
+    }
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+#ifndef JETSAM_CHECKSUM_H
+#define JETSAM_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Length in bytes of a SHA-256 digest.
+ */
+#define SHA256_DIGEST_LENGTH 32
+
+/**
+ * Length in bytes of a SHA-256 block.
+ */
+#define SHA256_BLOCK_LENGTH 64
+
+/**
+ * Bit flag selecting CRC32C (Castagnoli) checksums.
+ */
+#define CHECKSUM_CRC32C 1
+
+/**
+ * Bit flag selecting SHA-256 checksums.
+ */
+#define CHECKSUM_SHA256 2
+
+/**
+ * Largest header line rendered by g_checksum_header, including terminator.
+ */
+#define CHECKSUM_MAX_HEADER_LENGTH 96
+
+/**
+ * Incremental SHA-256 state.
+ */
+struct Sha256 {
+    /**
+     * Intermediate hash value.
+     */
+    uint32_t state[8];
+
+    /**
+     * Total bytes hashed so far.
+     */
+    uint64_t length;
+
+    /**
+     * Bytes of a partial block waiting to be hashed.
+     */
+    unsigned char block[SHA256_BLOCK_LENGTH];
+
+    /**
+     * Number of bytes in the partial block.
+     */
+    size_t nblock;
+};
+
+/**
+ * Incremental state for any combination of checksums.
+ */
+struct Checksum {
+    /**
+     * Bit flags of the checksums being computed.
+     */
+    int algorithms;
+
+    /**
+     * Running CRC32C, or the final value once finished.
+     */
+    uint32_t crc32c;
+
+    /**
+     * Running SHA-256.
+     */
+    struct Sha256 sha256;
+
+    /**
+     * Final SHA-256, once finished.
+     */
+    unsigned char sha256_digest[SHA256_DIGEST_LENGTH];
+};
+
+/**
+ * Select the fastest checksum implementations this CPU supports.
+ */
+void g_checksum_init();
+
+/**
+ * Continue a CRC32C.
+ * @param crc CRC32C of the preceding data, or 0 to start
+ * @param data bytes to checksum
+ * @param length number of bytes to checksum
+ * @return CRC32C of the preceding data followed by these bytes
+ */
+uint32_t g_checksum_crc32c(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Start computing checksums.
+ * @param checksum state to initialize
+ * @param algorithms bit flags of the checksums to compute
+ */
+void g_checksum_start(struct Checksum* checksum, int algorithms);
+
+/**
+ * Add data to the checksums.
+ * @param checksum state to update
+ * @param data bytes to checksum
+ * @param length number of bytes to checksum
+ */
+void g_checksum_update(struct Checksum* checksum, const void* data, size_t length);
+
+/**
+ * Finish computing checksums.
+ * @param checksum state to finish, which must be started again before reuse
+ */
+void g_checksum_finish(struct Checksum* checksum);
+
+/**
+ * Render a finished checksum as an HTTP header line.
+ * @param checksum finished state
+ * @param algorithm the single checksum to render
+ * @param line receives the NUL terminated header line
+ * @param size size of line, at least CHECKSUM_MAX_HEADER_LENGTH
+ */
+void g_checksum_header(const struct Checksum* checksum, int algorithm, char* line, size_t size);
+
+/**
+ * Start a new SHA-256 digest.
+ * @param sha256 state to initialize
+ */
+void g_checksum_sha256_init(struct Sha256* sha256);
+
+/**
+ * Add data to a SHA-256 digest.
+ * @param sha256 state to update
+ * @param data bytes to hash
+ * @param length number of bytes to hash
+ */
+void g_checksum_sha256_update(struct Sha256* sha256, const void* data, size_t length);
+
+/**
+ * Finish a SHA-256 digest.
+ * @param sha256 state to finish, which must be initialized again before reuse
+ * @param digest receives SHA256_DIGEST_LENGTH bytes
+ */
+void g_checksum_sha256_final(struct Sha256* sha256, unsigned char* digest);
+
+/**
+ * Render bytes as lowercase hexadecimal.
+ * @param data bytes to render
+ * @param length number of bytes to render
+ * @param hex receives 2 * length characters and a terminating NUL
+ */
+void g_checksum_to_hex(const unsigned char* data, size_t length, char* hex);
+
+/**
+ * Parse lowercase or uppercase hexadecimal.
+ * @param hex exactly 2 * length hexadecimal characters
+ * @param length number of bytes to produce
+ * @param data receives length bytes
+ * @return 0 on success, -1 if hex contains anything else
+ */
+int g_checksum_from_hex(const char* hex, size_t length, unsigned char* data);
+
+#endif //JETSAM_CHECKSUM_H
@@ -0,0 +1,308 @@
+// For accept4
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "log.h"
+#include "opts.h"
+#include "queue.h"
+
+/**
+ * Longest command line, including its newline.
+ */
+#define CONTROL_LINE_SIZE 4096
+
+/**
+ * Largest reply, enough for the status of every job.
+ */
+#define CONTROL_REPLY_SIZE (QUEUE_MAX_JOBS * 64 + 64)
+
+/**
+ * Most words in a command, the command and its patterns.
+ */
+#define CONTROL_MAX_WORDS (MAX_FILES + 1)
+
+/**
+ * A connected client.
+ */
+struct ControlClient {
+    /**
+     * The client's socket, or -1 if unused.
+     */
+    int fd;
+
+    /**
+     * Bytes of a command line received so far.
+     */
+    size_t length;
+
+    /**
+     * Command line being received.
+     */
+    char line[CONTROL_LINE_SIZE];
+};
+
+/**
+ * Control socket state.
+ */
+struct Control {
+    /**
+     * Listening socket, or -1.
+     */
+    int fd;
+
+    /**
+     * Connected clients.
+     */
+    struct ControlClient clients[CONTROL_MAX_CLIENTS];
+
+    /**
+     * Buffer replies are formatted in.
+     */
+    char reply[CONTROL_REPLY_SIZE];
+};
+
+/**
+ * The control instance.
+ */
+struct Control g_control_instance = { .fd = -1 };
+
+/**
+ * Pointer to the control instance.
+ */
+struct Control* g_control = &g_control_instance;
+
+/**
+ * Send the reply buffer to a client.  Replies are short, so one the client is not reading is dropped rather than waited
+ * on.
+ * @param client the client
+ */
+void control_send(struct ControlClient* client) {
+    ssize_t length = (ssize_t) strlen(g_control->reply);
+
+    if (send(client->fd, g_control->reply, length, MSG_NOSIGNAL) != length) {
+        ERRORV("Could not reply to control client %d: %s", client->fd, strerror(errno));
+    }
+}
+
+/**
+ * Format a reply and send it to a client.
+ * @param client the client
+ * @param format printf format of the reply
+ */
+void control_reply(struct ControlClient* client, const char* format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(g_control->reply, sizeof(g_control->reply), format, args);
+    va_end(args);
+
+    control_send(client);
+}
+
+/**
+ * Carry out a command line.
+ * @param client the client that sent it
+ * @param line the line, without its newline
+ */
+void control_command(struct ControlClient* client, char* line) {
+    char* words[CONTROL_MAX_WORDS];
+    char* state;
+    int nwords = 0;
+    int result;
+
+    for (char* word = strtok_r(line, " \t\r", &state); word != NULL; word = strtok_r(NULL, " \t\r", &state)) {
+        if (nwords == CONTROL_MAX_WORDS) {
+            control_reply(client, "ERROR too many words, at most %d\n", CONTROL_MAX_WORDS);
+            return;
+        }
+        words[nwords++] = word;
+    }
+
+    if (nwords == 0) {
+        return;
+    }
+    DEBUGV("Control command %s with %d arguments", words[0], nwords - 1);
+
+    if (strcmp(words[0], "UPLOAD") == 0 && nwords > 1) {
+        result = g_queue_add(words + 1, nwords - 1);
+        if (result > 0) {
+            control_reply(client, "OK %d\n", result);
+        } else if (result == QUEUE_ADD_FULL) {
+            control_reply(client, "ERROR queue full\n");
+        } else if (result == QUEUE_ADD_NO_MATCH) {
+            control_reply(client, "ERROR no files match\n");
+        } else if (result == QUEUE_ADD_HEAP) {
+            control_reply(client, "ERROR heap\n");
+        } else {
+            control_reply(client, "ERROR too many files, at most %d\n", MAX_FILES);
+        }
+    } else if (strcmp(words[0], "STATUS") == 0 && nwords == 1) {
+        // Leaving room for the OK line
+        g_queue_status(g_control->reply, sizeof(g_control->reply) - 3);
+        strcat(g_control->reply, "OK\n");
+        control_send(client);
+    } else if (strcmp(words[0], "CANCEL") == 0 && nwords == 2) {
+        if (g_queue_cancel(atoi(words[1]))) {
+            control_reply(client, "OK\n");
+        } else {
+            control_reply(client, "ERROR no job %s queued or running\n", words[1]);
+        }
+    } else {
+        control_reply(client, "ERROR unknown command, expected UPLOAD PATTERN [...], STATUS or CANCEL ID\n");
+    }
+}
+
+/**
+ * Find a connected client.
+ * @param fd the client's socket
+ * @return the client, or NULL if not connected
+ */
+struct ControlClient* control_client(int fd) {
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        if (g_control->clients[c].fd == fd) {
+            return &g_control->clients[c];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Disconnect a client.
+ * @param client the client
+ */
+void control_disconnect(struct ControlClient* client) {
+    DEBUGV("Control client %d disconnected", client->fd);
+
+    if (close(client->fd) != 0) {
+        ERRORV("Could not close control client %d: %s", client->fd, strerror(errno));
+    }
+    client->fd = -1;
+    client->length = 0;
+}
+
+int g_control_open() {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct stat socket_stat;
+
+    TRACE("g_control_open()");
+
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        g_control->clients[c].fd = -1;
+    }
+
+    if (strlen(g_opts->control_socket) >= sizeof(address.sun_path)) {
+        FATALV(FATAL_ERROR_CONTROL_INIT, "%s is too long a socket path, max %zu", g_opts->control_socket,
+               sizeof(address.sun_path) - 1);
+    }
+    strcpy(address.sun_path, g_opts->control_socket);
+
+    // A socket left behind by a previous run would fail binding, but anything else there is not ours to remove
+    if (lstat(g_opts->control_socket, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)) {
+        unlink(g_opts->control_socket);
+    }
+
+    g_control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_control->fd == -1 || bind(g_control->fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+            listen(g_control->fd, CONTROL_MAX_CLIENTS) != 0) {
+        FATALV(FATAL_ERROR_CONTROL_INIT, "Could not listen on %s: %s", g_opts->control_socket, strerror(errno));
+    }
+
+    INFOV("Listening for commands on %s", g_opts->control_socket);
+    return g_control->fd;
+}
+
+int g_control_accept() {
+    struct ControlClient* client;
+    int fd;
+
+    fd = accept4(g_control->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            ERRORV("Could not accept control client: %s", strerror(errno));
+        }
+        return -1;
+    }
+
+    client = control_client(-1);
+    if (client == NULL) {
+        ERRORV("Refusing control client, %d already connected", CONTROL_MAX_CLIENTS);
+        send(fd, "ERROR too many clients\n", 23, MSG_NOSIGNAL);
+        close(fd);
+        return -1;
+    }
+
+    DEBUGV("Control client %d connected", fd);
+    client->fd = fd;
+    client->length = 0;
+
+    return fd;
+}
+
+int g_control_handle(int fd) {
+    struct ControlClient* client = control_client(fd);
+    char* newline;
+    size_t consumed;
+    ssize_t nread;
+
+    if (client == NULL) {
+        return 0;
+    }
+
+    for (;;) {
+        nread = read(fd, client->line + client->length, sizeof(client->line) - client->length);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && errno == EAGAIN) {
+            return 1;
+        }
+        if (nread <= 0) {
+            control_disconnect(client);
+            return 0;
+        }
+        client->length += nread;
+
+        consumed = 0;
+        while ((newline = memchr(client->line + consumed, '\n', client->length - consumed)) != NULL) {
+            *newline = '\0';
+            control_command(client, client->line + consumed);
+            consumed = newline + 1 - client->line;
+        }
+        client->length -= consumed;
+        memmove(client->line, client->line + consumed, client->length);
+
+        if (client->length == sizeof(client->line)) {
+            control_reply(client, "ERROR line too long, at most %d bytes\n", CONTROL_LINE_SIZE - 1);
+            client->length = 0;
+        }
+    }
+}
+
+void g_control_close() {
+    TRACE("g_control_close()");
+
+    if (g_control->fd == -1) {
+        return;
+    }
+
+    for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+        if (g_control->clients[c].fd != -1) {
+            control_disconnect(&g_control->clients[c]);
+        }
+    }
+
+    close(g_control->fd);
+    g_control->fd = -1;
+    unlink(g_opts->control_socket);
+}
@@ -0,0 +1,38 @@
+#ifndef JETSAM_CONTROL_H
+#define JETSAM_CONTROL_H
+
+/**
+ * Clients connected at once, further connections being refused.
+ */
+#define CONTROL_MAX_CLIENTS 8
+
+/**
+ * Start listening on the control socket from the CLI options, replacing any left behind by a previous run.
+ * @return the listening socket, to watch for connections
+ */
+int g_control_open();
+
+/**
+ * Accept a client waiting to connect.
+ * @return the client's socket, to watch for commands, or -1 if none was accepted
+ */
+int g_control_accept();
+
+/**
+ * Handle commands a client has sent, a line each, replying to each with a line, or for STATUS one line per job and
+ * then one starting OK:
+ *   UPLOAD PATTERN [...] queues the files matching the paths or globs, replying OK ID
+ *   STATUS replies ID STATE UPLOADED/FILES for each job
+ *   CANCEL ID cancels a queued or running job
+ * Replies to errors start ERROR.  Never blocks waiting for commands.
+ * @param fd the client's socket
+ * @return 1 if the client may send more, 0 once it is disconnected and its socket closed
+ */
+int g_control_handle(int fd);
+
+/**
+ * Disconnect every client, stop listening and remove the control socket.
+ */
+void g_control_close();
+
+#endif //JETSAM_CONTROL_H
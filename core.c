@@ -0,0 +1,183 @@
+// For SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "heap.h"
+#include "http.h"
+#include "log.h"
+#include "opts.h"
+
+/**
+ * Core dump uploading state.
+ */
+struct Core {
+    /**
+     * Wall clock time at initialization or the last upload, core dumps modified since being new.
+     */
+    struct timespec start;
+
+    /**
+     * Header followed by the extent table, uploaded together, from the heap.
+     */
+    struct CoreHeader* header;
+
+    /**
+     * The extent table, following the header.
+     */
+    struct FileExtent* extents;
+};
+
+/**
+ * The core instance.
+ */
+struct Core g_core_instance;
+
+/**
+ * Pointer to the core instance.
+ */
+struct Core* g_core = &g_core_instance;
+
+/**
+ * Record the data extents of a file in the extent table, skipping holes.  Where the filesystem cannot report holes, the
+ * whole file is one extent.
+ * @param fd the file
+ * @param size size of the file in bytes
+ * @return number of extents
+ */
+uint32_t core_extents(int fd, off_t size) {
+    uint32_t nextents = 0;
+    off_t offset = 0, data, hole;
+
+    while (offset < size) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {
+            break;
+        }
+        hole = data == -1 ? size : lseek(fd, data, SEEK_HOLE);
+        if (data == -1 || hole == -1) {
+            data = data == -1 ? offset : data;
+            hole = size;
+        }
+
+        // Out of room, the last extent covers the rest of the file, reading its holes as zeros
+        if (nextents == CORE_MAX_EXTENTS) {
+            g_core->extents[nextents - 1].length = size - g_core->extents[nextents - 1].offset;
+            break;
+        }
+
+        g_core->extents[nextents].offset = data;
+        g_core->extents[nextents].length = hole - data;
+        nextents++;
+        offset = hole;
+    }
+
+    return nextents;
+}
+
+/**
+ * Upload a core dump as a sparse container.
+ * @param directory_fd the core directory
+ * @param name name of the core dump in the directory
+ * @param size size of the core dump in bytes
+ * @return 1 if and only if uploaded to every destination
+ */
+int core_upload(int directory_fd, const char* name, off_t size) {
+    char upload_name[NAME_MAX + sizeof(".sparse")];
+    struct ExtentFile file;
+    uint64_t ndata = 0;
+    int fd, nuploaded;
+
+    fd = openat(directory_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ERRORV("Could not open core dump %s: %s", name, strerror(errno));
+        return 0;
+    }
+
+    g_core->header->size = size;
+    g_core->header->nextents = core_extents(fd, size);
+    for (uint32_t i = 0; i < g_core->header->nextents; i++) {
+        ndata += g_core->extents[i].length;
+    }
+    INFOV("Core dump %s has %lu bytes of data in %u extents of %ld bytes", name, (unsigned long) ndata,
+          g_core->header->nextents, (long) size);
+
+    snprintf(upload_name, sizeof(upload_name), "%s.sparse", name);
+    file.name = upload_name;
+    file.header = (const char*) g_core->header;
+    file.header_length = sizeof(struct CoreHeader) + g_core->header->nextents * sizeof(struct FileExtent);
+    file.fd = fd;
+    file.extents = g_core->extents;
+    file.nextents = (int) g_core->header->nextents;
+    nuploaded = g_http_upload_extent_files(&file, 1);
+
+    close(fd);
+    return nuploaded == 1;
+}
+
+void g_core_init() {
+    TRACE("g_core_init()");
+
+    if (g_opts->core_directory == NULL || g_core->header != NULL) {
+        return;
+    }
+
+    g_core->header = g_heap_allocate(sizeof(struct CoreHeader) + CORE_MAX_EXTENTS * sizeof(struct FileExtent));
+    if (g_core->header == NULL) {
+        FATALV(FATAL_ERROR_CORE_INIT, "Could not allocate %d core dump extents", CORE_MAX_EXTENTS);
+    }
+    g_core->extents = (struct FileExtent*) (g_core->header + 1);
+
+    memcpy(g_core->header->magic, "salvsprs", sizeof(g_core->header->magic));
+    g_core->header->version = 1;
+    // File times come from the coarse clock, which may lag the precise one, hiding core dumps written right away
+    clock_gettime(CLOCK_REALTIME_COARSE, &g_core->start);
+}
+
+int g_core_upload() {
+    struct dirent* entry;
+    struct stat st;
+    struct timespec scanned;
+    DIR* directory;
+    int ncores = 0, nuploaded = 0;
+
+    TRACE("g_core_upload()");
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &scanned);
+    directory = opendir(g_opts->core_directory);
+    if (directory == NULL) {
+        ERRORV("Could not open core directory %s: %s", g_opts->core_directory, strerror(errno));
+        return 0;
+    }
+
+    while ((entry = readdir(directory)) != NULL) {
+        if (fstatat(dirfd(directory), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (st.st_mtim.tv_sec < g_core->start.tv_sec ||
+                (st.st_mtim.tv_sec == g_core->start.tv_sec && st.st_mtim.tv_nsec < g_core->start.tv_nsec)) {
+            continue;
+        }
+
+        ncores++;
+        nuploaded += core_upload(dirfd(directory), entry->d_name, st.st_size);
+    }
+    closedir(directory);
+
+    // Core dumps written from now on are left to the next upload, the child having been restarted
+    g_core->start = scanned;
+
+    if (ncores == 0) {
+        INFOV("No new core dumps in %s", g_opts->core_directory);
+    }
+    return nuploaded == ncores;
+}
@@ -0,0 +1,50 @@
+#ifndef JETSAM_CORE_H
+#define JETSAM_CORE_H
+
+#include <stdint.h>
+
+/**
+ * Most data extents recorded of a core dump, the last covering the rest of the file, holes included, once reached.
+ */
+#define CORE_MAX_EXTENTS 16384
+
+/**
+ * Start of an uploaded core dump, followed by its extent table, then the data of each extent in order.  A core dump is
+ * rebuilt by writing each extent's data at its offset in a file truncated to size bytes.
+ */
+struct CoreHeader {
+    /**
+     * "salvsprs".
+     */
+    char magic[8];
+
+    /**
+     * Format version, 1.
+     */
+    uint32_t version;
+
+    /**
+     * Number of extents in the table.
+     */
+    uint32_t nextents;
+
+    /**
+     * Size in bytes of the core dump, holes included.
+     */
+    uint64_t size;
+};
+
+/**
+ * Initialize core dump uploading, if configured in the CLI options, allocating the extent table from the heap and
+ * noting the time, as core dumps written from then on are the executed program's.  Only the first run initializes.
+ */
+void g_core_init();
+
+/**
+ * Upload core dumps written to the core directory since initialization or the last upload, each as a sparse container
+ * named after it with a .sparse suffix.
+ * @return 1 if and only if every core dump was uploaded to every destination
+ */
+int g_core_upload();
+
+#endif //JETSAM_CORE_H
@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "dedup.h"
+#include "heap.h"
+#include "log.h"
+#include "opts.h"
+
+/**
+ * Size of the buffer files are scanned through when chunking.
+ */
+#define DEDUP_SCAN_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Seed for the rolling hash table.  Changing it changes every chunk boundary, so it must never change.
+ */
+#define DEDUP_GEAR_SEED 0x6a657473616d2121ULL
+
+/**
+ * Deduplication state.
+ */
+struct Dedup {
+    /**
+     * Local chunk index file, or -1 if not open.
+     */
+    int index_fd;
+
+    /**
+     * Open addressed set of chunk identifiers known to be held by collectors, each combined with its collector's
+     * key.  All zero is empty.
+     */
+    unsigned char (*index)[SHA256_DIGEST_LENGTH];
+
+    /**
+     * Number of identifiers in the index.
+     */
+    size_t nindex;
+
+    /**
+     * Rolling hash table, one random value per byte value.
+     */
+    uint64_t gear[256];
+
+    /**
+     * Buffer files are scanned through.
+     */
+    unsigned char* scan_buffer;
+
+    /**
+     * Buffer chunks are read back into for upload.
+     */
+    char* chunk_buffer;
+
+    /**
+     * Chunks of the last file chunked.
+     */
+    struct DedupChunk* chunks;
+
+    /**
+     * Buffer for "have" query bodies.
+     */
+    char* have_buffer;
+};
+
+/**
+ * The deduplication instance.
+ */
+struct Dedup g_dedup_instance = { .index_fd = -1 };
+
+/**
+ * Pointer to the deduplication instance.
+ */
+struct Dedup* g_dedup = &g_dedup_instance;
+
+/**
+ * Allocate from the heap or fail.
+ */
+#define DEDUP_ALLOCATE(target, size)                                                    \
+    target = g_heap_allocate(size);                                                     \
+    if (target == NULL) {                                                               \
+        FATALV(FATAL_ERROR_DEDUP_INIT, "could not allocate %s (%d bytes)", #target, (int) (size)); \
+    }
+
+/**
+ * Bucket an entry hashes to in the index.
+ */
+size_t dedup_index_bucket(const unsigned char* entry) {
+    uint64_t hash;
+
+    memcpy(&hash, entry, sizeof(hash));
+    return (size_t) hash & (DEDUP_INDEX_CAPACITY - 1);
+}
+
+/**
+ * Whether an entry is the all zero empty marker.
+ */
+int dedup_is_empty(const unsigned char* entry) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        if (entry[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Insert an entry into the in-memory index only.
+ * @return 1 if inserted, 0 if already present or the index is full
+ */
+int dedup_index_insert(const unsigned char* entry) {
+    size_t bucket;
+
+    if (dedup_is_empty(entry)) {
+        return 0;
+    }
+
+    if (g_dedup->nindex >= DEDUP_INDEX_CAPACITY - DEDUP_INDEX_CAPACITY / 4) {
+        DEBUG("Chunk index full, not remembering chunk");
+        return 0;
+    }
+
+    bucket = dedup_index_bucket(entry);
+    while (!dedup_is_empty(g_dedup->index[bucket])) {
+        if (memcmp(g_dedup->index[bucket], entry, SHA256_DIGEST_LENGTH) == 0) {
+            return 0;
+        }
+        bucket = (bucket + 1) & (DEDUP_INDEX_CAPACITY - 1);
+    }
+
+    memcpy(g_dedup->index[bucket], entry, SHA256_DIGEST_LENGTH);
+    g_dedup->nindex++;
+    return 1;
+}
+
+/**
+ * Load the local index file into memory.
+ */
+void dedup_index_load() {
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    ssize_t nread;
+
+    while ((nread = read(g_dedup->index_fd, id, sizeof(id))) == sizeof(id)) {
+        dedup_index_insert(id);
+    }
+
+    if (nread < 0) {
+        ERRORV("Could not read chunk index %s: %s", g_opts->dedup_index, strerror(errno));
+    } else if (nread > 0) {
+        ERRORV("Chunk index %s has a truncated entry, ignoring it", g_opts->dedup_index);
+    }
+}
+
+void g_dedup_init() {
+    uint64_t seed = DEDUP_GEAR_SEED;
+    uint64_t z;
+
+    TRACE("g_dedup_init()");
+
+    // splitmix64, so the table is identical on every host without embedding it
+    for (int i = 0; i < 256; i++) {
+        z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_dedup->gear[i] = z ^ (z >> 31);
+    }
+
+    DEDUP_ALLOCATE(g_dedup->index, DEDUP_INDEX_CAPACITY * SHA256_DIGEST_LENGTH);
+    memset(g_dedup->index, 0, DEDUP_INDEX_CAPACITY * SHA256_DIGEST_LENGTH);
+    DEDUP_ALLOCATE(g_dedup->scan_buffer, DEDUP_SCAN_BUFFER_SIZE);
+    DEDUP_ALLOCATE(g_dedup->chunk_buffer, DEDUP_MAX_CHUNK_SIZE);
+    DEDUP_ALLOCATE(g_dedup->chunks, DEDUP_MAX_CHUNKS * sizeof(struct DedupChunk));
+    DEDUP_ALLOCATE(g_dedup->have_buffer, DEDUP_HAVE_BATCH * (DEDUP_HEX_ID_LENGTH + 1) + 1);
+
+    g_dedup->nindex = 0;
+    g_dedup->index_fd = open(g_opts->dedup_index, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (g_dedup->index_fd == -1) {
+        FATALV(FATAL_ERROR_DEDUP_INIT, "could not open chunk index %s: %s", g_opts->dedup_index, strerror(errno));
+    }
+
+    dedup_index_load();
+    INFOV("Loaded %d chunk identifiers from %s", (int) g_dedup->nindex, g_opts->dedup_index);
+}
+
+int g_dedup_chunk_file(int fd, off_t size, struct DedupChunk** chunks) {
+    struct Sha256 sha256;
+    struct DedupChunk* chunk;
+    uint64_t hash = 0;
+    off_t offset = 0;
+    size_t chunk_length = 0;
+    ssize_t nread;
+    size_t start, i;
+    int nchunks = 0;
+
+    TRACEV("g_dedup_chunk_file(%d, %ld, %p)", fd, (long) size, chunks);
+
+    g_checksum_sha256_init(&sha256);
+
+    // Bytes written past size meanwhile are left for the next upload, so the chunks add up to size
+    while (offset < size && (nread = pread(fd, g_dedup->scan_buffer, size - offset < DEDUP_SCAN_BUFFER_SIZE ?
+                                           (size_t) (size - offset) : DEDUP_SCAN_BUFFER_SIZE, offset)) > 0) {
+        for (start = 0, i = 0; i < (size_t) nread; i++) {
+            hash = (hash << 1) + g_dedup->gear[g_dedup->scan_buffer[i]];
+            chunk_length++;
+
+            if (chunk_length < DEDUP_MIN_CHUNK_SIZE ||
+                    ((hash & DEDUP_BOUNDARY_MASK) != 0 && chunk_length < DEDUP_MAX_CHUNK_SIZE)) {
+                continue;
+            }
+
+            if (nchunks == DEDUP_MAX_CHUNKS) {
+                INFOV("More than %d chunks, not deduplicating", DEDUP_MAX_CHUNKS);
+                return -1;
+            }
+
+            g_checksum_sha256_update(&sha256, g_dedup->scan_buffer + start, i + 1 - start);
+            chunk = &g_dedup->chunks[nchunks++];
+            chunk->offset = offset + (off_t) i + 1 - (off_t) chunk_length;
+            chunk->length = chunk_length;
+            g_checksum_sha256_final(&sha256, chunk->id);
+
+            g_checksum_sha256_init(&sha256);
+            start = i + 1;
+            chunk_length = 0;
+            hash = 0;
+        }
+
+        g_checksum_sha256_update(&sha256, g_dedup->scan_buffer + start, (size_t) nread - start);
+        offset += nread;
+    }
+
+    if (offset < size) {
+        if (nread < 0) {
+            ERRORV("Could not read file for chunking: %s", strerror(errno));
+        } else {
+            INFOV("File truncated to %ld of %ld bytes while chunking", (long) offset, (long) size);
+        }
+        return -1;
+    }
+
+    if (chunk_length > 0) {
+        if (nchunks == DEDUP_MAX_CHUNKS) {
+            INFOV("More than %d chunks, not deduplicating", DEDUP_MAX_CHUNKS);
+            return -1;
+        }
+
+        chunk = &g_dedup->chunks[nchunks++];
+        chunk->offset = offset - (off_t) chunk_length;
+        chunk->length = chunk_length;
+        g_checksum_sha256_final(&sha256, chunk->id);
+    }
+
+    DEBUGV("%d chunks in %ld bytes", nchunks, (long) offset);
+    *chunks = g_dedup->chunks;
+    return nchunks;
+}
+
+void g_dedup_prepare(struct DedupChunk* chunks, int nchunks, const unsigned char* key) {
+    for (int i = 0; i < nchunks; i++) {
+        chunks[i].state = g_dedup_index_contains(chunks[i].id, key) ? DEDUP_CHUNK_PRESENT : DEDUP_CHUNK_UNKNOWN;
+    }
+}
+
+const char* g_dedup_read_chunk(int fd, const struct DedupChunk* chunk) {
+    struct Sha256 sha256;
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    ssize_t nread;
+    size_t total = 0;
+
+    TRACEV("g_dedup_read_chunk(%d, %p)", fd, chunk);
+
+    while (total < chunk->length) {
+        nread = pread(fd, g_dedup->chunk_buffer + total, chunk->length - total, chunk->offset + (off_t) total);
+        if (nread <= 0) {
+            ERRORV("Could not read chunk at %ld: %s", (long) chunk->offset, nread == 0 ? "file truncated" : strerror(errno));
+            return NULL;
+        }
+        total += nread;
+    }
+
+    g_checksum_sha256_init(&sha256);
+    g_checksum_sha256_update(&sha256, g_dedup->chunk_buffer, chunk->length);
+    g_checksum_sha256_final(&sha256, id);
+    if (memcmp(id, chunk->id, SHA256_DIGEST_LENGTH) != 0) {
+        ERRORV("Chunk at %ld changed since it was chunked", (long) chunk->offset);
+        return NULL;
+    }
+
+    return g_dedup->chunk_buffer;
+}
+
+const char* g_dedup_have_request(struct DedupChunk* chunks, int nchunks, int* cursor, size_t* length) {
+    size_t nbody = 0;
+    int nbatch = 0;
+
+    for (; *cursor < nchunks && nbatch < DEDUP_HAVE_BATCH; (*cursor)++) {
+        if (chunks[*cursor].state != DEDUP_CHUNK_UNKNOWN) {
+            continue;
+        }
+
+        g_checksum_to_hex(chunks[*cursor].id, SHA256_DIGEST_LENGTH, g_dedup->have_buffer + nbody);
+        nbody += DEDUP_HEX_ID_LENGTH;
+        g_dedup->have_buffer[nbody++] = '\n';
+        chunks[*cursor].state = DEDUP_CHUNK_PRESENT;
+        nbatch++;
+    }
+
+    if (nbatch == 0) {
+        return NULL;
+    }
+
+    g_dedup->have_buffer[nbody] = '\0';
+    *length = nbody;
+    return g_dedup->have_buffer;
+}
+
+int g_dedup_have_response(struct DedupChunk* chunks, int nchunks, const char* response, size_t length) {
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    size_t line = 0;
+    int nmissing = 0;
+
+    while (line + DEDUP_HEX_ID_LENGTH <= length) {
+        if (g_checksum_from_hex(response + line, SHA256_DIGEST_LENGTH, id) != 0) {
+            ERROR("Malformed chunk identifier in have response");
+        } else {
+            for (int i = 0; i < nchunks; i++) {
+                if (chunks[i].state != DEDUP_CHUNK_MISSING && memcmp(chunks[i].id, id, SHA256_DIGEST_LENGTH) == 0) {
+                    chunks[i].state = DEDUP_CHUNK_MISSING;
+                    nmissing++;
+                }
+            }
+        }
+
+        while (line < length && response[line] != '\n') {
+            line++;
+        }
+        line++;
+    }
+
+    return nmissing;
+}
+
+void g_dedup_destination_key(const char* url, unsigned char* key) {
+    struct Sha256 sha256;
+
+    g_checksum_sha256_init(&sha256);
+    g_checksum_sha256_update(&sha256, url, strlen(url));
+    g_checksum_sha256_final(&sha256, key);
+}
+
+/**
+ * Combine a chunk identifier with a collector's key to give its index entry.
+ */
+void dedup_index_entry(const unsigned char* id, const unsigned char* key, unsigned char* entry) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        entry[i] = id[i] ^ key[i];
+    }
+}
+
+int g_dedup_index_contains(const unsigned char* id, const unsigned char* key) {
+    unsigned char entry[SHA256_DIGEST_LENGTH];
+    size_t bucket;
+
+    dedup_index_entry(id, key, entry);
+    bucket = dedup_index_bucket(entry);
+
+    while (!dedup_is_empty(g_dedup->index[bucket])) {
+        if (memcmp(g_dedup->index[bucket], entry, SHA256_DIGEST_LENGTH) == 0) {
+            return 1;
+        }
+        bucket = (bucket + 1) & (DEDUP_INDEX_CAPACITY - 1);
+    }
+
+    return 0;
+}
+
+void g_dedup_index_add(const unsigned char* id, const unsigned char* key) {
+    unsigned char entry[SHA256_DIGEST_LENGTH];
+
+    dedup_index_entry(id, key, entry);
+    if (!dedup_index_insert(entry)) {
+        return;
+    }
+
+    // No fsync, a lost entry only costs a "have" query next time
+    if (write(g_dedup->index_fd, entry, SHA256_DIGEST_LENGTH) != SHA256_DIGEST_LENGTH) {
+        ERRORV("Could not append to chunk index %s: %s", g_opts->dedup_index, strerror(errno));
+    }
+}
+
+void g_dedup_manifest_init(struct DedupManifest* manifest, const struct DedupChunk* chunks, int nchunks, off_t size) {
+    manifest->chunks = chunks;
+    manifest->nchunks = nchunks;
+    manifest->size = size;
+    manifest->next = -1;
+    manifest->nline = 0;
+    manifest->line_offset = 0;
+}
+
+size_t g_dedup_manifest_read(struct DedupManifest* manifest, char* buffer, size_t size) {
+    char hex[DEDUP_HEX_ID_LENGTH + 1];
+    const struct DedupChunk* chunk;
+    size_t ncopy, total = 0;
+
+    while (total < size) {
+        if (manifest->line_offset == manifest->nline) {
+            if (manifest->next == manifest->nchunks) {
+                break;
+            }
+
+            if (manifest->next == -1) {
+                manifest->nline = snprintf(manifest->line, sizeof(manifest->line),
+                                           "salvage-manifest 1\nsize %ld\nchunks %d\n",
+                                           (long) manifest->size, manifest->nchunks);
+            } else {
+                chunk = &manifest->chunks[manifest->next];
+                g_checksum_to_hex(chunk->id, SHA256_DIGEST_LENGTH, hex);
+                manifest->nline = snprintf(manifest->line, sizeof(manifest->line), "%s %ld %ld\n",
+                                           hex, (long) chunk->offset, (long) chunk->length);
+            }
+            manifest->next++;
+            manifest->line_offset = 0;
+        }
+
+        ncopy = manifest->nline - manifest->line_offset;
+        if (ncopy > size - total) {
+            ncopy = size - total;
+        }
+        memcpy(buffer + total, manifest->line + manifest->line_offset, ncopy);
+        manifest->line_offset += ncopy;
+        total += ncopy;
+    }
+
+    return total;
+}
+
+void g_dedup_destroy() {
+    TRACE("g_dedup_destroy()");
+
+    if (g_dedup->index_fd != -1 && close(g_dedup->index_fd) != 0) {
+        ERRORV("Could not close chunk index %s: %s", g_opts->dedup_index, strerror(errno));
+    }
+    g_dedup->index_fd = -1;
+}
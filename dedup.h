@@ -0,0 +1,226 @@
+#ifndef JETSAM_DEDUP_H
+#define JETSAM_DEDUP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "checksum.h"
+
+/**
+ * Chunks are never cut shorter than this, except at the end of a file.
+ */
+#define DEDUP_MIN_CHUNK_SIZE (32 * 1024)
+
+/**
+ * Chunks are always cut at this size if no content-defined boundary was found.
+ */
+#define DEDUP_MAX_CHUNK_SIZE (512 * 1024)
+
+/**
+ * Rolling hash bits that must be zero for a boundary, giving a 128KiB average chunk.
+ */
+#define DEDUP_BOUNDARY_MASK (((1ULL << 17) - 1) << 47)
+
+/**
+ * Maximum chunks in one file.  Bigger files are uploaded without deduplication.
+ */
+#define DEDUP_MAX_CHUNKS 16384
+
+/**
+ * Maximum chunk identifiers remembered in the local index, must be a power of two.
+ */
+#define DEDUP_INDEX_CAPACITY 16384
+
+/**
+ * Maximum chunk identifiers asked about in a single "have" query.
+ */
+#define DEDUP_HAVE_BATCH 512
+
+/**
+ * Length of a hexadecimal chunk identifier, excluding terminator.
+ */
+#define DEDUP_HEX_ID_LENGTH (SHA256_DIGEST_LENGTH * 2)
+
+/**
+ * What is known about a chunk being uploaded.
+ */
+enum DedupChunkState {
+    /**
+     * Not in the local index, the collector must be asked.
+     */
+    DEDUP_CHUNK_UNKNOWN = 0,
+
+    /**
+     * The collector already has this chunk.
+     */
+    DEDUP_CHUNK_PRESENT,
+
+    /**
+     * The collector does not have this chunk, so it must be uploaded.
+     */
+    DEDUP_CHUNK_MISSING
+};
+
+/**
+ * A content-defined chunk of a file.
+ */
+struct DedupChunk {
+    /**
+     * Offset of the chunk in the file.
+     */
+    off_t offset;
+
+    /**
+     * Length of the chunk in bytes.
+     */
+    size_t length;
+
+    /**
+     * SHA-256 of the chunk contents.
+     */
+    unsigned char id[SHA256_DIGEST_LENGTH];
+
+    /**
+     * DedupChunkState value.
+     */
+    int state;
+};
+
+/**
+ * Streaming renderer of a file manifest.
+ */
+struct DedupManifest {
+    /**
+     * Chunks making up the file, in order.
+     */
+    const struct DedupChunk* chunks;
+
+    /**
+     * Number of chunks.
+     */
+    int nchunks;
+
+    /**
+     * Total file size.
+     */
+    off_t size;
+
+    /**
+     * Next chunk to render, or -1 if the header has not been rendered.
+     */
+    int next;
+
+    /**
+     * Current rendered line.
+     */
+    char line[128];
+
+    /**
+     * Length of the current rendered line.
+     */
+    size_t nline;
+
+    /**
+     * Bytes of the current line already returned.
+     */
+    size_t line_offset;
+};
+
+/**
+ * Initialize the deduplication subsystem and load the local chunk index named in the CLI options.
+ */
+void g_dedup_init();
+
+/**
+ * Derive the key distinguishing one collector's entries in the local index from another's.
+ * @param url base URL of the collector
+ * @param key receives SHA256_DIGEST_LENGTH bytes
+ */
+void g_dedup_destination_key(const char* url, unsigned char* key);
+
+/**
+ * Split the start of a file into content-defined chunks, which cover exactly that many bytes however the file grows.
+ * @param fd open file descriptor, read from offset 0 with pread()
+ * @param size bytes to chunk, as the file's size was when examined
+ * @param chunks receives a pointer to the chunks, valid until the next call
+ * @return number of chunks, or -1 if the file could not be read, is now shorter than size, or has more than
+ *         DEDUP_MAX_CHUNKS chunks
+ */
+int g_dedup_chunk_file(int fd, off_t size, struct DedupChunk** chunks);
+
+/**
+ * Mark chunks found in the local index for a collector as present, and all others as unknown.
+ * @param chunks chunks of the file
+ * @param nchunks number of chunks
+ * @param key the collector's key from g_dedup_destination_key
+ */
+void g_dedup_prepare(struct DedupChunk* chunks, int nchunks, const unsigned char* key);
+
+/**
+ * Read a chunk back from a file, verifying it has not changed since it was chunked.
+ * @param fd open file descriptor
+ * @param chunk the chunk to read
+ * @return pointer to chunk->length bytes valid until the next call, or NULL if unreadable or changed
+ */
+const char* g_dedup_read_chunk(int fd, const struct DedupChunk* chunk);
+
+/**
+ * Render the next "have" query body, one hexadecimal identifier per line, for unknown chunks.  Chunks included are
+ * marked present, on the assumption that the response lists the missing ones.
+ * @param chunks chunks of the file
+ * @param nchunks number of chunks
+ * @param cursor chunk to continue from, updated on return
+ * @param length receives the body length
+ * @return the body, valid until the next call, or NULL if no unknown chunks remain
+ */
+const char* g_dedup_have_request(struct DedupChunk* chunks, int nchunks, int* cursor, size_t* length);
+
+/**
+ * Apply a "have" query response, one hexadecimal identifier per line of chunks the collector is missing.
+ * @param chunks chunks of the file
+ * @param nchunks number of chunks
+ * @param response response body
+ * @param length response body length
+ * @return number of chunks marked missing
+ */
+int g_dedup_have_response(struct DedupChunk* chunks, int nchunks, const char* response, size_t length);
+
+/**
+ * Check the local chunk index.
+ * @param id chunk identifier
+ * @param key the collector's key from g_dedup_destination_key
+ * @return 1 if and only if the chunk is known to be held by the collector
+ */
+int g_dedup_index_contains(const unsigned char* id, const unsigned char* key);
+
+/**
+ * Record that a collector holds a chunk, in memory and in the local index file.
+ * @param id chunk identifier
+ * @param key the collector's key from g_dedup_destination_key
+ */
+void g_dedup_index_add(const unsigned char* id, const unsigned char* key);
+
+/**
+ * Start rendering a manifest.
+ * @param manifest manifest state to initialize
+ * @param chunks chunks of the file, in order
+ * @param nchunks number of chunks
+ * @param size total file size
+ */
+void g_dedup_manifest_init(struct DedupManifest* manifest, const struct DedupChunk* chunks, int nchunks, off_t size);
+
+/**
+ * Render more of a manifest.
+ * @param manifest manifest state
+ * @param buffer receives manifest text
+ * @param size maximum bytes to render
+ * @return bytes rendered, 0 at end of manifest
+ */
+size_t g_dedup_manifest_read(struct DedupManifest* manifest, char* buffer, size_t size);
+
+/**
+ * Clean up the deduplication subsystem.
+ */
+void g_dedup_destroy();
+
+#endif //JETSAM_DEDUP_H
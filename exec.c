@@ -1,74 +1,723 @@
+// For environ and posix_spawn_file_actions_addchdir_np()
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "core.h"
+#include "heap.h"
+#include "http.h"
 #include "log.h"
+#include "metrics.h"
+#include "pressure.h"
 #include "opts.h"
+#include "plan.h"
+#include "quiesce.h"
+#include "sampler.h"
+#include "shared.h"
+#include "snapshot.h"
 #include "signal.h"
+#include "trace.h"
 
 /**
- * Flag as to whether a signal has been received.
+ * Maximum events handled per epoll_wait().
  */
-volatile int signal_received = 0;
+#define EXEC_MAX_EVENTS 8
 
 /**
- * The last signal number received.
+ * Longest wait in milliseconds before restarting the child, however many times in a row it is restarted.
  */
-volatile int last_signal = 0;
+#define EXEC_MAX_BACKOFF_MS 60000
 
 /**
- * Simple handler for signals.
+ * Milliseconds a run of the child lasts for it to count as healthy, ending a series of restarts in a row.
  */
-void signal_handler(int signum) {
-    TRACE("sigterm_handler()");
-    INFO("SIGTERM received");
-    signal_received = 1;
-    last_signal = signum;
+#define EXEC_HEALTHY_RUN_MS 60000
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+/**
+ * Our working directory while the child is spawned in another.
+ */
+char spawn_cwd[PATH_MAX];
+#endif
+
+/**
+ * Supervision state of the child process.
+ */
+struct Supervisor {
+    /**
+     * Child process pid.
+     */
+    pid_t child_pid;
+
+    /**
+     * pidfd of the child process, or -1 if pidfds are unsupported and SIGCHLD is relied upon instead.
+     */
+    int pidfd;
+
+    /**
+     * signalfd for SIGTERM, SIGINT and SIGCHLD.
+     */
+    int signalfd;
+
+    /**
+     * epoll instance watching pidfd and signalfd.
+     */
+    int epollfd;
+
+    /**
+     * Signals blocked so they are only delivered through signalfd.
+     */
+    sigset_t signals;
+
+    /**
+     * Signal mask before blocking, restored in the child.
+     */
+    sigset_t original_signals;
+
+    /**
+     * Signal received asking us to terminate, forwarded to the child, or 0.
+     */
+    int terminate_signal;
+
+    /**
+     * When the child is sent SIGKILL if it has not terminated after being forwarded a signal.
+     */
+    struct timespec kill_deadline;
+
+    /**
+     * Whether the child has been sent SIGKILL.
+     */
+    int killed;
+
+    /**
+     * Runs of the child so far.
+     */
+    int runs;
+
+    /**
+     * Environment the child is spawned with, built once for every run, or NULL.
+     */
+    char** envp;
+};
+
+/**
+ * The supervisor instance.
+ */
+struct Supervisor g_supervisor_instance = { .pidfd = -1, .signalfd = -1, .epollfd = -1 };
+
+/**
+ * Pointer to the supervisor instance.
+ */
+struct Supervisor* g_supervisor = &g_supervisor_instance;
+
+/**
+ * What is kept of a run of the child to upload, and its upload in the background while the child is restarted.
+ */
+struct RunUpload {
+    /**
+     * Files held in memory: the child's output, samples and shared memory.
+     */
+    struct VirtualFile files[CAPTURE_STREAMS + 2];
+
+    /**
+     * Number of files held in memory.
+     */
+    int nfiles;
+
+    /**
+     * Whether a run has been handed over and not yet uploaded.
+     */
+    int pending;
+
+    /**
+     * Thread uploading in the background.
+     */
+    pthread_t thread;
+
+    /**
+     * Whether the thread has been started and not yet joined.
+     */
+    int running;
+
+    /**
+     * Heap used once the first run was initialized, rewound to after each upload in the background.
+     */
+    size_t mark;
+};
+
+/**
+ * The run upload instance.
+ */
+struct RunUpload g_run_upload_instance;
+
+/**
+ * Pointer to the run upload instance.
+ */
+struct RunUpload* g_run_upload = &g_run_upload_instance;
+
+/**
+ * Build the child's environment: ours, with variables from the CLI options and for the shared memory added or replaced.
+ * @return null terminated environment, allocated from the heap
+ */
+char** spawn_environment() {
+    const char* shared = g_shared_environment();
+    char** envp;
+    size_t name_length;
+    int nenviron = 0, nenvp = 0, replaced;
+
+    while (environ[nenviron] != NULL) {
+        nenviron++;
+    }
+
+    envp = g_heap_allocate((nenviron + g_opts->nenv + 2) * sizeof(char*));
+    if (envp == NULL) {
+        FATAL(FATAL_ERROR_EXEC_FAILURE, "Could not allocate child environment");
+    }
+
+    for (int i = 0; i < nenviron; i++) {
+        replaced = 0;
+        for (int j = 0; j < g_opts->nenv && !replaced; j++) {
+            name_length = strcspn(g_opts->env[j], "=") + 1;
+            replaced = strncmp(environ[i], g_opts->env[j], name_length) == 0;
+        }
+        if (shared != NULL && !replaced) {
+            name_length = strcspn(shared, "=") + 1;
+            replaced = strncmp(environ[i], shared, name_length) == 0;
+        }
+        if (!replaced) {
+            envp[nenvp++] = environ[i];
+        }
+    }
+
+    for (int j = 0; j < g_opts->nenv; j++) {
+        envp[nenvp++] = g_opts->env[j];
+    }
+    // Its value is updated for each run, as the shared memory changes when restarting
+    if (shared != NULL) {
+        envp[nenvp++] = (char*) shared;
+    }
+    envp[nenvp] = NULL;
+
+    return envp;
 }
 
 /**
- * Fork and execute a program.
+ * Spawn a program with posix_spawn(), which shares our memory with the child until it execs rather than copying page
+ * tables, so launching costs the same however big the locked heap is.
  * @param pathname program to execute
  * @param argv arguments for the program, null terminated.
  * @return child process pid
  */
-pid_t fork_exec(char* pathname, char** argv) {
-    TRACEV("fork_exec(%p = \"%s\", %p)", pathname, pathname, argv);
+pid_t spawn_exec(char* pathname, char** argv) {
+    #define SPAWN_EXEC_CHECK(call)                                                             \
+        error_code = (call);                                                                   \
+        if (error_code != 0) {                                                                 \
+            FATALV(FATAL_ERROR_EXEC_FAILURE, "Failed %s: %s", #call, strerror(error_code));    \
+        }
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t file_actions;
+    sigset_t default_signals;
+    pid_t child_pid;
+    int error_code;
+
+    TRACEV("spawn_exec(%p = \"%s\", %p)", pathname, pathname, argv);
+
+    SPAWN_EXEC_CHECK(posix_spawnattr_init(&attr));
+    SPAWN_EXEC_CHECK(posix_spawn_file_actions_init(&file_actions));
+
+    // The child must receive signals as we were started with, not blocked for our signalfd
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGTERM);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGCHLD);
+    SPAWN_EXEC_CHECK(posix_spawnattr_setsigmask(&attr, &g_supervisor->original_signals));
+    SPAWN_EXEC_CHECK(posix_spawnattr_setsigdefault(&attr, &default_signals));
+    SPAWN_EXEC_CHECK(posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF));
+
+    if (g_opts->exec_stdin != NULL) {
+        SPAWN_EXEC_CHECK(posix_spawn_file_actions_addopen(&file_actions, STDIN_FILENO, g_opts->exec_stdin,
+                                                          O_RDONLY, 0));
+        DEBUGV("Child stdin is %s", g_opts->exec_stdin);
+    }
+
+    SPAWN_EXEC_CHECK(g_capture_spawn_actions(&file_actions));
+    SPAWN_EXEC_CHECK(g_shared_spawn_actions(&file_actions));
+
+    if (g_opts->exec_directory != NULL) {
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+        SPAWN_EXEC_CHECK(posix_spawn_file_actions_addchdir_np(&file_actions, g_opts->exec_directory));
+#else
+        // Without addchdir the child inherits our directory, so change it around spawning
+        if (getcwd(spawn_cwd, sizeof(spawn_cwd)) == NULL || chdir(g_opts->exec_directory) != 0) {
+            FATALV(FATAL_ERROR_EXEC_FAILURE, "Could not change to %s: %s", g_opts->exec_directory, strerror(errno));
+        }
+#endif
+        DEBUGV("Child directory is %s", g_opts->exec_directory);
+    }
+
+    error_code = posix_spawn(&child_pid, pathname, &file_actions, &attr, argv, g_supervisor->envp);
+    if (error_code != 0) {
+        FATALV(FATAL_ERROR_EXEC_FAILURE, "Could not spawn %s: %s", pathname, strerror(error_code));
+    }
+    g_capture_spawned();
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    if (g_opts->exec_directory != NULL && chdir(spawn_cwd) != 0) {
+        ERRORV("Could not change back to %s: %s", spawn_cwd, strerror(errno));
+    }
+#endif
+
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attr);
+
+    return child_pid;
+}
+
+/**
+ * Open a pidfd for a process.
+ * @param pid the process
+ * @return the pidfd, or -1 if pidfds are unsupported
+ */
+int exec_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+    int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd == -1) {
+        INFOV("pidfd unavailable, relying on SIGCHLD: %s", strerror(errno));
+    }
+    return pidfd;
+#else
+    INFO("pidfd unsupported, relying on SIGCHLD");
+    return -1;
+#endif
+}
 
-    int exec_result;
-    pid_t child_pid = fork();
-    if (child_pid != 0) {
-        return child_pid;
+/**
+ * Send a signal to the child, through its pidfd if possible so it cannot reach a recycled pid.
+ * @param signum the signal
+ */
+void exec_signal_child(int signum) {
+#ifdef SYS_pidfd_send_signal
+    if (g_supervisor->pidfd != -1 && syscall(SYS_pidfd_send_signal, g_supervisor->pidfd, signum, NULL, 0) == 0) {
+        return;
     }
+#endif
+    if (kill(g_supervisor->child_pid, signum) != 0) {
+        ERRORV("Could not send signal %d to child PID %d: %s", signum, g_supervisor->child_pid, strerror(errno));
+    }
+}
 
-    exec_result = execv(pathname, argv);
-    if (exec_result == -1) {
-        FATALV(FATAL_ERROR_EXEC_FAILURE, "Could not exec %s: %s", pathname, strerror(errno));
+/**
+ * Add a file descriptor to the epoll instance.
+ * @param fd the file descriptor to watch
+ * @param events epoll events to watch for
+ */
+void exec_epoll_add(int fd, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.fd = fd };
+
+    if (epoll_ctl(g_supervisor->epollfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Error adding %d to epoll: %s", fd, strerror(errno));
+    }
+}
+
+/**
+ * Remove a file descriptor from the epoll instance.
+ * @param fd the file descriptor to stop watching
+ */
+void exec_epoll_remove(int fd) {
+    if (epoll_ctl(g_supervisor->epollfd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+        ERRORV("Error removing %d from epoll: %s", fd, strerror(errno));
+    }
+}
+
+/**
+ * Milliseconds until the child is killed, rounded up.
+ * @return milliseconds, or -1 if no kill is due
+ */
+int exec_kill_timeout_ms() {
+    struct timespec now;
+    long ms;
+
+    if (g_supervisor->terminate_signal == 0 || g_supervisor->killed) {
+        return -1;
     }
-    // Never reached.
-    FATAL(FATAL_ERROR_UNREACHABLE_CODE_REACHED, "execv() returned something other than -1");
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (g_supervisor->kill_deadline.tv_sec - now.tv_sec) * 1000 +
+         (g_supervisor->kill_deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+    return ms > 0 ? (int) ms : 0;
 }
 
 /**
- * Run configured child process, and send SIGTERM if we are interrupted in any way.
+ * Forward a termination signal to the child, starting the countdown to SIGKILL.
+ * @param signum the signal received
+ */
+void exec_forward_signal(int signum) {
+    int64_t snapshot_us;
+
+    INFOV("Signal %d received, forwarding to child PID: %d", signum, g_supervisor->child_pid);
+    g_metrics_triggered();
+    g_trace_instant("child", "signal", strsignal(signum));
+
+    // Once signalled the child starts tearing itself down, so it is snapshotted first
+    snapshot_us = g_trace_now();
+    g_snapshot_take(g_supervisor->child_pid);
+    g_trace_span("child", "snapshot", NULL, snapshot_us, g_trace_now());
+    exec_signal_child(signum);
+
+    if (g_supervisor->terminate_signal != 0) {
+        return;
+    }
+
+    g_supervisor->terminate_signal = signum;
+    clock_gettime(CLOCK_MONOTONIC, &g_supervisor->kill_deadline);
+    g_supervisor->kill_deadline.tv_sec += g_opts->kill_timeout_ms / 1000;
+    g_supervisor->kill_deadline.tv_nsec += (g_opts->kill_timeout_ms % 1000) * 1000000L;
+    if (g_supervisor->kill_deadline.tv_nsec >= 1000000000L) {
+        g_supervisor->kill_deadline.tv_sec++;
+        g_supervisor->kill_deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Give back the heap an upload in the background used, its CURL handles being closed, and open them again for uploading
+ * early or after the last run.
+ */
+void exec_upload_rewind() {
+    DEBUGV("Run upload used %zu bytes of heap", g_heap_used() - g_run_upload->mark);
+    g_heap_rewind(g_run_upload->mark);
+
+    if (!g_http_open()) {
+        ERRORV("Could not open CURL handles again, %zu of %zu bytes of heap used", g_heap_used(), g_heap_size());
+    }
+}
+
+/**
+ * Wait for the upload of the previous run in the background, if any.
+ * @param block whether to wait for it to finish, rather than only checking whether it has
+ * @return 1 if and only if no upload is running in the background
+ */
+int exec_upload_join(int block) {
+    int error_code;
+
+    if (!g_run_upload->running) {
+        return 1;
+    }
+
+    error_code = block ? pthread_join(g_run_upload->thread, NULL) : pthread_tryjoin_np(g_run_upload->thread, NULL);
+    if (error_code == EBUSY) {
+        return 0;
+    }
+    if (error_code != 0) {
+        ERRORV("Could not finish uploading in the background: %s", strerror(error_code));
+    }
+    g_run_upload->running = 0;
+    exec_upload_rewind();
+
+    return 1;
+}
+
+/**
+ * Act on memory pressure crossing the threshold: record a sample, and start uploading while the child still runs in
+ * case it is OOM killed.
+ */
+void exec_memory_pressure() {
+    g_sampler_snapshot();
+
+    // Uploads run one at a time, and the previous run's upload is of the same files anyway
+    if (!exec_upload_join(0)) {
+        INFOV("Memory pressure on child PID %d, still uploading the previous run", g_supervisor->child_pid);
+        return;
+    }
+
+    INFOV("Memory pressure on child PID %d, uploading early", g_supervisor->child_pid);
+    if (g_opts->max_restarts > 0) {
+        g_http_name_run(g_supervisor->runs + 1);
+    }
+    g_http_upload_files_start();
+}
+
+/**
+ * Hand what was kept of the run over to be uploaded, so a next run keeps its own, named as of the run when restarting.
+ */
+void exec_hand_over() {
+    if (g_opts->max_restarts > 0) {
+        g_http_name_run(g_supervisor->runs);
+    }
+    g_run_upload->nfiles = g_capture_files(g_run_upload->files);
+    g_run_upload->nfiles += g_sampler_file(&g_run_upload->files[g_run_upload->nfiles]);
+    g_run_upload->nfiles += g_shared_file(&g_run_upload->files[g_run_upload->nfiles]);
+    g_run_upload->pending = 1;
+}
+
+/**
+ * Upload what was handed over of a run: the files from the CLI options, the child's output, samples and shared memory,
+ * the snapshot and new core dumps.
+ */
+void exec_upload() {
+    int64_t started_us = g_trace_now();
+    int nuploaded;
+
+    INFO("Uploading files...");
+    nuploaded = g_http_upload_files();
+    if (nuploaded < g_opts->nfiles) {
+        ERRORV("Only uploaded %d of %d files", nuploaded, g_opts->nfiles);
+    }
+
+    if (g_run_upload->nfiles > 0) {
+        INFO("Uploading output, samples and shared memory...");
+        g_http_upload_virtual_files(g_run_upload->files, g_run_upload->nfiles);
+    }
+
+    if (g_opts->snapshot_ms > 0) {
+        INFO("Uploading snapshot...");
+        g_snapshot_upload();
+    }
+
+    if (g_opts->core_directory != NULL) {
+        INFO("Uploading core dumps...");
+        g_core_upload();
+    }
+
+    // Last, so the trace covers the rest of the upload
+    g_trace_span("upload", "upload", NULL, started_us, g_trace_now());
+    if (g_opts->trace_file != NULL) {
+        INFO("Uploading trace...");
+        g_trace_upload();
+    }
+
+    g_run_upload->pending = 0;
+}
+
+/**
+ * Thread uploading a run while the child is restarted.  Neither quiescing nor preparing, which would look at the files
+ * the next run is writing, it uploads the files held when the run was handed over, then releases them.  It opens CURL
+ * handles of its own and closes them, so all it allocated can be rewound once it is joined.
+ * @param arg unused
+ * @return NULL
+ */
+void* exec_upload_thread(void* arg) {
+    TRACEV("exec_upload_thread(%p)", arg);
+
+    if (g_http_open()) {
+        exec_upload();
+    } else {
+        ERRORV("Could not start uploading run %d, %zu of %zu bytes of heap used", g_supervisor->runs, g_heap_used(),
+               g_heap_size());
+    }
+    g_http_close();
+
+    g_plan_release();
+    return NULL;
+}
+
+/**
+ * Start uploading the run handed over in the background, or if that fails, upload it now.
+ */
+void exec_upload_start() {
+    int error_code;
+
+    // Only one set of CURL handles is open at a time, and the upload opens its own
+    g_http_close();
+
+    error_code = pthread_create(&g_run_upload->thread, NULL, &exec_upload_thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not upload in the background, uploading before restarting: %s", strerror(error_code));
+        exec_upload_thread(NULL);
+        exec_upload_rewind();
+        return;
+    }
+    g_run_upload->running = 1;
+}
+
+/**
+ * Wait before restarting the child, unless asked to terminate meanwhile.
+ * @param delay_ms milliseconds to wait
+ * @return 1 if and only if the child is to be restarted
+ */
+int exec_backoff(long delay_ms) {
+    struct timespec timeout = { delay_ms / 1000, (delay_ms % 1000) * 1000000L };
+    sigset_t signals;
+    int signum;
+
+    INFOV("Restarting %s in %ldms", g_opts->exec_pathname, delay_ms);
+
+    // SIGTERM and SIGINT are still blocked from the run, so ones arriving between runs wait here to be taken
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    do {
+        signum = sigtimedwait(&signals, NULL, &timeout);
+    } while (signum == -1 && errno == EINTR);
+
+    if (signum > 0) {
+        INFOV("Signal %d received, not restarting", signum);
+        g_supervisor->terminate_signal = signum;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Milliseconds since a time.
+ * @param since the time, from CLOCK_MONOTONIC
+ * @return milliseconds
+ */
+long exec_elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Log how the child terminated, telling OOM kills apart from other kills.
+ * @param stat status from waitpid()
+ */
+void exec_report_termination(int stat) {
+    if (WIFEXITED(stat)) {
+        INFOV("Child PID %d exited with code %d", g_supervisor->child_pid, WEXITSTATUS(stat));
+    } else if (WTERMSIG(stat) == SIGKILL && !g_supervisor->killed && g_pressure_oom_killed()) {
+        INFOV("Child PID %d was killed by the OOM killer", g_supervisor->child_pid);
+    } else {
+        INFOV("Child PID %d was killed by signal %d (%s)", g_supervisor->child_pid, WTERMSIG(stat),
+              strsignal(WTERMSIG(stat)));
+    }
+}
+
+/**
+ * Reap the child if it has terminated.
+ * @param stat receives the status as per waitpid()
+ * @return 1 if and only if the child was reaped
+ */
+int exec_reap_child(int* stat) {
+    pid_t pid = waitpid(g_supervisor->child_pid, stat, WNOHANG);
+
+    if (pid == -1) {
+        FATALV(FATAL_ERROR_SIGNAL_EXEC, "Waiting on child failed: %s", strerror(errno));
+    }
+
+    return pid == g_supervisor->child_pid;
+}
+
+/**
+ * Run configured child process until it terminates, forwarding SIGTERM and SIGINT to it and sending SIGKILL if it
+ * does not terminate in time.  Everything is delivered through one epoll instance, so nothing is missed however
+ * signals and termination interleave.
  * @return status of child process as per waitpid()
  */
 int run_child_process() {
-    int stat;
+    struct epoll_event events[EXEC_MAX_EVENTS];
+    struct signalfd_siginfo siginfo;
+    int stat = 0;
+    int nevents;
 
     TRACE("run_child_process()");
 
-    int child_pid = fork_exec(g_opts->exec_pathname, g_opts->exec_args);
-    INFOV("Child PID: %d", child_pid);
+    g_supervisor->child_pid = spawn_exec(g_opts->exec_pathname, g_opts->exec_args);
+    INFOV("Child PID: %d", g_supervisor->child_pid);
+
+    g_supervisor->pidfd = exec_pidfd_open(g_supervisor->child_pid);
+    if (g_supervisor->pidfd != -1) {
+        exec_epoll_add(g_supervisor->pidfd, EPOLLIN);
+    }
+
+    for (int s = 0; s < 2; s++) {
+        if (g_capture_fd(s) != -1) {
+            exec_epoll_add(g_capture_fd(s), EPOLLIN);
+        }
+    }
+
+    if (g_sampler_start(g_supervisor->child_pid) != -1) {
+        exec_epoll_add(g_sampler_fd(), EPOLLIN);
+    }
+
+    if (g_plan_fd() != -1) {
+        exec_epoll_add(g_plan_fd(), EPOLLIN);
+    }
+
+    g_pressure_start(g_supervisor->child_pid);
+    for (int w = 0; w < PRESSURE_WATCHES; w++) {
+        if (g_pressure_fd(w) != -1) {
+            exec_epoll_add(g_pressure_fd(w), g_pressure_events(w));
+        }
+    }
+
+    // The child may have terminated before the pidfd was opened, in which case SIGCHLD is already pending
+    while (!exec_reap_child(&stat)) {
+        nevents = epoll_wait(g_supervisor->epollfd, events, EXEC_MAX_EVENTS, exec_kill_timeout_ms());
+        if (nevents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FATALV(FATAL_ERROR_SIGNAL_EXEC, "Error waiting on epoll: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].data.fd == g_supervisor->pidfd) {
+                TRACE("pidfd readable");
+                continue;
+            }
 
-    if (waitpid(child_pid, &stat, 0) == -1) {
-        INFOV("Waiting on child failed: %s", strerror(errno));
-        if (signal_received && last_signal == SIGTERM) {
-            INFOV("SIGTERM received, terminating child PID: %d", child_pid);
-            kill(child_pid, SIGTERM);
+            if (events[i].data.fd == g_sampler_fd()) {
+                g_sampler_sample();
+                continue;
+            }
+
+            if (events[i].data.fd == g_plan_fd()) {
+                g_plan_refresh();
+                continue;
+            }
+
+            for (int w = 0; w < PRESSURE_WATCHES; w++) {
+                if (events[i].data.fd == g_pressure_fd(w) && g_pressure_check(w)) {
+                    exec_memory_pressure();
+                }
+            }
+
+            if (events[i].data.fd != g_supervisor->signalfd) {
+                for (int s = 0; s < 2; s++) {
+                    if (events[i].data.fd == g_capture_fd(s) && !g_capture_drain(s)) {
+                        exec_epoll_remove(events[i].data.fd);
+                    }
+                }
+                continue;
+            }
+
+            while (read(g_supervisor->signalfd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+                DEBUGV("Signal %u received", siginfo.ssi_signo);
+                if (siginfo.ssi_signo == SIGTERM || siginfo.ssi_signo == SIGINT) {
+                    exec_forward_signal((int) siginfo.ssi_signo);
+                }
+            }
         }
+
+        if (exec_kill_timeout_ms() == 0) {
+            INFOV("Child PID %d did not terminate within %dms, sending SIGKILL", g_supervisor->child_pid,
+                  g_opts->kill_timeout_ms);
+            exec_signal_child(SIGKILL);
+            g_supervisor->killed = 1;
+        }
+    }
+
+    if (g_supervisor->pidfd != -1 && close(g_supervisor->pidfd) != 0) {
+        ERRORV("Could not close pidfd: %s", strerror(errno));
     }
+    g_supervisor->pidfd = -1;
 
     return stat;
 }
@@ -93,34 +742,155 @@ int is_abnormal_termination(int stat) {
 }
 
 /**
- * Execute the child process as provided in the CLI options.
- * @return 1 if and only if the child process terminated abnormally.
+ * Block termination signals and SIGCHLD, and watch for them with signalfd and epoll.
+ */
+void exec_supervisor_init() {
+    sigemptyset(&g_supervisor->signals);
+    sigaddset(&g_supervisor->signals, SIGTERM);
+    sigaddset(&g_supervisor->signals, SIGINT);
+    sigaddset(&g_supervisor->signals, SIGCHLD);
+
+    // Passing captured output through to a closed stream then fails with EPIPE rather than killing us
+    sigaddset(&g_supervisor->signals, SIGPIPE);
+
+    // Signals stay blocked between runs, so the mask before the first is the one every child is spawned with
+    if (sigprocmask(SIG_BLOCK, &g_supervisor->signals,
+                    g_supervisor->runs == 0 ? &g_supervisor->original_signals : NULL) != 0) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Error blocking signals: %s", strerror(errno));
+    }
+
+    g_supervisor->signalfd = signalfd(-1, &g_supervisor->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (g_supervisor->signalfd == -1) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Error creating signalfd: %s", strerror(errno));
+    }
+
+    g_supervisor->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_supervisor->epollfd == -1) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Error creating epoll: %s", strerror(errno));
+    }
+
+    exec_epoll_add(g_supervisor->signalfd, EPOLLIN);
+}
+
+/**
+ * Close the signalfd and epoll instance, leaving signals blocked so late ones cannot interrupt uploading.
+ */
+void exec_supervisor_destroy() {
+    if (close(g_supervisor->epollfd) != 0) {
+        ERRORV("Could not close epoll: %s", strerror(errno));
+    }
+    g_supervisor->epollfd = -1;
+
+    if (close(g_supervisor->signalfd) != 0) {
+        ERRORV("Could not close signalfd: %s", strerror(errno));
+    }
+    g_supervisor->signalfd = -1;
+}
+
+/**
+ * Execute the child process as provided in the CLI options, restarting it after abnormal termination if configured,
+ * with the previous run uploading in the background while the next starts.
+ * @return 1 if and only if the child process last terminated abnormally.
  */
 int g_exec_child_process() {
-    int stat;
+    struct timespec started;
+    int64_t started_us;
+    long backoff_ms = g_opts->restart_backoff_ms;
+    int stat, abnormal;
+    int nrestarts = 0;
 
     TRACE("g_exec_child_process()");
 
-    INFO("Registering SIGTERM...");
-    if (signal(SIGTERM, &signal_handler) != 0) {
-        FATALV(FATAL_ERROR_SIGNAL_INIT, "Error initializing signal handler: %s", strerror(errno));
-    }
+    for (;;) {
+        g_capture_init();
+        g_sampler_init();
+        g_shared_init();
+        g_snapshot_init();
+        g_core_init();
+
+        // Every run is spawned with the same environment, and what restarting uses of the heap from here on is rewound
+        if (g_supervisor->envp == NULL) {
+            g_supervisor->envp = spawn_environment();
+            g_run_upload->mark = g_heap_mark();
+        }
+
+        INFO("Registering SIGTERM...");
+        exec_supervisor_init();
+
+        INFOV("Running %s...", g_opts->exec_pathname);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        started_us = g_trace_now();
+        stat = run_child_process();
+        g_trace_span("child", "run", g_opts->exec_pathname, started_us, g_trace_now());
+        g_supervisor->runs++;
+        g_capture_finish();
+        g_sampler_stop();
+        exec_supervisor_destroy();
 
-    INFOV("Running %s...", g_opts->exec_pathname);
-    stat = run_child_process();
+        DEBUGV("Child process status: %d", stat);
+        exec_report_termination(stat);
+        g_pressure_stop();
+        g_http_upload_files_wait();
+        exec_upload_join(1);
 
-    DEBUGV("Child process status: %d", stat);
+        abnormal = g_supervisor->terminate_signal != 0 || is_abnormal_termination(stat);
+        if (abnormal) {
+            g_metrics_triggered();
+        }
+        if (!abnormal || g_supervisor->terminate_signal != 0 || g_opts->max_restarts == 0) {
+            break;
+        }
+
+        if (exec_elapsed_ms(&started) >= EXEC_HEALTHY_RUN_MS) {
+            nrestarts = 0;
+            backoff_ms = g_opts->restart_backoff_ms;
+        }
+        if (nrestarts == g_opts->max_restarts) {
+            INFOV("Restarted %s %d times in a row, giving up", g_opts->exec_pathname, nrestarts);
+            break;
+        }
+
+        // The run uploads while waiting to restart and during the next run, which keeps its own output and samples and
+        // writes the files past the sizes held
+        exec_hand_over();
+        g_plan_hold();
+        exec_upload_start();
+        if (!exec_backoff(backoff_ms)) {
+            exec_upload_join(1);
+            return 1;
+        }
+
+        nrestarts++;
+        if (backoff_ms < EXEC_MAX_BACKOFF_MS) {
+            backoff_ms = backoff_ms * 2 < EXEC_MAX_BACKOFF_MS ? backoff_ms * 2 : EXEC_MAX_BACKOFF_MS;
+        }
+        INFOV("Restart %d/%d of %s", nrestarts, g_opts->max_restarts, g_opts->exec_pathname);
+    }
 
-    if (!is_abnormal_termination(stat)) {
+    if (!abnormal) {
         INFO("Normal termination detected, finished");
         return 0;
     }
 
+    // Quiescing files can be read, and destinations connected to, while they settle
     if (g_opts->quiesce_secs > 0) {
-        INFOV("Waiting %d seconds to quiesce", g_opts->quiesce_secs);
-        sleep(g_opts->quiesce_secs);
+        g_http_prepare_start();
     }
+    g_quiesce_wait();
+    g_http_prepare_stop();
+    exec_hand_over();
 
     DEBUG("Abmornal termination");
     return 1;
-}
\ No newline at end of file
+}
+
+void g_exec_upload() {
+    TRACE("g_exec_upload()");
+
+    if (!g_run_upload->pending) {
+        INFO("Already uploaded in the background");
+        return;
+    }
+
+    exec_upload();
+}
@@ -6,9 +6,14 @@
 #define JETSAM_EXEC_H
 
 /**
- * Execute the configured child process.
+ * Execute the configured child process, restarting it after abnormal termination if configured.
  * @return exit code of child process, or -1 if not exited/terminated.
  */
 int g_exec_child_process();
 
+/**
+ * Upload what was kept of the last run of the child process, unless it was uploaded in the background already.
+ */
+void g_exec_upload();
+
 #endif //JETSAM_EXEC_H
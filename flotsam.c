@@ -1,10 +1,25 @@
+#include <errno.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
+#include "control.h"
 #include "log.h"
 #include "init.h"
 #include "http.h"
+#include "metrics.h"
 #include "opts.h"
+#include "queue.h"
+#include "trace.h"
 #include "wait.h"
+#include "watch.h"
+
+/**
+ * Most events handled per wait when resident.
+ */
+#define FLOTSAM_MAX_EVENTS 16
 
 /**
  * Number of signals to wait for.
@@ -16,7 +31,101 @@ const int nsignums = 2;
  */
 const int signums[] = { SIGTERM, SIGUSR1 };
 
+/**
+ * Watch a descriptor for input.
+ * @param epoll_fd the epoll instance
+ * @param fd the descriptor
+ */
+void flotsam_epoll_add(int epoll_fd, int fd) {
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        FATALV(FATAL_ERROR_CONTROL_INIT, "Could not watch descriptor %d: %s", fd, strerror(errno));
+    }
+}
+
+/**
+ * Stay resident, queueing uploads on commands from the control socket, as files matching watch patterns are written, or
+ * on SIGUSR1 for the files from the CLI options, until SIGTERM or SIGINT.  Queued uploads left running are cancelled.
+ */
+void flotsam_serve() {
+    struct epoll_event events[FLOTSAM_MAX_EVENTS];
+    struct signalfd_siginfo info;
+    sigset_t mask;
+    int epoll_fd, signal_fd, fd, nevents, job;
+    int listen_fd = -1, watch_fd = -1;
+    int serving = 1;
+
+    TRACE("flotsam_serve()");
+
+    // Blocked before the uploading thread starts, so it inherits the mask and the signals arrive at the signalfd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Could not block signals: %s", strerror(errno));
+    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || epoll_fd == -1) {
+        FATALV(FATAL_ERROR_SIGNAL_INIT, "Could not watch for signals: %s", strerror(errno));
+    }
+
+    flotsam_epoll_add(epoll_fd, signal_fd);
+    if (g_opts->control_socket != NULL) {
+        listen_fd = g_control_open();
+        flotsam_epoll_add(epoll_fd, listen_fd);
+    }
+    if (g_opts->nwatches > 0) {
+        watch_fd = g_watch_open();
+        flotsam_epoll_add(epoll_fd, watch_fd);
+    }
+
+    // Last, as jobs rewind the heap to where it was once everything else was allocated
+    g_queue_init();
+
+    INFO("Waiting for commands...");
+    while (serving) {
+        // Written files are queued in bursts, waking once the burst is over
+        nevents = epoll_wait(epoll_fd, events, FLOTSAM_MAX_EVENTS, g_watch_flush());
+        if (nevents == -1 && errno != EINTR) {
+            ERRORV("Could not wait for commands: %s", strerror(errno));
+            break;
+        }
+
+        for (int e = 0; e < nevents; e++) {
+            fd = events[e].data.fd;
+            if (fd == listen_fd) {
+                while ((fd = g_control_accept()) != -1) {
+                    flotsam_epoll_add(epoll_fd, fd);
+                }
+            } else if (fd == watch_fd) {
+                g_watch_handle();
+            } else if (fd != signal_fd) {
+                // Closing the client's socket also stops watching it
+                g_control_handle(fd);
+            } else if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGUSR1) {
+                    INFOV("Signal %u received, stopping", info.ssi_signo);
+                    serving = 0;
+                } else if (g_opts->nfiles > 0) {
+                    job = g_queue_add(g_opts->files, g_opts->nfiles);
+                    INFOV("SIGUSR1 received, queued as job %d", job);
+                }
+            }
+        }
+    }
+
+    g_watch_close();
+    g_control_close();
+    g_queue_destroy();
+    close(epoll_fd);
+    close(signal_fd);
+}
+
 int main(int argc, char* argv[]) {
+    int64_t started_us;
     int looping = 1;
     int nuploaded;
     int signum;
@@ -25,13 +134,21 @@ int main(int argc, char* argv[]) {
     INFO("Initializing...");
     g_init(argc, argv);
 
-    INFO("Waiting for signal...");
+    if (g_opts->control_socket != NULL || g_opts->nwatches > 0) {
+        flotsam_serve();
+        looping = 0;
+    } else {
+        INFO("Waiting for signal...");
+    }
     while (looping) {
         signum = g_wait_for_signal(nsignums, signums);
         switch (signum) {
             case SIGUSR1:
                 INFO("SIGUSR1 received, uploading");
+                g_metrics_triggered();
+                started_us = g_trace_now();
                 nuploaded = g_http_upload_files();
+                g_trace_span("upload", "upload", NULL, started_us, g_trace_now());
                 if (nuploaded < g_opts->nfiles) {
                     ERRORV("Only uploaded %d of %d files", nuploaded, g_opts->nfiles);
                 }
@@ -28,6 +28,11 @@ struct Heap {
      */
     volatile size_t used;
 
+    /**
+     * Most bytes ever consumed of the heap, however far it was rewound since.
+     */
+    volatile size_t high_water;
+
     /**
      * Pointer to start of heap memory.
      */
@@ -75,6 +80,7 @@ void g_heap_init() {
     g_heap->size = realigned_size;
     g_heap->memory = memory;
     g_heap->used = 0;
+    g_heap->high_water = 0;
 }
 
 void* g_heap_allocate(size_t size) {
@@ -108,6 +114,9 @@ void* g_heap_allocate(size_t size) {
 
     result = &g_heap->memory[g_heap->used];
     g_heap->used += realigned_size;
+    if (g_heap->used > g_heap->high_water) {
+        g_heap->high_water = g_heap->used;
+    }
 
     MEMLOGV("Now used %d bytes of heap", g_heap->used);
 
@@ -144,9 +153,14 @@ void* g_heap_emulate_realloc(void* ptr, size_t size) {
         return g_heap_emulate_malloc(size);
     }
 
+    // The old size is unknown, so as many bytes are copied as there are new ones, which the heap always has past ptr,
+    // and they overlap the new ones when ptr was allocated last
     realigned_size = size;
     result = g_heap_allocate(realigned_size);
-    memcpy(result, ptr, realigned_size);
+    if (result == NULL) {
+        return NULL;
+    }
+    memmove(result, ptr, realigned_size);
 
     MEMLOGV("g_heap_emulate_realloc(%p, %ld) -> %p", ptr, size, result);
     return result;
@@ -161,7 +175,11 @@ void* g_heap_emulate_calloc(size_t nmemb, size_t size) {
     realigned_size = realign(size);
     MEMLOGV("%d realigned to %d", size, realigned_size);
 
+    // Memory rewound over is not zeroed
     result = g_heap_allocate(nmemb * realigned_size);
+    if (result != NULL) {
+        memset(result, 0, nmemb * realigned_size);
+    }
 
     MEMLOGV("g_heap_emulate_calloc(%ld, %ld) -> %p", nmemb, size, result);
     return result;
@@ -180,7 +198,9 @@ void* g_heap_emulate_reallocarray(void* ptr, size_t nmemb, size_t size) {
     realigned_size = realign(size);
 
     result = g_heap_allocate(nmemb * realigned_size);
-    memcpy(result, ptr, nmemb * realigned_size);
+    if (result != NULL && ptr != NULL) {
+        memmove(result, ptr, nmemb * realigned_size);
+    }
 
     MEMLOGV("g_heap_emulate_reallocarray(%p, %ld) -> %p", ptr, size, result);
     return result;
@@ -190,6 +210,39 @@ void g_heap_emulate_free(void* ptr) {  // Stubbed.  We do not actually free anyt
     MEMLOGV("g_heap_emulate_free(%p)", ptr);
 }
 
+size_t g_heap_used() {
+    return g_heap->used;
+}
+
+size_t g_heap_high_water() {
+    return g_heap->high_water;
+}
+
+size_t g_heap_mark() {
+    size_t mark;
+
+    pthread_mutex_lock(&g_heap->lock);
+    mark = g_heap->used;
+    pthread_mutex_unlock(&g_heap->lock);
+
+    MEMLOGV("g_heap_mark() -> %zu", mark);
+    return mark;
+}
+
+void g_heap_rewind(size_t mark) {
+    MEMLOGV("g_heap_rewind(%zu)", mark);
+
+    pthread_mutex_lock(&g_heap->lock);
+    if (mark <= g_heap->used) {
+        g_heap->used = mark;
+    }
+    pthread_mutex_unlock(&g_heap->lock);
+}
+
+size_t g_heap_size() {
+    return g_heap->size;
+}
+
 void g_heap_destroy() {
     int error_code;
     TRACE("g_heap_destroy()");
@@ -209,4 +262,5 @@ void g_heap_destroy() {
     g_heap->size = 0;
     g_heap->memory = NULL;
     g_heap->used = 0;
+    g_heap->high_water = 0;
 }
@@ -52,6 +52,34 @@ void* g_heap_emulate_reallocarray(void* ptr, size_t nmemb, size_t size);
  */
 void g_heap_emulate_free(void* ptr);
 
+/**
+ * Bytes of the memory heap allocated so far, which only grows until rewound.
+ */
+size_t g_heap_used();
+
+/**
+ * Most bytes of the memory heap ever allocated at once, which rewinding does not lower.
+ */
+size_t g_heap_high_water();
+
+/**
+ * Mark how much of the memory heap is allocated, to rewind to once what is allocated after is no longer referenced.
+ * @return the mark
+ */
+size_t g_heap_mark();
+
+/**
+ * Release everything allocated since a mark, for reuse.  Nothing allocated since may still be referenced, by any
+ * thread.
+ * @param mark the mark, from g_heap_mark()
+ */
+void g_heap_rewind(size_t mark);
+
+/**
+ * Total bytes of the memory heap.
+ */
+size_t g_heap_size();
+
 /**
  * Destroy the memory heap.
  */
@@ -1,12 +1,23 @@
 #include <curl/curl.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "checksum.h"
+#include "dedup.h"
 #include "heap.h"
 #include "http.h"
+#include "journal.h"
 #include "log.h"
+#include "metrics.h"
 #include "opts.h"
+#include "plan.h"
+#include "trace.h"
 
 /**
  * Upload succeeded.
@@ -29,9 +40,374 @@
 #define MAX_URL_LENGTH 2048
 
 /**
- * CURL instance.
+ * Buffer size for "have" query responses.
  */
-CURL* curl = NULL;
+#define MAX_HAVE_RESPONSE_LENGTH (DEDUP_HAVE_BATCH * (DEDUP_HEX_ID_LENGTH + 2))
+
+/**
+ * Size of the buffer each file is read into once and uploaded to every destination from.  The fastest destination can
+ * get at most this far ahead of the slowest.
+ */
+#define SHARED_BUFFER_SIZE (256 * 1024)
+
+/**
+ * Seconds a transfer may send nothing before it is abandoned, so a stuck destination cannot hold the others back
+ * forever.
+ */
+#define STALL_SECS 30
+
+/**
+ * Milliseconds between adjustments of the send rate and the number of files in flight.
+ */
+#define PACING_INTERVAL_MS 500
+
+/**
+ * The send rate is never cut below this many bytes per second, however many errors are seen.
+ */
+#define PACING_MIN_RATE (64 * 1024)
+
+/**
+ * The send rate grows by this fraction of the ceiling per interval in which it was the bottleneck.
+ */
+#define PACING_RATE_STEPS 16
+
+/**
+ * An upload destination.
+ */
+struct Destination {
+    /**
+     * Base URL.
+     */
+    char* url;
+
+    /**
+     * CURL instance used for requests made one at a time to this destination.
+     */
+    CURL* curl;
+
+    /**
+     * Key for this destination's entries in the local chunk index.
+     */
+    unsigned char dedup_key[SHA256_DIGEST_LENGTH];
+};
+
+/**
+ * A file being read once for uploading to several destinations.
+ */
+struct SharedReader {
+    /**
+     * The open file.
+     */
+    int fd;
+
+    /**
+     * Bytes to upload, fixed when the file is opened.
+     */
+    off_t size;
+
+    /**
+     * Ring buffer of SHARED_BUFFER_SIZE bytes, the byte at file offset N being at N % SHARED_BUFFER_SIZE.
+     */
+    char* buffer;
+
+    /**
+     * File offset read up to.
+     */
+    off_t end;
+
+    /**
+     * errno of a failed read, or 0.
+     */
+    int error;
+
+    /**
+     * Checksums of the data read so far, finished once the whole file has been read.
+     */
+    struct Checksum checksum;
+};
+
+struct SharedUpload;
+
+/**
+ * Upload of a file being read by a SharedReader to one destination.
+ */
+struct Transfer {
+    /**
+     * Where to.
+     */
+    struct Destination* destination;
+
+    /**
+     * Upload this transfer is part of.
+     */
+    struct SharedUpload* upload;
+
+    /**
+     * CURL instance dedicated to this transfer, so transfers of several files can run at once.
+     */
+    CURL* curl;
+
+    /**
+     * File offset sent up to.
+     */
+    off_t offset;
+
+    /**
+     * Whether the transfer is running.
+     */
+    int active;
+
+    /**
+     * Whether the transfer is paused waiting for the reader.
+     */
+    int paused;
+
+    /**
+     * UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE once finished.
+     */
+    int result;
+};
+
+/**
+ * Upload of one file to several destinations at once.
+ */
+struct SharedUpload {
+    /**
+     * Whether a file is being uploaded.
+     */
+    int busy;
+
+    /**
+     * Index of the file in the CLI options.
+     */
+    int file;
+
+    /**
+     * Which destinations the file is being uploaded to, indexed as destinations.
+     */
+    int pending[MAX_URLS];
+
+    /**
+     * Result of stat() on the file before opening it.
+     */
+    int stat_result;
+
+    /**
+     * Status of the file before opening it, to detect changes while uploading.
+     */
+    struct stat file_stat;
+
+    /**
+     * Reader of the file.
+     */
+    struct SharedReader reader;
+
+    /**
+     * Transfers of the file, indexed as destinations.
+     */
+    struct Transfer transfers[MAX_URLS];
+};
+
+/**
+ * Adaptive send rate and concurrency.  Both follow AIMD: they grow additively while uploads go well, and halve as soon
+ * as transfers fail or stall, so uploads back off from a congested network without wasting time when it is idle.
+ */
+struct Pacing {
+    /**
+     * Send rate in bytes per second across all transfers, or 0 if unlimited.
+     */
+    curl_off_t rate;
+
+    /**
+     * Number of files uploaded at once.
+     */
+    int window;
+
+    /**
+     * Bytes handed to curl across all transfers.
+     */
+    curl_off_t sent;
+
+    /**
+     * Value of sent at the start of the interval.
+     */
+    curl_off_t interval_sent;
+
+    /**
+     * Start of the interval.
+     */
+    struct timespec interval_start;
+
+    /**
+     * Transfers that failed recoverably during the interval.
+     */
+    int errors;
+
+    /**
+     * Transfers that succeeded during the interval.
+     */
+    int completions;
+};
+
+/**
+ * CURL multi instance running transfers to all destinations at once.
+ */
+CURLM* multi = NULL;
+
+/**
+ * Destinations from the CLI options.
+ */
+struct Destination destinations[MAX_URLS];
+
+/**
+ * Uploads that can run at once, up to the CLI options' maximum.
+ */
+struct SharedUpload shared_uploads[MAX_PARALLEL];
+
+/**
+ * The pacing instance.
+ */
+struct Pacing pacing;
+
+/**
+ * Connection and DNS caches shared by every CURL instance, so connections made by one are reused by the others.
+ */
+CURLSH* share = NULL;
+
+/**
+ * Locks for the shared caches, indexed by curl_lock_data.
+ */
+pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/**
+ * Files opened ahead of uploading, indexed as files in the CLI options, or -1.
+ */
+int prepared_fds[MAX_FILES];
+
+/**
+ * Thread preparing uploads while the files quiesce.
+ */
+pthread_t prepare_thread;
+
+/**
+ * Whether the preparation thread was started and not yet joined.
+ */
+int prepare_running = 0;
+
+/**
+ * Thread uploading files while the child is still running.
+ */
+pthread_t early_upload_thread;
+
+/**
+ * Whether the early upload thread was started and not yet joined.
+ */
+int early_upload_running = 0;
+
+/**
+ * Set to ask the preparation thread to stop, and abandon chunk uploads it is making.
+ */
+atomic_int prepare_stopping = 0;
+
+/**
+ * Set to cancel the list of files being uploaded, aborting its transfers, or NULL if it cannot be cancelled.
+ */
+atomic_int* upload_cancel = NULL;
+
+/**
+ * Whether the list of files being uploaded is the CLI options', uploaded by their plan without looking paths up.
+ */
+int upload_planned = 0;
+
+/**
+ * Path component naming the run files are uploaded as of, /run-N, or empty if not named by run.
+ */
+char upload_run[16] = "";
+
+/**
+ * Headers sent with every request, from the CLI options.  Must outlive every request.
+ */
+struct curl_slist* headers = NULL;
+
+/**
+ * "Trailer" header announcing checksum trailers, followed by the other headers.
+ */
+struct curl_slist trailer_headers;
+
+/**
+ * Buffer for the "Trailer" header.
+ */
+char trailer_header[64];
+
+/**
+ * Buffer for "have" query responses, only allocated when deduplicating.
+ */
+char* have_response = NULL;
+
+/**
+ * Bytes received into have_response.
+ */
+size_t nhave_response = 0;
+
+/**
+ * In-memory data being uploaded.
+ */
+struct MemoryUpload {
+    /**
+     * Data to upload.
+     */
+    const char* data;
+
+    /**
+     * Total bytes to upload.
+     */
+    size_t length;
+
+    /**
+     * Bytes uploaded so far.
+     */
+    size_t offset;
+};
+
+/**
+ * Progress uploading a VirtualFile.
+ */
+struct VirtualUpload {
+    /**
+     * File to upload.
+     */
+    const struct VirtualFile* file;
+
+    /**
+     * Bytes uploaded so far.
+     */
+    size_t offset;
+};
+
+/**
+ * Progress of uploading an ExtentFile.
+ */
+struct ExtentUpload {
+    /**
+     * File to upload.
+     */
+    const struct ExtentFile* file;
+
+    /**
+     * Bytes of the header uploaded so far.
+     */
+    size_t header_offset;
+
+    /**
+     * Extent being uploaded.
+     */
+    int extent;
+
+    /**
+     * Bytes of the extent uploaded so far.
+     */
+    uint64_t extent_offset;
+};
 
 /**
  * List of CURL error codes that are unrecoverable, terminated by CURLE_OK
@@ -116,8 +492,10 @@ void curl_free_callback_fn(void* ptr) {
 char* curl_strdup_callback_fn(const char* str) {
     char* result;
     MEMLOGV("curl_strdup_callback_fn(%p = \"%s\")", str, str);
-    result = g_heap_allocate(strlen(str));
-    strcpy(result, str);
+    result = g_heap_allocate(strlen(str) + 1);
+    if (result != NULL) {
+        strcpy(result, str);
+    }
     return result;
 }
 
@@ -131,187 +509,1983 @@ void* curl_calloc_callback_fn(size_t nmemb, size_t size) {
     return result;
 }
 
-void g_http_init() {
-    #define G_HTTP_INIT_SET_CURL_OPTION(option, value)                                        \
-        curl_code = curl_easy_setopt(curl, (option), (value));                              \
-        if (curl_code != CURLE_OK) {                                                          \
-           FATALV(FATAL_ERROR_HTTP_CURL_INIT, "failed curl_easy_setopt(%s, %s) with code %d", \
-                #option, #value, curl_code);                                                  \
-        }
+/**
+ * curl share lock callback.
+ */
+void http_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+    pthread_mutex_lock(&share_locks[data]);
+}
 
-    CURLcode curl_code;
-    struct curl_slist* headers = NULL;
+/**
+ * curl share unlock callback.
+ */
+void http_share_unlock(CURL* handle, curl_lock_data data, void* userptr) {
+    pthread_mutex_unlock(&share_locks[data]);
+}
 
-    TRACE("g_http_init()");
+/**
+ * curl progress callback noting the first byte sent for metrics, and aborting transfers once the list of files being
+ * uploaded is cancelled.
+ */
+int http_cancel_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                  curl_off_t ulnow) {
+    atomic_int* cancel = upload_cancel;
 
-    curl_code = curl_global_init_mem(0,
-                                     &curl_malloc_callback_fn,
-                                     &curl_free_callback_fn,
-                                     &curl_realloc_callback_fn,
-                                     &curl_strdup_callback_fn,
-                                     &curl_calloc_callback_fn);
-    if (curl_code != CURLE_OK) {
-        FATALV(FATAL_ERROR_HTTP_CURL_INIT, "failed CURL global init with code %d", curl_code);
+    if (ulnow > 0) {
+        g_metrics_sending();
     }
 
+    return cancel != NULL && atomic_load(cancel);
+}
+
+/**
+ * Create a CURL instance with the options every request shares.
+ * @param private CURLOPT_PRIVATE value
+ * @return the instance, or NULL if it could not be created, as when the heap is exhausted
+ */
+CURL* http_easy_init(void* private) {
+    #define HTTP_EASY_INIT_SET_CURL_OPTION(option, value)                                   \
+        curl_code = curl_easy_setopt(curl, (option), (value));                            \
+        if (curl_code != CURLE_OK) {                                                        \
+           ERRORV("failed curl_easy_setopt(%s, %s) with code %d", #option, #value, curl_code); \
+           curl_easy_cleanup(curl);                                                         \
+           return NULL;                                                                     \
+        }
+
+    CURLcode curl_code;
+    CURL* curl;
+
     curl = curl_easy_init();
     if (curl == NULL) {
-        FATAL(FATAL_ERROR_HTTP_CURL_INIT, "failed CURL easy init");
+        ERROR("failed CURL easy init");
+        return NULL;
     }
     TRACEV("created CURL %p", curl);
 
-    for (int i = 0; i < g_opts->nheaders; i++) {
-        headers = curl_slist_append(headers, g_opts->headers[i]);
-        if (headers == NULL) {
-            FATALV(FATAL_ERROR_HTTP_CURL_INIT, "failed adding header: %s", g_opts->headers[i]);
-        }
-        INFOV("added header %s", g_opts->headers[i]);
-    }
-
     if (g_opts->certificate != NULL) {
-        G_HTTP_INIT_SET_CURL_OPTION(CURLOPT_PINNEDPUBLICKEY, g_opts->certificate);
+        HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_PINNEDPUBLICKEY, g_opts->certificate);
         DEBUGV("Pinned public key: %s", g_opts->certificate);
     }
 
-    G_HTTP_INIT_SET_CURL_OPTION(CURLOPT_HTTPHEADER, headers);
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_HTTPHEADER, headers);
     TRACE("Set headers");
 
-    G_HTTP_INIT_SET_CURL_OPTION(CURLOPT_VERBOSE, 1L);
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_VERBOSE, (long) LOG_ENABLED(TRACE));
     TRACE("Set verbose");
 
-    if (headers != NULL) {
-        curl_slist_free_all(headers);
-        TRACE("Freed headers");
-    }
-}
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_PRIVATE, private);
 
-/**
- * Upload a file to the configured location.
- * @param filename file to upload
- * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
- */
-int http_upload(char* filename) {
-    #define G_HTTP_UPLOAD_SET_CURL_OPTION(option, value)                        \
-        curl_code = curl_easy_setopt(curl, (option), (value));                  \
-        if (curl_code != CURLE_OK) {                                            \
-           ERRORV("failed curl_easy_setopt(%s, %s) with code %d",               \
-                #option, #value, curl_code);                                    \
-           return UPLOAD_UNRECOVERABLE_FAILURE;                                 \
-        }
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_SHARE, share);
 
-    char full_url[MAX_URL_LENGTH];
-    FILE* fd;
-    CURLcode curl_code;
-    struct stat fd_stat;
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_XFERINFOFUNCTION, &http_cancel_progress_callback);
+    HTTP_EASY_INIT_SET_CURL_OPTION(CURLOPT_NOPROGRESS, 0L);
 
-    TRACEV("http_upload(%p = \"%s\")", filename, filename);
+    return curl;
+}
 
-    if (snprintf(full_url, MAX_URL_LENGTH,"%s/%s", g_opts->url, filename) == MAX_URL_LENGTH) {
-        ERRORV("%s/%s is too long an URL, max URL size is %d", g_opts->url, filename, MAX_URL_LENGTH);
-        return UPLOAD_UNRECOVERABLE_FAILURE;
-    }
-    INFOV("Uploading %s to %s", filename, full_url);
+int g_http_open() {
+    struct SharedUpload* upload;
 
-    fd = fopen(filename, "rb");
-    if (fd == NULL) {
-        ERRORV("%s could not be opened: %s", filename, strerror(errno));
-        return UPLOAD_UNRECOVERABLE_FAILURE;
+    TRACE("g_http_open()");
+
+    multi = curl_multi_init();
+    if (multi == NULL) {
+        ERROR("failed CURL multi init");
+        return 0;
     }
-    TRACE("File opened");
+    TRACEV("created CURLM %p", multi);
 
-    if (fstat(fileno(fd), &fd_stat) != 0) {
-        ERRORV("%s could not be examined for size: %s", filename, strerror(errno));
+    share = curl_share_init();
+    if (share == NULL) {
+        ERROR("failed CURL share init");
+        return 0;
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &http_share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &http_share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    if (curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+        INFO("CURL cannot share connections, connections made ahead of uploading will not be reused");
+    }
 
-        if (fclose(fd) != 0) {
-            ERRORV("%s could not be closed on stat failure: %s", filename, strerror(errno));
+    for (int d = 0; d < g_opts->nurls; d++) {
+        destinations[d].curl = http_easy_init(NULL);
+        if (destinations[d].curl == NULL) {
+            return 0;
         }
+    }
 
-        return UPLOAD_UNRECOVERABLE_FAILURE;
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        upload = &shared_uploads[u];
+        for (int d = 0; d < g_opts->nurls; d++) {
+            upload->transfers[d].curl = http_easy_init(&upload->transfers[d]);
+            if (upload->transfers[d].curl == NULL) {
+                return 0;
+            }
+        }
     }
-    DEBUGV("File size: %d", fd_stat.st_size);
 
-    G_HTTP_UPLOAD_SET_CURL_OPTION(CURLOPT_URL, full_url);
-    G_HTTP_UPLOAD_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
-    G_HTTP_UPLOAD_SET_CURL_OPTION(CURLOPT_READDATA, fd);
-    G_HTTP_UPLOAD_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE,(curl_off_t)fd_stat.st_size);
+    return 1;
+}
 
-    curl_code = curl_easy_perform(curl);
-    if (curl_code != CURLE_OK) {
-        ERRORV("Upload failed: %s", curl_easy_strerror(curl_code));
+void g_http_close() {
+    TRACE("g_http_close()");
+
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        for (int d = 0; d < g_opts->nurls; d++) {
+            curl_easy_cleanup(shared_uploads[u].transfers[d].curl);
+            shared_uploads[u].transfers[d].curl = NULL;
+        }
     }
-    DEBUGV("curl result: %d", curl_code);
 
-    if (is_unrecoverable_curl_error(curl_code)) {
-        ERROR("curl result was unrecoverable");
-        return UPLOAD_UNRECOVERABLE_FAILURE;
+    for (int d = 0; d < g_opts->nurls; d++) {
+        curl_easy_cleanup(destinations[d].curl);
+        destinations[d].curl = NULL;
     }
 
-    return curl_code == CURLE_OK ? UPLOAD_SUCCESS : UPLOAD_RECOVERABLE_FAILURE;
+    curl_multi_cleanup(multi);
+    multi = NULL;
+
+    curl_share_cleanup(share);
+    share = NULL;
 }
 
-int g_http_upload_files() {
-    char* file;
-    int upload_result;
-    int ndone = 0;
-    int nuploaded = 0;
-    struct {
-        int done;
-        int attempts;
-    } uploads[g_opts->nfiles];
+void g_http_init() {
+    CURLcode curl_code;
+    struct SharedUpload* upload;
 
-    TRACE("g_http_upload_files()");
+    TRACE("g_http_init()");
 
-    bzero(uploads, sizeof(uploads));
+    curl_code = curl_global_init_mem(0,
+                                     &curl_malloc_callback_fn,
+                                     &curl_free_callback_fn,
+                                     &curl_realloc_callback_fn,
+                                     &curl_strdup_callback_fn,
+                                     &curl_calloc_callback_fn);
+    if (curl_code != CURLE_OK) {
+        FATALV(FATAL_ERROR_HTTP_CURL_INIT, "failed CURL global init with code %d", curl_code);
+    }
 
-    while (ndone < g_opts->nfiles) {
-        DEBUGV("%d/%d files done", ndone, g_opts->nfiles);
+    for (int i = 0; i < g_opts->nheaders; i++) {
+        headers = curl_slist_append(headers, g_opts->headers[i]);
+        if (headers == NULL) {
+            FATALV(FATAL_ERROR_HTTP_CURL_INIT, "failed adding header: %s", g_opts->headers[i]);
+        }
+        INFOV("added header %s", g_opts->headers[i]);
+    }
 
-        for (int i = 0; i < g_opts->nfiles; i++) {
-            file = g_opts->files[i];
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
 
-            if (uploads[i].done) {
-                TRACEV("%s done, skipping", g_opts->files[i]);
-                continue;
-            }
+    for (int i = 0; i < MAX_FILES; i++) {
+        prepared_fds[i] = -1;
+    }
 
-            uploads[i].attempts++;
+    for (int d = 0; d < g_opts->nurls; d++) {
+        destinations[d].url = g_opts->urls[d];
+        g_dedup_destination_key(g_opts->urls[d], destinations[d].dedup_key);
+    }
 
-            INFOV("Attempt %d/%d of upload of file %s", uploads[i].attempts, g_opts->max_attempts, file);
-            upload_result = http_upload(file);
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        upload = &shared_uploads[u];
+        upload->reader.fd = -1;
+        upload->reader.buffer = g_heap_allocate(SHARED_BUFFER_SIZE);
+        if (upload->reader.buffer == NULL) {
+            FATAL(FATAL_ERROR_HTTP_CURL_INIT, "failed allocating shared upload buffer");
+        }
 
-            if (upload_result == UPLOAD_RECOVERABLE_FAILURE && uploads[i].attempts < g_opts->max_attempts) {
-                ERRORV("Recoverable error encountered uploading %s, trying again", file);
-                continue;
-            }
+        for (int d = 0; d < g_opts->nurls; d++) {
+            upload->transfers[d].destination = &destinations[d];
+            upload->transfers[d].upload = upload;
+        }
+    }
+    if (!g_http_open()) {
+        FATAL(FATAL_ERROR_HTTP_CURL_INIT, "failed creating CURL instances");
+    }
+    DEBUGV("Prepared %d parallel uploads", g_opts->max_parallel);
 
-            if (upload_result == UPLOAD_RECOVERABLE_FAILURE && uploads[i].attempts == g_opts->max_attempts) {
-                ERRORV("Recoverable error encountered uploading %s, attempts exhausted so not trying again", file);
-                uploads[i].done = 1;
-                ndone++;
-                continue;
-            }
+    if (g_opts->checksums != 0) {
+        snprintf(trailer_header, sizeof(trailer_header), "Trailer: %s%s%s",
+                 g_opts->checksums & CHECKSUM_CRC32C ? "X-Checksum-CRC32C" : "",
+                 g_opts->checksums == (CHECKSUM_CRC32C | CHECKSUM_SHA256) ? ", " : "",
+                 g_opts->checksums & CHECKSUM_SHA256 ? "X-Checksum-SHA256" : "");
+        trailer_headers.data = trailer_header;
+        trailer_headers.next = headers;
+        DEBUGV("Checksum trailers announced with %s", trailer_header);
+    }
 
-            if (upload_result == UPLOAD_UNRECOVERABLE_FAILURE) {
-                ERRORV("Unrecoverable error encountered uploading %s", file);
-            }
+    if (g_opts->dedup_index != NULL) {
+        have_response = g_heap_allocate(MAX_HAVE_RESPONSE_LENGTH);
+        if (have_response == NULL) {
+            FATAL(FATAL_ERROR_HTTP_CURL_INIT, "failed allocating have response buffer");
+        }
+        TRACE("Allocated have response buffer");
+    }
+}
+
+/**
+ * Count a finished request in the metrics, by why it failed if it did.
+ * @param curl the CURL instance that made the request
+ * @param curl_code the curl result
+ */
+void http_count_result(CURL* curl, CURLcode curl_code) {
+    curl_off_t bytes = 0, duration_us = 0;
+    long status = 0;
+    int failure = -1;
+
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &duration_us);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    if (curl_code == CURLE_OPERATION_TIMEDOUT) {
+        failure = METRICS_FAILURE_TIMEOUT;
+    } else if (curl_code == CURLE_ABORTED_BY_CALLBACK) {
+        failure = METRICS_FAILURE_ABORTED;
+    } else if (curl_code != CURLE_OK) {
+        failure = METRICS_FAILURE_TRANSPORT;
+    } else if (status >= 500) {
+        failure = METRICS_FAILURE_SERVER;
+    } else if (status < 200 || status >= 300) {
+        failure = METRICS_FAILURE_CLIENT;
+    }
+
+    g_metrics_finished(failure, (int64_t) bytes, (int64_t) duration_us);
+}
+
+/**
+ * Trace a finished request and its phases, from curl's timings of it.
+ * @param curl the CURL instance that made the request
+ */
+void http_trace_result(CURL* curl) {
+    curl_off_t dns_us = 0, connect_us = 0, tls_us = 0, pretransfer_us = 0, total_us = 0;
+    int64_t start_us;
+    char* url = NULL;
+
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns_us);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+
+    // Timings are from the start of the request, which is now less its total; phases a reused connection skipped are 0
+    start_us = g_trace_now() - total_us;
+    g_trace_span("http", "request", url, start_us, start_us + total_us);
+    if (dns_us > 0) {
+        g_trace_span("http", "dns", url, start_us, start_us + dns_us);
+    }
+    if (connect_us > dns_us) {
+        g_trace_span("http", "connect", url, start_us + dns_us, start_us + connect_us);
+    }
+    if (tls_us > connect_us) {
+        g_trace_span("http", "tls", url, start_us + connect_us, start_us + tls_us);
+    }
+    if (total_us > pretransfer_us && pretransfer_us > 0) {
+        g_trace_span("http", "transfer", url, start_us + pretransfer_us, start_us + total_us);
+    }
+}
+
+/**
+ * Classify the outcome of a finished request by both the curl result and the HTTP status, counting it in the metrics.
+ * @param curl the CURL instance that made the request
+ * @param curl_code the curl result
+ * @param url the URL requested, for logging
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_result(CURL* curl, CURLcode curl_code, const char* url) {
+    long status = 0;
+
+    http_count_result(curl, curl_code);
+    http_trace_result(curl);
+
+    if (curl_code != CURLE_OK) {
+        ERRORV("Request to %s failed: %s", url, curl_easy_strerror(curl_code));
+        if (is_unrecoverable_curl_error(curl_code)) {
+            ERROR("curl result was unrecoverable");
+            return UPLOAD_UNRECOVERABLE_FAILURE;
+        }
+        return UPLOAD_RECOVERABLE_FAILURE;
+    }
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    DEBUGV("HTTP status %ld from %s", status, url);
+
+    if (status >= 200 && status < 300) {
+        return UPLOAD_SUCCESS;
+    }
+
+    ERRORV("HTTP status %ld from %s", status, url);
+    return status >= 500 || status == 408 || status == 429 ? UPLOAD_RECOVERABLE_FAILURE : UPLOAD_UNRECOVERABLE_FAILURE;
+}
+
+/**
+ * Perform the configured request on its own.
+ * @param curl the CURL instance to perform
+ * @param url the URL requested, for logging
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_perform(CURL* curl, const char* url) {
+    g_metrics_started();
+    return http_result(curl, curl_easy_perform(curl), url);
+}
+
+/**
+ * Lowest file offset an active transfer still has to send.
+ * @param upload the upload whose reader is shared by the transfers
+ * @return the lowest offset, or the reader's end if no transfer is active
+ */
+off_t shared_reader_low_water(struct SharedUpload* upload) {
+    off_t low = upload->reader.end;
+
+    for (int d = 0; d < g_opts->nurls; d++) {
+        if (upload->transfers[d].active && upload->transfers[d].offset < low) {
+            low = upload->transfers[d].offset;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Whether the reader can read more of the file without overwriting data an active transfer still needs.
+ */
+int shared_reader_can_fill(struct SharedUpload* upload) {
+    struct SharedReader* reader = &upload->reader;
+
+    return reader->error == 0 && reader->end < reader->size &&
+           reader->end - shared_reader_low_water(upload) < SHARED_BUFFER_SIZE;
+}
+
+/**
+ * Read as much more of the file as fits in the buffer, checksumming it once for all destinations.
+ * @param upload the upload whose reader to fill
+ */
+void shared_reader_fill(struct SharedUpload* upload) {
+    struct SharedReader* reader = &upload->reader;
+    size_t position, space;
+    ssize_t nread;
+
+    if (!shared_reader_can_fill(upload)) {
+        return;
+    }
+
+    position = reader->end % SHARED_BUFFER_SIZE;
+    space = SHARED_BUFFER_SIZE - (size_t) (reader->end - shared_reader_low_water(upload));
+    if (space > SHARED_BUFFER_SIZE - position) {
+        space = SHARED_BUFFER_SIZE - position;
+    }
+    if ((off_t) space > reader->size - reader->end) {
+        space = reader->size - reader->end;
+    }
+
+    nread = pread(reader->fd, reader->buffer + position, space, reader->end);
+    if (nread <= 0) {
+        reader->error = nread == 0 ? EIO : errno;
+        ERRORV("Read failed at %ld: %s", (long) reader->end, nread == 0 ? "file truncated" : strerror(errno));
+        return;
+    }
+    TRACEV("Read %ld bytes at %ld", (long) nread, (long) reader->end);
+
+    if (g_opts->checksums != 0) {
+        g_checksum_update(&reader->checksum, reader->buffer + position, nread);
+    }
+    reader->end += nread;
+
+    if (reader->end == reader->size && g_opts->checksums != 0) {
+        g_checksum_finish(&reader->checksum);
+    }
+}
+
+/**
+ * curl read callback sending a Transfer's data from its upload's SharedReader.
+ */
+size_t transfer_read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    struct Transfer* transfer = userdata;
+    struct SharedReader* reader = &transfer->upload->reader;
+    size_t position, ncopy;
+
+    if (transfer->offset == reader->size) {
+        return 0;
+    }
+
+    if (transfer->offset == reader->end) {
+        shared_reader_fill(transfer->upload);
+
+        if (reader->error != 0) {
+            return CURL_READFUNC_ABORT;
+        }
+
+        if (transfer->offset == reader->end) {
+            // Slower destinations must catch up before the buffer can be refilled
+            transfer->paused = 1;
+            return CURL_READFUNC_PAUSE;
+        }
+    }
+
+    position = transfer->offset % SHARED_BUFFER_SIZE;
+    ncopy = size * nitems;
+    if ((off_t) ncopy > reader->end - transfer->offset) {
+        ncopy = reader->end - transfer->offset;
+    }
+    if (ncopy > SHARED_BUFFER_SIZE - position) {
+        ncopy = SHARED_BUFFER_SIZE - position;
+    }
+
+    memcpy(buffer, reader->buffer + position, ncopy);
+    transfer->offset += ncopy;
+    pacing.sent += ncopy;
+
+    return ncopy;
+}
+
+/**
+ * curl trailer callback sending the checksums of a Transfer's SharedReader, finished by the time the body has been
+ * sent.
+ */
+int checksum_trailer_callback(struct curl_slist** list, void* userdata) {
+    struct Transfer* transfer = userdata;
+    struct Checksum* checksum = &transfer->upload->reader.checksum;
+    char line[CHECKSUM_MAX_HEADER_LENGTH];
+
+    for (int algorithm = CHECKSUM_CRC32C; algorithm <= CHECKSUM_SHA256; algorithm <<= 1) {
+        if ((checksum->algorithms & algorithm) == 0) {
+            continue;
+        }
+
+        g_checksum_header(checksum, algorithm, line, sizeof(line));
+        *list = curl_slist_append(*list, line);
+        if (*list == NULL) {
+            ERROR("failed adding checksum trailer");
+            return CURL_TRAILERFUNC_ABORT;
+        }
+        DEBUGV("Sending trailer %s", line);
+    }
+
+    return CURL_TRAILERFUNC_OK;
+}
+
+/**
+ * Link checksum headers in front of the configured headers, without allocating.
+ * @param checksum finished checksums
+ * @param nodes list nodes for the checksum headers
+ * @param lines buffers for the checksum headers
+ * @return the combined header list
+ */
+struct curl_slist* checksum_headers(const struct Checksum* checksum, struct curl_slist nodes[2],
+                                    char lines[2][CHECKSUM_MAX_HEADER_LENGTH]) {
+    struct curl_slist* list = headers;
+    int nnodes = 0;
+
+    for (int algorithm = CHECKSUM_CRC32C; algorithm <= CHECKSUM_SHA256; algorithm <<= 1) {
+        if ((checksum->algorithms & algorithm) == 0) {
+            continue;
+        }
+
+        g_checksum_header(checksum, algorithm, lines[nnodes], CHECKSUM_MAX_HEADER_LENGTH);
+        nodes[nnodes].data = lines[nnodes];
+        nodes[nnodes].next = list;
+        list = &nodes[nnodes++];
+    }
+
+    return list;
+}
+
+/**
+ * Lowest send rate pacing may choose.
+ */
+curl_off_t pacing_floor() {
+    return g_opts->max_rate < PACING_MIN_RATE ? g_opts->max_rate : PACING_MIN_RATE;
+}
+
+/**
+ * Share the send rate between active transfers.
+ */
+void pacing_apply() {
+    struct Transfer* transfer;
+    curl_off_t share = 0;
+    int nactive = 0;
+
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        for (int d = 0; d < g_opts->nurls; d++) {
+            nactive += shared_uploads[u].transfers[d].active;
+        }
+    }
+
+    if (pacing.rate != 0 && nactive != 0) {
+        share = pacing.rate / nactive > 0 ? pacing.rate / nactive : 1;
+    }
+
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        for (int d = 0; d < g_opts->nurls; d++) {
+            transfer = &shared_uploads[u].transfers[d];
+            if (transfer->active) {
+                curl_easy_setopt(transfer->curl, CURLOPT_MAX_SEND_SPEED_LARGE, share);
+            }
+        }
+    }
+}
+
+/**
+ * Start pacing a round of uploads: half the ceiling rate, one file at a time.
+ */
+void pacing_start() {
+    pacing.rate = g_opts->max_rate / 2 > pacing_floor() ? g_opts->max_rate / 2 : pacing_floor();
+    pacing.window = 1;
+    pacing.sent = 0;
+    pacing.interval_sent = 0;
+    pacing.errors = 0;
+    pacing.completions = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pacing.interval_start);
+
+    if (g_opts->max_rate == 0) {
+        INFOV("Pacing starts without a rate ceiling, %d of up to %d files at once",
+              pacing.window, g_opts->max_parallel);
+    } else {
+        INFOV("Pacing starts at %ld B/s of up to %ld B/s, %d of up to %d files at once",
+              (long) pacing.rate, (long) g_opts->max_rate, pacing.window, g_opts->max_parallel);
+    }
+}
+
+/**
+ * Adjust the send rate and number of files in flight once per PACING_INTERVAL_MS from what happened since.
+ */
+void pacing_update() {
+    struct timespec now;
+    curl_off_t throughput, rate = pacing.rate;
+    int window = pacing.window;
+    long elapsed_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - pacing.interval_start.tv_sec) * 1000 +
+                 (now.tv_nsec - pacing.interval_start.tv_nsec) / 1000000;
+    if (elapsed_ms < PACING_INTERVAL_MS) {
+        return;
+    }
+
+    throughput = (pacing.sent - pacing.interval_sent) * 1000 / elapsed_ms;
+
+    if (pacing.errors > 0) {
+        // Failures and stalls are the only congestion signal available, so back off hard
+        rate = rate / 2 > pacing_floor() ? rate / 2 : pacing_floor();
+        window = window / 2 > 1 ? window / 2 : 1;
+    } else {
+        // Only speed up where the rate limit, rather than the network or the reader, was the bottleneck
+        if (rate != 0 && throughput >= rate * 9 / 10) {
+            rate += g_opts->max_rate / PACING_RATE_STEPS;
+            rate = rate < g_opts->max_rate ? rate : g_opts->max_rate;
+        }
+        if (pacing.completions > 0 && window < g_opts->max_parallel) {
+            window++;
+        }
+    }
+
+    if (rate != pacing.rate || window != pacing.window) {
+        INFOV("Pacing at %ld B/s, %d files at once (measured %ld B/s, %d failed, %d succeeded)",
+              (long) rate, window, (long) throughput, pacing.errors, pacing.completions);
+    } else {
+        DEBUGV("Pacing at %ld B/s, %d files at once (measured %ld B/s)", (long) rate, window, (long) throughput);
+    }
+
+    pacing.rate = rate;
+    pacing.window = window;
+    pacing.interval_sent = pacing.sent;
+    pacing.interval_start = now;
+    pacing.errors = 0;
+    pacing.completions = 0;
+    pacing_apply();
+}
+
+/**
+ * Start a transfer of an open shared reader's file to a destination.
+ * @param transfer the transfer to start
+ * @param filename file being uploaded
+ * @param url URL of the file at the destination from its plan, or NULL to build it
+ */
+void http_transfer_start(struct Transfer* transfer, char* filename, const char* url) {
+    #define HTTP_TRANSFER_START_SET_CURL_OPTION(option, value)                  \
+        curl_code = curl_easy_setopt(curl, (option), (value));                  \
+        if (curl_code != CURLE_OK) {                                            \
+           ERRORV("failed curl_easy_setopt(%s, %s) with code %d",               \
+                #option, #value, curl_code);                                    \
+           return;                                                              \
+        }
+
+    char full_url[MAX_URL_LENGTH];
+    CURL* curl = transfer->curl;
+    CURLcode curl_code;
+    CURLMcode curlm_code;
+
+    if (url == NULL) {
+        if (snprintf(full_url, MAX_URL_LENGTH, "%s%s/%s", transfer->destination->url, upload_run,
+                     filename) >= MAX_URL_LENGTH) {
+            ERRORV("%s%s/%s is too long an URL, max URL size is %d", transfer->destination->url, upload_run, filename,
+                   MAX_URL_LENGTH);
+            return;
+        }
+        url = full_url;
+    }
+    INFOV("Uploading %s to %s", filename, url);
+
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_URL, url);
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_READFUNCTION, &transfer_read_callback);
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_READDATA, transfer);
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_LOW_SPEED_LIMIT, 1L);
+    HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_LOW_SPEED_TIME, (long) STALL_SECS);
+
+    if (g_opts->checksums != 0) {
+        // Checksums are only known once the whole file has been read, so they follow the body as trailers
+        HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, (curl_off_t) -1);
+        HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_HTTPHEADER, &trailer_headers);
+        HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_TRAILERFUNCTION, &checksum_trailer_callback);
+        HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_TRAILERDATA, transfer);
+    } else {
+        HTTP_TRANSFER_START_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, (curl_off_t) transfer->upload->reader.size);
+    }
+
+    curlm_code = curl_multi_add_handle(multi, curl);
+    if (curlm_code != CURLM_OK) {
+        ERRORV("failed curl_multi_add_handle with code %d", curlm_code);
+        return;
+    }
+
+    g_metrics_started();
+    transfer->offset = 0;
+    transfer->paused = 0;
+    transfer->active = 1;
+}
+
+/**
+ * Finish a transfer, accounting for it in pacing.
+ * @param transfer the transfer
+ * @param result UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+void http_transfer_finish(struct Transfer* transfer, int result) {
+    curl_off_t speed = 0;
+
+    curl_multi_remove_handle(multi, transfer->curl);
+    curl_easy_getinfo(transfer->curl, CURLINFO_SPEED_UPLOAD_T, &speed);
+
+    transfer->active = 0;
+    transfer->paused = 0;
+    transfer->result = result;
+
+    if (result == UPLOAD_SUCCESS) {
+        pacing.completions++;
+    } else if (result == UPLOAD_RECOVERABLE_FAILURE) {
+        pacing.errors++;
+    }
+
+    DEBUGV("Transfer to %s finished after %ld bytes at %ld B/s with result %d",
+           transfer->destination->url, (long) transfer->offset, (long) speed, result);
+}
+
+/**
+ * Status of a file being uploaded, from its plan if uploading by plan and it is open there, otherwise by its path.
+ * @param filename the file
+ * @param file index of the file in the list being uploaded, or -1
+ * @param file_stat receives the status
+ * @return 0 on success, -1 on error as per stat()
+ */
+int http_stat(char* filename, int file, struct stat* file_stat) {
+    int result;
+
+    if (upload_planned && file >= 0) {
+        result = g_plan_stat(file, file_stat);
+        // Held files are never looked up by path, which may already be the next run's
+        if (result == 0 || g_plan_holding()) {
+            return result;
+        }
+    }
+
+    return stat(filename, file_stat);
+}
+
+/**
+ * Status of a file being uploaded once open, as it was when held if it is.
+ * @param file index of the file in the list being uploaded, or -1
+ * @param fd the open file
+ * @param file_stat receives the status
+ * @return 0 on success, -1 on error as per fstat()
+ */
+int http_fstat(int file, int fd, struct stat* file_stat) {
+    return upload_planned && file >= 0 ? g_plan_fstat(file, fd, file_stat) : fstat(fd, file_stat);
+}
+
+/**
+ * Open a file being uploaded, from its plan if uploading by plan and it is open there, otherwise by its path.
+ * @param filename the file
+ * @param file index of the file in the list being uploaded, or -1
+ * @return the open file, or -1 on error as per open()
+ */
+int http_open(char* filename, int file) {
+    int fd;
+
+    if (upload_planned && file >= 0) {
+        fd = g_plan_open(file);
+        if (fd != -1 || g_plan_holding()) {
+            return fd;
+        }
+    }
+
+    return open(filename, O_RDONLY);
+}
+
+/**
+ * Take the file descriptor opened ahead of uploading a file, if it is still the file at that path.
+ * @param filename the file
+ * @param file index of the file in the CLI options, or -1
+ * @return the open file, or -1 if it must be opened
+ */
+int http_take_prepared_fd(char* filename, int file) {
+    struct stat fd_stat, path_stat;
+    int fd;
+
+    if (file < 0 || prepared_fds[file] == -1) {
+        return -1;
+    }
+
+    fd = prepared_fds[file];
+    prepared_fds[file] = -1;
+
+    if (fstat(fd, &fd_stat) != 0 || stat(filename, &path_stat) != 0 ||
+            fd_stat.st_dev != path_stat.st_dev || fd_stat.st_ino != path_stat.st_ino) {
+        DEBUGV("%s was replaced since it was opened ahead of uploading", filename);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Open a file and start uploading it to several destinations at once, reading it only once.
+ * @param upload an idle upload
+ * @param filename file to upload
+ * @param file index of the file in the CLI options, or -1
+ * @param pending which destinations to upload to, indexed as destinations
+ */
+void http_upload_start(struct SharedUpload* upload, char* filename, int file, const int* pending) {
+    struct SharedReader* reader = &upload->reader;
+    struct stat fd_stat;
+    int64_t started_us;
+
+    TRACEV("http_upload_start(%p, %p = \"%s\", %d, %p)", upload, filename, filename, file, pending);
+
+    upload->busy = 1;
+    upload->file = file;
+    for (int d = 0; d < g_opts->nurls; d++) {
+        upload->pending[d] = pending[d];
+        upload->transfers[d].result = UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+
+    started_us = g_trace_now();
+    reader->fd = upload_planned ? -1 : http_take_prepared_fd(filename, file);
+    if (reader->fd == -1) {
+        reader->fd = http_open(filename, file);
+    }
+    g_trace_span("file", "open", filename, started_us, g_trace_now());
+    if (reader->fd == -1) {
+        ERRORV("%s could not be opened: %s", filename, strerror(errno));
+        return;
+    }
+    TRACE("File opened");
+
+    if (http_fstat(file, reader->fd, &fd_stat) != 0) {
+        ERRORV("%s could not be examined for size: %s", filename, strerror(errno));
+
+        if (close(reader->fd) != 0) {
+            ERRORV("%s could not be closed on stat failure: %s", filename, strerror(errno));
+        }
+        reader->fd = -1;
+
+        return;
+    }
+    DEBUGV("File size: %ld", (long) fd_stat.st_size);
+
+    reader->size = fd_stat.st_size;
+    reader->end = 0;
+    reader->error = 0;
+    g_checksum_start(&reader->checksum, g_opts->checksums);
+    if (reader->size == 0 && g_opts->checksums != 0) {
+        g_checksum_finish(&reader->checksum);
+    }
+
+    for (int d = 0; d < g_opts->nurls; d++) {
+        if (pending[d]) {
+            // Planned URLs are not named by run
+            http_transfer_start(&upload->transfers[d], filename,
+                                upload_planned && file >= 0 && upload_run[0] == '\0' ? g_plan_url(file, d) : NULL);
+        }
+    }
+
+    pacing_apply();
+}
+
+/**
+ * Whether every transfer of an upload has finished.
+ */
+int http_upload_is_finished(struct SharedUpload* upload) {
+    for (int d = 0; d < g_opts->nurls; d++) {
+        if (upload->transfers[d].active) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Collect the results of a finished upload, making it idle again.
+ * @param upload the finished upload
+ * @param results receives UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE for each pending
+ *                destination
+ */
+void http_upload_collect(struct SharedUpload* upload, int* results) {
+    for (int d = 0; d < g_opts->nurls; d++) {
+        if (upload->pending[d]) {
+            results[d] = upload->transfers[d].result;
+        }
+    }
+
+    if (upload->reader.fd != -1 && close(upload->reader.fd) != 0) {
+        ERRORV("Uploaded file could not be closed: %s", strerror(errno));
+    }
+    upload->reader.fd = -1;
+    upload->busy = 0;
+}
+
+/**
+ * Make progress on every running transfer, waiting for the network if none can progress.
+ */
+void http_multi_step() {
+    struct CURLMsg* message;
+    struct Transfer* transfer;
+    struct SharedUpload* upload;
+    CURLMcode curlm_code;
+    int running, nmessages;
+
+    curlm_code = curl_multi_perform(multi, &running);
+    if (curlm_code != CURLM_OK) {
+        ERRORV("failed curl_multi_perform with code %d", curlm_code);
+
+        for (int u = 0; u < g_opts->max_parallel; u++) {
+            for (int d = 0; d < g_opts->nurls; d++) {
+                if (shared_uploads[u].transfers[d].active) {
+                    http_transfer_finish(&shared_uploads[u].transfers[d], UPLOAD_RECOVERABLE_FAILURE);
+                }
+            }
+        }
+
+        return;
+    }
+
+    while ((message = curl_multi_info_read(multi, &nmessages)) != NULL) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**) &transfer);
+        http_transfer_finish(transfer, http_result(message->easy_handle, message->data.result,
+                                                   transfer->destination->url));
+    }
+
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        upload = &shared_uploads[u];
+
+        for (int d = 0; d < g_opts->nurls; d++) {
+            transfer = &upload->transfers[d];
+            if (transfer->active && transfer->paused &&
+                    (transfer->offset < upload->reader.end || shared_reader_can_fill(upload))) {
+                transfer->paused = 0;
+                curl_easy_pause(transfer->curl, CURLPAUSE_CONT);
+            }
+        }
+    }
+
+    pacing_update();
+
+    if (running > 0) {
+        curlm_code = curl_multi_poll(multi, NULL, 0, PACING_INTERVAL_MS, NULL);
+        if (curlm_code != CURLM_OK) {
+            ERRORV("failed curl_multi_poll with code %d", curlm_code);
+        }
+    }
+}
+
+/**
+ * Upload a file to several destinations at once, reading it only once, and wait for it to finish.
+ * @param filename file to upload
+ * @param file index of the file in the list being uploaded, or -1
+ * @param pending which destinations to upload to, indexed as destinations
+ * @param results receives UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE for each pending
+ *                destination
+ */
+void http_upload(char* filename, int file, const int* pending, int* results) {
+    struct SharedUpload* upload = &shared_uploads[0];
+
+    TRACEV("http_upload(%p = \"%s\", %d, %p, %p)", filename, filename, file, pending, results);
+
+    http_upload_start(upload, filename, file, pending);
+    while (!http_upload_is_finished(upload)) {
+        http_multi_step();
+    }
+    http_upload_collect(upload, results);
+}
+
+/**
+ * curl read callback uploading a MemoryUpload.
+ */
+size_t memory_read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    struct MemoryUpload* upload = userdata;
+    size_t ncopy = size * nitems;
+
+    if (ncopy > upload->length - upload->offset) {
+        ncopy = upload->length - upload->offset;
+    }
+    memcpy(buffer, upload->data + upload->offset, ncopy);
+    upload->offset += ncopy;
+
+    return ncopy;
+}
+
+/**
+ * curl read callback uploading a VirtualUpload.
+ */
+size_t virtual_read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    struct VirtualUpload* upload = userdata;
+    size_t space = size * nitems;
+    size_t position = upload->offset;
+    size_t ncopied = 0, ncopy;
+
+    for (int i = 0; i < VIRTUAL_FILE_PIECES && ncopied < space; i++) {
+        if (position >= upload->file->length[i]) {
+            position -= upload->file->length[i];
+            continue;
+        }
+
+        ncopy = upload->file->length[i] - position;
+        if (ncopy > space - ncopied) {
+            ncopy = space - ncopied;
+        }
+        memcpy(buffer + ncopied, upload->file->data[i] + position, ncopy);
+        ncopied += ncopy;
+        position = 0;
+    }
+    upload->offset += ncopied;
+
+    return ncopied;
+}
+
+/**
+ * curl read callback uploading an ExtentUpload, reading extents with pread so holes between them are never read.
+ */
+size_t extent_read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    struct ExtentUpload* upload = userdata;
+    const struct ExtentFile* file = upload->file;
+    const struct FileExtent* extent;
+    size_t space = size * nitems;
+    uint64_t ncopy;
+    ssize_t nread;
+
+    if (upload->header_offset < file->header_length) {
+        ncopy = file->header_length - upload->header_offset;
+        if (ncopy > space) {
+            ncopy = space;
+        }
+        memcpy(buffer, file->header + upload->header_offset, ncopy);
+        upload->header_offset += ncopy;
+        return ncopy;
+    }
+
+    while (upload->extent < file->nextents && upload->extent_offset == file->extents[upload->extent].length) {
+        upload->extent++;
+        upload->extent_offset = 0;
+    }
+    if (upload->extent == file->nextents) {
+        return 0;
+    }
+
+    extent = &file->extents[upload->extent];
+    ncopy = extent->length - upload->extent_offset;
+    if (ncopy > space) {
+        ncopy = space;
+    }
+
+    // A short file would leave the upload short of the size promised, so it is aborted rather than ended early
+    nread = pread(file->fd, buffer, ncopy, (off_t) (extent->offset + upload->extent_offset));
+    if (nread <= 0) {
+        ERRORV("Could not read %s at %lu: %s", file->name, (unsigned long) (extent->offset + upload->extent_offset),
+               nread == 0 ? "file truncated" : strerror(errno));
+        return CURL_READFUNC_ABORT;
+    }
+    upload->extent_offset += nread;
+
+    return nread;
+}
+
+/**
+ * curl read callback uploading a DedupManifest.
+ */
+size_t manifest_read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    return g_dedup_manifest_read(userdata, buffer, size * nitems);
+}
+
+/**
+ * curl write callback collecting a "have" query response.
+ */
+size_t have_write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    size_t length = size * nmemb;
+
+    if (nhave_response + length > MAX_HAVE_RESPONSE_LENGTH) {
+        ERRORV("Have response longer than %d bytes", MAX_HAVE_RESPONSE_LENGTH);
+        return 0;
+    }
+    memcpy(have_response + nhave_response, ptr, length);
+    nhave_response += length;
+
+    return length;
+}
+
+/**
+ * Set an option on a destination's CURL instance, or fail the request.
+ */
+#define HTTP_DEDUP_SET_CURL_OPTION(option, value)                               \
+    curl_code = curl_easy_setopt(destination->curl, (option), (value));         \
+    if (curl_code != CURLE_OK) {                                                \
+       ERRORV("failed curl_easy_setopt(%s, %s) with code %d",                   \
+            #option, #value, curl_code);                                        \
+       return UPLOAD_UNRECOVERABLE_FAILURE;                                     \
+    }
+
+/**
+ * Ask a destination which of a batch of chunks it is missing.
+ * @param destination the destination
+ * @param body "have" query body from g_dedup_have_request
+ * @param length body length
+ * @param chunks chunks of the file, updated with the response
+ * @param nchunks number of chunks
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_have_query(struct Destination* destination, const char* body, size_t length,
+                    struct DedupChunk* chunks, int nchunks) {
+    char full_url[MAX_URL_LENGTH];
+    CURLcode curl_code;
+    int result;
+
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s/chunks/have", destination->url) >= MAX_URL_LENGTH) {
+        ERRORV("%s/chunks/have is too long an URL, max URL size is %d", destination->url, MAX_URL_LENGTH);
+        return UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+
+    nhave_response = 0;
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_URL, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_UPLOAD, 0L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_POST, 1L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_POSTFIELDS, body);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) length);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_WRITEFUNCTION, &have_write_callback);
+
+    result = http_perform(destination->curl, full_url);
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_WRITEFUNCTION, NULL);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_WRITEDATA, stdout);
+
+    if (result == UPLOAD_SUCCESS) {
+        DEBUGV("%s is missing %d chunks", destination->url,
+               g_dedup_have_response(chunks, nchunks, have_response, nhave_response));
+    }
+
+    return result;
+}
+
+/**
+ * Upload a single chunk to a destination, addressed by its identifier.
+ * @param destination the destination
+ * @param chunk the chunk
+ * @param data the chunk contents
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_upload_chunk(struct Destination* destination, const struct DedupChunk* chunk, const char* data) {
+    char full_url[MAX_URL_LENGTH];
+    char hex[DEDUP_HEX_ID_LENGTH + 1];
+    struct MemoryUpload upload = { data, chunk->length, 0 };
+    struct Checksum checksum;
+    struct curl_slist checksum_nodes[2];
+    char checksum_lines[2][CHECKSUM_MAX_HEADER_LENGTH];
+    CURLcode curl_code;
+    int result;
+
+    g_checksum_to_hex(chunk->id, SHA256_DIGEST_LENGTH, hex);
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s/chunks/%s", destination->url, hex) >= MAX_URL_LENGTH) {
+        ERRORV("%s/chunks/%s is too long an URL, max URL size is %d", destination->url, hex, MAX_URL_LENGTH);
+        return UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+    DEBUGV("Uploading %ld byte chunk to %s", (long) chunk->length, full_url);
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_URL, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READFUNCTION, &memory_read_callback);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READDATA, &upload);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, (curl_off_t) chunk->length);
+
+    if (g_opts->checksums == 0) {
+        return http_perform(destination->curl, full_url);
+    }
+
+    // The chunk is already in memory, so checksums are known up front and sent as headers
+    g_checksum_start(&checksum, g_opts->checksums & ~CHECKSUM_SHA256);
+    g_checksum_update(&checksum, data, chunk->length);
+    g_checksum_finish(&checksum);
+    checksum.algorithms = g_opts->checksums;
+    memcpy(checksum.sha256_digest, chunk->id, SHA256_DIGEST_LENGTH);
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_HTTPHEADER, checksum_headers(&checksum, checksum_nodes, checksum_lines));
+    result = http_perform(destination->curl, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_HTTPHEADER, headers);
+
+    return result;
+}
+
+/**
+ * Upload the manifest describing how a file is assembled from chunks.
+ * @param destination the destination
+ * @param filename the file
+ * @param chunks chunks of the file, in order
+ * @param nchunks number of chunks
+ * @param size file size
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_upload_manifest(struct Destination* destination, char* filename, const struct DedupChunk* chunks,
+                         int nchunks, off_t size) {
+    char full_url[MAX_URL_LENGTH];
+    struct DedupManifest manifest;
+    CURLcode curl_code;
+
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s%s/%s.manifest", destination->url, upload_run,
+                 filename) >= MAX_URL_LENGTH) {
+        ERRORV("%s%s/%s.manifest is too long an URL, max URL size is %d", destination->url, upload_run, filename,
+               MAX_URL_LENGTH);
+        return UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+    INFOV("Uploading manifest of %d chunks to %s", nchunks, full_url);
+
+    g_dedup_manifest_init(&manifest, chunks, nchunks, size);
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_URL, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READFUNCTION, &manifest_read_callback);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READDATA, &manifest);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, (curl_off_t) -1);
+
+    return http_perform(destination->curl, full_url);
+}
+
+/**
+ * Upload chunks a destination does not already have.
+ * @param destination the destination
+ * @param journal the journal entry of the upload, or NULL
+ * @param filename file being uploaded
+ * @param fd the open file
+ * @param chunks chunks of the file
+ * @param nchunks number of chunks
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE, or -1 to upload the file whole
+ */
+int http_send_chunks(struct Destination* destination, struct JournalEntry* journal, char* filename, int fd,
+                     struct DedupChunk* chunks, int nchunks) {
+    const char* body;
+    const char* data;
+    size_t length;
+    int cursor = 0, nuploaded = 0, result;
+
+    g_dedup_prepare(chunks, nchunks, destination->dedup_key);
+
+    while ((body = g_dedup_have_request(chunks, nchunks, &cursor, &length)) != NULL) {
+        result = http_have_query(destination, body, length, chunks, nchunks);
+        if (result == UPLOAD_UNRECOVERABLE_FAILURE) {
+            INFOV("%s does not support chunks, uploading %s whole", destination->url, filename);
+            return -1;
+        }
+        if (result != UPLOAD_SUCCESS) {
+            return result;
+        }
+    }
+
+    for (int i = 0; i < nchunks; i++) {
+        if (chunks[i].state != DEDUP_CHUNK_MISSING) {
+            continue;
+        }
+
+        if (atomic_load(&prepare_stopping)) {
+            return UPLOAD_RECOVERABLE_FAILURE;
+        }
+
+        // Repeated chunks within the file are only uploaded once
+        if (g_dedup_index_contains(chunks[i].id, destination->dedup_key)) {
+            chunks[i].state = DEDUP_CHUNK_PRESENT;
+            continue;
+        }
+
+        data = g_dedup_read_chunk(fd, &chunks[i]);
+        if (data == NULL) {
+            INFOV("%s changed while uploading chunks, uploading whole", filename);
+            return -1;
+        }
+
+        result = http_upload_chunk(destination, &chunks[i], data);
+        if (result != UPLOAD_SUCCESS) {
+            return result;
+        }
+
+        g_dedup_index_add(chunks[i].id, destination->dedup_key);
+        g_journal_acknowledge(journal, chunks[i].length);
+        chunks[i].state = DEDUP_CHUNK_PRESENT;
+        nuploaded++;
+    }
+    INFOV("Uploaded %d of %d chunks of %s to %s", nuploaded, nchunks, filename, destination->url);
+
+    return UPLOAD_SUCCESS;
+}
+
+/**
+ * Upload chunks a destination does not already have, followed by a manifest.
+ * @param destination the destination
+ * @param journal the journal entry of the upload, or NULL
+ * @param filename file being uploaded
+ * @param fd the open file
+ * @param size file size
+ * @param chunks chunks of the file
+ * @param nchunks number of chunks
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE, or -1 to upload the file whole
+ */
+int http_upload_chunks(struct Destination* destination, struct JournalEntry* journal, char* filename, int fd,
+                       off_t size, struct DedupChunk* chunks, int nchunks) {
+    int result = http_send_chunks(destination, journal, filename, fd, chunks, nchunks);
+
+    if (result != UPLOAD_SUCCESS) {
+        return result;
+    }
+
+    return http_upload_manifest(destination, filename, chunks, nchunks, size);
+}
+
+/**
+ * Upload a file as content-defined chunks to several destinations.  The file is chunked once, then each destination
+ * is sent the chunks it is missing in turn.  Falls back to http_upload() for destinations that do not support chunks,
+ * or if the file cannot be chunked.
+ * @param filename file to upload
+ * @param file index of the file in the list being uploaded
+ * @param pending which destinations to upload to, indexed as destinations
+ * @param journal journal entries of the uploads, indexed as destinations, NULL where not journaling
+ * @param results receives UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE for each pending
+ *                destination
+ */
+void http_upload_deduplicated(char* filename, int file, const int* pending, struct JournalEntry** journal,
+                              int* results) {
+    struct DedupChunk* chunks;
+    struct stat fd_stat, chunked_stat;
+    int whole[MAX_URLS] = { 0 };
+    int fd, nchunks, nwhole = 0;
+
+    TRACEV("http_upload_deduplicated(%p = \"%s\", %d, %p, %p, %p)", filename, filename, file, pending, journal,
+           results);
+
+    for (int i = 0; i < g_opts->nurls; i++) {
+        results[i] = UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+
+    fd = http_open(filename, file);
+    if (fd == -1) {
+        ERRORV("%s could not be opened: %s", filename, strerror(errno));
+        return;
+    }
+
+    nchunks = -1;
+    if (http_fstat(file, fd, &fd_stat) != 0) {
+        ERRORV("%s could not be examined for size: %s", filename, strerror(errno));
+    } else {
+        nchunks = g_dedup_chunk_file(fd, fd_stat.st_size, &chunks);
+        if (nchunks >= 0 && (http_fstat(file, fd, &chunked_stat) != 0 || chunked_stat.st_size != fd_stat.st_size ||
+                chunked_stat.st_mtim.tv_sec != fd_stat.st_mtim.tv_sec ||
+                chunked_stat.st_mtim.tv_nsec != fd_stat.st_mtim.tv_nsec)) {
+            INFOV("%s changed while being chunked", filename);
+            nchunks = -1;
+        }
+        if (nchunks < 0) {
+            INFOV("%s could not be chunked, uploading whole", filename);
+        } else {
+            INFOV("%s is %d chunks", filename, nchunks);
+        }
+    }
+
+    for (int i = 0; i < g_opts->nurls; i++) {
+        if (!pending[i]) {
+            continue;
+        }
+
+        results[i] = nchunks < 0 ? -1 : http_upload_chunks(&destinations[i], journal[i], filename, fd,
+                                                           fd_stat.st_size, chunks, nchunks);
+        if (results[i] == -1) {
+            whole[i] = 1;
+            nwhole++;
+        }
+    }
 
-            if (upload_result == UPLOAD_SUCCESS) {
-                INFOV("Success uploading %s", file);
-                nuploaded++;
-            }
+    if (close(fd) != 0) {
+        ERRORV("%s could not be closed: %s", filename, strerror(errno));
+    }
+
+    if (nwhole > 0) {
+        http_upload(filename, file, whole, results);
+    }
+}
+
+/**
+ * curl progress callback aborting requests made ahead of uploading once uploading is due to start.
+ */
+int http_prepare_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                   curl_off_t ulnow) {
+    return atomic_load(&prepare_stopping);
+}
+
+/**
+ * Connect to a destination ahead of uploading, so DNS, TCP and TLS are done with by the time uploading starts.  The
+ * connection is kept in the shared connection cache for the uploads to reuse.
+ * @param destination the destination
+ */
+void http_warm_connection(struct Destination* destination) {
+    char full_url[MAX_URL_LENGTH];
+    CURLcode curl_code;
+
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s/", destination->url) >= MAX_URL_LENGTH) {
+        return;
+    }
+
+    curl_easy_setopt(destination->curl, CURLOPT_URL, full_url);
+    curl_easy_setopt(destination->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(destination->curl, CURLOPT_TIMEOUT, (long) g_opts->quiesce_secs);
+
+    curl_code = curl_easy_perform(destination->curl);
+    DEBUGV("Warmed connection to %s: %s", destination->url, curl_easy_strerror(curl_code));
+
+    curl_easy_setopt(destination->curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(destination->curl, CURLOPT_TIMEOUT, 0L);
+}
+
+/**
+ * Send every chunk of a file but the last, which is probably still growing, to every destination, so only the tail is
+ * left to send when uploading.  Chunk boundaries depend on content, so the same chunks are found again then.
+ * @param filename the file
+ * @param fd the open file
+ */
+void http_prepare_chunks(char* filename, int fd) {
+    struct DedupChunk* chunks;
+    struct stat fd_stat;
+    int nchunks;
+
+    if (fstat(fd, &fd_stat) != 0) {
+        return;
+    }
+    nchunks = g_dedup_chunk_file(fd, fd_stat.st_size, &chunks);
+    if (nchunks < 2) {
+        return;
+    }
+
+    for (int d = 0; d < g_opts->nurls && !atomic_load(&prepare_stopping); d++) {
+        http_send_chunks(&destinations[d], NULL, filename, fd, chunks, nchunks - 1);
+    }
+}
+
+/**
+ * Prepare uploading while the files quiesce: connect to every destination, open every file and start reading it into
+ * the page cache, and send the chunks of deduplicated files that are no longer changing.
+ */
+void* http_prepare_thread(void* arg) {
+    int fd;
+
+    TRACEV("http_prepare_thread(%p)", arg);
+
+    for (int d = 0; d < g_opts->nurls; d++) {
+        curl_easy_setopt(destinations[d].curl, CURLOPT_XFERINFOFUNCTION, &http_prepare_progress_callback);
+        curl_easy_setopt(destinations[d].curl, CURLOPT_NOPROGRESS, 0L);
+    }
+
+    for (int d = 0; d < g_opts->nurls && !atomic_load(&prepare_stopping); d++) {
+        http_warm_connection(&destinations[d]);
+    }
+
+    if (g_opts->pin_files) {
+        g_plan_refresh();
+    }
+
+    for (int i = 0; i < g_opts->nfiles && !atomic_load(&prepare_stopping); i++) {
+        fd = g_opts->pin_files ? g_plan_open(i) : open(g_opts->files[i], O_RDONLY);
+        if (fd == -1) {
+            DEBUGV("%s could not be opened ahead of uploading: %s", g_opts->files[i], strerror(errno));
+            continue;
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+        if (g_opts->dedup_index != NULL) {
+            http_prepare_chunks(g_opts->files[i], fd);
+            close(fd);
+        } else if (g_opts->pin_files) {
+            // Already open in the plan, which uploads take it from
+            close(fd);
+        } else {
+            prepared_fds[i] = fd;
+        }
+    }
+
+    for (int d = 0; d < g_opts->nurls; d++) {
+        curl_easy_setopt(destinations[d].curl, CURLOPT_XFERINFOFUNCTION, &http_cancel_progress_callback);
+    }
+
+    DEBUG("Upload preparation done");
+    return NULL;
+}
+
+void g_http_prepare_start() {
+    int error_code;
+
+    TRACE("g_http_prepare_start()");
+
+    atomic_store(&prepare_stopping, 0);
+    error_code = pthread_create(&prepare_thread, NULL, &http_prepare_thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not start preparing uploads: %s", strerror(error_code));
+        return;
+    }
+    prepare_running = 1;
+}
+
+void g_http_prepare_stop() {
+    int error_code;
+
+    TRACE("g_http_prepare_stop()");
+
+    if (!prepare_running) {
+        return;
+    }
+
+    atomic_store(&prepare_stopping, 1);
+    error_code = pthread_join(prepare_thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not finish preparing uploads: %s", strerror(error_code));
+    }
+    prepare_running = 0;
+    atomic_store(&prepare_stopping, 0);
+}
+
+/**
+ * Progress uploading one file to one destination.
+ */
+struct UploadState {
+    /**
+     * Whether no more attempts will be made.
+     */
+    int done;
+
+    /**
+     * Attempts made so far in this run.
+     */
+    int attempts;
+
+    /**
+     * Whether the upload was given up on.
+     */
+    int failed;
+
+    /**
+     * Journal entry of the upload, or NULL if not journaling.
+     */
+    struct JournalEntry* journal;
+};
+
+/**
+ * Act on the results of an attempt to upload a file.
+ * @param file file that was uploaded
+ * @param index index of the file in the list being uploaded
+ * @param uploads progress uploading the file, indexed as destinations
+ * @param pending which destinations the file was uploaded to, indexed as destinations
+ * @param results UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE for each pending destination
+ * @param stat_result result of stat() on the file before the attempt
+ * @param file_stat status of the file before the attempt
+ * @param sha256 SHA-256 of the file contents, or NULL if not computed
+ * @return number of destinations the file is now done with
+ */
+int http_upload_results(char* file, int index, struct UploadState* uploads, const int* pending, const int* results,
+                        int stat_result, const struct stat* file_stat, const unsigned char* sha256) {
+    struct stat uploaded_stat;
+    int upload_result;
+    int ndone = 0;
+
+    // Only journal completion if the file did not change while uploading, so the next run uploads it again
+    if (stat_result == 0 && (http_stat(file, index, &uploaded_stat) != 0 ||
+            uploaded_stat.st_size != file_stat->st_size ||
+            uploaded_stat.st_mtim.tv_sec != file_stat->st_mtim.tv_sec ||
+            uploaded_stat.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec)) {
+        INFOV("%s changed while uploading", file);
+        stat_result = -1;
+    }
+
+    for (int d = 0; d < g_opts->nurls; d++) {
+        if (!pending[d]) {
+            continue;
+        }
+        upload_result = results[d];
+
+        if (upload_result == UPLOAD_RECOVERABLE_FAILURE && uploads[d].attempts < g_opts->max_attempts) {
+            ERRORV("Recoverable error encountered uploading %s to %s, trying again", file, g_opts->urls[d]);
+            g_metrics_retried();
+            g_trace_instant("upload", "retry", file);
+            continue;
+        }
 
-            INFOV("Done uploading %s", file);
-            uploads[i].done = 1;
+        if (upload_result == UPLOAD_RECOVERABLE_FAILURE && uploads[d].attempts == g_opts->max_attempts) {
+            ERRORV("Recoverable error encountered uploading %s to %s, attempts exhausted so not trying again",
+                   file, g_opts->urls[d]);
+            uploads[d].failed = 1;
+            uploads[d].done = 1;
             ndone++;
+            continue;
+        }
+
+        if (upload_result == UPLOAD_UNRECOVERABLE_FAILURE) {
+            ERRORV("Unrecoverable error encountered uploading %s to %s", file, g_opts->urls[d]);
+            uploads[d].failed = 1;
+        }
+
+        if (upload_result == UPLOAD_SUCCESS) {
+            INFOV("Success uploading %s to %s", file, g_opts->urls[d]);
+            if (stat_result == 0) {
+                g_journal_done(uploads[d].journal, sha256);
+            }
+        }
+
+        INFOV("Done uploading %s to %s", file, g_opts->urls[d]);
+        uploads[d].done = 1;
+        ndone++;
+    }
+
+    return ndone;
+}
+
+/**
+ * Whether a list of files is the CLI options', as a copy of it queued by flotsam may be, so is uploaded by their plan,
+ * or as held.
+ * @param files the files
+ * @param nfiles number of files
+ * @return 1 if and only if planned
+ */
+int http_is_planned(char* files[], int nfiles) {
+    if ((!g_opts->pin_files && !g_plan_holding()) || nfiles != g_opts->nfiles) {
+        return 0;
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        if (files[i] != g_opts->files[i] && strcmp(files[i], g_opts->files[i]) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Find an idle upload, if pacing allows another file in flight.
+ * @return the upload, or NULL if none may start
+ */
+struct SharedUpload* http_upload_idle() {
+    struct SharedUpload* idle = NULL;
+    int nbusy = 0;
+
+    for (int u = 0; u < g_opts->max_parallel; u++) {
+        if (shared_uploads[u].busy) {
+            nbusy++;
+        } else if (idle == NULL) {
+            idle = &shared_uploads[u];
+        }
+    }
+
+    return nbusy < pacing.window ? idle : NULL;
+}
+
+int g_http_upload_files() {
+    TRACE("g_http_upload_files()");
+
+    return g_http_upload_file_list(g_opts->files, g_opts->nfiles, NULL);
+}
+
+int g_http_upload_file_list(char* files[], int nfiles, atomic_int* cancel) {
+    struct SharedUpload* upload;
+    char* file;
+    int ndone = 0;
+    int nuploaded = 0;
+    int next = 0;
+    int pending[MAX_URLS];
+    int results[MAX_URLS];
+    struct JournalEntry* journal[MAX_URLS];
+    struct stat file_stat;
+    const unsigned char* sha256;
+    int i, npending, nfailed, nbusy, stat_result, cancelled;
+    struct UploadState uploads[nfiles][g_opts->nurls];
+    int in_flight[nfiles];
+
+    TRACEV("g_http_upload_file_list(%p, %d, %p)", files, nfiles, cancel);
+
+    upload_cancel = cancel;
+
+    // Replacements since the last refresh are followed before anything is looked at
+    upload_planned = http_is_planned(files, nfiles);
+    if (upload_planned) {
+        g_plan_refresh();
+    }
+
+    bzero(uploads, sizeof(uploads));
+    bzero(in_flight, sizeof(in_flight));
+
+    for (i = 0; i < nfiles; i++) {
+        stat_result = http_stat(files[i], i, &file_stat);
+
+        for (int d = 0; d < g_opts->nurls; d++) {
+            uploads[i][d].journal = g_journal_entry(files[i], g_opts->urls[d]);
+
+            if (stat_result == 0 && g_journal_is_done(uploads[i][d].journal, &file_stat)) {
+                INFOV("%s was already uploaded to %s by a previous run", files[i], g_opts->urls[d]);
+                uploads[i][d].done = 1;
+                ndone++;
+            }
+        }
+    }
+
+    pacing_start();
+
+    while (ndone < nfiles * g_opts->nurls) {
+        DEBUGV("%d/%d file uploads done", ndone, nfiles * g_opts->nurls);
+        cancelled = cancel != NULL && atomic_load(cancel);
+
+        // Files are started in turn, so every file is tried once before any is tried again
+        for (int n = 0; n < nfiles && !cancelled && (upload = http_upload_idle()) != NULL; n++) {
+            i = next;
+            next = (next + 1) % nfiles;
+            file = files[i];
+
+            if (in_flight[i]) {
+                continue;
+            }
+
+            stat_result = http_stat(file, i, &file_stat);
+
+            npending = 0;
+            for (int d = 0; d < g_opts->nurls; d++) {
+                pending[d] = !uploads[i][d].done;
+                journal[d] = uploads[i][d].journal;
+                if (pending[d]) {
+                    npending++;
+                    uploads[i][d].attempts++;
+                    if (stat_result == 0) {
+                        g_journal_attempt(journal[d], &file_stat);
+                    }
+                    INFOV("Attempt %d/%d of upload of file %s to %s",
+                          uploads[i][d].attempts, g_opts->max_attempts, file, g_opts->urls[d]);
+                }
+            }
+
+            if (npending == 0) {
+                TRACEV("%s done, skipping", file);
+                continue;
+            }
+
+            if (g_opts->dedup_index != NULL) {
+                // Deduplicated uploads are a conversation with each destination, so they run one at a time
+                http_upload_deduplicated(file, i, pending, journal, results);
+                ndone += http_upload_results(file, i, uploads[i], pending, results, stat_result, &file_stat, NULL);
+                continue;
+            }
+
+            upload->stat_result = stat_result;
+            upload->file_stat = file_stat;
+            http_upload_start(upload, file, i, pending);
+            in_flight[i] = 1;
+        }
+
+        nbusy = 0;
+        for (int u = 0; u < g_opts->max_parallel; u++) {
+            nbusy += shared_uploads[u].busy;
+        }
+        if (nbusy == 0) {
+            // Once cancelled transfers in flight abort, leaving files not yet done undone
+            if (cancelled) {
+                INFOV("Cancelled with %d/%d file uploads done", ndone, nfiles * g_opts->nurls);
+                break;
+            }
+            continue;
+        }
+
+        http_multi_step();
+
+        for (int u = 0; u < g_opts->max_parallel; u++) {
+            upload = &shared_uploads[u];
+            if (!upload->busy || !http_upload_is_finished(upload)) {
+                continue;
+            }
+
+            i = upload->file;
+            sha256 = g_opts->checksums & CHECKSUM_SHA256 ? upload->reader.checksum.sha256_digest : NULL;
+            http_upload_collect(upload, results);
+            in_flight[i] = 0;
+            ndone += http_upload_results(files[i], i, uploads[i], upload->pending, results,
+                                         upload->stat_result, &upload->file_stat, sha256);
+        }
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        nfailed = 0;
+        for (int d = 0; d < g_opts->nurls; d++) {
+            nfailed += uploads[i][d].failed || !uploads[i][d].done;
+        }
+        if (nfailed == 0) {
+            nuploaded++;
+        }
+    }
+
+    upload_cancel = NULL;
+    upload_planned = 0;
+    INFOV("%d files uploaded to every destination", nuploaded);
+    return nuploaded;
+}
+
+/**
+ * Upload a file held in memory to a destination.
+ * @param destination the destination
+ * @param file the file
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_upload_virtual(struct Destination* destination, const struct VirtualFile* file) {
+    char full_url[MAX_URL_LENGTH];
+    struct VirtualUpload upload = { file, 0 };
+    curl_off_t size = 0;
+    struct Checksum checksum;
+    struct curl_slist checksum_nodes[2];
+    char checksum_lines[2][CHECKSUM_MAX_HEADER_LENGTH];
+    CURLcode curl_code;
+    int result;
+
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s%s/%s", destination->url, upload_run, file->name) >= MAX_URL_LENGTH) {
+        ERRORV("%s%s/%s is too long an URL, max URL size is %d", destination->url, upload_run, file->name,
+               MAX_URL_LENGTH);
+        return UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+    INFOV("Uploading %s to %s", file->name, full_url);
+
+    for (int i = 0; i < VIRTUAL_FILE_PIECES; i++) {
+        size += (curl_off_t) file->length[i];
+    }
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_URL, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READFUNCTION, &virtual_read_callback);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READDATA, &upload);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, size);
+
+    if (g_opts->checksums == 0) {
+        return http_perform(destination->curl, full_url);
+    }
+
+    // The file is already in memory, so checksums are known up front and sent as headers
+    g_checksum_start(&checksum, g_opts->checksums);
+    for (int i = 0; i < VIRTUAL_FILE_PIECES; i++) {
+        g_checksum_update(&checksum, file->data[i], file->length[i]);
+    }
+    g_checksum_finish(&checksum);
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_HTTPHEADER, checksum_headers(&checksum, checksum_nodes, checksum_lines));
+    result = http_perform(destination->curl, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_HTTPHEADER, headers);
+
+    return result;
+}
+
+/**
+ * Upload a file made of extents of a file on disk to a destination.
+ * @param destination the destination
+ * @param file the file
+ * @return UPLOAD_SUCCESS, UPLOAD_UNRECOVERABLE_FAILURE, UPLOAD_RECOVERABLE_FAILURE
+ */
+int http_upload_extents(struct Destination* destination, const struct ExtentFile* file) {
+    char full_url[MAX_URL_LENGTH];
+    struct ExtentUpload upload = { file, 0, 0, 0 };
+    curl_off_t size = (curl_off_t) file->header_length;
+    CURLcode curl_code;
+
+    if (snprintf(full_url, MAX_URL_LENGTH, "%s%s/%s", destination->url, upload_run, file->name) >= MAX_URL_LENGTH) {
+        ERRORV("%s%s/%s is too long an URL, max URL size is %d", destination->url, upload_run, file->name,
+               MAX_URL_LENGTH);
+        return UPLOAD_UNRECOVERABLE_FAILURE;
+    }
+    INFOV("Uploading %s to %s", file->name, full_url);
+
+    for (int i = 0; i < file->nextents; i++) {
+        size += (curl_off_t) file->extents[i].length;
+    }
+
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_URL, full_url);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_UPLOAD, 1L);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READFUNCTION, &extent_read_callback);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_READDATA, &upload);
+    HTTP_DEDUP_SET_CURL_OPTION(CURLOPT_INFILESIZE_LARGE, size);
+
+    return http_perform(destination->curl, full_url);
+}
+
+/**
+ * Upload files provided in CLI options while the child is still running.
+ */
+void* http_early_upload_thread(void* arg) {
+    TRACEV("http_early_upload_thread(%p)", arg);
+
+    g_http_upload_files();
+    return NULL;
+}
+
+void g_http_upload_files_start() {
+    int error_code;
+
+    TRACE("g_http_upload_files_start()");
+
+    if (early_upload_running) {
+        return;
+    }
+
+    error_code = pthread_create(&early_upload_thread, NULL, &http_early_upload_thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not start uploading early: %s", strerror(error_code));
+        return;
+    }
+    early_upload_running = 1;
+}
+
+void g_http_upload_files_wait() {
+    int error_code;
+
+    TRACE("g_http_upload_files_wait()");
+
+    if (!early_upload_running) {
+        return;
+    }
+
+    INFO("Waiting for early upload to finish");
+    error_code = pthread_join(early_upload_thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not finish uploading early: %s", strerror(error_code));
+    }
+    early_upload_running = 0;
+}
+
+int g_http_upload_virtual_files(const struct VirtualFile* files, int nfiles) {
+    int nuploaded = 0;
+    int result, nfailed;
+
+    TRACEV("g_http_upload_virtual_files(%p, %d)", files, nfiles);
+
+    for (int i = 0; i < nfiles; i++) {
+        nfailed = 0;
+
+        for (int d = 0; d < g_opts->nurls; d++) {
+            result = UPLOAD_RECOVERABLE_FAILURE;
+            for (int attempt = 1; attempt <= g_opts->max_attempts && result == UPLOAD_RECOVERABLE_FAILURE; attempt++) {
+                INFOV("Attempt %d/%d of upload of %s to %s", attempt, g_opts->max_attempts, files[i].name,
+                      g_opts->urls[d]);
+                if (attempt > 1) {
+                    g_metrics_retried();
+                    g_trace_instant("upload", "retry", files[i].name);
+                }
+                result = http_upload_virtual(&destinations[d], &files[i]);
+            }
+
+            if (result == UPLOAD_SUCCESS) {
+                INFOV("Success uploading %s to %s", files[i].name, g_opts->urls[d]);
+            } else {
+                ERRORV("Could not upload %s to %s", files[i].name, g_opts->urls[d]);
+                nfailed++;
+            }
+        }
+
+        if (nfailed == 0) {
+            nuploaded++;
+        }
+    }
+
+    return nuploaded;
+}
+
+int g_http_upload_extent_files(const struct ExtentFile* files, int nfiles) {
+    int nuploaded = 0;
+    int result, nfailed;
+
+    TRACEV("g_http_upload_extent_files(%p, %d)", files, nfiles);
+
+    for (int i = 0; i < nfiles; i++) {
+        nfailed = 0;
+
+        for (int d = 0; d < g_opts->nurls; d++) {
+            result = UPLOAD_RECOVERABLE_FAILURE;
+            for (int attempt = 1; attempt <= g_opts->max_attempts && result == UPLOAD_RECOVERABLE_FAILURE; attempt++) {
+                INFOV("Attempt %d/%d of upload of %s to %s", attempt, g_opts->max_attempts, files[i].name,
+                      g_opts->urls[d]);
+                if (attempt > 1) {
+                    g_metrics_retried();
+                    g_trace_instant("upload", "retry", files[i].name);
+                }
+                result = http_upload_extents(&destinations[d], &files[i]);
+            }
+
+            if (result == UPLOAD_SUCCESS) {
+                INFOV("Success uploading %s to %s", files[i].name, g_opts->urls[d]);
+            } else {
+                ERRORV("Could not upload %s to %s", files[i].name, g_opts->urls[d]);
+                nfailed++;
+            }
+        }
+
+        if (nfailed == 0) {
+            nuploaded++;
         }
     }
 
-    INFOV("%d files uploaded", ndone);
     return nuploaded;
 }
 
+void g_http_name_run(int run) {
+    TRACEV("g_http_name_run(%d)", run);
+
+    if (run > 0) {
+        snprintf(upload_run, sizeof(upload_run), "/run-%d", run);
+    } else {
+        upload_run[0] = '\0';
+    }
+}
+
 void g_http_destroy() {
     TRACE("g_http_destroy()");
-    curl_easy_cleanup(curl);
+
+    g_http_close();
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (prepared_fds[i] != -1) {
+            close(prepared_fds[i]);
+            prepared_fds[i] = -1;
+        }
+    }
+
+    if (headers != NULL) {
+        curl_slist_free_all(headers);
+        headers = NULL;
+        TRACE("Freed headers");
+    }
+
     curl_global_cleanup();
 }
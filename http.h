@@ -2,20 +2,164 @@
 #define JETSAM_HTTP_H
 
 #include <curl/curl.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "heap.h"
 
+/**
+ * Most pieces a VirtualFile is held in: a header, then the two parts of a ring buffer.
+ */
+#define VIRTUAL_FILE_PIECES 3
+
+/**
+ * A file held in memory rather than on disk, in pieces as a ring buffer holds it.
+ */
+struct VirtualFile {
+    /**
+     * Name the file is uploaded as.
+     */
+    const char* name;
+
+    /**
+     * Pieces of the file contents, in order.
+     */
+    const char* data[VIRTUAL_FILE_PIECES];
+
+    /**
+     * Length of each piece in bytes.
+     */
+    size_t length[VIRTUAL_FILE_PIECES];
+};
+
+/**
+ * A range of a file holding data.
+ */
+struct FileExtent {
+    /**
+     * Offset of the first byte.
+     */
+    uint64_t offset;
+
+    /**
+     * Length in bytes.
+     */
+    uint64_t length;
+};
+
+/**
+ * A file uploaded as a header held in memory followed by extents of a file on disk, skipping what lies between them.
+ */
+struct ExtentFile {
+    /**
+     * Name the file is uploaded as.
+     */
+    const char* name;
+
+    /**
+     * Header sent before the extents.
+     */
+    const char* header;
+
+    /**
+     * Length of the header in bytes.
+     */
+    size_t header_length;
+
+    /**
+     * File the extents are read from.
+     */
+    int fd;
+
+    /**
+     * Extents sent, in order.
+     */
+    const struct FileExtent* extents;
+
+    /**
+     * Number of extents.
+     */
+    int nextents;
+};
+
 /**
  * Initialize HTTP subsystem.
  */
 void g_http_init();
 
+/**
+ * Create every CURL instance again after g_http_close(), allocating from the heap as curl does.  g_http_init() has
+ * already created them.
+ * @return 1 on success, 0 if any could not be created, as when the heap is exhausted
+ */
+int g_http_open();
+
+/**
+ * Clean up every CURL instance, closing their connections and dropping what curl cached, so nothing curl allocated
+ * from the heap is referenced any longer.  Nothing is uploaded until g_http_open().
+ */
+void g_http_close();
+
+/**
+ * Start preparing to upload files provided in CLI options in the background: connecting, opening files, and sending
+ * what can already be sent.
+ */
+void g_http_prepare_start();
+
+/**
+ * Stop preparing to upload, waiting for preparation to reach a point uploading can continue from.
+ */
+void g_http_prepare_stop();
+
 /**
  * Upload files provided in CLI options.
  * @return number of successfully uploaded files.
  */
 int g_http_upload_files();
 
+/**
+ * Upload a list of files, as files provided in CLI options are.
+ * @param files the files
+ * @param nfiles number of files
+ * @param cancel set from another thread to stop starting files and abort transfers in flight, or NULL
+ * @return number of files uploaded to every destination
+ */
+int g_http_upload_file_list(char* files[], int nfiles, atomic_int* cancel);
+
+/**
+ * Start uploading files provided in CLI options in the background, while the child is still running, if not already
+ * started.
+ */
+void g_http_upload_files_start();
+
+/**
+ * Wait for uploading started by g_http_upload_files_start() to finish, if started.
+ */
+void g_http_upload_files_wait();
+
+/**
+ * Upload files held in memory to every destination.
+ * @param files the files
+ * @param nfiles number of files
+ * @return number of files uploaded to every destination
+ */
+int g_http_upload_virtual_files(const struct VirtualFile* files, int nfiles);
+
+/**
+ * Upload files made of extents of files on disk to every destination, without checksums.
+ * @param files the files
+ * @param nfiles number of files
+ * @return number of files uploaded to every destination
+ */
+int g_http_upload_extent_files(const struct ExtentFile* files, int nfiles);
+
+/**
+ * Name every file uploaded from now on as of a run, under run-N/ at each destination, so the uploads of runs do not
+ * overwrite each other's.  Only called while nothing is uploading.
+ * @param run number of the run, from 1, or 0 not to name files by run
+ */
+void g_http_name_run(int run);
+
 /**
  * Clean up HTTP subsystem.
  */
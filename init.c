@@ -1,10 +1,17 @@
+#include "checksum.h"
+#include "dedup.h"
 #include "init.h"
 #include "heap.h"
 #include "http.h"
+#include "journal.h"
 #include "log.h"
+#include "metrics.h"
 #include "opts.h"
+#include "plan.h"
+#include "trace.h"
 
 void g_init(int argc, char* argv[]) {
+    int64_t init_us = g_trace_now(), heap_us, log_us, started_us;
     int opts_parse_result;
 
     TRACEV("g_init(%d, %p)", argc, argv);
@@ -19,19 +26,82 @@ void g_init(int argc, char* argv[]) {
     }
     TRACE("Options parsed");
 
+    heap_us = g_trace_now();
     g_heap_init(g_opts->heap_size);
     TRACE("Heap initialized");
 
+    log_us = g_trace_now();
+    g_log_init();
+    TRACE("Log initialized");
+
+    // What came before could not be traced without the heap
+    g_trace_init();
+    g_trace_span("init", "options", NULL, init_us, heap_us);
+    g_trace_span("init", "heap", NULL, heap_us, log_us);
+    g_trace_span("init", "log", NULL, log_us, g_trace_now());
+    TRACE("Trace initialized");
+
+    g_checksum_init();
+    TRACE("Checksums initialized");
+
+    if (g_opts->dedup_index != NULL) {
+        g_dedup_init();
+        TRACE("Deduplication initialized");
+    }
+
+    if (g_opts->journal != NULL) {
+        g_journal_init();
+        TRACE("Journal initialized");
+    }
+
+    if (g_opts->pin_files) {
+        started_us = g_trace_now();
+        g_plan_init();
+        g_trace_span("init", "plan", NULL, started_us, g_trace_now());
+        TRACE("Plan initialized");
+    }
+
+    started_us = g_trace_now();
     g_http_init();
+    g_trace_span("init", "curl", NULL, started_us, g_trace_now());
     TRACE("HTTP initialized");
+
+    g_metrics_init();
+    TRACE("Metrics initialized");
+
+    g_trace_span("init", "g_init", NULL, init_us, g_trace_now());
 }
 
 void g_destroy() {
     TRACE("g_destroy()");
 
+    g_metrics_destroy();
+    TRACE("Metrics destroyed");
+
     g_http_destroy();
     TRACE("HTTP destroyed");
 
+    if (g_opts->pin_files) {
+        g_plan_destroy();
+        TRACE("Plan destroyed");
+    }
+
+    if (g_opts->journal != NULL) {
+        g_journal_destroy();
+        TRACE("Journal destroyed");
+    }
+
+    if (g_opts->dedup_index != NULL) {
+        g_dedup_destroy();
+        TRACE("Deduplication destroyed");
+    }
+
+    g_trace_destroy();
+    TRACE("Trace destroyed");
+
+    g_log_destroy();
+    TRACE("Log destroyed");
+
     g_heap_destroy();
     TRACE("Heap destroyed");
 
@@ -1,11 +1,10 @@
 #include "log.h"
 #include "exec.h"
 #include "init.h"
-#include "http.h"
 #include "opts.h"
 
 int main(int argc, char* argv[]) {
-    int exit_code, nuploaded;
+    int exit_code;
 
     TRACEV("main(%d, %p)", argc, argv);
     INFO("Initializing...");
@@ -15,11 +14,7 @@ int main(int argc, char* argv[]) {
     exit_code = g_exec_child_process();
 
     if (exit_code != 0) {
-        INFO("Uploading files...");
-        nuploaded = g_http_upload_files();
-        if (nuploaded < g_opts->nfiles) {
-            ERRORV("Only uploaded %d of %d files", nuploaded, g_opts->nfiles);
-        }
+        g_exec_upload();
     }
 
     INFO("Shutting down...");
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "journal.h"
+#include "log.h"
+#include "opts.h"
+
+/**
+ * Identifies a journal file.
+ */
+#define JOURNAL_MAGIC "salvjrnl"
+
+/**
+ * Journal file layout version, files with any other version are started afresh.
+ */
+#define JOURNAL_VERSION 1
+
+/**
+ * Layout of the journal file, mapped directly.
+ */
+struct JournalFile {
+    /**
+     * JOURNAL_MAGIC, without terminator.
+     */
+    char magic[8];
+
+    /**
+     * JOURNAL_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * Incremented on every run.
+     */
+    uint32_t generation;
+
+    /**
+     * Upload records.
+     */
+    struct JournalEntry entries[JOURNAL_MAX_ENTRIES];
+};
+
+/**
+ * Journal state.
+ */
+struct Journal {
+    /**
+     * Journal file, or -1 if not open.
+     */
+    int fd;
+
+    /**
+     * Mapped journal file, or NULL if not mapped.
+     */
+    struct JournalFile* file;
+};
+
+/**
+ * The journal instance.
+ */
+struct Journal g_journal_instance = { .fd = -1, .file = NULL };
+
+/**
+ * Pointer to the journal instance.
+ */
+struct Journal* g_journal = &g_journal_instance;
+
+/**
+ * Compute the CRC32C protecting an entry.
+ * @param entry the entry
+ * @return CRC32C of everything before the crc32c field
+ */
+uint32_t journal_entry_crc32c(const struct JournalEntry* entry) {
+    return g_checksum_crc32c(0, entry, offsetof(struct JournalEntry, crc32c));
+}
+
+/**
+ * Check whether an entry was completely written.
+ * @param entry the entry
+ * @return 1 if and only if the entry is in use and intact
+ */
+int journal_entry_is_valid(const struct JournalEntry* entry) {
+    return entry->state != JOURNAL_EMPTY && entry->crc32c == journal_entry_crc32c(entry);
+}
+
+/**
+ * Seal an entry after changing it.  Plain stores to the shared mapping survive the process being killed, so this is
+ * all that is needed until the kernel writes the page back.
+ * @param entry the entry
+ */
+void journal_entry_seal(struct JournalEntry* entry) {
+    entry->crc32c = journal_entry_crc32c(entry);
+}
+
+/**
+ * Modification time of a file in nanoseconds.
+ */
+int64_t journal_mtime_ns(const struct stat* file_stat) {
+    return (int64_t) file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+}
+
+void g_journal_init() {
+    TRACE("g_journal_init()");
+
+    g_journal->fd = open(g_opts->journal, O_RDWR | O_CREAT, 0600);
+    if (g_journal->fd == -1) {
+        FATALV(FATAL_ERROR_JOURNAL_INIT, "could not open journal %s: %s", g_opts->journal, strerror(errno));
+    }
+
+    if (ftruncate(g_journal->fd, sizeof(struct JournalFile)) != 0) {
+        FATALV(FATAL_ERROR_JOURNAL_INIT, "could not size journal %s: %s", g_opts->journal, strerror(errno));
+    }
+
+    g_journal->file = mmap(NULL, sizeof(struct JournalFile), PROT_READ | PROT_WRITE, MAP_SHARED, g_journal->fd, 0);
+    if (g_journal->file == MAP_FAILED) {
+        g_journal->file = NULL;
+        FATALV(FATAL_ERROR_JOURNAL_INIT, "could not map journal %s: %s", g_opts->journal, strerror(errno));
+    }
+
+    if (memcmp(g_journal->file->magic, JOURNAL_MAGIC, sizeof(g_journal->file->magic)) != 0 ||
+            g_journal->file->version != JOURNAL_VERSION) {
+        INFOV("Starting new journal %s", g_opts->journal);
+        memset(g_journal->file, 0, sizeof(struct JournalFile));
+        memcpy(g_journal->file->magic, JOURNAL_MAGIC, sizeof(g_journal->file->magic));
+        g_journal->file->version = JOURNAL_VERSION;
+    }
+
+    g_journal->file->generation++;
+    INFOV("Mapped journal %s, run %u", g_opts->journal, g_journal->file->generation);
+}
+
+struct JournalEntry* g_journal_entry(const char* filename, const char* url) {
+    struct Sha256 sha256;
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    struct JournalEntry* entry;
+    struct JournalEntry* victim = NULL;
+
+    TRACEV("g_journal_entry(%p = \"%s\", %p = \"%s\")", filename, filename, url, url);
+
+    if (g_journal->file == NULL) {
+        return NULL;
+    }
+
+    g_checksum_sha256_init(&sha256);
+    g_checksum_sha256_update(&sha256, filename, strlen(filename) + 1);
+    g_checksum_sha256_update(&sha256, url, strlen(url));
+    g_checksum_sha256_final(&sha256, key);
+
+    for (int i = 0; i < JOURNAL_MAX_ENTRIES; i++) {
+        entry = &g_journal->file->entries[i];
+
+        if (!journal_entry_is_valid(entry)) {
+            if (victim == NULL || journal_entry_is_valid(victim)) {
+                victim = entry;
+            }
+            continue;
+        }
+
+        if (memcmp(entry->key, key, SHA256_DIGEST_LENGTH) == 0) {
+            entry->generation = g_journal->file->generation;
+            journal_entry_seal(entry);
+            DEBUGV("Journal has %s to %s: state %u, %ld bytes acknowledged, %u attempts", filename, url,
+                   entry->state, (long) entry->bytes_acked, entry->attempts);
+            return entry;
+        }
+
+        // Recycle whatever was used longest ago
+        if (victim == NULL || (journal_entry_is_valid(victim) && entry->generation < victim->generation)) {
+            victim = entry;
+        }
+    }
+
+    memset(victim, 0, sizeof(struct JournalEntry));
+    memcpy(victim->key, key, SHA256_DIGEST_LENGTH);
+    victim->generation = g_journal->file->generation;
+    victim->state = JOURNAL_PENDING;
+    journal_entry_seal(victim);
+
+    return victim;
+}
+
+int g_journal_is_done(const struct JournalEntry* entry, const struct stat* file_stat) {
+    return entry != NULL &&
+           entry->state == JOURNAL_DONE &&
+           entry->size == file_stat->st_size &&
+           entry->mtime_ns == journal_mtime_ns(file_stat);
+}
+
+void g_journal_attempt(struct JournalEntry* entry, const struct stat* file_stat) {
+    if (entry == NULL) {
+        return;
+    }
+
+    if (entry->size != file_stat->st_size || entry->mtime_ns != journal_mtime_ns(file_stat)) {
+        entry->size = file_stat->st_size;
+        entry->mtime_ns = journal_mtime_ns(file_stat);
+        entry->bytes_acked = 0;
+        memset(entry->sha256, 0, SHA256_DIGEST_LENGTH);
+    }
+
+    entry->state = JOURNAL_PENDING;
+    entry->attempts++;
+    journal_entry_seal(entry);
+}
+
+void g_journal_acknowledge(struct JournalEntry* entry, int64_t length) {
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->bytes_acked += length;
+    journal_entry_seal(entry);
+}
+
+void g_journal_done(struct JournalEntry* entry, const unsigned char* sha256) {
+    if (entry == NULL) {
+        return;
+    }
+
+    if (sha256 != NULL) {
+        memcpy(entry->sha256, sha256, SHA256_DIGEST_LENGTH);
+    }
+    entry->bytes_acked = entry->size;
+    entry->state = JOURNAL_DONE;
+    journal_entry_seal(entry);
+
+    // Only power loss can lose the stores above, so start write back without waiting for it
+    if (msync(g_journal->file, sizeof(struct JournalFile), MS_ASYNC) != 0) {
+        ERRORV("Could not schedule journal write back: %s", strerror(errno));
+    }
+}
+
+void g_journal_destroy() {
+    TRACE("g_journal_destroy()");
+
+    if (g_journal->file != NULL) {
+        if (msync(g_journal->file, sizeof(struct JournalFile), MS_ASYNC) != 0) {
+            ERRORV("Could not schedule journal write back: %s", strerror(errno));
+        }
+        if (munmap(g_journal->file, sizeof(struct JournalFile)) != 0) {
+            ERRORV("Could not unmap journal %s: %s", g_opts->journal, strerror(errno));
+        }
+    }
+    g_journal->file = NULL;
+
+    if (g_journal->fd != -1 && close(g_journal->fd) != 0) {
+        ERRORV("Could not close journal %s: %s", g_opts->journal, strerror(errno));
+    }
+    g_journal->fd = -1;
+}
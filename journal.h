@@ -0,0 +1,132 @@
+#ifndef JETSAM_JOURNAL_H
+#define JETSAM_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "checksum.h"
+#include "opts.h"
+
+/**
+ * Maximum uploads remembered in the journal, enough for every file to every destination.
+ */
+#define JOURNAL_MAX_ENTRIES (MAX_FILES * MAX_URLS)
+
+/**
+ * Where an upload of a file to a destination got to.
+ */
+enum JournalState {
+    /**
+     * Slot unused.
+     */
+    JOURNAL_EMPTY = 0,
+
+    /**
+     * Upload started but not known to have completed.
+     */
+    JOURNAL_PENDING,
+
+    /**
+     * Upload completed for the recorded size and modification time.
+     */
+    JOURNAL_DONE
+};
+
+/**
+ * Journal record of the upload of one file to one destination.
+ */
+struct JournalEntry {
+    /**
+     * SHA-256 of the filename and destination URL.
+     */
+    unsigned char key[SHA256_DIGEST_LENGTH];
+
+    /**
+     * SHA-256 of the file contents if computed while uploading, otherwise all zero.
+     */
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+
+    /**
+     * File size when last attempted.
+     */
+    int64_t size;
+
+    /**
+     * File modification time in nanoseconds when last attempted.
+     */
+    int64_t mtime_ns;
+
+    /**
+     * Bytes the destination has acknowledged receiving.
+     */
+    int64_t bytes_acked;
+
+    /**
+     * Run in which the entry was last used, for recycling entries of files no longer uploaded.
+     */
+    uint32_t generation;
+
+    /**
+     * Upload attempts over every run.
+     */
+    uint32_t attempts;
+
+    /**
+     * JournalState value.
+     */
+    uint32_t state;
+
+    /**
+     * CRC32C of the entry up to this field, so entries torn by a crash are ignored.
+     */
+    uint32_t crc32c;
+};
+
+/**
+ * Initialize the journal and map the journal file named in the CLI options.
+ */
+void g_journal_init();
+
+/**
+ * Find or create the journal entry for uploading a file to a destination.
+ * @param filename file being uploaded
+ * @param url base URL of the destination
+ * @return the entry, or NULL if journaling is disabled
+ */
+struct JournalEntry* g_journal_entry(const char* filename, const char* url);
+
+/**
+ * Check whether a previous run completed an upload.
+ * @param entry entry from g_journal_entry, or NULL
+ * @param file_stat current status of the file
+ * @return 1 if and only if the file was uploaded unchanged
+ */
+int g_journal_is_done(const struct JournalEntry* entry, const struct stat* file_stat);
+
+/**
+ * Record the start of an upload attempt, forgetting progress if the file changed.
+ * @param entry entry from g_journal_entry, or NULL
+ * @param file_stat status of the file being uploaded
+ */
+void g_journal_attempt(struct JournalEntry* entry, const struct stat* file_stat);
+
+/**
+ * Record bytes acknowledged by the destination during an upload.
+ * @param entry entry from g_journal_entry, or NULL
+ * @param length additional bytes acknowledged
+ */
+void g_journal_acknowledge(struct JournalEntry* entry, int64_t length);
+
+/**
+ * Record the completion of an upload, and schedule the journal to be written back.
+ * @param entry entry from g_journal_entry, or NULL
+ * @param sha256 SHA-256 of the file contents, or NULL if not computed
+ */
+void g_journal_done(struct JournalEntry* entry, const unsigned char* sha256);
+
+/**
+ * Unmap the journal, scheduling it to be written back.
+ */
+void g_journal_destroy();
+
+#endif //JETSAM_JOURNAL_H
@@ -0,0 +1,602 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "log.h"
+
+/**
+ * Records in the ring, a power of two.
+ */
+#define LOG_RING_RECORDS 256
+
+/**
+ * Bytes of string arguments copied into a record, longer strings being truncated.
+ */
+#define LOG_RECORD_STRINGS 224
+
+/**
+ * Milliseconds between drains of the ring.
+ */
+#define LOG_DRAIN_MS 10
+
+/**
+ * Most bytes of a rendered message.
+ */
+#define LOG_LINE_SIZE 1024
+
+/**
+ * Bytes of rendered messages written to stderr at once.
+ */
+#define LOG_OUTPUT_SIZE 16384
+
+/**
+ * Type of a stored argument.
+ */
+enum LogType {
+    LOG_TYPE_SIGNED = 0,
+    LOG_TYPE_UNSIGNED,
+    LOG_TYPE_DOUBLE,
+    LOG_TYPE_STRING,
+    LOG_TYPE_POINTER
+};
+
+/**
+ * A stored argument.
+ */
+union LogArg {
+    long long s;
+    unsigned long long u;
+    double d;
+    const volatile void* p;
+};
+
+struct LogRecord {
+    /**
+     * Position in the ring this record may next be claimed at, or that plus one once committed.
+     */
+    atomic_size_t sequence;
+
+    /**
+     * Position in the ring this record was claimed at.
+     */
+    size_t position;
+
+    /**
+     * Where the message is logged from.
+     */
+    const struct LogSite* site;
+
+    /**
+     * When the message was logged.
+     */
+    struct timespec time;
+
+    /**
+     * Number of arguments.
+     */
+    int nargs;
+
+    /**
+     * Bytes of strings used.
+     */
+    size_t used;
+
+    /**
+     * LogType of each argument.
+     */
+    unsigned char types[LOG_MAX_ARGS];
+
+    /**
+     * The arguments, strings as their pointers.
+     */
+    union LogArg args[LOG_MAX_ARGS];
+
+    /**
+     * Offsets of string arguments' copies into strings.
+     */
+    unsigned short offsets[LOG_MAX_ARGS];
+
+    /**
+     * String arguments, null terminated one after another.
+     */
+    char strings[LOG_RECORD_STRINGS];
+};
+
+/**
+ * The ring of records: many threads claim and commit records at the tail, the thread draining it renders them from
+ * the head.
+ */
+struct LogRing {
+    /**
+     * Next position to claim.
+     */
+    atomic_size_t tail;
+
+    /**
+     * Next position to render, under the lock.
+     */
+    size_t head;
+
+    /**
+     * Messages dropped for want of room since last reported.
+     */
+    atomic_long ndropped;
+
+    /**
+     * The records.
+     */
+    struct LogRecord records[LOG_RING_RECORDS];
+};
+
+/**
+ * Log state.
+ */
+struct Log {
+    /**
+     * The ring, from the heap, or NULL while logging immediately.
+     */
+    struct LogRing* ring;
+
+    /**
+     * Held while draining, and guarding stopping.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled to stop the thread draining the ring.
+     */
+    pthread_cond_t stop;
+
+    /**
+     * Whether the thread draining the ring is asked to stop.
+     */
+    int stopping;
+
+    /**
+     * Thread draining the ring.
+     */
+    pthread_t thread;
+
+    /**
+     * Bytes of output used.
+     */
+    size_t used;
+
+    /**
+     * Rendered messages not yet written, from the heap.
+     */
+    char* output;
+};
+
+/**
+ * The runtime log level, INFO until the CLI options are parsed.
+ */
+int g_log_level = LOG_LEVEL_INFO;
+
+/**
+ * The log instance.
+ */
+struct Log g_log_instance = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Pointer to the log instance.
+ */
+struct Log* g_log = &g_log_instance;
+
+/**
+ * Record of a message logged while there is no ring, one per thread.
+ */
+_Thread_local struct LogRecord log_immediate;
+
+/**
+ * Write bytes to stderr, however many writes it takes.
+ * @param buffer the bytes
+ * @param size number of bytes
+ */
+void log_write(const char* buffer, size_t size) {
+    ssize_t nwritten;
+
+    while (size > 0) {
+        nwritten = write(STDERR_FILENO, buffer, size);
+        if (nwritten == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            return;
+        }
+        buffer += nwritten;
+        size -= (size_t) nwritten;
+    }
+}
+
+/**
+ * Render one conversion of a message's format with a stored argument.
+ * @param record the record
+ * @param index index of the argument
+ * @param spec the conversion, from '%' to its conversion character, without length modifier
+ * @param conversion the conversion character
+ * @param wide whether the conversion had a length modifier wider than int
+ * @param line receives the rendered conversion
+ * @param size bytes of room in line
+ * @return what snprintf returned
+ */
+int log_render_arg(const struct LogRecord* record, int index, const char* spec, char conversion, int wide, char* line,
+                   size_t size) {
+    char format[32];
+    const union LogArg* arg;
+    long long s;
+    unsigned long long u;
+    int type;
+
+    if (index >= record->nargs) {
+        return snprintf(line, size, "(?)");
+    }
+
+    arg = &record->args[index];
+    type = record->types[index];
+    s = type == LOG_TYPE_SIGNED ? arg->s : (long long) arg->u;
+    u = type == LOG_TYPE_SIGNED ? (unsigned long long) arg->s : arg->u;
+    switch (conversion) {
+        case 'd':
+        case 'i':
+            if (type == LOG_TYPE_SIGNED || type == LOG_TYPE_UNSIGNED) {
+                snprintf(format, sizeof(format), "%.*slld", (int) strlen(spec) - 1, spec);
+                return snprintf(line, size, format, wide ? s : (long long) (int) s);
+            }
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if (type == LOG_TYPE_SIGNED || type == LOG_TYPE_UNSIGNED) {
+                snprintf(format, sizeof(format), "%.*sll%c", (int) strlen(spec) - 1, spec, conversion);
+                return snprintf(line, size, format, wide ? u : (unsigned long long) (unsigned int) u);
+            }
+            break;
+        case 'c':
+            if (type == LOG_TYPE_SIGNED || type == LOG_TYPE_UNSIGNED) {
+                return snprintf(line, size, spec, (int) s);
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (type == LOG_TYPE_DOUBLE) {
+                return snprintf(line, size, spec, arg->d);
+            }
+            break;
+        case 'p':
+            if (type == LOG_TYPE_POINTER || type == LOG_TYPE_STRING) {
+                return snprintf(line, size, spec, arg->p);
+            }
+            break;
+        case 's':
+            if (type == LOG_TYPE_STRING) {
+                return snprintf(line, size, spec, record->strings + record->offsets[index]);
+            }
+            break;
+    }
+
+    return snprintf(line, size, "(?)");
+}
+
+/**
+ * Render a record as a line of text, as printf would have formatted it when logged.
+ * @param record the record
+ * @param line receives the line, newline terminated
+ * @return bytes of the line
+ */
+size_t log_render(const struct LogRecord* record, char* line) {
+    const struct LogSite* site = record->site;
+    const char* format = site->format;
+    char spec[32];
+    size_t used, length;
+    int index = 0;
+    int wide;
+    int nrendered;
+
+    nrendered = snprintf(line, LOG_LINE_SIZE, "[salvage] %ld.%06ld %s(%d) %s#%d: ", (long) record->time.tv_sec,
+                         record->time.tv_nsec / 1000, site->name, site->level, site->file, site->line);
+    used = nrendered < LOG_LINE_SIZE ? (size_t) nrendered : LOG_LINE_SIZE - 1;
+
+    while (*format != '\0' && used < LOG_LINE_SIZE - 1) {
+        if (*format != '%') {
+            line[used++] = *format++;
+            continue;
+        }
+        if (format[1] == '%') {
+            line[used++] = '%';
+            format += 2;
+            continue;
+        }
+
+        // Flags, width and precision are kept, length modifiers are replaced by the stored argument's
+        length = strspn(format + 1, "-+ #0123456789.") + 1;
+        if (length >= sizeof(spec) - 1) {
+            break;
+        }
+        memcpy(spec, format, length);
+        format += length;
+        wide = 0;
+        while (*format != '\0' && strchr("hlqjztL", *format) != NULL) {
+            wide |= *format != 'h';
+            format++;
+        }
+        if (*format == '\0') {
+            break;
+        }
+        spec[length] = *format;
+        spec[length + 1] = '\0';
+
+        nrendered = log_render_arg(record, index++, spec, *format++, wide, line + used, LOG_LINE_SIZE - 1 - used);
+        if (nrendered > 0) {
+            used += (size_t) nrendered < LOG_LINE_SIZE - 1 - used ? (size_t) nrendered : LOG_LINE_SIZE - 1 - used;
+        }
+    }
+
+    line[used++] = '\n';
+    return used;
+}
+
+/**
+ * Write the rendered messages waiting in the output.
+ */
+void log_output_flush() {
+    log_write(g_log->output, g_log->used);
+    g_log->used = 0;
+}
+
+/**
+ * Add a rendered message to the output, writing the output first if it has no room.
+ * @param line the message
+ * @param length bytes of the message
+ */
+void log_output(const char* line, size_t length) {
+    if (g_log->used + length > LOG_OUTPUT_SIZE) {
+        log_output_flush();
+    }
+    memcpy(g_log->output + g_log->used, line, length);
+    g_log->used += length;
+}
+
+/**
+ * Render and write every record committed in order from the head of the ring, stopping at one not yet committed.  The
+ * lock is held.
+ */
+void log_drain() {
+    struct LogRing* ring = g_log->ring;
+    struct LogRecord* record;
+    char line[LOG_LINE_SIZE];
+    long ndropped;
+
+    for (;;) {
+        record = &ring->records[ring->head & (LOG_RING_RECORDS - 1)];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != ring->head + 1) {
+            break;
+        }
+
+        log_output(line, log_render(record, line));
+        atomic_store_explicit(&record->sequence, ring->head + LOG_RING_RECORDS, memory_order_release);
+        ring->head++;
+    }
+
+    ndropped = atomic_exchange_explicit(&ring->ndropped, 0, memory_order_relaxed);
+    if (ndropped > 0) {
+        log_output(line, (size_t) snprintf(line, sizeof(line), "[salvage] %ld messages dropped, the log ring being "
+                                                               "full\n", ndropped));
+    }
+    log_output_flush();
+}
+
+/**
+ * Thread draining the ring every LOG_DRAIN_MS until asked to stop.
+ * @param arg unused
+ * @return NULL
+ */
+void* log_thread(void* arg) {
+    struct timespec deadline;
+    int error_code;
+
+    (void) arg;
+
+    pthread_mutex_lock(&g_log->lock);
+    while (!g_log->stopping) {
+        log_drain();
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        error_code = 0;
+        while (!g_log->stopping && error_code != ETIMEDOUT) {
+            error_code = pthread_cond_timedwait(&g_log->stop, &g_log->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&g_log->lock);
+
+    return NULL;
+}
+
+/**
+ * Write what is left in the ring when exiting, however exit was called.
+ */
+void log_exit() {
+    g_log_flush();
+}
+
+struct LogRecord* g_log_begin(const struct LogSite* site) {
+    struct LogRing* ring = g_log->ring;
+    struct LogRecord* record;
+    size_t position, sequence;
+
+    if (ring == NULL) {
+        record = &log_immediate;
+    } else {
+        position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (;;) {
+            record = &ring->records[position & (LOG_RING_RECORDS - 1)];
+            sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+            if (sequence == position) {
+                if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1, memory_order_relaxed,
+                                                          memory_order_relaxed)) {
+                    break;
+                }
+            } else if ((intptr_t) (sequence - position) < 0) {
+                // Not yet rendered since the ring last came round
+                atomic_fetch_add_explicit(&ring->ndropped, 1, memory_order_relaxed);
+                return NULL;
+            } else {
+                position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            }
+        }
+        record->position = position;
+    }
+
+    record->site = site;
+    record->nargs = 0;
+    record->used = 0;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    return record;
+}
+
+void g_log_signed(struct LogRecord* record, int index, long long value) {
+    record->types[index] = LOG_TYPE_SIGNED;
+    record->args[index].s = value;
+    record->nargs = index + 1;
+}
+
+void g_log_unsigned(struct LogRecord* record, int index, unsigned long long value) {
+    record->types[index] = LOG_TYPE_UNSIGNED;
+    record->args[index].u = value;
+    record->nargs = index + 1;
+}
+
+void g_log_double(struct LogRecord* record, int index, double value) {
+    record->types[index] = LOG_TYPE_DOUBLE;
+    record->args[index].d = value;
+    record->nargs = index + 1;
+}
+
+void g_log_string(struct LogRecord* record, int index, const char* value) {
+    size_t length;
+
+    record->types[index] = LOG_TYPE_STRING;
+    record->args[index].p = value;
+    record->offsets[index] = (unsigned short) record->used;
+    if (value == NULL) {
+        value = "(null)";
+    }
+
+    // The last byte is left null terminated, for strings with no room at all
+    length = strnlen(value, LOG_RECORD_STRINGS - 1 - record->used);
+    memcpy(record->strings + record->used, value, length);
+    record->strings[record->used + length] = '\0';
+    record->used += length < LOG_RECORD_STRINGS - 1 - record->used ? length + 1 : length;
+    record->nargs = index + 1;
+}
+
+void g_log_pointer(struct LogRecord* record, int index, const volatile void* value) {
+    record->types[index] = LOG_TYPE_POINTER;
+    record->args[index].p = value;
+    record->nargs = index + 1;
+}
+
+void g_log_commit(struct LogRecord* record) {
+    char line[LOG_LINE_SIZE];
+
+    if (record == &log_immediate) {
+        log_write(line, log_render(record, line));
+        return;
+    }
+
+    atomic_store_explicit(&record->sequence, record->position + 1, memory_order_release);
+}
+
+void g_log_init() {
+    struct LogRing* ring;
+    pthread_condattr_t attr;
+    sigset_t all, previous;
+    int error_code;
+
+    TRACE("g_log_init()");
+
+    ring = g_heap_allocate(sizeof(struct LogRing));
+    g_log->output = g_heap_allocate(LOG_OUTPUT_SIZE);
+    if (ring == NULL || g_log->output == NULL) {
+        FATALV(FATAL_ERROR_LOG_INIT, "Could not allocate log ring of %zu bytes", sizeof(struct LogRing));
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->ndropped, 0);
+    ring->head = 0;
+    for (size_t r = 0; r < LOG_RING_RECORDS; r++) {
+        atomic_init(&ring->records[r].sequence, r);
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_log->stop, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Messages go to the ring from here on
+    g_log->ring = ring;
+    g_log->stopping = 0;
+
+    // Signals are left to the threads watching for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    error_code = pthread_create(&g_log->thread, NULL, &log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error_code != 0) {
+        g_log->ring = NULL;
+        FATALV(FATAL_ERROR_LOG_INIT, "Could not start log thread: %s", strerror(error_code));
+    }
+
+    atexit(&log_exit);
+}
+
+void g_log_flush() {
+    pthread_mutex_lock(&g_log->lock);
+    if (g_log->ring != NULL) {
+        log_drain();
+    }
+    pthread_mutex_unlock(&g_log->lock);
+}
+
+void g_log_destroy() {
+    int error_code;
+
+    TRACE("g_log_destroy()");
+
+    if (g_log->ring == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_log->lock);
+    g_log->stopping = 1;
+    pthread_cond_signal(&g_log->stop);
+    pthread_mutex_unlock(&g_log->lock);
+
+    error_code = pthread_join(g_log->thread, NULL);
+
+    pthread_mutex_lock(&g_log->lock);
+    log_drain();
+    g_log->ring = NULL;
+    pthread_mutex_unlock(&g_log->lock);
+
+    if (error_code != 0) {
+        ERRORV("Could not stop log thread: %s", strerror(error_code));
+    }
+}
@@ -17,6 +17,20 @@ enum ExitCodes {
     FATAL_ERROR_SIGNAL_INIT,
     FATAL_ERROR_SIGNAL_EXEC,
     FATAL_ERROR_EXEC_FAILURE,
+    FATAL_ERROR_DEDUP_INIT,
+    FATAL_ERROR_JOURNAL_INIT,
+    FATAL_ERROR_CAPTURE_INIT,
+    FATAL_ERROR_SAMPLER_INIT,
+    FATAL_ERROR_SNAPSHOT_INIT,
+    FATAL_ERROR_CORE_INIT,
+    FATAL_ERROR_QUEUE_INIT,
+    FATAL_ERROR_CONTROL_INIT,
+    FATAL_ERROR_WATCH_INIT,
+    FATAL_ERROR_METRICS_INIT,
+    FATAL_ERROR_LOG_INIT,
+    FATAL_ERROR_TRACE_INIT,
+    FATAL_ERROR_SHARED_INIT,
+    FATAL_ERROR_PLAN_INIT,
     FATAL_ERROR_UNREACHABLE_CODE_REACHED
 };
 
@@ -27,8 +41,169 @@ enum ExitCodes {
 #define LOG_LEVEL_TRACE  4
 #define LOG_LEVEL_MEMLOG 5
 
+/**
+ * Most verbose level compiled in, set by the build.  Messages above it are compiled away, their arguments never
+ * evaluated.
+ */
+#ifndef LOG_LEVEL_COMPILED
+#define LOG_LEVEL_COMPILED LOG_LEVEL_TRACE
+#endif
+
+/**
+ * Most arguments a message may have.
+ */
+#define LOG_MAX_ARGS 8
+
+/**
+ * Most verbose level logged at runtime, from the CLI options, up to LOG_LEVEL_COMPILED.
+ */
+extern int g_log_level;
+
+/**
+ * Where a message is logged from, one constant per call site, so records only refer to it.
+ */
+struct LogSite {
+    /**
+     * Level of the message.
+     */
+    int level;
+
+    /**
+     * Name of the level.
+     */
+    const char* name;
+
+    /**
+     * Source file.
+     */
+    const char* file;
+
+    /**
+     * Source line.
+     */
+    int line;
+
+    /**
+     * printf format of the message.
+     */
+    const char* format;
+};
+
+/**
+ * A message being logged, its arguments stored in binary to be formatted later.
+ */
+struct LogRecord;
+
+/**
+ * Start logging a message, claiming a record in the ring without locking or allocating.  Before the ring is
+ * initialized and after it is destroyed, while only one thread runs, messages are written immediately instead.
+ * @param site where the message is logged from
+ * @return the record to store arguments in and commit, or NULL if the ring is full and the message is dropped
+ */
+struct LogRecord* g_log_begin(const struct LogSite* site);
+
+/**
+ * Store a signed integer argument.
+ * @param record the record
+ * @param index index of the argument
+ * @param value the argument
+ */
+void g_log_signed(struct LogRecord* record, int index, long long value);
+
+/**
+ * Store an unsigned integer argument.
+ * @param record the record
+ * @param index index of the argument
+ * @param value the argument
+ */
+void g_log_unsigned(struct LogRecord* record, int index, unsigned long long value);
+
+/**
+ * Store a floating point argument.
+ * @param record the record
+ * @param index index of the argument
+ * @param value the argument
+ */
+void g_log_double(struct LogRecord* record, int index, double value);
+
+/**
+ * Store a string argument, copying it into the record, truncated if it does not fit.
+ * @param record the record
+ * @param index index of the argument
+ * @param value the argument
+ */
+void g_log_string(struct LogRecord* record, int index, const char* value);
+
+/**
+ * Store a pointer argument.
+ * @param record the record
+ * @param index index of the argument
+ * @param value the argument
+ */
+void g_log_pointer(struct LogRecord* record, int index, const volatile void* value);
+
+/**
+ * Finish logging a message, handing its record to the thread draining the ring.
+ * @param record the record
+ */
+void g_log_commit(struct LogRecord* record);
+
+/**
+ * Allocate the ring from the heap and start the thread draining it to stderr, flushing it on exit.
+ */
+void g_log_init();
+
+/**
+ * Write every committed message now, before exiting.
+ */
+void g_log_flush();
+
+/**
+ * Stop the thread draining the ring and write what is left, logging immediately from then on.
+ */
+void g_log_destroy();
+
+/**
+ * Whether messages at a level are logged: a constant for levels compiled away, otherwise one predictable branch.
+ */
+#define LOG_ENABLED(level) \
+    (LOG_LEVEL_##level <= LOG_LEVEL_COMPILED && \
+     __builtin_expect(LOG_LEVEL_##level <= g_log_level, LOG_LEVEL_##level <= LOG_LEVEL_INFO))
+
+/**
+ * Store an argument by its type.
+ */
+#define LOG_ARG(record, index, arg) _Generic((arg),                                                  \
+    char*: g_log_string, const char*: g_log_string,                                                  \
+    _Bool: g_log_unsigned, char: g_log_signed, signed char: g_log_signed, unsigned char: g_log_unsigned, \
+    short: g_log_signed, unsigned short: g_log_unsigned, int: g_log_signed, unsigned int: g_log_unsigned, \
+    long: g_log_signed, unsigned long: g_log_unsigned,                                               \
+    long long: g_log_signed, unsigned long long: g_log_unsigned,                                     \
+    float: g_log_double, double: g_log_double, long double: g_log_double,                            \
+    default: g_log_pointer)((record), (index), (arg))
+
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define LOG_ARGS_SELECT(n) LOG_ARGS_SELECT_(n)
+#define LOG_ARGS_SELECT_(n) LOG_ARGS_##n
+#define LOG_ARGS(record, ...) LOG_ARGS_SELECT(LOG_NARGS(__VA_ARGS__))(record, __VA_ARGS__)
+#define LOG_ARGS_1(r, a1) LOG_ARG(r, 0, a1)
+#define LOG_ARGS_2(r, a1, a2) LOG_ARGS_1(r, a1), LOG_ARG(r, 1, a2)
+#define LOG_ARGS_3(r, a1, a2, a3) LOG_ARGS_2(r, a1, a2), LOG_ARG(r, 2, a3)
+#define LOG_ARGS_4(r, a1, a2, a3, a4) LOG_ARGS_3(r, a1, a2, a3), LOG_ARG(r, 3, a4)
+#define LOG_ARGS_5(r, a1, a2, a3, a4, a5) LOG_ARGS_4(r, a1, a2, a3, a4), LOG_ARG(r, 4, a5)
+#define LOG_ARGS_6(r, a1, a2, a3, a4, a5, a6) LOG_ARGS_5(r, a1, a2, a3, a4, a5), LOG_ARG(r, 5, a6)
+#define LOG_ARGS_7(r, a1, a2, a3, a4, a5, a6, a7) LOG_ARGS_6(r, a1, a2, a3, a4, a5, a6), LOG_ARG(r, 6, a7)
+#define LOG_ARGS_8(r, a1, a2, a3, a4, a5, a6, a7, a8) LOG_ARGS_7(r, a1, a2, a3, a4, a5, a6, a7), LOG_ARG(r, 7, a8)
+
 #define LOG(level, message) \
-    fprintf(stderr, "[salvage] %s(%d) %s#%d: " message "\n", #level, LOG_LEVEL_##level, __FILE__, __LINE__)
+    (LOG_ENABLED(level) ? ({                                                                         \
+        static const struct LogSite log_site = { LOG_LEVEL_##level, #level, __FILE__, __LINE__, message }; \
+        struct LogRecord* log_record = g_log_begin(&log_site);                                       \
+        if (log_record != NULL) {                                                                    \
+            g_log_commit(log_record);                                                                \
+        }                                                                                            \
+    }) : (void) 0)
 #define MEMLOG(message) LOG(MEMLOG, message)
 #define TRACE(message) LOG(TRACE, message)
 #define DEBUG(message) LOG(DEBUG, message)
@@ -37,7 +212,15 @@ enum ExitCodes {
 #define FATAL(code, message) LOGV(FATAL, #code "(%d): " message, code), exit((code))
 
 #define LOGV(level, message, ...) \
-    fprintf(stderr, "[salvage] %s(%d) %s#%d: " message "\n", #level, LOG_LEVEL_##level, __FILE__, __LINE__, __VA_ARGS__)
+    (LOG_ENABLED(level) ? ({                                                                         \
+        static const struct LogSite log_site = { LOG_LEVEL_##level, #level, __FILE__, __LINE__, message }; \
+        struct LogRecord* log_record = g_log_begin(&log_site);                                       \
+        (void) sizeof(printf(message, __VA_ARGS__)); /* Checks the arguments against the format */  \
+        if (log_record != NULL) {                                                                    \
+            LOG_ARGS(log_record, __VA_ARGS__);                                                       \
+            g_log_commit(log_record);                                                                \
+        }                                                                                            \
+    }) : (void) 0)
 #define MEMLOGV(message, ...) LOGV(MEMLOG, message, __VA_ARGS__)
 #define TRACEV(message, ...) LOGV(TRACE, message, __VA_ARGS__)
 #define DEBUGV(message, ...) LOGV(DEBUG, message, __VA_ARGS__)
@@ -0,0 +1,424 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "log.h"
+#include "metrics.h"
+#include "opts.h"
+
+/**
+ * Bytes of metrics text at most.
+ */
+#define METRICS_TEXT_SIZE (16 * 1024)
+
+/**
+ * Number of histogram bucket bounds, an overflow bucket following them.
+ */
+#define METRICS_BOUNDS 13
+
+/**
+ * Histogram bucket upper bounds in microseconds.
+ */
+const int64_t metrics_bounds_us[METRICS_BOUNDS] = {
+    5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/**
+ * Failure reason labels, indexed by MetricsFailure.
+ */
+const char* metrics_failure_names[METRICS_FAILURES] = { "transport", "timeout", "aborted", "server", "client" };
+
+/**
+ * Histogram of durations, updated without locking.
+ */
+struct MetricsHistogram {
+    /**
+     * Observations falling in each bucket, not cumulative, the last being those beyond every bound.
+     */
+    atomic_ullong buckets[METRICS_BOUNDS + 1];
+
+    /**
+     * Sum of observations in microseconds.
+     */
+    atomic_ullong sum_us;
+};
+
+/**
+ * Metrics state.  Counters are updated without locking from any thread, and read by the thread writing them.
+ */
+struct Metrics {
+    /**
+     * Requests started.
+     */
+    atomic_ullong started;
+
+    /**
+     * Requests succeeded.
+     */
+    atomic_ullong succeeded;
+
+    /**
+     * Requests failed, indexed by MetricsFailure.
+     */
+    atomic_ullong failed[METRICS_FAILURES];
+
+    /**
+     * Uploads tried again.
+     */
+    atomic_ullong retried;
+
+    /**
+     * Bytes sent by finished requests.
+     */
+    atomic_ullong bytes;
+
+    /**
+     * Durations of finished requests.
+     */
+    struct MetricsHistogram durations;
+
+    /**
+     * Latencies from a trigger to the first byte sent after it.
+     */
+    struct MetricsHistogram latencies;
+
+    /**
+     * Monotonic nanoseconds uploading was last triggered at, or 0 once sending.
+     */
+    atomic_llong triggered_ns;
+
+    /**
+     * Text the metrics are formatted into, from the heap, or NULL if not writing a file.
+     */
+    char* text;
+
+    /**
+     * Bytes of text formatted.
+     */
+    size_t used;
+
+    /**
+     * Guards stopping.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled to stop the thread writing the metrics file.
+     */
+    pthread_cond_t stop;
+
+    /**
+     * Whether the thread writing the metrics file is asked to stop.
+     */
+    int stopping;
+
+    /**
+     * Thread writing the metrics file.
+     */
+    pthread_t thread;
+};
+
+/**
+ * The metrics instance.
+ */
+struct Metrics g_metrics_instance = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Pointer to the metrics instance.
+ */
+struct Metrics* g_metrics = &g_metrics_instance;
+
+/**
+ * Monotonic clock in nanoseconds.
+ * @return nanoseconds
+ */
+int64_t metrics_now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Add an observation to a histogram.
+ * @param histogram the histogram
+ * @param value_us the observation in microseconds
+ */
+void metrics_observe(struct MetricsHistogram* histogram, int64_t value_us) {
+    int b = 0;
+
+    while (b < METRICS_BOUNDS && value_us > metrics_bounds_us[b]) {
+        b++;
+    }
+
+    atomic_fetch_add_explicit(&histogram->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_us, value_us > 0 ? value_us : 0, memory_order_relaxed);
+}
+
+/**
+ * Append to the metrics text, truncating once it is full.
+ * @param format printf format
+ */
+void metrics_append(const char* format, ...) {
+    va_list args;
+    int length;
+
+    if (g_metrics->used >= METRICS_TEXT_SIZE - 1) {
+        return;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(g_metrics->text + g_metrics->used, METRICS_TEXT_SIZE - g_metrics->used, format, args);
+    va_end(args);
+
+    if (length > 0) {
+        g_metrics->used += (size_t) length;
+    }
+}
+
+/**
+ * Append a metric's help and type lines.
+ * @param name name of the metric
+ * @param type Prometheus type of the metric
+ * @param help description of the metric
+ */
+void metrics_describe(const char* name, const char* type, const char* help) {
+    metrics_append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Append a histogram of durations in seconds.
+ * @param name name of the metric
+ * @param help description of the metric
+ * @param histogram the histogram
+ */
+void metrics_append_histogram(const char* name, const char* help, struct MetricsHistogram* histogram) {
+    unsigned long long cumulative = 0;
+
+    metrics_describe(name, "histogram", help);
+    for (int b = 0; b < METRICS_BOUNDS; b++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        metrics_append("%s_bucket{le=\"%g\"} %llu\n", name, metrics_bounds_us[b] / 1e6, cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram->buckets[METRICS_BOUNDS], memory_order_relaxed);
+    metrics_append("%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+    metrics_append("%s_sum %.6f\n", name, atomic_load_explicit(&histogram->sum_us, memory_order_relaxed) / 1e6);
+    metrics_append("%s_count %llu\n", name, cumulative);
+}
+
+/**
+ * Format every metric into the metrics text, in the Prometheus text format.
+ */
+void metrics_format() {
+    g_metrics->used = 0;
+
+    metrics_describe("salvage_uploads_started_total", "counter", "HTTP upload requests started.");
+    metrics_append("salvage_uploads_started_total %llu\n", atomic_load(&g_metrics->started));
+
+    metrics_describe("salvage_uploads_succeeded_total", "counter", "HTTP upload requests succeeded.");
+    metrics_append("salvage_uploads_succeeded_total %llu\n", atomic_load(&g_metrics->succeeded));
+
+    metrics_describe("salvage_uploads_failed_total", "counter", "HTTP upload requests failed, by reason.");
+    for (int f = 0; f < METRICS_FAILURES; f++) {
+        metrics_append("salvage_uploads_failed_total{reason=\"%s\"} %llu\n", metrics_failure_names[f],
+                       atomic_load(&g_metrics->failed[f]));
+    }
+
+    metrics_describe("salvage_upload_retries_total", "counter", "File uploads tried again after a recoverable failure.");
+    metrics_append("salvage_upload_retries_total %llu\n", atomic_load(&g_metrics->retried));
+
+    metrics_describe("salvage_upload_bytes_total", "counter", "Bytes sent by finished HTTP upload requests.");
+    metrics_append("salvage_upload_bytes_total %llu\n", atomic_load(&g_metrics->bytes));
+
+    metrics_append_histogram("salvage_upload_duration_seconds", "Duration of finished HTTP upload requests.",
+                             &g_metrics->durations);
+    metrics_append_histogram("salvage_trigger_to_first_byte_seconds",
+                             "Latency from a signal, termination or command calling for uploads to the first byte sent.",
+                             &g_metrics->latencies);
+
+    metrics_describe("salvage_heap_used_bytes", "gauge",
+                     "Bytes of the locked heap allocated, rewound after each resident job or restarted run.");
+    metrics_append("salvage_heap_used_bytes %zu\n", g_heap_used());
+
+    metrics_describe("salvage_heap_high_water_bytes", "gauge",
+                     "Most bytes of the locked heap ever allocated at once, however far rewound since.");
+    metrics_append("salvage_heap_high_water_bytes %zu\n", g_heap_high_water());
+
+    metrics_describe("salvage_heap_size_bytes", "gauge", "Bytes of the locked heap.");
+    metrics_append("salvage_heap_size_bytes %zu\n", g_heap_size());
+}
+
+/**
+ * Write the metrics file, replacing it atomically so collectors never read it half written.
+ */
+void metrics_write() {
+    char temporary[PATH_MAX];
+    ssize_t nwritten;
+    size_t offset = 0;
+    int fd;
+
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", g_opts->metrics_file) >= (int) sizeof(temporary)) {
+        ERRORV("%s is too long a metrics file path", g_opts->metrics_file);
+        return;
+    }
+
+    metrics_format();
+
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        ERRORV("Could not open %s: %s", temporary, strerror(errno));
+        return;
+    }
+    while (offset < g_metrics->used) {
+        nwritten = write(fd, g_metrics->text + offset, g_metrics->used - offset);
+        if (nwritten == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            ERRORV("Could not write %s: %s", temporary, strerror(errno));
+            close(fd);
+            return;
+        }
+        offset += nwritten;
+    }
+    close(fd);
+
+    if (rename(temporary, g_opts->metrics_file) != 0) {
+        ERRORV("Could not replace %s: %s", g_opts->metrics_file, strerror(errno));
+    }
+}
+
+/**
+ * Thread writing the metrics file every METRICS_WRITE_MS until asked to stop.
+ * @param arg unused
+ * @return NULL
+ */
+void* metrics_thread(void* arg) {
+    struct timespec deadline;
+    int error_code;
+
+    TRACEV("metrics_thread(%p)", arg);
+
+    pthread_mutex_lock(&g_metrics->lock);
+    while (!g_metrics->stopping) {
+        metrics_write();
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += METRICS_WRITE_MS / 1000;
+        deadline.tv_nsec += (METRICS_WRITE_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        error_code = 0;
+        while (!g_metrics->stopping && error_code != ETIMEDOUT) {
+            error_code = pthread_cond_timedwait(&g_metrics->stop, &g_metrics->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&g_metrics->lock);
+
+    return NULL;
+}
+
+void g_metrics_init() {
+    pthread_condattr_t attr;
+    sigset_t all, previous;
+    int error_code;
+
+    TRACE("g_metrics_init()");
+
+    if (g_opts->metrics_file == NULL) {
+        return;
+    }
+
+    g_metrics->text = g_heap_allocate(METRICS_TEXT_SIZE);
+    if (g_metrics->text == NULL) {
+        FATALV(FATAL_ERROR_METRICS_INIT, "Could not allocate %d bytes of metrics", METRICS_TEXT_SIZE);
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_metrics->stop, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Signals are left to the threads watching for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    error_code = pthread_create(&g_metrics->thread, NULL, &metrics_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error_code != 0) {
+        FATALV(FATAL_ERROR_METRICS_INIT, "Could not start metrics thread: %s", strerror(error_code));
+    }
+
+    INFOV("Writing metrics to %s every %dms", g_opts->metrics_file, METRICS_WRITE_MS);
+}
+
+void g_metrics_started() {
+    atomic_fetch_add_explicit(&g_metrics->started, 1, memory_order_relaxed);
+}
+
+void g_metrics_finished(int failure, int64_t bytes, int64_t duration_us) {
+    if (failure < 0) {
+        atomic_fetch_add_explicit(&g_metrics->succeeded, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&g_metrics->failed[failure], 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&g_metrics->bytes, bytes > 0 ? bytes : 0, memory_order_relaxed);
+    metrics_observe(&g_metrics->durations, duration_us);
+}
+
+void g_metrics_retried() {
+    atomic_fetch_add_explicit(&g_metrics->retried, 1, memory_order_relaxed);
+}
+
+void g_metrics_triggered() {
+    long long expected = 0;
+
+    atomic_compare_exchange_strong(&g_metrics->triggered_ns, &expected, metrics_now_ns());
+}
+
+void g_metrics_sending() {
+    long long triggered_ns;
+
+    // Called for every progress update, so the common case is one load
+    if (atomic_load_explicit(&g_metrics->triggered_ns, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    triggered_ns = atomic_exchange(&g_metrics->triggered_ns, 0);
+    if (triggered_ns != 0) {
+        metrics_observe(&g_metrics->latencies, (metrics_now_ns() - triggered_ns) / 1000);
+    }
+}
+
+void g_metrics_destroy() {
+    int error_code;
+
+    TRACE("g_metrics_destroy()");
+
+    if (g_metrics->text == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_metrics->lock);
+    g_metrics->stopping = 1;
+    pthread_cond_signal(&g_metrics->stop);
+    pthread_mutex_unlock(&g_metrics->lock);
+
+    error_code = pthread_join(g_metrics->thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not stop metrics thread: %s", strerror(error_code));
+    }
+
+    metrics_write();
+    g_metrics->text = NULL;
+}
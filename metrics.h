@@ -0,0 +1,63 @@
+#ifndef JETSAM_METRICS_H
+#define JETSAM_METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Milliseconds between writes of the metrics file.
+ */
+#define METRICS_WRITE_MS 5000
+
+/**
+ * Why a request failed, labelling the failure counter.
+ */
+enum MetricsFailure {
+    METRICS_FAILURE_TRANSPORT = 0,
+    METRICS_FAILURE_TIMEOUT,
+    METRICS_FAILURE_ABORTED,
+    METRICS_FAILURE_SERVER,
+    METRICS_FAILURE_CLIENT,
+    METRICS_FAILURES
+};
+
+/**
+ * Initialize metrics and, if a metrics file is configured in the CLI options, allocate the text it is written from on
+ * the heap and start the thread writing it every METRICS_WRITE_MS.  Metrics are kept either way.
+ */
+void g_metrics_init();
+
+/**
+ * Count a request started.
+ */
+void g_metrics_started();
+
+/**
+ * Count a request finished.
+ * @param failure a MetricsFailure, or -1 if it succeeded
+ * @param bytes bytes sent
+ * @param duration_us microseconds the request took
+ */
+void g_metrics_finished(int failure, int64_t bytes, int64_t duration_us);
+
+/**
+ * Count an upload about to be tried again.
+ */
+void g_metrics_retried();
+
+/**
+ * Note that uploading was called for, by a signal, the program terminating or a command, unless already noted and not
+ * yet sending.
+ */
+void g_metrics_triggered();
+
+/**
+ * Note that a request is sending, observing the latency from the trigger to the first byte if this is the first since.
+ */
+void g_metrics_sending();
+
+/**
+ * Write the metrics file a last time, if configured, and stop the thread writing it.
+ */
+void g_metrics_destroy();
+
+#endif //JETSAM_METRICS_H
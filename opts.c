@@ -3,8 +3,14 @@
 #include <string.h>
 #include <strings.h>
 
+#include "checksum.h"
 #include "log.h"
+#include "metrics.h"
 #include "opts.h"
+#include "pressure.h"
+#include "salvage_shm.h"
+#include "sampler.h"
+#include "trace.h"
 
 /**
  * The options instance.
@@ -16,6 +22,92 @@ struct Options g_opts_instance;
  */
 struct Options* g_opts = NULL;
 
+/**
+ * Parse a comma separated list of checksum algorithms.
+ * @param list the list, e.g. "crc32c,sha256"
+ * @return bit flags of the algorithms, or -1 if any is unknown
+ */
+int opts_parse_checksums(const char* list) {
+    int checksums = 0;
+    size_t length;
+
+    while (*list != '\0') {
+        length = strcspn(list, ",");
+        if (length == strlen("crc32c") && strncasecmp(list, "crc32c", length) == 0) {
+            checksums |= CHECKSUM_CRC32C;
+        } else if (length == strlen("sha256") && strncasecmp(list, "sha256", length) == 0) {
+            checksums |= CHECKSUM_SHA256;
+        } else {
+            return -1;
+        }
+
+        list += length;
+        if (*list == ',') {
+            list++;
+        }
+    }
+
+    return checksums;
+}
+
+/**
+ * Check a PSI trigger is one the kernel accepts.
+ * @param trigger the trigger, e.g. "some 150000 1000000"
+ * @return 1 if and only if valid
+ */
+int opts_valid_pressure_trigger(const char* trigger) {
+    char type[8];
+    long stall_us, window_us;
+    char end;
+
+    if (sscanf(trigger, "%7s %ld %ld %c", type, &stall_us, &window_us, &end) != 3) {
+        return 0;
+    }
+
+    return (strcmp(type, "some") == 0 || strcmp(type, "full") == 0) &&
+           window_us >= 500000 && window_us <= 10000000 && stall_us > 0 && stall_us <= window_us;
+}
+
+/**
+ * Parse a log level, by name or number.
+ * @param level the level, error, info, debug, trace, memlog or LOG_LEVEL_ERROR to LOG_LEVEL_MEMLOG
+ * @return the level, or -1 if invalid
+ */
+int opts_parse_log_level(const char* level) {
+    const char* names[] = { "fatal", "error", "info", "debug", "trace", "memlog" };
+    char* end;
+    long number;
+
+    for (int l = LOG_LEVEL_ERROR; l <= LOG_LEVEL_MEMLOG; l++) {
+        if (strcasecmp(level, names[l]) == 0) {
+            return l;
+        }
+    }
+
+    number = strtol(level, &end, 10);
+    return *level != '\0' && *end == '\0' && number >= LOG_LEVEL_ERROR && number <= LOG_LEVEL_MEMLOG ? (int) number : -1;
+}
+
+/**
+ * Validate a watch pattern, which must name files rather than only a directory.
+ * @param pattern the pattern
+ * @return 1 if and only if valid
+ */
+int opts_valid_watch(const char* pattern) {
+    size_t length = strlen(pattern);
+
+    return length > 0 && pattern[length - 1] != '/';
+}
+
+/**
+ * Whether flotsam stays resident, taking files to upload from commands or watches rather than only the CLI options, so
+ * needs neither files nor a program.
+ * @return 1 if and only if resident
+ */
+int opts_resident() {
+    return g_opts->control_socket != NULL || g_opts->nwatches > 0;
+}
+
 void g_opts_init() {
     TRACE("g_opts_init()");
     g_opts = &g_opts_instance;
@@ -31,9 +123,12 @@ int g_opts_parse(int argc, char* argv[]) {
 
     g_opts->heap_size = DEFAULT_HEAP_SIZE;
     g_opts->quiesce_secs = DEFAULT_QUIESCE_SECS;
+    g_opts->kill_timeout_ms = DEFAULT_KILL_TIMEOUT_MS;
     g_opts->max_attempts = DEFAULT_MAX_ATTEMPTS;
+    g_opts->max_parallel = DEFAULT_MAX_PARALLEL;
+    g_opts->restart_backoff_ms = DEFAULT_RESTART_BACKOFF_MS;
 
-    while ((opt = getopt(argc, argv, "s:m:u:c:f:h:q:")) != -1) {
+    while ((opt = getopt(argc, argv, "s:m:u:b:c:C:d:D:e:f:h:i:j:k:M:o:Op:P:q:Q:r:R:S:t:T:J:U:v:w:W:X:")) != -1) {
         DEBUGV("Encountered option %c", opt);
 
         switch (opt) {
@@ -46,13 +141,73 @@ int g_opts_parse(int argc, char* argv[]) {
                 INFOV("HTTP method is: %s", optarg);
                 break;
             case 'u':
-                g_opts->url = optarg;
-                INFOV("HTTP base URL is: %s", optarg);
+                if (g_opts->nurls == MAX_URLS) {
+                    return OPTS_PARSE_URL_OVERFLOW;
+                }
+                g_opts->urls[g_opts->nurls++] = optarg;
+                INFOV("HTTP base URL %d is: %s", g_opts->nurls, optarg);
                 break;
             case 'c':
                 g_opts->certificate = optarg;
                 INFOV("Certificate is: %s", optarg);
                 break;
+            case 'W':
+                if (g_opts->nwatches == MAX_WATCHES || !opts_valid_watch(optarg)) {
+                    return OPTS_PARSE_BAD_WATCH;
+                }
+                g_opts->watches[g_opts->nwatches++] = optarg;
+                INFOV("Watch %d is: %s", g_opts->nwatches, optarg);
+                break;
+            case 'v':
+                g_log_level = opts_parse_log_level(optarg);
+                if (g_log_level < 0) {
+                    g_log_level = LOG_LEVEL_INFO;
+                    return OPTS_PARSE_BAD_LOG_LEVEL;
+                }
+                if (g_log_level > LOG_LEVEL_COMPILED) {
+                    ERRORV("Log level %s is more verbose than compiled in, level %d", optarg, LOG_LEVEL_COMPILED);
+                }
+                INFOV("Log level is: %s", optarg);
+                break;
+            case 'X':
+                g_opts->metrics_file = optarg;
+                INFOV("Metrics file is: %s", optarg);
+                break;
+            case 'J':
+                g_opts->trace_file = optarg;
+                INFOV("Trace file is: %s", optarg);
+                break;
+            case 'U':
+                g_opts->control_socket = optarg;
+                INFOV("Control socket is: %s", optarg);
+                break;
+            case 'C':
+                g_opts->core_directory = optarg;
+                INFOV("Core directory is: %s", optarg);
+                break;
+            case 'd':
+                g_opts->dedup_index = optarg;
+                INFOV("Chunk index is: %s", optarg);
+                break;
+            case 'j':
+                g_opts->journal = optarg;
+                INFOV("Journal is: %s", optarg);
+                break;
+            case 'e':
+                if (g_opts->nenv == MAX_ENV || strchr(optarg, '=') == NULL) {
+                    return OPTS_PARSE_BAD_ENV;
+                }
+                g_opts->env[g_opts->nenv++] = optarg;
+                INFOV("Environment variable %d is: %s", g_opts->nenv, optarg);
+                break;
+            case 'i':
+                g_opts->exec_stdin = optarg;
+                INFOV("Program stdin is: %s", optarg);
+                break;
+            case 'w':
+                g_opts->exec_directory = optarg;
+                INFOV("Program working directory is: %s", optarg);
+                break;
             case 'h':
                 g_opts->headers[g_opts->nheaders++] = optarg;
                 if (g_opts->nheaders == MAX_HEADERS) {
@@ -67,23 +222,84 @@ int g_opts_parse(int argc, char* argv[]) {
                 }
                 INFOV("File %d is: %s", g_opts->nfiles, optarg);
                 break;
+            case 'k':
+                g_opts->checksums = opts_parse_checksums(optarg);
+                if (g_opts->checksums <= 0) {
+                    return OPTS_PARSE_BAD_CHECKSUM;
+                }
+                INFOV("Checksums are: %s", optarg);
+                break;
+            case 'p':
+                g_opts->max_parallel = atoi(optarg);
+                INFOV("Max parallel uploads is: %s", optarg);
+                break;
             case 'q':
                 g_opts->quiesce_secs = atoi(optarg);
                 INFOV("Quiesce is: %s", optarg);
                 break;
+            case 'Q':
+                g_opts->settle_ms = atoi(optarg);
+                INFOV("Settle window is: %s", optarg);
+                break;
+            case 'P':
+                g_opts->pressure_trigger = optarg;
+                INFOV("Pressure trigger is: %s", optarg);
+                break;
+            case 'M':
+                g_opts->pressure_file = optarg;
+                INFOV("Pressure file is: %s", optarg);
+                break;
+            case 'T':
+                g_opts->snapshot_ms = atoi(optarg);
+                INFOV("Snapshot budget is: %s", optarg);
+                break;
+            case 'S':
+                g_opts->sample_ms = atoi(optarg);
+                INFOV("Sample interval is: %s", optarg);
+                break;
+            case 'o':
+                g_opts->output_size = atoi(optarg);
+                INFOV("Output capture size is: %s", optarg);
+                break;
+            case 'O':
+                g_opts->pin_files = 1;
+                INFO("Files are opened at startup");
+                break;
+            case 'D':
+                g_opts->shared_size = atoi(optarg);
+                INFOV("Shared ring buffer size is: %s", optarg);
+                break;
+            case 'r':
+                g_opts->max_rate = atol(optarg);
+                INFOV("Max upload rate is: %s", optarg);
+                break;
+            case 'R':
+                g_opts->max_restarts = atoi(optarg);
+                INFOV("Max restarts is: %s", optarg);
+                break;
+            case 'b':
+                g_opts->restart_backoff_ms = atoi(optarg);
+                INFOV("Restart backoff is: %s", optarg);
+                break;
+            case 't':
+                g_opts->kill_timeout_ms = atoi(optarg);
+                INFOV("Kill timeout is: %s", optarg);
+                break;
             case '?':
             default:
                 return OPTS_PARSE_SYNTAX;
         }
     }
 
-    if (argc - optind < 1) {
+    if (argc - optind < 1 && !opts_resident()) {
         DEBUG("No exec pathname provided");
         return OPTS_PARSE_NO_EXEC;
     }
 
-    g_opts->exec_pathname = argv[optind];
-    INFOV("Exec pathname is: %s", g_opts->exec_pathname);
+    if (optind < argc) {
+        g_opts->exec_pathname = argv[optind];
+        INFOV("Exec pathname is: %s", g_opts->exec_pathname);
+    }
 
     for (optind = optind + 1; optind < argc; optind++) {
         g_opts->exec_args[g_opts->exec_nargs++] = argv[optind];
@@ -99,32 +315,96 @@ int g_opts_parse(int argc, char* argv[]) {
         return OPTS_PARSE_BAD_MAX_ATTEMPTS;
     }
 
+    if (g_opts->settle_ms < 0) {
+        DEBUG("Illegal settle ms");
+        return OPTS_PARSE_BAD_SETTLE_MS;
+    }
+
+    if (g_opts->kill_timeout_ms < 0) {
+        DEBUG("Illegal kill timeout");
+        return OPTS_PARSE_BAD_KILL_TIMEOUT;
+    }
+
+    if (g_opts->max_rate < 0) {
+        DEBUG("Illegal max rate");
+        return OPTS_PARSE_BAD_MAX_RATE;
+    }
+
+    if (g_opts->max_parallel < 1 || g_opts->max_parallel > MAX_PARALLEL) {
+        DEBUG("Illegal max parallel");
+        return OPTS_PARSE_BAD_MAX_PARALLEL;
+    }
+
     if (g_opts->heap_size < MIN_HEAP_SIZE) {
         DEBUG("Illegal heap size");
         return OPTS_PARSE_BAD_HEAP_SIZE;
     }
 
+    if (g_opts->pressure_trigger != NULL && !opts_valid_pressure_trigger(g_opts->pressure_trigger)) {
+        DEBUG("Illegal pressure trigger");
+        return OPTS_PARSE_BAD_PRESSURE;
+    }
+
+    if (g_opts->snapshot_ms < 0) {
+        DEBUG("Illegal snapshot ms");
+        return OPTS_PARSE_BAD_SNAPSHOT_MS;
+    }
+
+    if (g_opts->sample_ms < 0) {
+        DEBUG("Illegal sample ms");
+        return OPTS_PARSE_BAD_SAMPLE_MS;
+    }
+
+    if (g_opts->max_restarts < 0) {
+        DEBUG("Illegal max restarts");
+        return OPTS_PARSE_BAD_RESTARTS;
+    }
+
+    if (g_opts->restart_backoff_ms < 0) {
+        DEBUG("Illegal restart backoff");
+        return OPTS_PARSE_BAD_BACKOFF_MS;
+    }
+
+    // Both streams are kept in the heap, twice over when restarting, which must still have room for everything else
+    if (g_opts->output_size < 0 ||
+            (g_opts->max_restarts > 0 ? 4L : 2L) * g_opts->output_size > g_opts->heap_size - MIN_HEAP_SIZE) {
+        DEBUG("Illegal output size");
+        return OPTS_PARSE_BAD_OUTPUT_SIZE;
+    }
+
+    if (g_opts->shared_size < 0) {
+        DEBUG("Illegal shared size");
+        return OPTS_PARSE_BAD_SHARED_SIZE;
+    }
+
     if (g_opts->quiesce_secs < 0) {
         DEBUG("Illegal quiesce secs");
         return OPTS_PARSE_BAD_QUIESCE_SECS;
     }
 
-    if (g_opts->url == NULL || strlen(g_opts->url) == 0) {
-        DEBUG("Illegal URL");
+    if (g_opts->nurls == 0) {
+        DEBUG("No URL");
         return OPTS_PARSE_BAD_URL;
     }
 
+    for (int i = 0; i < g_opts->nurls; i++) {
+        if (strlen(g_opts->urls[i]) == 0) {
+            DEBUG("Illegal URL");
+            return OPTS_PARSE_BAD_URL;
+        }
+    }
+
     if (g_opts->method == NULL || strlen(g_opts->method) == 0) {
         DEBUG("Illegal method");
         return OPTS_PARSE_BAD_METHOD;
     }
 
-    if (g_opts->exec_pathname == NULL || strlen(g_opts->exec_pathname) == 0) {
+    if (!opts_resident() && (g_opts->exec_pathname == NULL || strlen(g_opts->exec_pathname) == 0)) {
         DEBUG("Illegal exec path");
         return OPTS_PARSE_NO_EXEC;
     }
 
-    if (g_opts->nfiles == 0) {
+    if (g_opts->nfiles == 0 && !opts_resident()) {
         DEBUG("No files");
         return OPTS_PARSE_NO_FILES;
     }
@@ -170,16 +450,89 @@ void g_opts_usage(char* image_name, int opts_parse_result) {
             break;
         case OPTS_PARSE_BAD_MAX_ATTEMPTS:
             ERROR("Invalid max attempts provided.  Must be 1 or more");
+            break;
+        case OPTS_PARSE_BAD_CHECKSUM:
+            ERROR("Invalid checksums provided.  Must be crc32c, sha256 or both separated by a comma");
+            break;
+        case OPTS_PARSE_URL_OVERFLOW:
+            ERRORV("Too many URLs parsed.  Only %d URLs are supported", MAX_URLS);
+            break;
+        case OPTS_PARSE_BAD_MAX_RATE:
+            ERROR("Invalid max upload rate provided.  Must be 0 or more bytes per second");
+            break;
+        case OPTS_PARSE_BAD_MAX_PARALLEL:
+            ERRORV("Invalid max parallel uploads provided.  Must be between 1 and %d", MAX_PARALLEL);
+            break;
+        case OPTS_PARSE_BAD_KILL_TIMEOUT:
+            ERROR("Invalid kill timeout provided.  Must be 0 or more milliseconds");
+            break;
+        case OPTS_PARSE_BAD_ENV:
+            ERRORV("Invalid environment variable provided.  Must be NAME=VALUE, up to %d variables", MAX_ENV);
+            break;
+        case OPTS_PARSE_BAD_SETTLE_MS:
+            ERROR("Invalid settle window provided.  Must be 0 or more milliseconds");
+            break;
+        case OPTS_PARSE_BAD_PRESSURE:
+            ERROR("Invalid pressure trigger provided.  Must be some or full, then stall and window microseconds, the window between 500000 and 10000000 and no shorter than the stall");
+            break;
+        case OPTS_PARSE_BAD_SNAPSHOT_MS:
+            ERROR("Invalid snapshot budget provided.  Must be 0 or more milliseconds");
+            break;
+        case OPTS_PARSE_BAD_SAMPLE_MS:
+            ERROR("Invalid sample interval provided.  Must be 0 or more milliseconds");
+            break;
+        case OPTS_PARSE_BAD_RESTARTS:
+            ERROR("Invalid max restarts provided.  Must be 0 or more");
+            break;
+        case OPTS_PARSE_BAD_BACKOFF_MS:
+            ERROR("Invalid restart backoff provided.  Must be 0 or more milliseconds");
+            break;
+        case OPTS_PARSE_BAD_LOG_LEVEL:
+            ERROR("Invalid log level provided.  Must be error, info, debug, trace or memlog, or 1 to 5");
+            break;
+        case OPTS_PARSE_BAD_WATCH:
+            ERRORV("Invalid watch provided.  Must be DIRECTORY/NAME_GLOB, up to %d watches", MAX_WATCHES);
+            break;
+        case OPTS_PARSE_BAD_OUTPUT_SIZE:
+            ERRORV("Invalid output capture size provided.  Must be 0 or more bytes, twice which, or four times when restarting, leaves %d bytes of heap", MIN_HEAP_SIZE);
+            break;
+        case OPTS_PARSE_BAD_SHARED_SIZE:
+            ERROR("Invalid shared ring buffer size provided.  Must be 0 or more bytes");
     }
 
-    EXPLAINV("Usage: %s -u URL -f FILE [-f ...] [-n MAX_ATTEMPTS] [-q QUIESCE_SECS] [-m METHOD] [-s HEAP_SIZE] [-c CERTIFICATE] [-h HEADER [-h ...]] PROGRAM ARG [...]", image_name);
-    EXPLAIN("\t-u URL\tURL to upload to (required)");
+    EXPLAINV("Usage: %s -u URL [-u ...] -f FILE [-f ...] [-n MAX_ATTEMPTS] [-r MAX_RATE] [-p MAX_PARALLEL] [-q QUIESCE_SECS] [-Q SETTLE_MS] [-t KILL_TIMEOUT_MS] [-T SNAPSHOT_MS] [-m METHOD] [-s HEAP_SIZE] [-c CERTIFICATE] [-d CHUNK_INDEX] [-j JOURNAL] [-O] [-k CHECKSUMS] [-h HEADER [-h ...]] [-e NAME=VALUE [-e ...]] [-w DIRECTORY] [-i STDIN] [-o OUTPUT_SIZE] [-D SHARED_SIZE] [-S SAMPLE_MS] [-P PRESSURE_TRIGGER] [-M PRESSURE_FILE] [-C CORE_DIRECTORY] [-R MAX_RESTARTS] [-b BACKOFF_MS] [-U CONTROL_SOCKET] [-W WATCH [-W ...]] [-X METRICS_FILE] [-J TRACE_FILE] [-v LOG_LEVEL] PROGRAM ARG [...]", image_name);
+    EXPLAINV("\t-u URL\tURL to upload to (required, multiple, up to %d URLs, every file goes to every URL)", MAX_URLS);
     EXPLAINV("\t-f FILE\tFile to upload (required, multiple, up to %d files)", MAX_FILES);
     EXPLAINV("\t-n MAX_ATTEMPTS\tMax attempts to upload a file (optional, default %d)", DEFAULT_MAX_ATTEMPTS);
+    EXPLAIN("\t-r MAX_RATE\tCeiling in bytes per second the upload rate adapts within (optional, default no ceiling)");
+    EXPLAINV("\t-p MAX_PARALLEL\tCeiling on files uploaded at once, adapted within (optional, default %d, up to %d)", DEFAULT_MAX_PARALLEL, MAX_PARALLEL);
     EXPLAINV("\t-q QUIESCE_SECS\tSeconds to wait after abnormal termination before uploading (optional, default %d)", DEFAULT_QUIESCE_SECS);
+    EXPLAIN("\t-Q SETTLE_MS\tUpload once files have been unchanged this long, QUIESCE_SECS at most (optional, default always wait QUIESCE_SECS)");
+    EXPLAINV("\t-t KILL_TIMEOUT_MS\tMilliseconds after forwarding SIGTERM or SIGINT to the program before sending SIGKILL (optional, default %d)", DEFAULT_KILL_TIMEOUT_MS);
+    EXPLAIN("\t-T SNAPSHOT_MS\tBefore forwarding SIGTERM or SIGINT, spend up to this long snapshotting the program's /proc files to upload (optional, default no snapshot)");
     EXPLAINV("\t-m METHOD\tHTTP method to upload with (optional, default %s)", DEFAULT_METHOD);
     EXPLAINV("\t-s HEAP_SIZE\tHeap size (optional, default %dB)", DEFAULT_HEAP_SIZE);
+    EXPLAIN("\t-d CHUNK_INDEX\tUpload files as deduplicated chunks, remembering uploaded chunks in this file (optional)");
+    EXPLAIN("\t-j JOURNAL\tRecord upload progress in this file, skipping files a previous run uploaded (optional)");
+    EXPLAIN("\t-O\tOpen the files and their directories at startup, following files replaced at their paths, so uploads and retries look no paths up and files unlinked or renamed away are still uploaded (optional)");
+    EXPLAIN("\t-k CHECKSUMS\tChecksums to send with uploads, crc32c and/or sha256 comma separated (optional)");
     EXPLAINV("\t-h HEADER\tHeader to send with upload (optional, multiple, up to %d headers)", MAX_HEADERS);
+    EXPLAINV("\t-e NAME=VALUE\tEnvironment variable to add or replace for the program (optional, multiple, up to %d variables)", MAX_ENV);
+    EXPLAIN("\t-w DIRECTORY\tWorking directory for the program (optional, default ours)");
+    EXPLAIN("\t-i STDIN\tFile to open as stdin for the program (optional, default ours)");
+    EXPLAIN("\t-o OUTPUT_SIZE\tPass the program's stdout and stderr through, keeping the last OUTPUT_SIZE bytes of each to upload (optional, default inherited and not uploaded)");
+    EXPLAINV("\t-D SHARED_SIZE\tShare a ring buffer of this many bytes with the program, passing its memfd in %s for salvage_shm.h, and upload what it holds as shared (optional, default no shared memory)", SALVAGE_SHM_ENV);
+    EXPLAINV("\t-S SAMPLE_MS\tSample the program's resource usage this often, keeping the last %d samples to upload (optional, default no sampling)", SAMPLER_MAX_SAMPLES);
+    EXPLAIN("\t-P PRESSURE_TRIGGER\tStart uploading while the program runs once memory stalls \"some|full STALL_US WINDOW_US\" (optional)");
+    EXPLAINV("\t-M PRESSURE_FILE\tPSI file, or file in its format to poll, the trigger is on (optional, default the program's cgroup's, or %s)", PRESSURE_DEFAULT_FILE);
+    EXPLAIN("\t-C CORE_DIRECTORY\tDirectory core dumps are written to, those written by the program being uploaded without their holes (optional)");
+    EXPLAIN("\t-R MAX_RESTARTS\tRestart the program after abnormal termination, up to this many times in a row, uploading each run in the background under run-N/ (optional, default never)");
+    EXPLAINV("\t-b BACKOFF_MS\tMilliseconds before the first restart in a row, doubling for each after (optional, default %d)", DEFAULT_RESTART_BACKOFF_MS);
+    EXPLAIN("\t-U CONTROL_SOCKET\tflotsam only: stay resident, taking UPLOAD, STATUS and CANCEL commands on this Unix socket (optional, then -f and PROGRAM are optional too)");
+    EXPLAINV("\t-W WATCH\tflotsam only: stay resident, uploading files matching DIRECTORY/NAME_GLOB as soon as they are written or moved into the directory (optional, multiple, up to %d watches, then -f and PROGRAM are optional too)", MAX_WATCHES);
+    EXPLAINV("\t-X METRICS_FILE\tWrite upload and heap metrics in the Prometheus text format to this file every %dms and on exit, replacing it atomically (optional)", METRICS_WRITE_MS);
+    EXPLAINV("\t-J TRACE_FILE\tWrite spans of initialization, the program running, quiescing and each request in the Chrome trace event format to this file on exit, uploading them as trace.json after the other files (optional, up to %d spans)", TRACE_MAX_EVENTS);
+    EXPLAIN("\t-v LOG_LEVEL\tMost verbose messages to log, error, info, debug, trace or memlog, curl's own from trace (optional, default info)");
     EXPLAIN("\tPROGRAM\tProgram to execute (required)");
     EXPLAIN("\tARG\tArguments for program to executed (optional, multiple, no limit)");
 }
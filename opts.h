@@ -4,12 +4,19 @@
 #define MIN_HEAP_SIZE 1 * 1024 * 1024
 #define DEFAULT_HEAP_SIZE 10 * 1024 * 1024
 #define DEFAULT_QUIESCE_SECS 10
+#define DEFAULT_KILL_TIMEOUT_MS 10000
 #define DEFAULT_METHOD "PUT"
 #define DEFAULT_MAX_ATTEMPTS 3
+#define DEFAULT_MAX_PARALLEL 4
+#define DEFAULT_RESTART_BACKOFF_MS 1000
 
 #define MAX_HEADERS   128
 #define MAX_FILES     128
 #define MAX_EXEC_ARGS 128
+#define MAX_URLS      8
+#define MAX_ENV       64
+#define MAX_PARALLEL  16
+#define MAX_WATCHES   16
 
 /**
  * The outcome of parsing CLI options.
@@ -27,7 +34,23 @@ enum OptsParseResult {
     OPTS_PARSE_BAD_QUIESCE_SECS,
     OPTS_PARSE_NO_EXEC,
     OPTS_PARSE_EXEC_ARGS_OVERFLOW,
-    OPTS_PARSE_BAD_MAX_ATTEMPTS
+    OPTS_PARSE_BAD_MAX_ATTEMPTS,
+    OPTS_PARSE_BAD_CHECKSUM,
+    OPTS_PARSE_URL_OVERFLOW,
+    OPTS_PARSE_BAD_MAX_RATE,
+    OPTS_PARSE_BAD_MAX_PARALLEL,
+    OPTS_PARSE_BAD_KILL_TIMEOUT,
+    OPTS_PARSE_BAD_ENV,
+    OPTS_PARSE_BAD_SETTLE_MS,
+    OPTS_PARSE_BAD_OUTPUT_SIZE,
+    OPTS_PARSE_BAD_SAMPLE_MS,
+    OPTS_PARSE_BAD_PRESSURE,
+    OPTS_PARSE_BAD_SNAPSHOT_MS,
+    OPTS_PARSE_BAD_RESTARTS,
+    OPTS_PARSE_BAD_BACKOFF_MS,
+    OPTS_PARSE_BAD_WATCH,
+    OPTS_PARSE_BAD_LOG_LEVEL,
+    OPTS_PARSE_BAD_SHARED_SIZE
 };
 
 /**
@@ -44,15 +67,41 @@ struct Options {
      */
     int quiesce_secs;
 
+    /**
+     * Milliseconds files must be unchanged for before uploading, within the quiesce time, or 0 to always wait the
+     * quiesce time.
+     */
+    int settle_ms;
+
+    /**
+     * Milliseconds after forwarding a termination signal to the subprocess before it is sent SIGKILL.
+     */
+    int kill_timeout_ms;
+
     /**
      * Maximum retries for uploading a file.
      */
     int max_attempts;
 
     /**
-     * Base URL for uploading a file.
+     * Ceiling on the upload send rate in bytes per second, or 0 for no ceiling.
      */
-    char* url;
+    long max_rate;
+
+    /**
+     * Ceiling on the number of files uploaded at once.
+     */
+    int max_parallel;
+
+    /**
+     * Number of base URLs every file is uploaded to.
+     */
+    int nurls;
+
+    /**
+     * Base URLs for uploading a file.
+     */
+    char* urls[MAX_URLS];
 
     /**
      * HTTP method for uploading a file.
@@ -64,6 +113,21 @@ struct Options {
      */
     char* certificate;
 
+    /**
+     * Local chunk index filename, enables deduplicated uploads if set.
+     */
+    char* dedup_index;
+
+    /**
+     * Upload journal filename, enables resuming uploads across runs if set.
+     */
+    char* journal;
+
+    /**
+     * Bit flags of checksums to send with uploads, see checksum.h.
+     */
+    int checksums;
+
     /**
      * Program to execute.
      */
@@ -89,6 +153,102 @@ struct Options {
      */
     char* files[MAX_FILES];
 
+    /**
+     * Working directory for the executed program, or NULL to inherit ours.
+     */
+    char* exec_directory;
+
+    /**
+     * File opened as stdin for the executed program, or NULL to inherit ours.
+     */
+    char* exec_stdin;
+
+    /**
+     * Bytes of the executed program's stdout and of its stderr kept to upload, or 0 to leave them inherited.
+     */
+    int output_size;
+
+    /**
+     * Bytes of the ring buffer shared with the executed program to upload, or 0 not to share memory.
+     */
+    int shared_size;
+
+    /**
+     * Whether the files are opened with their directories at startup, and uploaded from those rather than by path.
+     */
+    int pin_files;
+
+    /**
+     * Milliseconds between samples of the executed program's resource usage, or 0 not to sample.
+     */
+    int sample_ms;
+
+    /**
+     * PSI trigger "some|full STALL_US WINDOW_US" starting uploads while the executed program runs, or NULL.
+     */
+    char* pressure_trigger;
+
+    /**
+     * Milliseconds spent at most snapshotting the executed program's /proc files before forwarding a termination
+     * signal to it, or 0 not to snapshot.
+     */
+    int snapshot_ms;
+
+    /**
+     * Pressure file the trigger is on, or NULL for the program's cgroup's or the system's.
+     */
+    char* pressure_file;
+
+    /**
+     * Directory the executed program's core dumps are written to, new ones being uploaded sparsely, or NULL.
+     */
+    char* core_directory;
+
+    /**
+     * Times in a row the executed program is restarted after terminating abnormally, or 0 never to restart it.
+     */
+    int max_restarts;
+
+    /**
+     * Milliseconds before the first restart, doubled for each further restart in a row.
+     */
+    int restart_backoff_ms;
+
+    /**
+     * Unix domain socket flotsam stays resident taking commands on, or NULL to upload once on a signal.
+     */
+    char* control_socket;
+
+    /**
+     * Number of watch patterns.
+     */
+    int nwatches;
+
+    /**
+     * Patterns, DIRECTORY/NAME_GLOB, of files flotsam uploads as soon as they are written into a directory.
+     */
+    char* watches[MAX_WATCHES];
+
+    /**
+     * File metrics are written to in the Prometheus text format, for a textfile collector, or NULL.
+     */
+    char* metrics_file;
+
+    /**
+     * File spans of what the program does are written to in the Chrome trace event format, or NULL.
+     */
+    char* trace_file;
+
+    /**
+     * Number of environment variables added for the executed program.
+     */
+    int nenv;
+
+    /**
+     * Environment variables, NAME=VALUE, added to or replacing ours for the executed program.
+     */
+    char* env[MAX_ENV];
+
     /**
      * Number of arguments for the executed program.
      */
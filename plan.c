@@ -0,0 +1,373 @@
+// For O_PATH
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "log.h"
+#include "opts.h"
+#include "plan.h"
+
+/**
+ * Bytes of events read at once.
+ */
+#define PLAN_EVENTS_SIZE 4096
+
+/**
+ * Events a file being replaced at its path is noticed by.
+ */
+#define PLAN_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+/**
+ * Buffer size for URLs, as when uploading.
+ */
+#define PLAN_MAX_URL_LENGTH 2048
+
+/**
+ * A file planned for uploading.
+ */
+struct PlanFile {
+    /**
+     * The open file, or -1 if it could not be opened yet.
+     */
+    int fd;
+
+    /**
+     * The open directory the file is in, or -1 if it could not be opened.
+     */
+    int directory_fd;
+
+    /**
+     * inotify watch of the directory, shared by files in the same directory, or -1.
+     */
+    int wd;
+
+    /**
+     * Name of the file in the directory, pointing into the CLI options.
+     */
+    const char* name;
+
+    /**
+     * URL of the file at each destination, from the heap, NULL where too long.
+     */
+    char* urls[MAX_URLS];
+};
+
+/**
+ * Upload plan of the files in the CLI options.
+ */
+struct Plan {
+    /**
+     * Guards the files' descriptors, refreshed while uploads may be reading them.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * inotify descriptor, or -1.
+     */
+    int fd;
+
+    /**
+     * The files, from the heap, indexed as files in the CLI options, or NULL if not planning.
+     */
+    struct PlanFile* files;
+
+    /**
+     * Whether the files are held, as by g_plan_hold().
+     */
+    int holding;
+
+    /**
+     * The files held, indexed as files in the CLI options, each open or -1 if it could not be opened.
+     */
+    int held_fds[MAX_FILES];
+
+    /**
+     * Status of each file held, as it was when held.
+     */
+    struct stat held_stats[MAX_FILES];
+};
+
+/**
+ * The plan instance.
+ */
+struct Plan g_plan_instance = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+/**
+ * Pointer to the plan instance.
+ */
+struct Plan* g_plan = &g_plan_instance;
+
+/**
+ * Open a file by name within its open directory, replacing the file open before if another is now at its path.  The
+ * lock is held.
+ * @param file the file
+ * @param path path of the file, for logging
+ */
+void plan_pin(struct PlanFile* file, const char* path) {
+    struct stat pinned_stat, fd_stat;
+    int fd;
+
+    if (file->directory_fd == -1) {
+        return;
+    }
+
+    fd = openat(file->directory_fd, file->name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        DEBUGV("%s could not be opened: %s", path, strerror(errno));
+        return;
+    }
+
+    if (file->fd != -1 && fstat(file->fd, &pinned_stat) == 0 && fstat(fd, &fd_stat) == 0 &&
+            pinned_stat.st_dev == fd_stat.st_dev && pinned_stat.st_ino == fd_stat.st_ino) {
+        close(fd);
+        return;
+    }
+
+    if (file->fd != -1) {
+        INFOV("%s was replaced, uploading the new file", path);
+        close(file->fd);
+    }
+    file->fd = fd;
+}
+
+void g_plan_init() {
+    char directory[PATH_MAX];
+    struct PlanFile* file;
+    const char* slash;
+    size_t length;
+
+    TRACE("g_plan_init()");
+
+    g_plan->files = g_heap_allocate(MAX_FILES * sizeof(struct PlanFile));
+    if (g_plan->files == NULL) {
+        FATAL(FATAL_ERROR_PLAN_INIT, "Could not allocate upload plan");
+    }
+
+    g_plan->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_plan->fd == -1) {
+        FATALV(FATAL_ERROR_PLAN_INIT, "Could not start watching files: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < g_opts->nfiles; i++) {
+        file = &g_plan->files[i];
+        file->fd = -1;
+        file->wd = -1;
+
+        // A file named without a directory is in our working directory, and one at the root in the root
+        slash = strrchr(g_opts->files[i], '/');
+        file->name = slash != NULL ? slash + 1 : g_opts->files[i];
+        length = slash == NULL ? 0 : slash == g_opts->files[i] ? 1 : (size_t) (slash - g_opts->files[i]);
+        if (length == 0) {
+            snprintf(directory, sizeof(directory), ".");
+        } else {
+            snprintf(directory, sizeof(directory), "%.*s", (int) length, g_opts->files[i]);
+        }
+
+        file->directory_fd = open(directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (file->directory_fd == -1) {
+            ERRORV("%s could not be opened, %s is looked up by path: %s", directory, g_opts->files[i],
+                   strerror(errno));
+        } else {
+            file->wd = inotify_add_watch(g_plan->fd, directory, PLAN_EVENTS);
+            if (file->wd == -1) {
+                ERRORV("%s could not be watched, %s is not followed if replaced: %s", directory, g_opts->files[i],
+                       strerror(errno));
+            }
+        }
+        plan_pin(file, g_opts->files[i]);
+
+        for (int d = 0; d < g_opts->nurls; d++) {
+            length = strlen(g_opts->urls[d]) + 1 + strlen(g_opts->files[i]) + 1;
+            file->urls[d] = length <= PLAN_MAX_URL_LENGTH ? g_heap_allocate(length) : NULL;
+            if (length <= PLAN_MAX_URL_LENGTH && file->urls[d] == NULL) {
+                FATAL(FATAL_ERROR_PLAN_INIT, "Could not allocate upload plan URL");
+            }
+            if (file->urls[d] != NULL) {
+                snprintf(file->urls[d], length, "%s/%s", g_opts->urls[d], g_opts->files[i]);
+            }
+        }
+
+        DEBUGV("Planned %s, %s", g_opts->files[i], file->fd != -1 ? "open" : "not yet created");
+    }
+
+    INFOV("Planned uploading %d files", g_opts->nfiles);
+}
+
+int g_plan_fd() {
+    return g_plan->fd;
+}
+
+void g_plan_refresh() {
+    char events[PLAN_EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    ssize_t nread;
+
+    if (g_plan->files == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_plan->lock);
+    for (;;) {
+        nread = read(g_plan->fd, events, sizeof(events));
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread == -1 && errno != EAGAIN) {
+                ERRORV("Could not read file events: %s", strerror(errno));
+            }
+            break;
+        }
+
+        for (char* next = events; next < events + nread; next += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) next;
+
+            // After an overflow which files were replaced is unknown, so every file is opened again
+            for (int i = 0; i < g_opts->nfiles; i++) {
+                if ((event->mask & IN_Q_OVERFLOW) || (g_plan->files[i].wd == event->wd && event->len > 0 &&
+                                                      strcmp(g_plan->files[i].name, event->name) == 0)) {
+                    plan_pin(&g_plan->files[i], g_opts->files[i]);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_plan->lock);
+}
+
+void g_plan_hold() {
+    int fd;
+
+    TRACE("g_plan_hold()");
+
+    g_plan_refresh();
+
+    pthread_mutex_lock(&g_plan->lock);
+    for (int i = 0; i < g_opts->nfiles; i++) {
+        if (g_plan->files != NULL && g_plan->files[i].fd != -1) {
+            fd = fcntl(g_plan->files[i].fd, F_DUPFD_CLOEXEC, 0);
+        } else {
+            fd = open(g_opts->files[i], O_RDONLY | O_CLOEXEC);
+        }
+        if (fd != -1 && fstat(fd, &g_plan->held_stats[i]) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        g_plan->held_fds[i] = fd;
+
+        DEBUGV("Held %s at %ld bytes", g_opts->files[i], fd != -1 ? (long) g_plan->held_stats[i].st_size : -1L);
+    }
+    g_plan->holding = 1;
+    pthread_mutex_unlock(&g_plan->lock);
+}
+
+int g_plan_holding() {
+    int holding;
+
+    pthread_mutex_lock(&g_plan->lock);
+    holding = g_plan->holding;
+    pthread_mutex_unlock(&g_plan->lock);
+
+    return holding;
+}
+
+void g_plan_release() {
+    TRACE("g_plan_release()");
+
+    pthread_mutex_lock(&g_plan->lock);
+    if (g_plan->holding) {
+        for (int i = 0; i < g_opts->nfiles; i++) {
+            if (g_plan->held_fds[i] != -1) {
+                close(g_plan->held_fds[i]);
+            }
+        }
+        g_plan->holding = 0;
+    }
+    pthread_mutex_unlock(&g_plan->lock);
+}
+
+int g_plan_open(int file) {
+    int fd = -1;
+
+    pthread_mutex_lock(&g_plan->lock);
+    if (g_plan->holding) {
+        if (g_plan->held_fds[file] != -1) {
+            fd = fcntl(g_plan->held_fds[file], F_DUPFD_CLOEXEC, 0);
+        } else {
+            errno = ENOENT;
+        }
+    } else if (g_plan->files != NULL && g_plan->files[file].fd != -1) {
+        fd = fcntl(g_plan->files[file].fd, F_DUPFD_CLOEXEC, 0);
+    }
+    pthread_mutex_unlock(&g_plan->lock);
+
+    return fd;
+}
+
+int g_plan_stat(int file, struct stat* file_stat) {
+    int result = -1;
+
+    pthread_mutex_lock(&g_plan->lock);
+    if (g_plan->holding) {
+        if (g_plan->held_fds[file] != -1) {
+            *file_stat = g_plan->held_stats[file];
+            result = 0;
+        } else {
+            errno = ENOENT;
+        }
+    } else if (g_plan->files != NULL && g_plan->files[file].fd != -1) {
+        result = fstat(g_plan->files[file].fd, file_stat);
+    }
+    pthread_mutex_unlock(&g_plan->lock);
+
+    return result;
+}
+
+int g_plan_fstat(int file, int fd, struct stat* file_stat) {
+    int held = 0;
+
+    pthread_mutex_lock(&g_plan->lock);
+    if (g_plan->holding && g_plan->held_fds[file] != -1) {
+        *file_stat = g_plan->held_stats[file];
+        held = 1;
+    }
+    pthread_mutex_unlock(&g_plan->lock);
+
+    return held ? 0 : fstat(fd, file_stat);
+}
+
+const char* g_plan_url(int file, int destination) {
+    return g_plan->files != NULL ? g_plan->files[file].urls[destination] : NULL;
+}
+
+void g_plan_destroy() {
+    TRACE("g_plan_destroy()");
+
+    g_plan_release();
+    if (g_plan->files == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_plan->lock);
+    for (int i = 0; i < g_opts->nfiles; i++) {
+        if (g_plan->files[i].fd != -1) {
+            close(g_plan->files[i].fd);
+        }
+        if (g_plan->files[i].directory_fd != -1) {
+            close(g_plan->files[i].directory_fd);
+        }
+    }
+    if (close(g_plan->fd) != 0) {
+        ERRORV("Could not stop watching files: %s", strerror(errno));
+    }
+    g_plan->fd = -1;
+    g_plan->files = NULL;
+    pthread_mutex_unlock(&g_plan->lock);
+}
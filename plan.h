@@ -0,0 +1,81 @@
+#ifndef JETSAM_PLAN_H
+#define JETSAM_PLAN_H
+
+#include <sys/stat.h>
+
+/**
+ * Initialize the upload plan of the files in the CLI options: open each file and its directory, watch the directories
+ * for files replaced at their paths, and build the URL of each file at each destination in the heap.  Files that do
+ * not exist yet are opened once they are created.
+ */
+void g_plan_init();
+
+/**
+ * File descriptor to watch for changes to the planned files' directories.
+ * @return the file descriptor, or -1 if not planning
+ */
+int g_plan_fd();
+
+/**
+ * Follow files replaced at their paths since the last refresh, opening the new files by name within their open
+ * directories.  Never blocks waiting for changes.  Files unlinked or renamed away stay open, to upload what was written
+ * to them.
+ */
+void g_plan_refresh();
+
+/**
+ * Hold the files in the CLI options as they are now, planned or not: open each, from the plan if it is open there,
+ * otherwise by its path, and keep its status.  Until released, the files are uploaded from the held file descriptors
+ * up to the sizes held, however they grow or are replaced since, and files not open then are not uploaded.
+ */
+void g_plan_hold();
+
+/**
+ * Whether the files are held.
+ * @return 1 if and only if held by g_plan_hold() and not yet released
+ */
+int g_plan_holding();
+
+/**
+ * Close the files held, if held.
+ */
+void g_plan_release();
+
+/**
+ * Open a planned or held file for reading, without looking its path up.
+ * @param file index of the file in the CLI options
+ * @return a new file descriptor for the caller to close, or -1 if the file is not open
+ */
+int g_plan_open(int file);
+
+/**
+ * Status of a planned or held file, without looking its path up, a held file's being as it was when held.
+ * @param file index of the file in the CLI options
+ * @param file_stat receives the status
+ * @return 0 on success, -1 if the file is not open or on error as per fstat()
+ */
+int g_plan_stat(int file, struct stat* file_stat);
+
+/**
+ * Status of a file opened by g_plan_open(): as it was when held if held, otherwise as per fstat().
+ * @param file index of the file in the CLI options
+ * @param fd the open file
+ * @param file_stat receives the status
+ * @return 0 on success, -1 on error as per fstat()
+ */
+int g_plan_fstat(int file, int fd, struct stat* file_stat);
+
+/**
+ * URL a planned file is uploaded to at a destination.
+ * @param file index of the file in the CLI options
+ * @param destination index of the URL in the CLI options
+ * @return the URL, or NULL if it is too long or the files are only held
+ */
+const char* g_plan_url(int file, int destination);
+
+/**
+ * Close the planned files, their directories and the watch, and the files held.
+ */
+void g_plan_destroy();
+
+#endif //JETSAM_PLAN_H
@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/statfs.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "opts.h"
+#include "pressure.h"
+#include "sampler.h"
+
+/**
+ * Filesystem magic numbers of procfs and cgroup2, the filesystems PSI files live on.
+ */
+#define PRESSURE_PROC_SUPER_MAGIC 0x9fa0
+#define PRESSURE_CGROUP2_SUPER_MAGIC 0x63677270
+
+/**
+ * Size of the buffer pressure and event files are read into.
+ */
+#define PRESSURE_READ_BUFFER_SIZE 1024
+
+/**
+ * Memory pressure watching state.
+ */
+struct Pressure {
+    /**
+     * Watched file descriptors, -1 where unused: the PSI trigger or polling timer, and memory.events.
+     */
+    int fds[PRESSURE_WATCHES];
+
+    /**
+     * Pressure file read when polling, -1 when a PSI trigger is used instead.
+     */
+    int poll_fd;
+
+    /**
+     * "some" or "full", the line of the pressure file the trigger is on.
+     */
+    char type[8];
+
+    /**
+     * Microseconds of stall within the window that crosses the threshold.
+     */
+    long stall_us;
+
+    /**
+     * Window in microseconds.
+     */
+    long window_us;
+
+    /**
+     * Total stall in microseconds at the last poll, or -1 before the first.
+     */
+    long long total_us;
+
+    /**
+     * Events of memory.events counting towards pressure, when last read.
+     */
+    uint64_t high, max, oom;
+
+    /**
+     * OOM kills of the cgroup from memory.events, or of the system from /proc/vmstat, when watching started.
+     */
+    uint64_t oom_kills;
+
+    /**
+     * Whether oom_kills is from memory.events rather than /proc/vmstat.
+     */
+    int cgroup_oom_kills;
+
+    /**
+     * Buffer files are read into.
+     */
+    char buffer[PRESSURE_READ_BUFFER_SIZE];
+};
+
+/**
+ * The pressure instance.
+ */
+struct Pressure g_pressure_instance = { .fds = { -1, -1 }, .poll_fd = -1 };
+
+/**
+ * Pointer to the pressure instance.
+ */
+struct Pressure* g_pressure = &g_pressure_instance;
+
+/**
+ * Read a file from the start into the read buffer, null terminated.
+ * @param fd the file
+ * @return the contents, or NULL on error
+ */
+const char* pressure_read(int fd) {
+    ssize_t nread = pread(fd, g_pressure->buffer, sizeof(g_pressure->buffer) - 1, 0);
+
+    if (nread < 0) {
+        return NULL;
+    }
+    g_pressure->buffer[nread] = '\0';
+
+    return g_pressure->buffer;
+}
+
+/**
+ * OOM kills system wide, from /proc/vmstat.
+ * @return the count, or 0 if unavailable
+ */
+uint64_t pressure_system_oom_kills() {
+    uint64_t oom_kills = 0;
+    char line[128];
+    FILE* vmstat;
+
+    vmstat = fopen("/proc/vmstat", "re");
+    if (vmstat == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), vmstat) != NULL) {
+        if (strncmp(line, "oom_kill ", 9) == 0) {
+            oom_kills = strtoull(line + 9, NULL, 10);
+        }
+    }
+    fclose(vmstat);
+
+    return oom_kills;
+}
+
+/**
+ * Open the pressure file and register the trigger on it, or if it does not support triggers, poll it on a timer.
+ * @param path the pressure file
+ * @param name the pressure file as logged
+ * @return file descriptor to watch, or -1 on error
+ */
+int pressure_open(const char* path, const char* name) {
+    struct itimerspec interval = { 0 };
+    struct statfs fs;
+    char trigger[64];
+    int fd, timerfd;
+
+    // Writing a trigger to an ordinary file would overwrite it, so only PSI files are written to
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1 && fstatfs(fd, &fs) == 0 &&
+            (fs.f_type == PRESSURE_PROC_SUPER_MAGIC || fs.f_type == PRESSURE_CGROUP2_SUPER_MAGIC)) {
+        snprintf(trigger, sizeof(trigger), "%s %ld %ld", g_pressure->type, g_pressure->stall_us, g_pressure->window_us);
+        if (write(fd, trigger, strlen(trigger) + 1) >= 0) {
+            INFOV("Watching %s for %s", name, trigger);
+            return fd;
+        }
+        INFOV("%s does not support triggers, polling it instead: %s", name, strerror(errno));
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    g_pressure->poll_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (g_pressure->poll_fd == -1) {
+        ERRORV("Could not open %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1) {
+        ERRORV("Could not create pressure polling timer: %s", strerror(errno));
+        return -1;
+    }
+    interval.it_interval.tv_sec = g_pressure->window_us / 1000000;
+    interval.it_interval.tv_nsec = (g_pressure->window_us % 1000000) * 1000;
+    interval.it_value = interval.it_interval;
+    timerfd_settime(timerfd, 0, &interval, NULL);
+
+    g_pressure->total_us = -1;
+    INFOV("Polling %s every %ldus", name, g_pressure->window_us);
+    return timerfd;
+}
+
+/**
+ * Poll the pressure file, comparing its total stall with the last poll.
+ * @return 1 if and only if the stall since the last poll crossed the threshold
+ */
+int pressure_poll() {
+    const char* contents;
+    const char* total;
+    uint64_t expirations;
+    long long total_us, last_us;
+
+    if (read(g_pressure->fds[0], &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+
+    contents = pressure_read(g_pressure->poll_fd);
+    contents = contents == NULL ? NULL : strstr(contents, g_pressure->type);
+    total = contents == NULL ? NULL : strstr(contents, "total=");
+    if (total == NULL) {
+        return 0;
+    }
+
+    total_us = strtoll(total + 6, NULL, 10);
+    last_us = g_pressure->total_us;
+    g_pressure->total_us = total_us;
+
+    return last_us >= 0 && total_us - last_us >= g_pressure->stall_us;
+}
+
+/**
+ * Read memory.events, comparing events with the last read.
+ * @return 1 if and only if the cgroup went over memory.high, hit memory.max or hit OOM since the last read
+ */
+int pressure_events() {
+    const char* contents = pressure_read(g_pressure->fds[1]);
+    uint64_t high, max, oom;
+    int crossed;
+
+    if (contents == NULL) {
+        return 0;
+    }
+
+    high = g_sampler_field(contents, "high ", 0);
+    max = g_sampler_field(contents, "max ", 0);
+    oom = g_sampler_field(contents, "oom ", 0);
+    crossed = high > g_pressure->high || max > g_pressure->max || oom > g_pressure->oom;
+    if (crossed) {
+        INFOV("cgroup memory events: high %lu, max %lu, oom %lu", (unsigned long) high, (unsigned long) max,
+              (unsigned long) oom);
+    }
+
+    g_pressure->high = high;
+    g_pressure->max = max;
+    g_pressure->oom = oom;
+    return crossed;
+}
+
+void g_pressure_start(pid_t pid) {
+    char pressure_file[PATH_MAX];
+    const char* contents;
+    int fd;
+
+    TRACEV("g_pressure_start(%d)", pid);
+
+    fd = g_sampler_cgroup_open(pid, "memory.events");
+    contents = fd == -1 ? NULL : pressure_read(fd);
+    g_pressure->cgroup_oom_kills = contents != NULL;
+    if (contents != NULL) {
+        g_pressure->oom_kills = g_sampler_field(contents, "oom_kill ", 0);
+        g_pressure->high = g_sampler_field(contents, "high ", 0);
+        g_pressure->max = g_sampler_field(contents, "max ", 0);
+        g_pressure->oom = g_sampler_field(contents, "oom ", 0);
+    } else {
+        g_pressure->oom_kills = pressure_system_oom_kills();
+    }
+    g_pressure->fds[1] = fd;
+
+    if (g_opts->pressure_trigger == NULL) {
+        return;
+    }
+
+    sscanf(g_opts->pressure_trigger, "%7s %ld %ld", g_pressure->type, &g_pressure->stall_us, &g_pressure->window_us);
+
+    // The child's cgroup measures pressure on the child alone, so is preferred to the system wide file
+    if (g_opts->pressure_file != NULL) {
+        g_pressure->fds[0] = pressure_open(g_opts->pressure_file, g_opts->pressure_file);
+    } else {
+        fd = g_sampler_cgroup_open(pid, "memory.pressure");
+        if (fd != -1) {
+            snprintf(pressure_file, sizeof(pressure_file), "/proc/self/fd/%d", fd);
+            g_pressure->fds[0] = pressure_open(pressure_file, "cgroup memory.pressure");
+            close(fd);
+        } else {
+            g_pressure->fds[0] = pressure_open(PRESSURE_DEFAULT_FILE, PRESSURE_DEFAULT_FILE);
+        }
+    }
+}
+
+int g_pressure_fd(int watch) {
+    // memory.events is only watched for pressure when a trigger is configured, otherwise it only counts OOM kills
+    if (watch == 1 && g_opts->pressure_trigger == NULL) {
+        return -1;
+    }
+    return g_pressure->fds[watch];
+}
+
+uint32_t g_pressure_events(int watch) {
+    return watch == 0 && g_pressure->poll_fd != -1 ? EPOLLIN : EPOLLPRI;
+}
+
+int g_pressure_check(int watch) {
+    if (watch == 1) {
+        return pressure_events();
+    }
+
+    // PSI triggers have nothing to read, an event is the threshold being crossed
+    return g_pressure->poll_fd == -1 ? 1 : pressure_poll();
+}
+
+int g_pressure_oom_killed() {
+    const char* contents;
+    uint64_t oom_kills;
+
+    if (g_pressure->cgroup_oom_kills) {
+        contents = pressure_read(g_pressure->fds[1]);
+        oom_kills = contents == NULL ? 0 : g_sampler_field(contents, "oom_kill ", 0);
+    } else {
+        oom_kills = pressure_system_oom_kills();
+    }
+
+    return oom_kills > g_pressure->oom_kills;
+}
+
+void g_pressure_stop() {
+    TRACE("g_pressure_stop()");
+
+    for (int i = 0; i < PRESSURE_WATCHES; i++) {
+        if (g_pressure->fds[i] != -1) {
+            close(g_pressure->fds[i]);
+            g_pressure->fds[i] = -1;
+        }
+    }
+
+    if (g_pressure->poll_fd != -1) {
+        close(g_pressure->poll_fd);
+        g_pressure->poll_fd = -1;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef JETSAM_PRESSURE_H
+#define JETSAM_PRESSURE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * File descriptors watched for memory pressure: the PSI trigger, or a timer polling the pressure file where triggers
+ * are unsupported, and the cgroup's memory.events.
+ */
+#define PRESSURE_WATCHES 2
+
+/**
+ * Default pressure file, used unless the child's cgroup has its own.
+ */
+#define PRESSURE_DEFAULT_FILE "/proc/pressure/memory"
+
+/**
+ * Start watching memory pressure on a process, if a trigger is configured in the CLI options.
+ * @param pid the process
+ */
+void g_pressure_start(pid_t pid);
+
+/**
+ * File descriptor to watch for priority events or input.
+ * @param watch index below PRESSURE_WATCHES
+ * @return the file descriptor, or -1 if unused
+ */
+int g_pressure_fd(int watch);
+
+/**
+ * epoll events to watch a file descriptor for.
+ * @param watch index below PRESSURE_WATCHES
+ * @return EPOLLPRI for PSI triggers and memory.events, which are always readable, or EPOLLIN for the polling timer
+ */
+uint32_t g_pressure_events(int watch);
+
+/**
+ * Handle an event on a watched file descriptor.
+ * @param watch index below PRESSURE_WATCHES
+ * @return 1 if and only if memory pressure crossed the threshold
+ */
+int g_pressure_check(int watch);
+
+/**
+ * Whether the OOM killer killed a process in the child's cgroup, or anywhere if the cgroup is unknown, since watching
+ * started.
+ * @return 1 if and only if an OOM kill was seen
+ */
+int g_pressure_oom_killed();
+
+/**
+ * Stop watching memory pressure.
+ */
+void g_pressure_stop();
+
+#endif //JETSAM_PRESSURE_H
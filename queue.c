@@ -0,0 +1,550 @@
+// For struct dirent64
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "opts.h"
+#include "queue.h"
+#include "trace.h"
+
+/**
+ * Bytes of directory entries read at once when expanding patterns.
+ */
+#define QUEUE_DIRENTS_SIZE 4096
+
+/**
+ * State of a job.
+ */
+enum QueueJobState {
+    QUEUE_JOB_FREE = 0,
+    QUEUE_JOB_QUEUED,
+    QUEUE_JOB_RUNNING,
+    QUEUE_JOB_DONE,
+    QUEUE_JOB_CANCELLED
+};
+
+/**
+ * Names of job states, indexed by QueueJobState.
+ */
+const char* queue_state_names[] = { "free", "queued", "running", "done", "cancelled" };
+
+/**
+ * Files uploaded together.
+ */
+struct QueueJob {
+    /**
+     * Id of the job, increasing in the order jobs are queued.
+     */
+    int id;
+
+    /**
+     * A QueueJobState.
+     */
+    int state;
+
+    /**
+     * Files to upload, pointing into paths.
+     */
+    char* files[MAX_FILES];
+
+    /**
+     * Number of files.
+     */
+    int nfiles;
+
+    /**
+     * Files uploaded to every destination, once done.
+     */
+    int nuploaded;
+
+    /**
+     * Set to cancel the job while it runs.
+     */
+    atomic_int cancel;
+
+    /**
+     * The files' paths, null terminated one after another.
+     */
+    char paths[QUEUE_PATHS_SIZE];
+};
+
+/**
+ * Paths patterns expand to, held without allocating memory.
+ */
+struct QueueMatches {
+    /**
+     * The paths, pointing into buffer.
+     */
+    char* paths[MAX_FILES];
+
+    /**
+     * Number of paths.
+     */
+    size_t npaths;
+
+    /**
+     * Bytes of buffer used.
+     */
+    size_t used;
+
+    /**
+     * Whether more paths matched than are held.
+     */
+    int overflow;
+
+    /**
+     * The paths, null terminated one after another.
+     */
+    char buffer[QUEUE_PATHS_SIZE];
+};
+
+/**
+ * Job queue state.
+ */
+struct Queue {
+    /**
+     * Jobs, allocated from the heap.
+     */
+    struct QueueJob* jobs;
+
+    /**
+     * Id of the next job queued.
+     */
+    int next_id;
+
+    /**
+     * Guards jobs and stopping.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled when a job is queued, or the thread is asked to stop.
+     */
+    pthread_cond_t changed;
+
+    /**
+     * Thread uploading jobs.
+     */
+    pthread_t thread;
+
+    /**
+     * Whether the thread is asked to stop.
+     */
+    int stopping;
+
+    /**
+     * Heap used before any job, rewound to after each.
+     */
+    size_t mark;
+};
+
+/**
+ * The queue instance.
+ */
+struct Queue g_queue_instance = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+/**
+ * Pointer to the queue instance.
+ */
+struct Queue* g_queue = &g_queue_instance;
+
+/**
+ * Find the queued job queued first.  Called with the lock held.
+ * @return the job, or NULL if none is queued
+ */
+struct QueueJob* queue_next() {
+    struct QueueJob* next = NULL;
+
+    for (int j = 0; j < QUEUE_MAX_JOBS; j++) {
+        if (g_queue->jobs[j].state == QUEUE_JOB_QUEUED && (next == NULL || g_queue->jobs[j].id < next->id)) {
+            next = &g_queue->jobs[j];
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Find a job to reuse: a free one, or else the finished one queued first.  Called with the lock held.
+ * @return the job, or NULL if every job is queued or running
+ */
+struct QueueJob* queue_reusable() {
+    struct QueueJob* oldest = NULL;
+    struct QueueJob* job;
+
+    for (int j = 0; j < QUEUE_MAX_JOBS; j++) {
+        job = &g_queue->jobs[j];
+        if (job->state == QUEUE_JOB_FREE) {
+            return job;
+        }
+        if ((job->state == QUEUE_JOB_DONE || job->state == QUEUE_JOB_CANCELLED) &&
+                (oldest == NULL || job->id < oldest->id)) {
+            oldest = job;
+        }
+    }
+
+    return oldest;
+}
+
+/**
+ * Bytes of heap a job is expected to need, for every CURL instance it creates.
+ * @return the bytes
+ */
+size_t queue_job_heap_size() {
+    return (size_t) (g_opts->max_parallel + 1) * (size_t) g_opts->nurls * QUEUE_CURL_HEAP_SIZE;
+}
+
+/**
+ * Run a job with CURL instances of its own, allocated from the heap past the mark and no longer referenced once
+ * cleaned up, so the heap is rewound to the mark after.
+ * @param job the job
+ * @return number of files uploaded to every destination
+ */
+int queue_run(struct QueueJob* job) {
+    int nuploaded = 0;
+
+    if (g_http_open()) {
+        nuploaded = g_http_upload_file_list(job->files, job->nfiles, &job->cancel);
+    } else {
+        ERRORV("Job %d could not start uploading, %zu of %zu bytes of heap used", job->id, g_heap_used(),
+               g_heap_size());
+    }
+    g_http_close();
+
+    DEBUGV("Job %d used %zu bytes of heap", job->id, g_heap_used() - g_queue->mark);
+    g_heap_rewind(g_queue->mark);
+
+    return nuploaded;
+}
+
+/**
+ * Thread uploading queued jobs one after another, so the upload engine is only ever used by one thread.
+ * @param arg unused
+ * @return NULL
+ */
+void* queue_thread(void* arg) {
+    struct QueueJob* job;
+    char detail[32];
+    int64_t started_us;
+    int nuploaded;
+
+    TRACEV("queue_thread(%p)", arg);
+
+    pthread_mutex_lock(&g_queue->lock);
+    for (;;) {
+        while (!g_queue->stopping && (job = queue_next()) == NULL) {
+            pthread_cond_wait(&g_queue->changed, &g_queue->lock);
+        }
+        if (g_queue->stopping) {
+            break;
+        }
+
+        job->state = QUEUE_JOB_RUNNING;
+        pthread_mutex_unlock(&g_queue->lock);
+
+        INFOV("Job %d uploading %d files", job->id, job->nfiles);
+        started_us = g_trace_now();
+        nuploaded = queue_run(job);
+        snprintf(detail, sizeof(detail), "job %d", job->id);
+        g_trace_span("upload", "job", detail, started_us, g_trace_now());
+
+        pthread_mutex_lock(&g_queue->lock);
+        job->nuploaded = nuploaded;
+        job->state = atomic_load(&job->cancel) ? QUEUE_JOB_CANCELLED : QUEUE_JOB_DONE;
+        INFOV("Job %d %s, %d of %d files uploaded", job->id, queue_state_names[job->state], nuploaded, job->nfiles);
+    }
+    pthread_mutex_unlock(&g_queue->lock);
+
+    return NULL;
+}
+
+void g_queue_init() {
+    int error_code;
+
+    TRACE("g_queue_init()");
+
+    g_queue->jobs = g_heap_allocate(QUEUE_MAX_JOBS * sizeof(struct QueueJob));
+    if (g_queue->jobs == NULL) {
+        FATALV(FATAL_ERROR_QUEUE_INIT, "Could not allocate %d jobs", QUEUE_MAX_JOBS);
+    }
+    memset(g_queue->jobs, 0, QUEUE_MAX_JOBS * sizeof(struct QueueJob));
+    g_queue->next_id = 1;
+
+    // The CURL instances created at initialization are replaced by each job's own
+    g_http_close();
+    g_queue->mark = g_heap_mark();
+    if (g_heap_size() - g_queue->mark < queue_job_heap_size()) {
+        ERRORV("%zu bytes of heap left, jobs needing %zu will be refused", g_heap_size() - g_queue->mark,
+               queue_job_heap_size());
+    }
+
+    error_code = pthread_create(&g_queue->thread, NULL, &queue_thread, NULL);
+    if (error_code != 0) {
+        FATALV(FATAL_ERROR_QUEUE_INIT, "Could not start uploading thread: %s", strerror(error_code));
+    }
+}
+
+/**
+ * Copy files into a job.  Called with the lock held.
+ * @param job the job
+ * @param paths the files' paths, directories marked with a trailing slash being skipped
+ * @param npaths number of paths
+ * @return number of files, or a QueueAddError
+ */
+int queue_fill(struct QueueJob* job, char* paths[], size_t npaths) {
+    size_t length, used = 0;
+    int nfiles = 0;
+
+    for (size_t p = 0; p < npaths; p++) {
+        length = strlen(paths[p]);
+        if (length == 0 || paths[p][length - 1] == '/') {
+            continue;
+        }
+        if (nfiles == MAX_FILES || used + length + 1 > sizeof(job->paths)) {
+            return QUEUE_ADD_TOO_MANY;
+        }
+
+        job->files[nfiles++] = memcpy(job->paths + used, paths[p], length + 1);
+        used += length + 1;
+    }
+
+    return nfiles > 0 ? nfiles : QUEUE_ADD_NO_MATCH;
+}
+
+/**
+ * Queue a job uploading files.
+ * @param paths the files' paths, directories marked with a trailing slash being skipped
+ * @param npaths number of paths
+ * @return id of the job, or a QueueAddError
+ */
+int queue_push(char* paths[], size_t npaths) {
+    struct QueueJob* job;
+    int result;
+
+    if (g_heap_size() - g_queue->mark < queue_job_heap_size()) {
+        return QUEUE_ADD_HEAP;
+    }
+
+    pthread_mutex_lock(&g_queue->lock);
+    job = queue_reusable();
+    result = job == NULL ? QUEUE_ADD_FULL : queue_fill(job, paths, npaths);
+    if (result > 0) {
+        job->id = g_queue->next_id++;
+        job->nfiles = result;
+        job->nuploaded = 0;
+        atomic_store(&job->cancel, 0);
+        job->state = QUEUE_JOB_QUEUED;
+        result = job->id;
+        INFOV("Job %d queued with %d files", job->id, job->nfiles);
+        g_metrics_triggered();
+        pthread_cond_signal(&g_queue->changed);
+    }
+    pthread_mutex_unlock(&g_queue->lock);
+
+    return result;
+}
+
+/**
+ * Add a path a pattern expanded to, if it is a file.  Directories are skipped, so only files are uploaded.
+ * @param matches the matches
+ * @param path the path
+ */
+void queue_match(struct QueueMatches* matches, const char* path) {
+    struct stat path_stat;
+    size_t length = strlen(path);
+
+    if (stat(path, &path_stat) != 0 || S_ISDIR(path_stat.st_mode)) {
+        return;
+    }
+    if (matches->npaths == MAX_FILES || matches->used + length + 1 > sizeof(matches->buffer)) {
+        matches->overflow = 1;
+        return;
+    }
+
+    matches->paths[matches->npaths++] = memcpy(matches->buffer + matches->used, path, length + 1);
+    matches->used += length + 1;
+}
+
+/**
+ * Expand what is left of a pattern past the directory it has expanded to so far, a component at a time as glob() does,
+ * but reading directory entries onto the stack, as glob() allocates memory that would not come from the heap.
+ * @param matches receives the paths
+ * @param path the directory so far, ending with a slash unless empty, with room for PATH_MAX bytes
+ * @param length length of the directory so far
+ * @param pattern what is left of the pattern
+ */
+void queue_expand(struct QueueMatches* matches, char* path, size_t length, const char* pattern) {
+    char entries[QUEUE_DIRENTS_SIZE] __attribute__((aligned(__alignof__(struct dirent64))));
+    char component[NAME_MAX + 1];
+    const struct dirent64* entry;
+    const char* rest;
+    size_t component_length, name_length;
+    long nread;
+    int fd;
+
+    // Components without wildcards are taken as they are, up to the first with any
+    for (;;) {
+        rest = strchr(pattern, '/');
+        component_length = rest != NULL ? (size_t) (rest - pattern) : strlen(pattern);
+        if (component_length > NAME_MAX || length + component_length + 2 > PATH_MAX) {
+            return;
+        }
+        memcpy(component, pattern, component_length);
+        component[component_length] = '\0';
+        if (strpbrk(component, "*?[") != NULL) {
+            break;
+        }
+
+        memcpy(path + length, component, component_length);
+        length += component_length;
+        path[length] = '\0';
+        if (rest == NULL) {
+            queue_match(matches, path);
+            return;
+        }
+        path[length++] = '/';
+        pattern = rest + 1;
+    }
+
+    path[length] = '\0';
+    fd = open(length > 0 ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    while ((nread = syscall(SYS_getdents64, fd, entries, sizeof(entries))) > 0) {
+        for (long offset = 0; offset < nread; offset += entry->d_reclen) {
+            entry = (const struct dirent64*) (entries + offset);
+            name_length = strlen(entry->d_name);
+            if (fnmatch(component, entry->d_name, FNM_PERIOD) != 0 || length + name_length + 2 > PATH_MAX) {
+                continue;
+            }
+
+            memcpy(path + length, entry->d_name, name_length + 1);
+            if (rest == NULL) {
+                queue_match(matches, path);
+            } else {
+                path[length + name_length] = '/';
+                queue_expand(matches, path, length + name_length + 1, rest + 1);
+            }
+        }
+    }
+    if (nread == -1) {
+        path[length] = '\0';
+        ERRORV("Could not read directory %s: %s", length > 0 ? path : ".", strerror(errno));
+    }
+    close(fd);
+}
+
+int g_queue_add(char* patterns[], int npatterns) {
+    struct QueueMatches matches;
+    char path[PATH_MAX];
+
+    TRACEV("g_queue_add(%p, %d)", patterns, npatterns);
+
+    matches.npaths = 0;
+    matches.used = 0;
+    matches.overflow = 0;
+    for (int p = 0; p < npatterns; p++) {
+        queue_expand(&matches, path, 0, patterns[p]);
+    }
+
+    return matches.overflow ? QUEUE_ADD_TOO_MANY : queue_push(matches.paths, matches.npaths);
+}
+
+int g_queue_add_files(char* files[], int nfiles) {
+    TRACEV("g_queue_add_files(%p, %d)", files, nfiles);
+
+    return queue_push(files, nfiles);
+}
+
+void g_queue_status(char* buffer, size_t size) {
+    struct QueueJob* job;
+    size_t used = 0;
+    int written;
+
+    buffer[0] = '\0';
+
+    pthread_mutex_lock(&g_queue->lock);
+    for (int j = 0; j < QUEUE_MAX_JOBS; j++) {
+        job = &g_queue->jobs[j];
+        if (job->state == QUEUE_JOB_FREE) {
+            continue;
+        }
+
+        written = snprintf(buffer + used, size - used, "%d %s %d/%d\n", job->id, queue_state_names[job->state],
+                           job->nuploaded, job->nfiles);
+        if (written < 0 || (size_t) written >= size - used) {
+            break;
+        }
+        used += written;
+    }
+    pthread_mutex_unlock(&g_queue->lock);
+}
+
+int g_queue_cancel(int id) {
+    struct QueueJob* job;
+    int cancelled = 0;
+
+    TRACEV("g_queue_cancel(%d)", id);
+
+    pthread_mutex_lock(&g_queue->lock);
+    for (int j = 0; j < QUEUE_MAX_JOBS; j++) {
+        job = &g_queue->jobs[j];
+        if (job->id != id) {
+            continue;
+        }
+
+        if (job->state == QUEUE_JOB_QUEUED) {
+            job->state = QUEUE_JOB_CANCELLED;
+            cancelled = 1;
+        } else if (job->state == QUEUE_JOB_RUNNING) {
+            atomic_store(&job->cancel, 1);
+            cancelled = 1;
+        }
+    }
+    pthread_mutex_unlock(&g_queue->lock);
+
+    if (cancelled) {
+        INFOV("Job %d cancelled", id);
+    }
+    return cancelled;
+}
+
+void g_queue_destroy() {
+    int error_code;
+
+    TRACE("g_queue_destroy()");
+
+    if (g_queue->jobs == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_queue->lock);
+    for (int j = 0; j < QUEUE_MAX_JOBS; j++) {
+        atomic_store(&g_queue->jobs[j].cancel, 1);
+    }
+    g_queue->stopping = 1;
+    pthread_cond_signal(&g_queue->changed);
+    pthread_mutex_unlock(&g_queue->lock);
+
+    error_code = pthread_join(g_queue->thread, NULL);
+    if (error_code != 0) {
+        ERRORV("Could not stop uploading thread: %s", strerror(error_code));
+    }
+}
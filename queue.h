@@ -0,0 +1,75 @@
+#ifndef JETSAM_QUEUE_H
+#define JETSAM_QUEUE_H
+
+#include <stddef.h>
+
+/**
+ * Jobs kept at once, queued, running or finished, the oldest finished being forgotten to make room.
+ */
+#define QUEUE_MAX_JOBS 16
+
+/**
+ * Bytes of paths a job holds in total, each null terminated.
+ */
+#define QUEUE_PATHS_SIZE (16 * 1024)
+
+/**
+ * Bytes of heap a job is expected to need for each CURL instance, for its buffers and the state curl keeps, about 120KB
+ * being used uploading over plain HTTP.
+ */
+#define QUEUE_CURL_HEAP_SIZE (160 * 1024)
+
+/**
+ * Reasons a job could not be queued.
+ */
+enum QueueAddError {
+    QUEUE_ADD_FULL = -1,
+    QUEUE_ADD_NO_MATCH = -2,
+    QUEUE_ADD_TOO_MANY = -3,
+    QUEUE_ADD_HEAP = -4
+};
+
+/**
+ * Initialize the queue, allocating jobs from the heap, and start the thread uploading them one after another.  Each
+ * job creates the CURL instances it uploads with and cleans them up once done, and the heap is then rewound to where
+ * it was before the first, so jobs do not use up the heap however many run.  As nothing else may allocate from the
+ * heap from then on, the queue is initialized after everything else.
+ */
+void g_queue_init();
+
+/**
+ * Queue a job uploading the files matching glob patterns, expanded without allocating memory, in no particular order.
+ * @param patterns the patterns, each a path or glob
+ * @param npatterns number of patterns
+ * @return id of the job, or a QueueAddError
+ */
+int g_queue_add(char* patterns[], int npatterns);
+
+/**
+ * Queue a job uploading files by path, without expanding globs.
+ * @param files the files' paths
+ * @param nfiles number of files
+ * @return id of the job, or a QueueAddError
+ */
+int g_queue_add_files(char* files[], int nfiles);
+
+/**
+ * Describe every job kept, a line each: its id, state, then files uploaded to every destination out of its files.
+ * @param buffer receives the lines, null terminated
+ * @param size size of the buffer
+ */
+void g_queue_status(char* buffer, size_t size);
+
+/**
+ * Cancel a job: one queued is never started, one running stops starting files and aborts its transfers.
+ * @param id id of the job
+ * @return 1 if and only if the job was queued or running
+ */
+int g_queue_cancel(int id);
+
+/**
+ * Cancel every job and stop the uploading thread.
+ */
+void g_queue_destroy();
+
+#endif //JETSAM_QUEUE_H
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "opts.h"
+#include "quiesce.h"
+#include "trace.h"
+
+/**
+ * Events on a directory meaning a file in it changed.
+ */
+#define QUIESCE_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/**
+ * Size of the buffer inotify events are read into.
+ */
+#define QUIESCE_EVENT_BUFFER_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/**
+ * Quiescence detection state.
+ */
+struct Quiesce {
+    /**
+     * inotify instance, or -1.
+     */
+    int fd;
+
+    /**
+     * Watch descriptor of each file's directory, indexed as files in the CLI options.  Directories are watched rather
+     * than files so files that are created, replaced or rotated are still noticed.
+     */
+    int wds[MAX_FILES];
+
+    /**
+     * Name of each file within its directory, indexed as files in the CLI options.
+     */
+    const char* names[MAX_FILES];
+
+    /**
+     * Buffer events are read into.
+     */
+    char events[QUIESCE_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+};
+
+/**
+ * The quiescence detection instance.
+ */
+struct Quiesce g_quiesce_instance = { .fd = -1 };
+
+/**
+ * Pointer to the quiescence detection instance.
+ */
+struct Quiesce* g_quiesce = &g_quiesce_instance;
+
+/**
+ * Current monotonic time in milliseconds.
+ */
+long quiesce_now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Watch the directories of every file to upload.
+ * @return 0 on success, -1 if inotify is unavailable
+ */
+int quiesce_watch() {
+    char directory[PATH_MAX];
+    const char* file;
+    const char* slash;
+
+    g_quiesce->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_quiesce->fd == -1) {
+        ERRORV("Could not initialize inotify: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < g_opts->nfiles; i++) {
+        file = g_opts->files[i];
+        slash = strrchr(file, '/');
+
+        if (slash == NULL) {
+            strcpy(directory, ".");
+            g_quiesce->names[i] = file;
+        } else if ((size_t) (slash - file) < sizeof(directory)) {
+            // The root directory keeps its slash
+            memcpy(directory, file, slash == file ? 1 : slash - file);
+            directory[slash == file ? 1 : slash - file] = '\0';
+            g_quiesce->names[i] = slash + 1;
+        } else {
+            ERRORV("%s is too long a path to watch", file);
+            return -1;
+        }
+
+        // Watching the same directory again returns the same watch descriptor
+        g_quiesce->wds[i] = inotify_add_watch(g_quiesce->fd, directory, QUIESCE_EVENTS);
+        if (g_quiesce->wds[i] == -1) {
+            ERRORV("Could not watch %s: %s", directory, strerror(errno));
+            return -1;
+        }
+        DEBUGV("Watching %s in %s", g_quiesce->names[i], directory);
+    }
+
+    return 0;
+}
+
+/**
+ * Read pending inotify events.
+ * @return 1 if and only if any of them was about a file to upload
+ */
+int quiesce_read_events() {
+    const struct inotify_event* event;
+    ssize_t nread;
+    int changed = 0;
+
+    while ((nread = read(g_quiesce->fd, g_quiesce->events, sizeof(g_quiesce->events))) > 0) {
+        for (char* p = g_quiesce->events; p < g_quiesce->events + nread; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) p;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+                continue;
+            }
+
+            for (int i = 0; i < g_opts->nfiles && event->len > 0; i++) {
+                if (event->wd == g_quiesce->wds[i] && strcmp(event->name, g_quiesce->names[i]) == 0) {
+                    TRACEV("%s changed (0x%x)", g_opts->files[i], event->mask);
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Wait until no file to upload has changed for the settle window, or the quiesce time has passed.
+ */
+void quiesce_settle() {
+    struct pollfd pollfd;
+    long start, deadline, settled, now;
+    int timeout;
+
+    start = quiesce_now_ms();
+    deadline = start + g_opts->quiesce_secs * 1000L;
+    settled = start + g_opts->settle_ms;
+
+    INFOV("Waiting up to %d seconds for files to be quiet for %dms", g_opts->quiesce_secs, g_opts->settle_ms);
+
+    pollfd.fd = g_quiesce->fd;
+    pollfd.events = POLLIN;
+
+    while ((now = quiesce_now_ms()) < settled && now < deadline) {
+        timeout = (int) ((settled < deadline ? settled : deadline) - now);
+
+        if (poll(&pollfd, 1, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERRORV("Could not wait for file changes: %s", strerror(errno));
+            return;
+        }
+
+        if (pollfd.revents & POLLIN && quiesce_read_events()) {
+            settled = quiesce_now_ms() + g_opts->settle_ms;
+        }
+    }
+
+    if (now >= settled) {
+        INFOV("Files quiet after %ldms", now - start);
+    } else {
+        INFOV("Files still changing after %d seconds, uploading anyway", g_opts->quiesce_secs);
+    }
+}
+
+void g_quiesce_wait() {
+    int64_t started_us = g_trace_now();
+
+    TRACE("g_quiesce_wait()");
+
+    if (g_opts->quiesce_secs == 0) {
+        return;
+    }
+
+    if (g_opts->settle_ms == 0 || quiesce_watch() != 0) {
+        INFOV("Waiting %d seconds to quiesce", g_opts->quiesce_secs);
+        sleep(g_opts->quiesce_secs);
+    } else {
+        quiesce_settle();
+    }
+
+    if (g_quiesce->fd != -1 && close(g_quiesce->fd) != 0) {
+        ERRORV("Could not close inotify: %s", strerror(errno));
+    }
+    g_quiesce->fd = -1;
+
+    g_trace_span("quiesce", "quiesce", NULL, started_us, g_trace_now());
+}
@@ -0,0 +1,11 @@
+#ifndef JETSAM_QUIESCE_H
+#define JETSAM_QUIESCE_H
+
+/**
+ * Wait for the files to upload to stop changing.  Waits the full quiesce time from the CLI options, unless a settle
+ * window is configured, in which case the files are watched with inotify and waiting stops as soon as none has changed
+ * for the settle window, with the quiesce time as a ceiling.
+ */
+void g_quiesce_wait();
+
+#endif //JETSAM_QUIESCE_H
@@ -0,0 +1,137 @@
+#ifndef SALVAGE_SHM_H
+#define SALVAGE_SHM_H
+
+/**
+ * Header-only C API for a program run by jetsam -D to keep in-memory diagnostics, such as a flight recorder, in a ring
+ * buffer shared with jetsam.  jetsam uploads what the ring buffer last holds straight from the shared memory if the
+ * program terminates abnormally, so writing to it costs a memcpy() and nothing survives on disk.
+ *
+ *     struct SalvageShm* shm = salvage_shm_open();
+ *     salvage_shm_write(shm, record, length);
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Environment variable jetsam passes the shared memory file descriptor in.
+ */
+#define SALVAGE_SHM_ENV "SALVAGE_SHM_FD"
+
+/**
+ * Magic the shared memory starts with.
+ */
+#define SALVAGE_SHM_MAGIC "salvring"
+
+/**
+ * Format version of the shared memory.
+ */
+#define SALVAGE_SHM_VERSION 1
+
+/**
+ * Start of the shared memory, followed by the ring buffer.
+ */
+struct SalvageShm {
+    /**
+     * SALVAGE_SHM_MAGIC.
+     */
+    char magic[8];
+
+    /**
+     * Format version, SALVAGE_SHM_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * Bytes from the start of the shared memory to the ring buffer.
+     */
+    uint32_t header_size;
+
+    /**
+     * Size in bytes of the ring buffer.
+     */
+    uint64_t size;
+
+    /**
+     * Total bytes written, the next write's position in the ring buffer being this modulo its size.
+     */
+    _Atomic uint64_t head;
+};
+
+/**
+ * Map the shared memory jetsam passed us.
+ * @return the shared memory, or NULL if we were not run by jetsam -D or it could not be mapped
+ */
+static inline struct SalvageShm* salvage_shm_open(void) {
+    const char* fd_text = getenv(SALVAGE_SHM_ENV);
+    struct SalvageShm* shm;
+    struct stat st;
+    int fd;
+
+    if (fd_text == NULL || fd_text[0] == '\0') {
+        return NULL;
+    }
+    fd = atoi(fd_text);
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(struct SalvageShm)) {
+        return NULL;
+    }
+
+    shm = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(shm->magic, SALVAGE_SHM_MAGIC, sizeof(shm->magic)) != 0 || shm->version != SALVAGE_SHM_VERSION ||
+            shm->size == 0 || shm->header_size + shm->size > (uint64_t) st.st_size) {
+        munmap(shm, (size_t) st.st_size);
+        return NULL;
+    }
+
+    return shm;
+}
+
+/**
+ * Write to the ring buffer, overwriting the oldest bytes once it is full.  Threads may write at once, each write
+ * claiming its own range, though a write not finished when the program terminates is uploaded part written.
+ * @param shm the shared memory, or NULL to do nothing
+ * @param data bytes to write, of which only the last that fit are kept if more than the ring buffer holds
+ * @param length number of bytes
+ */
+static inline void salvage_shm_write(struct SalvageShm* shm, const void* data, size_t length) {
+    char* ring;
+    uint64_t head;
+    size_t position, first;
+
+    if (shm == NULL || length == 0) {
+        return;
+    }
+
+    ring = (char*) shm + shm->header_size;
+    head = atomic_fetch_add_explicit(&shm->head, length, memory_order_relaxed);
+    if (length > shm->size) {
+        data = (const char*) data + (length - shm->size);
+        head += length - shm->size;
+        length = shm->size;
+    }
+
+    // The write may run past the end of the ring buffer, in which case it wraps to the start
+    position = head % shm->size;
+    first = shm->size - position < length ? shm->size - position : length;
+    memcpy(ring + position, data, first);
+    memcpy(ring, (const char*) data + first, length - first);
+}
+
+/**
+ * Unmap the shared memory.  What was written is still uploaded.
+ * @param shm the shared memory, or NULL
+ */
+static inline void salvage_shm_close(struct SalvageShm* shm) {
+    if (shm != NULL) {
+        munmap(shm, shm->header_size + shm->size);
+    }
+}
+
+#endif //SALVAGE_SHM_H
@@ -0,0 +1,418 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "http.h"
+#include "log.h"
+#include "opts.h"
+#include "sampler.h"
+
+/**
+ * Size of the buffer /proc files are read into, enough for the largest, /proc/PID/status.
+ */
+#define SAMPLER_READ_BUFFER_SIZE 4096
+
+/**
+ * Least milliseconds between reads of /proc/PID/smaps_rollup, which walks every page table of the process and so costs
+ * far more than the other files for a large one.
+ */
+#define SAMPLER_ROLLUP_INTERVAL_MS 1000
+
+/**
+ * Where cgroup v2 may be mounted, alone or alongside v1.
+ */
+const char* sampler_cgroup_roots[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified", NULL };
+
+/**
+ * Files sampled, kept open and read from the start for each sample.
+ */
+enum SamplerFile {
+    SAMPLER_STAT = 0,
+    SAMPLER_STATUS,
+    SAMPLER_IO,
+    SAMPLER_SMAPS_ROLLUP,
+    SAMPLER_MEMORY_CURRENT,
+    SAMPLER_MEMORY_EVENTS,
+    SAMPLER_FILES
+};
+
+/**
+ * Resource sampling state.
+ */
+struct Sampler {
+    /**
+     * timerfd for the sampling interval, or -1.
+     */
+    int timerfd;
+
+    /**
+     * Sampled files, indexed by SamplerFile, -1 where unavailable.
+     */
+    int fds[SAMPLER_FILES];
+
+    /**
+     * Header of the uploaded time series, allocated from the heap followed by the ring buffer of samples.
+     */
+    struct SamplerHeader* header;
+
+    /**
+     * Ring buffer of samples, following the header.
+     */
+    struct SamplerSample* samples;
+
+    /**
+     * Header and ring buffer the next run samples into when restarting, or NULL.
+     */
+    struct SamplerHeader* spare;
+
+    /**
+     * Samples taken in total, the next sample's position in the ring buffer being this modulo its size.
+     */
+    uint64_t nsamples;
+
+    /**
+     * When sampling started.
+     */
+    struct timespec start;
+
+    /**
+     * time_ms of the last sample /proc/PID/smaps_rollup was read for.
+     */
+    uint64_t rollup_ms;
+
+    /**
+     * CPU time spent sampling in nanoseconds.
+     */
+    uint64_t cost_ns;
+
+    /**
+     * Buffer files are read into.
+     */
+    char buffer[SAMPLER_READ_BUFFER_SIZE];
+};
+
+/**
+ * The sampler instance.
+ */
+struct Sampler g_sampler_instance = { .timerfd = -1, .fds = { -1, -1, -1, -1, -1, -1 } };
+
+/**
+ * Pointer to the sampler instance.
+ */
+struct Sampler* g_sampler = &g_sampler_instance;
+
+/**
+ * Nanoseconds from one time to another.
+ */
+uint64_t sampler_elapsed_ns(const struct timespec* from, const struct timespec* to) {
+    return (uint64_t) (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+int g_sampler_cgroup_open(pid_t pid, const char* name) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    FILE* file;
+    int fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    file = fopen(path, "re");
+    if (file == NULL) {
+        return -1;
+    }
+
+    // cgroup v2 is the hierarchy with ID 0 and no controllers listed
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) != 0) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        for (int i = 0; sampler_cgroup_roots[i] != NULL && fd == -1; i++) {
+            if (snprintf(path, sizeof(path), "%s%s/%s", sampler_cgroup_roots[i], line + 3, name) < (int) sizeof(path)) {
+                fd = open(path, O_RDONLY | O_CLOEXEC);
+            }
+        }
+    }
+
+    fclose(file);
+    return fd;
+}
+
+/**
+ * Read a sampled file from the start into the read buffer, null terminated.
+ * @param file the SamplerFile
+ * @return the contents, or NULL if unavailable
+ */
+const char* sampler_read(int file) {
+    ssize_t nread;
+
+    if (g_sampler->fds[file] == -1) {
+        return NULL;
+    }
+
+    nread = pread(g_sampler->fds[file], g_sampler->buffer, sizeof(g_sampler->buffer) - 1, 0);
+    if (nread < 0) {
+        return NULL;
+    }
+    g_sampler->buffer[nread] = '\0';
+
+    return g_sampler->buffer;
+}
+
+uint64_t g_sampler_field(const char* contents, const char* key, uint64_t missing) {
+    size_t length = strlen(key);
+    const char* line = contents;
+
+    while (line != NULL && *line != '\0') {
+        if (strncmp(line, key, length) == 0) {
+            return strtoull(line + length, NULL, 10);
+        }
+        line = strchr(line, '\n');
+        line = line == NULL ? NULL : line + 1;
+    }
+
+    return missing;
+}
+
+/**
+ * Fill in a sample from /proc/PID/stat.
+ * @param sample the sample
+ */
+void sampler_read_stat(struct SamplerSample* sample) {
+    const char* contents = sampler_read(SAMPLER_STAT);
+    unsigned long minflt, majflt, utime, stime, vsize;
+    long threads, rss;
+
+    // The command name may contain anything, so fields are counted from after its closing parenthesis
+    contents = contents == NULL ? NULL : strrchr(contents, ')');
+    if (contents == NULL || sscanf(contents + 1, " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu %*d %*d %*d %*d "
+                                                 "%ld %*d %*u %lu %ld", &minflt, &majflt, &utime, &stime, &threads,
+                                                 &vsize, &rss) != 7) {
+        return;
+    }
+
+    sample->minor_faults = minflt;
+    sample->major_faults = majflt;
+    sample->utime_ticks = utime;
+    sample->stime_ticks = stime;
+    sample->threads = (uint64_t) threads;
+    sample->vsize_bytes = vsize;
+    sample->rss_pages = (uint64_t) rss;
+}
+
+/**
+ * Take a sample into the next slot of the ring buffer.
+ */
+void sampler_take() {
+    struct SamplerSample* sample = &g_sampler->samples[g_sampler->nsamples % SAMPLER_MAX_SAMPLES];
+    struct timespec now, cpu_start, cpu_end;
+    const char* contents;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(sample, 0xff, sizeof(*sample));
+    sample->time_ms = sampler_elapsed_ns(&g_sampler->start, &now) / 1000000;
+
+    sampler_read_stat(sample);
+
+    contents = sampler_read(SAMPLER_STATUS);
+    sample->vm_hwm_kb = g_sampler_field(contents, "VmHWM:", SAMPLER_UNAVAILABLE);
+    sample->vm_rss_kb = g_sampler_field(contents, "VmRSS:", SAMPLER_UNAVAILABLE);
+    sample->vm_swap_kb = g_sampler_field(contents, "VmSwap:", SAMPLER_UNAVAILABLE);
+    sample->voluntary_switches = g_sampler_field(contents, "voluntary_ctxt_switches:", SAMPLER_UNAVAILABLE);
+    sample->involuntary_switches = g_sampler_field(contents, "nonvoluntary_ctxt_switches:", SAMPLER_UNAVAILABLE);
+
+    contents = sampler_read(SAMPLER_IO);
+    sample->rchar = g_sampler_field(contents, "rchar:", SAMPLER_UNAVAILABLE);
+    sample->wchar = g_sampler_field(contents, "wchar:", SAMPLER_UNAVAILABLE);
+    sample->read_bytes = g_sampler_field(contents, "read_bytes:", SAMPLER_UNAVAILABLE);
+    sample->write_bytes = g_sampler_field(contents, "write_bytes:", SAMPLER_UNAVAILABLE);
+
+    if (g_sampler->nsamples == 0 || sample->time_ms - g_sampler->rollup_ms >= SAMPLER_ROLLUP_INTERVAL_MS) {
+        contents = sampler_read(SAMPLER_SMAPS_ROLLUP);
+        sample->pss_kb = g_sampler_field(contents, "Pss:", SAMPLER_UNAVAILABLE);
+        sample->anonymous_kb = g_sampler_field(contents, "Anonymous:", SAMPLER_UNAVAILABLE);
+        g_sampler->rollup_ms = sample->time_ms;
+    }
+
+    contents = sampler_read(SAMPLER_MEMORY_CURRENT);
+    sample->cgroup_memory_bytes = contents == NULL ? SAMPLER_UNAVAILABLE : strtoull(contents, NULL, 10);
+
+    contents = sampler_read(SAMPLER_MEMORY_EVENTS);
+    sample->cgroup_high = g_sampler_field(contents, "high ", SAMPLER_UNAVAILABLE);
+    sample->cgroup_max = g_sampler_field(contents, "max ", SAMPLER_UNAVAILABLE);
+    sample->cgroup_oom = g_sampler_field(contents, "oom ", SAMPLER_UNAVAILABLE);
+    sample->cgroup_oom_kill = g_sampler_field(contents, "oom_kill ", SAMPLER_UNAVAILABLE);
+
+    g_sampler->nsamples++;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    g_sampler->cost_ns += sampler_elapsed_ns(&cpu_start, &cpu_end);
+}
+
+/**
+ * Allocate a header followed by a ring buffer of samples from the heap.
+ * @return the header
+ */
+struct SamplerHeader* sampler_allocate() {
+    struct SamplerHeader* header;
+
+    header = g_heap_allocate(sizeof(struct SamplerHeader) + SAMPLER_MAX_SAMPLES * sizeof(struct SamplerSample));
+    if (header == NULL) {
+        FATALV(FATAL_ERROR_SAMPLER_INIT, "Could not allocate %d samples", SAMPLER_MAX_SAMPLES);
+    }
+
+    memcpy(header->magic, "salvsmpl", sizeof(header->magic));
+    header->version = 1;
+    header->sample_size = sizeof(struct SamplerSample);
+    header->interval_ms = g_opts->sample_ms;
+    header->clock_ticks = sysconf(_SC_CLK_TCK);
+    header->page_size = sysconf(_SC_PAGESIZE);
+
+    return header;
+}
+
+void g_sampler_init() {
+    TRACE("g_sampler_init()");
+
+    if (g_opts->sample_ms == 0 || g_sampler->header != NULL) {
+        return;
+    }
+
+    g_sampler->header = sampler_allocate();
+    g_sampler->samples = (struct SamplerSample*) (g_sampler->header + 1);
+    g_sampler->spare = g_opts->max_restarts > 0 ? sampler_allocate() : NULL;
+}
+
+int g_sampler_start(pid_t pid) {
+    const char* proc_files[] = { "stat", "status", "io", "smaps_rollup" };
+    struct itimerspec interval = { 0 };
+    struct timespec now;
+    char path[PATH_MAX];
+
+    TRACEV("g_sampler_start(%d)", pid);
+
+    if (g_sampler->samples == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < SAMPLER_MEMORY_CURRENT; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, proc_files[i]);
+        g_sampler->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (g_sampler->fds[i] == -1) {
+            INFOV("Not sampling %s: %s", path, strerror(errno));
+        }
+    }
+    g_sampler->fds[SAMPLER_MEMORY_CURRENT] = g_sampler_cgroup_open(pid, "memory.current");
+    g_sampler->fds[SAMPLER_MEMORY_EVENTS] = g_sampler_cgroup_open(pid, "memory.events");
+    if (g_sampler->fds[SAMPLER_MEMORY_CURRENT] == -1) {
+        INFO("Not sampling cgroup memory, cgroup v2 memory controller unavailable");
+    }
+
+    g_sampler->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_sampler->timerfd == -1) {
+        ERRORV("Could not create sampling timer: %s", strerror(errno));
+        return -1;
+    }
+
+    interval.it_interval.tv_sec = g_opts->sample_ms / 1000;
+    interval.it_interval.tv_nsec = (g_opts->sample_ms % 1000) * 1000000L;
+    interval.it_value = interval.it_interval;
+    if (timerfd_settime(g_sampler->timerfd, 0, &interval, NULL) != 0) {
+        ERRORV("Could not start sampling timer: %s", strerror(errno));
+    }
+
+    g_sampler->nsamples = 0;
+    g_sampler->cost_ns = 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    g_sampler->header->start_ms = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &g_sampler->start);
+
+    INFOV("Sampling child PID %d every %dms", pid, g_opts->sample_ms);
+    sampler_take();
+
+    return g_sampler->timerfd;
+}
+
+int g_sampler_fd() {
+    return g_sampler->timerfd;
+}
+
+void g_sampler_sample() {
+    uint64_t expirations;
+
+    // Samples missed while busy are not made up, the time series just has a gap
+    if (read(g_sampler->timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        sampler_take();
+    }
+}
+
+void g_sampler_snapshot() {
+    if (g_sampler->timerfd != -1) {
+        sampler_take();
+    }
+}
+
+void g_sampler_stop() {
+    TRACE("g_sampler_stop()");
+
+    if (g_sampler->timerfd == -1) {
+        return;
+    }
+
+    if (close(g_sampler->timerfd) != 0) {
+        ERRORV("Could not close sampling timer: %s", strerror(errno));
+    }
+    g_sampler->timerfd = -1;
+
+    for (int i = 0; i < SAMPLER_FILES; i++) {
+        if (g_sampler->fds[i] != -1) {
+            close(g_sampler->fds[i]);
+            g_sampler->fds[i] = -1;
+        }
+    }
+
+    INFOV("Took %lu samples, using %luus of CPU each on average", (unsigned long) g_sampler->nsamples,
+          (unsigned long) (g_sampler->cost_ns / 1000 / (g_sampler->nsamples > 0 ? g_sampler->nsamples : 1)));
+}
+
+int g_sampler_file(struct VirtualFile* file) {
+    struct SamplerHeader* header = g_sampler->header;
+    uint64_t nkept, oldest;
+
+    TRACEV("g_sampler_file(%p)", file);
+
+    if (header == NULL) {
+        return 0;
+    }
+
+    nkept = g_sampler->nsamples < SAMPLER_MAX_SAMPLES ? g_sampler->nsamples : SAMPLER_MAX_SAMPLES;
+    oldest = (g_sampler->nsamples - nkept) % SAMPLER_MAX_SAMPLES;
+    header->nsamples = (uint32_t) nkept;
+
+    // The oldest sample kept may be part way round the ring buffer, in which case the samples wrap to the start
+    file->name = "samples";
+    file->data[0] = (const char*) header;
+    file->length[0] = sizeof(*header);
+    file->data[1] = (const char*) &g_sampler->samples[oldest];
+    file->length[1] = (SAMPLER_MAX_SAMPLES - oldest < nkept ? SAMPLER_MAX_SAMPLES - oldest : nkept) *
+                      sizeof(struct SamplerSample);
+    file->data[2] = (const char*) g_sampler->samples;
+    file->length[2] = nkept * sizeof(struct SamplerSample) - file->length[1];
+
+    if (g_sampler->spare != NULL) {
+        g_sampler->header = g_sampler->spare;
+        g_sampler->samples = (struct SamplerSample*) (g_sampler->header + 1);
+        g_sampler->spare = header;
+    }
+
+    return 1;
+}
@@ -0,0 +1,194 @@
+#ifndef JETSAM_SAMPLER_H
+#define JETSAM_SAMPLER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+/**
+ * Samples kept, the oldest being overwritten once full.
+ */
+#define SAMPLER_MAX_SAMPLES 2048
+
+/**
+ * Value of a sample field that could not be read.
+ */
+#define SAMPLER_UNAVAILABLE UINT64_MAX
+
+/**
+ * Start of the uploaded time series, followed by its samples from oldest to newest.
+ */
+struct SamplerHeader {
+    /**
+     * "salvsmpl".
+     */
+    char magic[8];
+
+    /**
+     * Format version, 1.
+     */
+    uint32_t version;
+
+    /**
+     * Size in bytes of each sample.
+     */
+    uint32_t sample_size;
+
+    /**
+     * Milliseconds between samples.
+     */
+    uint32_t interval_ms;
+
+    /**
+     * Number of samples following.
+     */
+    uint32_t nsamples;
+
+    /**
+     * Wall clock time sampling started, in milliseconds since the epoch.
+     */
+    uint64_t start_ms;
+
+    /**
+     * Clock ticks per second, the unit of CPU times.
+     */
+    uint64_t clock_ticks;
+
+    /**
+     * Page size in bytes, the unit of rss_pages.
+     */
+    uint64_t page_size;
+};
+
+/**
+ * Resource usage of the child at one moment, every field SAMPLER_UNAVAILABLE if it could not be read.
+ */
+struct SamplerSample {
+    /**
+     * Milliseconds since sampling started.
+     */
+    uint64_t time_ms;
+
+    /**
+     * User and system CPU time in clock ticks, from /proc/PID/stat.
+     */
+    uint64_t utime_ticks;
+    uint64_t stime_ticks;
+
+    /**
+     * Minor and major page faults, from /proc/PID/stat.
+     */
+    uint64_t minor_faults;
+    uint64_t major_faults;
+
+    /**
+     * Threads, virtual memory size in bytes and resident set size in pages, from /proc/PID/stat.
+     */
+    uint64_t threads;
+    uint64_t vsize_bytes;
+    uint64_t rss_pages;
+
+    /**
+     * Peak and current resident set size and swap in kB, from /proc/PID/status.
+     */
+    uint64_t vm_hwm_kb;
+    uint64_t vm_rss_kb;
+    uint64_t vm_swap_kb;
+
+    /**
+     * Voluntary and involuntary context switches, from /proc/PID/status.
+     */
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+
+    /**
+     * Bytes read and written, through any means and from storage, from /proc/PID/io.
+     */
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+
+    /**
+     * Proportional set size and anonymous memory in kB, from /proc/PID/smaps_rollup, which is only read once a second
+     * at most as it is costly to read.
+     */
+    uint64_t pss_kb;
+    uint64_t anonymous_kb;
+
+    /**
+     * Memory use in bytes of the child's cgroup, from memory.current.
+     */
+    uint64_t cgroup_memory_bytes;
+
+    /**
+     * Times the child's cgroup went over memory.high, hit memory.max, hit OOM and had a process OOM killed, from
+     * memory.events.
+     */
+    uint64_t cgroup_high;
+    uint64_t cgroup_max;
+    uint64_t cgroup_oom;
+    uint64_t cgroup_oom_kill;
+};
+
+/**
+ * Initialize sampling, if configured in the CLI options, allocating the ring buffer of samples from the heap on the
+ * first run only.  When restarting, a spare ring buffer is allocated too.
+ */
+void g_sampler_init();
+
+/**
+ * Start sampling a process, taking a first sample.
+ * @param pid the process
+ * @return timerfd readable when the next sample is due, or -1 if not sampling
+ */
+int g_sampler_start(pid_t pid);
+
+/**
+ * File descriptor readable when the next sample is due.
+ * @return the timerfd, or -1 if not sampling
+ */
+int g_sampler_fd();
+
+/**
+ * Take a sample, if one is due.
+ */
+void g_sampler_sample();
+
+/**
+ * Stop sampling, the process having terminated.
+ */
+void g_sampler_stop();
+
+/**
+ * Open a file of the cgroup v2 cgroup a process is in.
+ * @param pid the process
+ * @param name the file within the cgroup directory
+ * @return file descriptor, or -1 if cgroup v2 or the file is unavailable
+ */
+int g_sampler_cgroup_open(pid_t pid, const char* name);
+
+/**
+ * Find a value in the contents of a file of "key value" lines, as in /proc and cgroup files.
+ * @param contents the contents, or NULL
+ * @param key the key, including any separator before the value
+ * @param missing the value if not found
+ * @return the value, or missing if not found
+ */
+uint64_t g_sampler_field(const char* contents, const char* key, uint64_t missing);
+
+/**
+ * Take a sample now, if sampling, as well as those due on the timer.
+ */
+void g_sampler_snapshot();
+
+/**
+ * Hand the samples over to be uploaded, as a time series named samples.  When restarting, the next run samples into
+ * the spare ring buffer, so this run's stays untouched while it uploads.
+ * @param file receives the file
+ * @return 1 if sampling, otherwise 0 and no file
+ */
+int g_sampler_file(struct VirtualFile* file);
+
+#endif //JETSAM_SAMPLER_H
@@ -0,0 +1,159 @@
+// For memfd_create()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "opts.h"
+#include "salvage_shm.h"
+#include "shared.h"
+
+/**
+ * Shared memory, a file descriptor and our mapping of it.
+ */
+struct SharedMemory {
+    /**
+     * memfd, or -1 if not created.
+     */
+    int fd;
+
+    /**
+     * Our mapping, or NULL.
+     */
+    struct SalvageShm* shm;
+};
+
+/**
+ * State of the ring buffer shared with the child.
+ */
+struct Shared {
+    /**
+     * Shared memory the current run writes to.
+     */
+    struct SharedMemory memory;
+
+    /**
+     * Shared memory the next run writes to when restarting.
+     */
+    struct SharedMemory spare;
+
+    /**
+     * SALVAGE_SHM_FD=FD for the child's environment.
+     */
+    char environment[32];
+};
+
+/**
+ * The shared instance.
+ */
+struct Shared g_shared_instance = { .memory = { .fd = -1 }, .spare = { .fd = -1 } };
+
+/**
+ * Pointer to the shared instance.
+ */
+struct Shared* g_shared = &g_shared_instance;
+
+/**
+ * Create shared memory holding the header and a ring buffer the size from the CLI options.  It is sealed at that size,
+ * so the child cannot shrink it under our mapping.
+ * @param memory receives the shared memory
+ */
+void shared_create(struct SharedMemory* memory) {
+    size_t size = sizeof(struct SalvageShm) + (size_t) g_opts->shared_size;
+
+    memory->fd = memfd_create("salvage", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memory->fd == -1 || ftruncate(memory->fd, (off_t) size) != 0 ||
+            fcntl(memory->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        FATALV(FATAL_ERROR_SHARED_INIT, "Could not create %zu bytes of shared memory: %s", size, strerror(errno));
+    }
+
+    memory->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory->fd, 0);
+    if (memory->shm == MAP_FAILED) {
+        FATALV(FATAL_ERROR_SHARED_INIT, "Could not map %zu bytes of shared memory: %s", size, strerror(errno));
+    }
+}
+
+void g_shared_init() {
+    struct SalvageShm* shm;
+
+    TRACE("g_shared_init()");
+
+    if (g_opts->shared_size == 0) {
+        return;
+    }
+
+    if (g_shared->memory.shm == NULL) {
+        shared_create(&g_shared->memory);
+        if (g_opts->max_restarts > 0) {
+            shared_create(&g_shared->spare);
+        }
+    }
+
+    // Written for every run, as the child may have written over the header of the last
+    shm = g_shared->memory.shm;
+    memcpy(shm->magic, SALVAGE_SHM_MAGIC, sizeof(shm->magic));
+    shm->version = SALVAGE_SHM_VERSION;
+    shm->header_size = sizeof(struct SalvageShm);
+    shm->size = (uint64_t) g_opts->shared_size;
+    atomic_store_explicit(&shm->head, 0, memory_order_relaxed);
+
+    snprintf(g_shared->environment, sizeof(g_shared->environment), "%s=%d", SALVAGE_SHM_ENV, g_shared->memory.fd);
+
+    INFOV("Sharing a %d byte ring buffer with the program", g_opts->shared_size);
+}
+
+int g_shared_spawn_actions(posix_spawn_file_actions_t* file_actions) {
+    if (g_shared->memory.fd == -1) {
+        return 0;
+    }
+
+    // Duplicating a file descriptor onto itself clears close-on-exec for the child only
+    return posix_spawn_file_actions_adddup2(file_actions, g_shared->memory.fd, g_shared->memory.fd);
+}
+
+const char* g_shared_environment() {
+    return g_shared->memory.fd != -1 ? g_shared->environment : NULL;
+}
+
+int g_shared_file(struct VirtualFile* file) {
+    struct SharedMemory memory = g_shared->memory;
+    size_t size = (size_t) g_opts->shared_size;
+    size_t kept, position;
+    uint64_t head;
+    const char* ring;
+
+    TRACEV("g_shared_file(%p)", file);
+
+    if (memory.shm == NULL) {
+        return 0;
+    }
+
+    // Only the head is read back from the shared memory, the child having had the run of the rest
+    head = atomic_load_explicit(&memory.shm->head, memory_order_acquire);
+    ring = (const char*) (memory.shm + 1);
+    kept = head < size ? (size_t) head : size;
+    position = (size_t) ((head - kept) % size);
+
+    // The oldest bytes kept may be part way round the ring buffer, in which case they wrap to the start
+    file->name = "shared";
+    file->data[0] = ring + position;
+    file->length[0] = size - position < kept ? size - position : kept;
+    file->data[1] = ring;
+    file->length[1] = kept - file->length[0];
+    file->data[2] = ring;
+    file->length[2] = 0;
+
+    INFOV("Kept %zu of %llu bytes written to shared memory", kept, (unsigned long long) head);
+
+    if (g_shared->spare.shm != NULL) {
+        g_shared->memory = g_shared->spare;
+        g_shared->spare = memory;
+    }
+
+    return 1;
+}
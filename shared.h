@@ -0,0 +1,36 @@
+#ifndef JETSAM_SHARED_H
+#define JETSAM_SHARED_H
+
+#include <spawn.h>
+
+#include "http.h"
+
+/**
+ * Initialize the ring buffer shared with the child, if configured in the CLI options: shared memory from memfd_create()
+ * laid out as salvage_shm.h describes, created on the first run only, and emptied for each run.  When restarting,
+ * spare shared memory is created too.
+ */
+void g_shared_init();
+
+/**
+ * Add a file action passing the shared memory file descriptor to the child.
+ * @param file_actions file actions the child is spawned with
+ * @return 0 on success, otherwise an error number
+ */
+int g_shared_spawn_actions(posix_spawn_file_actions_t* file_actions);
+
+/**
+ * Environment variable telling the child the shared memory file descriptor, its value updated for each run.
+ * @return SALVAGE_SHM_FD=FD, or NULL if not sharing memory
+ */
+const char* g_shared_environment();
+
+/**
+ * Hand what the ring buffer holds over to be uploaded straight from the shared memory, as a file named shared.  When
+ * restarting, the next run writes to the spare shared memory, so this run's stays untouched while it uploads.
+ * @param file receives the file
+ * @return 1 if the file was handed over, 0 if not sharing memory
+ */
+int g_shared_file(struct VirtualFile* file);
+
+#endif //JETSAM_SHARED_H
@@ -0,0 +1,439 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "http.h"
+#include "log.h"
+#include "opts.h"
+#include "snapshot.h"
+
+/**
+ * Threads reading files at once.
+ */
+#define SNAPSHOT_THREADS 4
+
+/**
+ * Most files in a snapshot.
+ */
+#define SNAPSHOT_MAX_ITEMS 64
+
+/**
+ * Bytes of file contents a snapshot holds in total.
+ */
+#define SNAPSHOT_ARENA_SIZE (1024 * 1024)
+
+/**
+ * Most bytes of the header written before each file in the uploaded snapshot.
+ */
+#define SNAPSHOT_HEADER_SIZE 128
+
+/**
+ * Bytes kept of each thread's stack.
+ */
+#define SNAPSHOT_STACK_SIZE 4096
+
+/**
+ * One /proc file in a snapshot.
+ */
+struct SnapshotItem {
+    /**
+     * Path of the file.
+     */
+    char path[64];
+
+    /**
+     * Whether the path is a directory of file descriptors, listed with their targets, rather than a file.
+     */
+    int fd_directory;
+
+    /**
+     * Buffer the contents are read into, part of the arena.
+     */
+    char* buffer;
+
+    /**
+     * Size of the buffer.
+     */
+    size_t capacity;
+
+    /**
+     * Bytes of contents read.
+     */
+    size_t length;
+
+    /**
+     * Error reading the file, or 0.
+     */
+    int error;
+
+    /**
+     * Set once the item has been read.
+     */
+    atomic_int done;
+
+    /**
+     * Whether the item was read within the time budget, and so is uploaded.
+     */
+    int captured;
+};
+
+/**
+ * Snapshot state.
+ */
+struct Snapshot {
+    /**
+     * Files in the snapshot.
+     */
+    struct SnapshotItem items[SNAPSHOT_MAX_ITEMS];
+
+    /**
+     * Number of files in the snapshot.
+     */
+    int nitems;
+
+    /**
+     * Next item a thread reads.
+     */
+    atomic_int next;
+
+    /**
+     * Set once the time budget is spent, so threads stop starting items.
+     */
+    atomic_int closed;
+
+    /**
+     * Items finished, guarded by lock.
+     */
+    int nfinished;
+
+    /**
+     * Lock guarding nfinished.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled when an item is finished.
+     */
+    pthread_cond_t finished;
+
+    /**
+     * Threads reading items.
+     */
+    pthread_t threads[SNAPSHOT_THREADS];
+
+    /**
+     * Number of threads started.
+     */
+    int nthreads;
+
+    /**
+     * Whether a snapshot was taken.
+     */
+    int taken;
+
+    /**
+     * Buffer item contents are read into, allocated from the heap.
+     */
+    char* arena;
+
+    /**
+     * Bytes of the arena given to items.
+     */
+    size_t arena_used;
+
+    /**
+     * Buffer the uploaded snapshot is assembled in, allocated from the heap.
+     */
+    char* output;
+};
+
+/**
+ * The snapshot instance.
+ */
+struct Snapshot g_snapshot_instance;
+
+/**
+ * Pointer to the snapshot instance.
+ */
+struct Snapshot* g_snapshot = &g_snapshot_instance;
+
+/**
+ * Add a file to the snapshot, giving it part of the arena.
+ * @param capacity most bytes kept of the file
+ * @param fd_directory whether the path is a directory of file descriptors
+ * @param format printf format of the path
+ * @param ... arguments of the format
+ */
+void snapshot_add(size_t capacity, int fd_directory, const char* format, ...) {
+    struct SnapshotItem* item;
+    va_list args;
+
+    if (g_snapshot->nitems == SNAPSHOT_MAX_ITEMS || g_snapshot->arena_used + capacity > SNAPSHOT_ARENA_SIZE) {
+        return;
+    }
+
+    item = &g_snapshot->items[g_snapshot->nitems++];
+    va_start(args, format);
+    vsnprintf(item->path, sizeof(item->path), format, args);
+    va_end(args);
+
+    item->fd_directory = fd_directory;
+    item->buffer = g_snapshot->arena + g_snapshot->arena_used;
+    item->capacity = capacity;
+    item->length = 0;
+    item->error = 0;
+    item->captured = 0;
+    atomic_store(&item->done, 0);
+    g_snapshot->arena_used += capacity;
+}
+
+/**
+ * Read a file into its item's buffer, up to the buffer's size.
+ * @param item the item
+ */
+void snapshot_read_file(struct SnapshotItem* item) {
+    ssize_t nread;
+    int fd;
+
+    fd = open(item->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        item->error = errno;
+        return;
+    }
+
+    while (item->length < item->capacity &&
+           (nread = read(fd, item->buffer + item->length, item->capacity - item->length)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            item->error = errno;
+            break;
+        }
+        item->length += nread;
+    }
+
+    close(fd);
+}
+
+/**
+ * List a directory of file descriptors with their targets into its item's buffer, up to the buffer's size.
+ * @param item the item
+ */
+void snapshot_read_fds(struct SnapshotItem* item) {
+    char link[PATH_MAX + 32];
+    char target[PATH_MAX];
+    struct dirent* entry;
+    ssize_t ntarget;
+    DIR* directory;
+    int nprinted;
+
+    directory = opendir(item->path);
+    if (directory == NULL) {
+        item->error = errno;
+        return;
+    }
+
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(link, sizeof(link), "%s/%s", item->path, entry->d_name);
+        ntarget = readlink(link, target, sizeof(target) - 1);
+        target[ntarget < 0 ? 0 : ntarget] = '\0';
+
+        nprinted = snprintf(item->buffer + item->length, item->capacity - item->length, "%s -> %s\n",
+                            entry->d_name, target);
+        if (nprinted < 0 || (size_t) nprinted >= item->capacity - item->length) {
+            break;
+        }
+        item->length += nprinted;
+    }
+
+    closedir(directory);
+}
+
+/**
+ * Thread reading items until none are left or the time budget is spent.
+ */
+void* snapshot_thread(void* arg) {
+    struct SnapshotItem* item;
+    int i;
+
+    while (!atomic_load(&g_snapshot->closed) && (i = atomic_fetch_add(&g_snapshot->next, 1)) < g_snapshot->nitems) {
+        item = &g_snapshot->items[i];
+
+        if (item->fd_directory) {
+            snapshot_read_fds(item);
+        } else {
+            snapshot_read_file(item);
+        }
+        atomic_store(&item->done, 1);
+
+        pthread_mutex_lock(&g_snapshot->lock);
+        g_snapshot->nfinished++;
+        pthread_cond_signal(&g_snapshot->finished);
+        pthread_mutex_unlock(&g_snapshot->lock);
+    }
+
+    return arg;
+}
+
+/**
+ * List the files to snapshot of a process: its own, then the stack of each of its threads while there is room.
+ * @param pid the process
+ */
+void snapshot_list(pid_t pid) {
+    char path[64];
+    struct dirent* entry;
+    DIR* tasks;
+
+    snapshot_add(8192, 0, "/proc/%d/status", pid);
+    snapshot_add(4096, 0, "/proc/%d/limits", pid);
+    snapshot_add(65536, 1, "/proc/%d/fd", pid);
+    snapshot_add(32768, 0, "/proc/%d/environ", pid);
+    snapshot_add(262144, 0, "/proc/%d/maps", pid);
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    tasks = opendir(path);
+    if (tasks == NULL) {
+        return;
+    }
+    while ((entry = readdir(tasks)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snapshot_add(SNAPSHOT_STACK_SIZE, 0, "/proc/%d/task/%.16s/stack", pid, entry->d_name);
+        }
+    }
+    closedir(tasks);
+}
+
+void g_snapshot_init() {
+    pthread_condattr_t attr;
+
+    TRACE("g_snapshot_init()");
+
+    // A snapshot ends restarting, so every run shares the buffers allocated for the first
+    if (g_opts->snapshot_ms == 0 || g_snapshot->arena != NULL) {
+        return;
+    }
+
+    g_snapshot->arena = g_heap_allocate(SNAPSHOT_ARENA_SIZE);
+    g_snapshot->output = g_heap_allocate(SNAPSHOT_ARENA_SIZE + SNAPSHOT_MAX_ITEMS * SNAPSHOT_HEADER_SIZE);
+    if (g_snapshot->arena == NULL || g_snapshot->output == NULL) {
+        FATAL(FATAL_ERROR_SNAPSHOT_INIT, "Could not allocate snapshot buffers");
+    }
+
+    pthread_mutex_init(&g_snapshot->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_snapshot->finished, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void g_snapshot_take(pid_t pid) {
+    struct timespec start, deadline, end;
+    int error_code, ncaptured = 0;
+
+    TRACEV("g_snapshot_take(%d)", pid);
+
+    if (g_snapshot->arena == NULL || g_snapshot->taken) {
+        return;
+    }
+    g_snapshot->taken = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += g_opts->snapshot_ms / 1000;
+    deadline.tv_nsec += (g_opts->snapshot_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    snapshot_list(pid);
+
+    for (int t = 0; t < SNAPSHOT_THREADS && t < g_snapshot->nitems; t++) {
+        error_code = pthread_create(&g_snapshot->threads[t], NULL, &snapshot_thread, NULL);
+        if (error_code != 0) {
+            ERRORV("Could not start snapshot thread: %s", strerror(error_code));
+            break;
+        }
+        g_snapshot->nthreads++;
+    }
+
+    pthread_mutex_lock(&g_snapshot->lock);
+    error_code = 0;
+    while (g_snapshot->nthreads > 0 && g_snapshot->nfinished < g_snapshot->nitems && error_code != ETIMEDOUT) {
+        error_code = pthread_cond_timedwait(&g_snapshot->finished, &g_snapshot->lock, &deadline);
+    }
+    atomic_store(&g_snapshot->closed, 1);
+
+    // Items finished after the budget reflect the process after it was signalled, so are left out
+    for (int i = 0; i < g_snapshot->nitems; i++) {
+        g_snapshot->items[i].captured = atomic_load(&g_snapshot->items[i].done);
+        ncaptured += g_snapshot->items[i].captured;
+    }
+    pthread_mutex_unlock(&g_snapshot->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    INFOV("Snapshot %d of %d files of PID %d in %ldus", ncaptured, g_snapshot->nitems, pid,
+          (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+int g_snapshot_upload() {
+    struct VirtualFile file = { .name = "snapshot" };
+    struct SnapshotItem* item;
+    size_t length = 0;
+
+    TRACE("g_snapshot_upload()");
+
+    if (!g_snapshot->taken) {
+        return 0;
+    }
+
+    for (int t = 0; t < g_snapshot->nthreads; t++) {
+        pthread_join(g_snapshot->threads[t], NULL);
+    }
+    g_snapshot->nthreads = 0;
+
+    for (int i = 0; i < g_snapshot->nitems; i++) {
+        item = &g_snapshot->items[i];
+
+        if (!item->captured) {
+            length += snprintf(g_snapshot->output + length, SNAPSHOT_HEADER_SIZE, "==> %s (not read within %dms) <==\n",
+                               item->path, g_opts->snapshot_ms);
+            continue;
+        }
+        if (item->error != 0) {
+            length += snprintf(g_snapshot->output + length, SNAPSHOT_HEADER_SIZE, "==> %s (%s) <==\n", item->path,
+                               strerror(item->error));
+            continue;
+        }
+
+        length += snprintf(g_snapshot->output + length, SNAPSHOT_HEADER_SIZE, "==> %s (%zu bytes%s) <==\n",
+                           item->path, item->length, item->length == item->capacity ? ", truncated" : "");
+        memcpy(g_snapshot->output + length, item->buffer, item->length);
+
+        // environ separates variables with nulls
+        for (size_t c = 0; c < item->length; c++) {
+            if (g_snapshot->output[length + c] == '\0') {
+                g_snapshot->output[length + c] = '\n';
+            }
+        }
+        length += item->length;
+    }
+
+    file.data[0] = g_snapshot->output;
+    file.length[0] = length;
+    return g_http_upload_virtual_files(&file, 1);
+}
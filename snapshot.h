@@ -0,0 +1,24 @@
+#ifndef JETSAM_SNAPSHOT_H
+#define JETSAM_SNAPSHOT_H
+
+#include <sys/types.h>
+
+/**
+ * Initialize snapshotting, if configured in the CLI options, allocating buffers from the heap.
+ */
+void g_snapshot_init();
+
+/**
+ * Snapshot a process's /proc files in parallel, returning once every file is read or the time budget from the CLI
+ * options is spent, whichever is first.  Only the first snapshot is kept.
+ * @param pid the process
+ */
+void g_snapshot_take(pid_t pid);
+
+/**
+ * Upload the snapshot, if one was taken, named snapshot.
+ * @return 1 if and only if uploaded to every destination
+ */
+int g_snapshot_upload();
+
+#endif //JETSAM_SNAPSHOT_H
@@ -0,0 +1,312 @@
+// For gettid
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "http.h"
+#include "log.h"
+#include "opts.h"
+#include "trace.h"
+
+/**
+ * Bytes of trace text an event takes at most, its detail escaped.
+ */
+#define TRACE_EVENT_TEXT_SIZE (2 * TRACE_DETAIL_SIZE + 256)
+
+/**
+ * Bytes of trace text at most.
+ */
+#define TRACE_TEXT_SIZE (TRACE_MAX_EVENTS * TRACE_EVENT_TEXT_SIZE + 256)
+
+/**
+ * A span or instant.
+ */
+struct TraceEvent {
+    /**
+     * Whether the event has been recorded in full.
+     */
+    atomic_int ready;
+
+    /**
+     * Chrome trace event phase, 'X' for a span or 'i' for an instant.
+     */
+    char phase;
+
+    /**
+     * Category of the event.
+     */
+    const char* category;
+
+    /**
+     * Name of the event.
+     */
+    const char* name;
+
+    /**
+     * When the event started, from g_trace_now().
+     */
+    int64_t start_us;
+
+    /**
+     * How long the event lasted.
+     */
+    int64_t duration_us;
+
+    /**
+     * Thread recording the event.
+     */
+    pid_t tid;
+
+    /**
+     * What the event concerns, or empty.
+     */
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+/**
+ * Trace state.  Events are claimed without locking from any thread.
+ */
+struct Trace {
+    /**
+     * The events, from the heap, or NULL if not tracing.
+     */
+    struct TraceEvent* events;
+
+    /**
+     * Events claimed, including those dropped beyond TRACE_MAX_EVENTS.
+     */
+    atomic_int nevents;
+
+    /**
+     * Guards the text.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Bytes of text used.
+     */
+    size_t used;
+
+    /**
+     * The events as text, from the heap.
+     */
+    char* text;
+};
+
+/**
+ * The trace instance.
+ */
+struct Trace g_trace_instance = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Pointer to the trace instance.
+ */
+struct Trace* g_trace = &g_trace_instance;
+
+/**
+ * Claim an event to record.
+ * @param phase Chrome trace event phase
+ * @param category category of the event
+ * @param name name of the event
+ * @param detail what the event concerns, or NULL
+ * @return the event, to fill in the times of and mark ready, or NULL if not tracing or out of events
+ */
+struct TraceEvent* trace_claim(char phase, const char* category, const char* name, const char* detail) {
+    struct TraceEvent* event;
+    int index;
+
+    if (g_trace->events == NULL) {
+        return NULL;
+    }
+
+    index = atomic_fetch_add_explicit(&g_trace->nevents, 1, memory_order_relaxed);
+    if (index >= TRACE_MAX_EVENTS) {
+        return NULL;
+    }
+
+    event = &g_trace->events[index];
+    event->phase = phase;
+    event->category = category;
+    event->name = name;
+    event->tid = gettid();
+    snprintf(event->detail, sizeof(event->detail), "%s", detail != NULL ? detail : "");
+    return event;
+}
+
+/**
+ * Append a string to the text escaped for JSON, control characters replaced.
+ * @param string the string
+ */
+void trace_escape(const char* string) {
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_trace->text[g_trace->used++] = '\\';
+        }
+        g_trace->text[g_trace->used++] = (unsigned char) *c < 0x20 ? '?' : *c;
+    }
+}
+
+/**
+ * Format the events recorded so far into the text as a Chrome trace event JSON object.  The lock is held.
+ */
+void trace_format() {
+    const struct TraceEvent* event;
+    int nevents = atomic_load_explicit(&g_trace->nevents, memory_order_relaxed);
+    pid_t pid = getpid();
+    int nformatted = 0;
+
+    g_trace->used = (size_t) snprintf(g_trace->text, TRACE_TEXT_SIZE, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int e = 0; e < nevents && e < TRACE_MAX_EVENTS; e++) {
+        event = &g_trace->events[e];
+        if (!atomic_load_explicit(&event->ready, memory_order_acquire)) {
+            continue;
+        }
+
+        g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used,
+                                           "%s{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                                           "\"ts\":%lld,", nformatted++ > 0 ? ",\n" : "", event->phase, event->category,
+                                           event->name, (int) pid, (int) event->tid, (long long) event->start_us);
+        if (event->phase == 'X') {
+            g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used,
+                                               "\"dur\":%lld,", (long long) event->duration_us);
+        } else {
+            g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used,
+                                               "\"s\":\"t\",");
+        }
+        g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used,
+                                           "\"args\":{\"detail\":\"");
+        trace_escape(event->detail);
+        g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used, "\"}}");
+    }
+    g_trace->used += (size_t) snprintf(g_trace->text + g_trace->used, TRACE_TEXT_SIZE - g_trace->used, "\n]}\n");
+
+    if (nevents > TRACE_MAX_EVENTS) {
+        ERRORV("%d trace events dropped beyond the first %d", nevents - TRACE_MAX_EVENTS, TRACE_MAX_EVENTS);
+    }
+}
+
+int64_t g_trace_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void g_trace_init() {
+    TRACE("g_trace_init()");
+
+    if (g_opts->trace_file == NULL) {
+        return;
+    }
+
+    g_trace->text = g_heap_allocate(TRACE_TEXT_SIZE);
+    g_trace->events = g_heap_allocate(TRACE_MAX_EVENTS * sizeof(struct TraceEvent));
+    if (g_trace->text == NULL || g_trace->events == NULL) {
+        FATALV(FATAL_ERROR_TRACE_INIT, "Could not allocate %d trace events", TRACE_MAX_EVENTS);
+    }
+    for (int e = 0; e < TRACE_MAX_EVENTS; e++) {
+        atomic_init(&g_trace->events[e].ready, 0);
+    }
+
+    INFOV("Tracing to %s", g_opts->trace_file);
+}
+
+void g_trace_span(const char* category, const char* name, const char* detail, int64_t start_us, int64_t end_us) {
+    struct TraceEvent* event = trace_claim('X', category, name, detail);
+
+    if (event == NULL) {
+        return;
+    }
+
+    event->start_us = start_us;
+    event->duration_us = end_us > start_us ? end_us - start_us : 0;
+    atomic_store_explicit(&event->ready, 1, memory_order_release);
+}
+
+void g_trace_instant(const char* category, const char* name, const char* detail) {
+    struct TraceEvent* event = trace_claim('i', category, name, detail);
+
+    if (event == NULL) {
+        return;
+    }
+
+    event->start_us = g_trace_now();
+    event->duration_us = 0;
+    atomic_store_explicit(&event->ready, 1, memory_order_release);
+}
+
+int g_trace_upload() {
+    struct VirtualFile file = { .name = "trace.json" };
+    int nuploaded;
+
+    TRACE("g_trace_upload()");
+
+    if (g_trace->events == NULL) {
+        return 0;
+    }
+
+    // Held while uploading, so the text is not formatted over meanwhile
+    pthread_mutex_lock(&g_trace->lock);
+    trace_format();
+    file.data[0] = g_trace->text;
+    file.length[0] = g_trace->used;
+    nuploaded = g_http_upload_virtual_files(&file, 1);
+    pthread_mutex_unlock(&g_trace->lock);
+
+    return nuploaded == 1;
+}
+
+void g_trace_destroy() {
+    char temporary[PATH_MAX];
+    ssize_t nwritten;
+    size_t offset = 0;
+    int fd;
+
+    TRACE("g_trace_destroy()");
+
+    if (g_trace->events == NULL) {
+        return;
+    }
+
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", g_opts->trace_file) >= (int) sizeof(temporary)) {
+        ERRORV("%s is too long a trace file path", g_opts->trace_file);
+        return;
+    }
+
+    pthread_mutex_lock(&g_trace->lock);
+    trace_format();
+    g_trace->events = NULL;
+
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        ERRORV("Could not open %s: %s", temporary, strerror(errno));
+        pthread_mutex_unlock(&g_trace->lock);
+        return;
+    }
+    while (offset < g_trace->used) {
+        nwritten = write(fd, g_trace->text + offset, g_trace->used - offset);
+        if (nwritten == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            ERRORV("Could not write %s: %s", temporary, strerror(errno));
+            break;
+        }
+        offset += nwritten;
+    }
+    close(fd);
+    pthread_mutex_unlock(&g_trace->lock);
+
+    if (offset == g_trace->used && rename(temporary, g_opts->trace_file) != 0) {
+        ERRORV("Could not replace %s: %s", g_opts->trace_file, strerror(errno));
+    }
+}
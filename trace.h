@@ -0,0 +1,56 @@
+#ifndef JETSAM_TRACE_H
+#define JETSAM_TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Most spans recorded, later ones being dropped.
+ */
+#define TRACE_MAX_EVENTS 1024
+
+/**
+ * Bytes of a span's detail, such as the file or URL it concerns, kept at most.
+ */
+#define TRACE_DETAIL_SIZE 128
+
+/**
+ * Microseconds on the clock spans are timed by.  Usable before the trace is initialized, to time what comes first.
+ * @return microseconds since an arbitrary point
+ */
+int64_t g_trace_now();
+
+/**
+ * Allocate the spans on the heap, if a trace file is configured in the CLI options.
+ */
+void g_trace_init();
+
+/**
+ * Record a span.  Does nothing if no trace file is configured, or not yet initialized.
+ * @param category category of the span, a constant
+ * @param name name of the span, a constant
+ * @param detail what the span concerns, copied and truncated to TRACE_DETAIL_SIZE, or NULL
+ * @param start_us when the span started, from g_trace_now()
+ * @param end_us when the span ended, from g_trace_now()
+ */
+void g_trace_span(const char* category, const char* name, const char* detail, int64_t start_us, int64_t end_us);
+
+/**
+ * Record an instant, such as a retry.  Does nothing if no trace file is configured, or not yet initialized.
+ * @param category category of the instant, a constant
+ * @param name name of the instant, a constant
+ * @param detail what the instant concerns, copied and truncated to TRACE_DETAIL_SIZE, or NULL
+ */
+void g_trace_instant(const char* category, const char* name, const char* detail);
+
+/**
+ * Upload the spans recorded so far, as trace.json, if a trace file is configured.
+ * @return 1 if and only if uploaded to every destination
+ */
+int g_trace_upload();
+
+/**
+ * Write the spans to the trace file, if configured, in the Chrome trace event format.
+ */
+void g_trace_destroy();
+
+#endif //JETSAM_TRACE_H
@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "log.h"
+#include "opts.h"
+#include "queue.h"
+#include "watch.h"
+
+/**
+ * Bytes of events read at once.
+ */
+#define WATCH_EVENTS_SIZE 4096
+
+/**
+ * Events a file being written into a watched directory is noticed by.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+
+/**
+ * A watch pattern, split into its directory and the glob names in it are matched against.
+ */
+struct WatchPattern {
+    /**
+     * inotify watch of the directory, shared by patterns in the same directory.
+     */
+    int wd;
+
+    /**
+     * The directory, from the heap.
+     */
+    char* directory;
+
+    /**
+     * Glob names are matched against, following the directory.
+     */
+    char* name;
+};
+
+/**
+ * Files waiting to be queued together.
+ */
+struct WatchBatch {
+    /**
+     * Number of files.
+     */
+    int nfiles;
+
+    /**
+     * Bytes of paths used.
+     */
+    size_t used;
+
+    /**
+     * When the first file was added.
+     */
+    struct timespec first;
+
+    /**
+     * When the last file was added.
+     */
+    struct timespec last;
+
+    /**
+     * Files, pointing into paths.
+     */
+    char* files[MAX_FILES];
+
+    /**
+     * The files' paths, null terminated one after another.
+     */
+    char paths[QUEUE_PATHS_SIZE];
+};
+
+/**
+ * Watch state.
+ */
+struct Watch {
+    /**
+     * inotify descriptor, or -1.
+     */
+    int fd;
+
+    /**
+     * Watch patterns, one per CLI option.
+     */
+    struct WatchPattern patterns[MAX_WATCHES];
+
+    /**
+     * Files waiting to be queued, from the heap, or NULL if not watching.
+     */
+    struct WatchBatch* batch;
+
+    /**
+     * Files dropped for want of room in the batch and the queue, or in the heap.
+     */
+    long ndropped;
+};
+
+/**
+ * The watch instance.
+ */
+struct Watch g_watch_instance = { .fd = -1 };
+
+/**
+ * Pointer to the watch instance.
+ */
+struct Watch* g_watch = &g_watch_instance;
+
+/**
+ * Milliseconds from one time to another.
+ * @param from the earlier time
+ * @param to the later time
+ * @return milliseconds between them
+ */
+long watch_elapsed_ms(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * Split a watch pattern into its directory and name glob, the directory being the working directory if it has none.
+ * @param pattern the watch pattern
+ * @param watch_pattern receives the directory and name glob
+ */
+void watch_split(const char* pattern, struct WatchPattern* watch_pattern) {
+    const char* slash = strrchr(pattern, '/');
+    size_t directory_length;
+
+    // Room for the directory and name, or "." and the pattern, each null terminated
+    watch_pattern->directory = g_heap_allocate(strlen(pattern) + 3);
+    if (watch_pattern->directory == NULL) {
+        FATALV(FATAL_ERROR_WATCH_INIT, "Could not allocate watch %s", pattern);
+    }
+
+    if (slash == NULL) {
+        strcpy(watch_pattern->directory, ".");
+        watch_pattern->name = strcpy(watch_pattern->directory + 2, pattern);
+        return;
+    }
+
+    // The root directory keeps its slash
+    directory_length = slash == pattern ? 1 : (size_t) (slash - pattern);
+    memcpy(watch_pattern->directory, pattern, directory_length);
+    watch_pattern->directory[directory_length] = '\0';
+    watch_pattern->name = strcpy(watch_pattern->directory + directory_length + 1, slash + 1);
+}
+
+/**
+ * Queue the batch as a job, emptying it.  A batch the heap has no room for is dropped, as the heap only has as much
+ * room as it had before the first job, so waiting would not make room.
+ * @return 1 if and only if queued, dropped or nothing was waiting, 0 if the queue had no room
+ */
+int watch_queue() {
+    struct WatchBatch* batch = g_watch->batch;
+    int result;
+
+    if (batch->nfiles == 0) {
+        return 1;
+    }
+
+    result = g_queue_add_files(batch->files, batch->nfiles);
+    if (result == QUEUE_ADD_FULL) {
+        return 0;
+    }
+    if (result == QUEUE_ADD_HEAP) {
+        g_watch->ndropped += batch->nfiles;
+        ERRORV("No heap to upload %d written files, %ld written files dropped", batch->nfiles, g_watch->ndropped);
+    } else if (result < 0) {
+        ERRORV("Could not queue %d written files: %d", batch->nfiles, result);
+    }
+
+    batch->nfiles = 0;
+    batch->used = 0;
+    return 1;
+}
+
+/**
+ * Add a file written into a watched directory to the batch, once however often it is written before being queued.
+ * @param directory the directory
+ * @param name name of the file in the directory
+ */
+void watch_add(const char* directory, const char* name) {
+    struct WatchBatch* batch = g_watch->batch;
+    size_t length = strlen(directory) + 1 + strlen(name) + 1;
+    char* path;
+
+    // Full, whether of files or of paths, the batch goes ahead of its settle window
+    if ((batch->nfiles == MAX_FILES || batch->used + length > sizeof(batch->paths)) && !watch_queue()) {
+        g_watch->ndropped++;
+        ERRORV("No room to queue %s/%s, %ld written files dropped", directory, name, g_watch->ndropped);
+        return;
+    }
+
+    path = batch->paths + batch->used;
+    snprintf(path, length, "%s/%s", directory, name);
+    for (int f = 0; f < batch->nfiles; f++) {
+        if (strcmp(batch->files[f], path) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &batch->last);
+            return;
+        }
+    }
+
+    DEBUGV("%s written", path);
+    batch->files[batch->nfiles++] = path;
+    batch->used += length;
+    clock_gettime(CLOCK_MONOTONIC, &batch->last);
+    if (batch->nfiles == 1) {
+        batch->first = batch->last;
+    }
+}
+
+int g_watch_open() {
+    struct WatchPattern* pattern;
+
+    TRACE("g_watch_open()");
+
+    g_watch->batch = g_heap_allocate(sizeof(struct WatchBatch));
+    if (g_watch->batch == NULL) {
+        FATAL(FATAL_ERROR_WATCH_INIT, "Could not allocate batch of written files");
+    }
+    g_watch->batch->nfiles = 0;
+    g_watch->batch->used = 0;
+
+    g_watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_watch->fd == -1) {
+        FATALV(FATAL_ERROR_WATCH_INIT, "Could not start watching: %s", strerror(errno));
+    }
+
+    for (int w = 0; w < g_opts->nwatches; w++) {
+        pattern = &g_watch->patterns[w];
+        watch_split(g_opts->watches[w], pattern);
+
+        pattern->wd = inotify_add_watch(g_watch->fd, pattern->directory, WATCH_EVENTS);
+        if (pattern->wd == -1) {
+            FATALV(FATAL_ERROR_WATCH_INIT, "Could not watch %s: %s", pattern->directory, strerror(errno));
+        }
+        INFOV("Watching %s for %s", pattern->directory, pattern->name);
+    }
+
+    return g_watch->fd;
+}
+
+void g_watch_handle() {
+    char events[WATCH_EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    ssize_t nread;
+
+    for (;;) {
+        nread = read(g_watch->fd, events, sizeof(events));
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread == -1 && errno != EAGAIN) {
+                ERRORV("Could not read watch events: %s", strerror(errno));
+            }
+            return;
+        }
+
+        for (char* next = events; next < events + nread; next += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) next;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                ERROR("Watch events overflowed, files written meanwhile are not uploaded");
+            } else if (event->mask & IN_IGNORED) {
+                ERRORV("Watch %d stopped, its directory being removed or unmounted", event->wd);
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+
+            for (int w = 0; w < g_opts->nwatches; w++) {
+                if (g_watch->patterns[w].wd == event->wd &&
+                        fnmatch(g_watch->patterns[w].name, event->name, FNM_PERIOD) == 0) {
+                    watch_add(g_watch->patterns[w].directory, event->name);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int g_watch_flush() {
+    struct WatchBatch* batch = g_watch->batch;
+    struct timespec now;
+    long quiet_ms, waited_ms;
+
+    if (batch == NULL || batch->nfiles == 0) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    quiet_ms = watch_elapsed_ms(&batch->last, &now);
+    waited_ms = watch_elapsed_ms(&batch->first, &now);
+    if (quiet_ms < WATCH_SETTLE_MS && waited_ms < WATCH_MAX_DELAY_MS) {
+        return (int) (WATCH_SETTLE_MS - quiet_ms < WATCH_MAX_DELAY_MS - waited_ms ?
+                      WATCH_SETTLE_MS - quiet_ms : WATCH_MAX_DELAY_MS - waited_ms);
+    }
+
+    // Once the queue has room again
+    return watch_queue() ? -1 : WATCH_SETTLE_MS;
+}
+
+void g_watch_close() {
+    TRACE("g_watch_close()");
+
+    if (g_watch->fd != -1) {
+        close(g_watch->fd);
+        g_watch->fd = -1;
+    }
+    if (g_watch->batch != NULL && g_watch->batch->nfiles > 0) {
+        INFOV("Dropping %d written files not yet queued", g_watch->batch->nfiles);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef JETSAM_WATCH_H
+#define JETSAM_WATCH_H
+
+/**
+ * Milliseconds without another matching file being written before those written in a burst are queued as one job.
+ */
+#define WATCH_SETTLE_MS 250
+
+/**
+ * Milliseconds at most a written file waits to be queued, however long its burst goes on.
+ */
+#define WATCH_MAX_DELAY_MS 2000
+
+/**
+ * Start watching the directories of the watch patterns from the CLI options for files written or moved into them,
+ * allocating the batch of files waiting to be queued from the heap.
+ * @return the inotify descriptor, to watch for events
+ */
+int g_watch_open();
+
+/**
+ * Read pending events, adding files matching a watch pattern to the batch waiting to be queued.  Never blocks.
+ */
+void g_watch_handle();
+
+/**
+ * Queue the batch as a job once no file has been added for WATCH_SETTLE_MS, its first file has waited
+ * WATCH_MAX_DELAY_MS, or it is full.  A batch the queue has no room for is kept and tried again.
+ * @return milliseconds until the batch is next due to be queued, or -1 if it is empty
+ */
+int g_watch_flush();
+
+/**
+ * Stop watching, dropping files not yet queued.
+ */
+void g_watch_close();
+
+#endif //JETSAM_WATCH_H